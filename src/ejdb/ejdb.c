@@ -69,12 +69,79 @@ typedef union {
 typedef struct {
     EJCOLL *coll; //current collection
     bool icase; //ignore case normalization
+    bool numkey; //produce binary number keys for `TDBITBINNUM` indexes
 } _BSONIPATHROWLDR;
 
+/* Size of the binary number key stored in `TDBITBINNUM` indexes: 
+ * 8 bytes of sortable double followed by 2 bytes of int64 rounding residual */
+#define JBNUMKEYSZ 10
+
 
 /* Maximum number of objects keeped to update deffered indexes */
 #define JBMAXDEFFEREDIDXNUM 512
 
+/* range of binary number keys matched by query condition. See `_numkeyrange()` */
+typedef struct {
+    char lkey[JBNUMKEYSZ];      //lower bound key
+    char ukey[JBNUMKEYSZ + 3];  //upper bound key, 3 extra bytes to jump past the key suffix
+    bool haslow;                //lower bound is set
+    bool hasup;                 //upper bound is set
+    bool lincl;                 //lower bound is inclusive
+    bool uincl;                 //upper bound is inclusive
+    TCLIST *keys;               //sorted unique keys of `$in` condition or NULL
+} _NUMKEYRANGE;
+
+/* Number of equi-depth histogram buckets collected by `ejdbanalyze()` */
+#define JBANALYZEBUCKETS 16
+
+/* Indexes having more entries are sampled by `ejdbanalyze()` instead of the full walk */
+#define JBANALYZEMAXKEYS (1 << 16)
+
+/* Number of sampled pairs of adjacent keys of large indexes. See `_analyzeidx()` */
+#define JBANALYZESAMPLES 8192
+
+/* Seed of the gaps between sampled pairs of keys, stats of the same index are reproducible */
+#define JBANALYZESEED 0x9e3779b97f4a7c15ULL
+
+/* Default memory budget (64M) of sorted result set, exceeding records are spilled into run files */
+#define JBSORTMEMDEF (64 * 1024 * 1024)
+
+/* Maximum number of sorted runs merged at once. See `_sortmerge()` */
+#define JBSORTMERGEWAY 64
+
+/* Approximate hash map memory overhead of the `$group` aggregation group. See `_aggrec()` */
+#define JBAGGGRPOVERHEAD 64
+
+/* Memory budget (16M) of the records cache of `$do $join` lookups. See `_qryjoinget()` */
+#define JBJOINCACHESZ (16 * 1024 * 1024)
+
+/* Number of index entries read at the cost of one record fetch. See `_qryisectplan()` */
+#define JBISECTENTRYCOST 10
+
+/* Maximum number of fields of compound index. See `ejdbsetcompoundindex()` */
+#define JBCIDXMAXFIELDS 8
+
+/* Number of records scanned by one parallel full scan worker at once. See `_pscannext()` */
+#define JBPSCANBATCH 1024
+
+/* Maximum number of parallel full scan worker threads set by `$threads` query hint */
+#define JBPSCANMAXTHREADS 64
+
+/* Number of scan loop iterations between query deadline checks. See `_qryinterrupted()` */
+#define JBQDEADLINETICKS 64
+
+/* Number of index keys stepped over by cursor before it is repositioned by jump. See `_qrycurstep()` */
+#define JBMERGESTEPS 32
+
+/* Maximum number of compiled regular expressions kept by database. See `_qryrxcompile()` */
+#define JBRXCACHEMAX 1024
+
+/* Compound index key component tags. See `_cidxkeycat()` */
+#define JBCIDXTNULL 0x01    //null or missing value
+#define JBCIDXTNUM 0x02     //number, followed by `JBNUMKEYSZ` bytes of binary number key
+#define JBCIDXTSTR 0x03     //string, followed by escaped and terminated string bytes
+#define JBCIDXMULTI 0xff    //single byte key of records with not indexable values in indexed fields
+
 /* context of deffered index updates. See `_updatebsonidx()` */
 typedef struct {
     bson_oid_t oid;
@@ -82,6 +149,167 @@ typedef struct {
     TCMAP *imap;
 } _DEFFEREDIDXCTX;
 
+/* result set sorting context. See `_ejdbsoncmp()` */
+typedef struct {
+    EJQF **ofs;
+    int ofsz;
+} _EJBSORTCTX;
+
+/* precomputed sort key of a single $orderby field. See `_ejdbsortres()` */
+typedef struct {
+    bson_iterator it;   //field value iterator, BSON_EOO type if field not found
+    char kt;            //key kind: 'i' integer, 'd' double, 's' string, 0 generic
+    union {
+        int64_t inum;
+        double dnum;
+        struct {
+            const char *ptr;
+            int len;
+        } str;
+    } v;
+} _EJBSORTKEY;
+
+/* result set record with its sort keys. See `_ejdbsortres()` */
+typedef struct {
+    TCLISTDATUM d;      //record data
+    _EJBSORTKEY *keys;  //record sort keys, one per active $orderby field
+    uint64_t seq;       //record insertion sequence number, records with equal keys are kept in this order
+} _EJBSORTREC;
+
+/* precomputed keys sorting context. See `_ejdbsortreccmp()` */
+typedef struct {
+    int ksz;            //number of sort keys per record
+    int *dirs;          //sort direction of every key: 1 or -1
+} _EJBSORTKCTX;
+
+/* sorted run source of result set merging. See `_sortmergeruns()` */
+typedef struct {
+    HANDLE fd;          //run file handle or `INVALID_HANDLE_VALUE` for in-memory run
+    TCLIST *mlist;      //in-memory run records
+    int midx;           //current in-memory run record index
+    char *buf;          //run file record buffer
+    int bsiz;           //allocated size of `buf`
+    TCLISTDATUM d;      //current record
+    bool err;           //reading of the run file failed
+} _EJBSORTRUN;
+
+/* streaming k-way merge of sorted runs. See `_sortmergeopen()` */
+typedef struct {
+    _EJBSORTRUN *runs;  //merged run files followed by the optional in-memory run
+    _EJBSORTRUN **heap; //runs heap, the run with the least current record is kept at the root
+    int pnum;           //number of merged run files
+    int hnum;           //number of runs in `heap`
+    bool taken;         //current record of the heap root has been returned by `_sortmergenext()`
+} _EJBSORTMERGE;
+
+enum { /* `$group` accumulator operators */
+    JBAGGSUM,           //$sum
+    JBAGGAVG,           //$avg
+    JBAGGMIN,           //$min
+    JBAGGMAX,           //$max
+    JBAGGCOUNT          //$count
+};
+
+/* `$group` accumulator. See `_aggnew()` */
+typedef struct {
+    char *name;         //output field name
+    int op;             //accumulator operator
+    char *fpath;        //field path of accumulated values or NULL if `cval` constant is accumulated
+    int fpathsz;        //field path length
+    double cval;        //accumulated constant value
+    bool cint;          //accumulated constant is integer
+} _AGGACC;
+
+/* state of the `$group` accumulator of a single group */
+typedef struct {
+    int64_t n;          //number of accumulated values
+    int64_t isum;       //sum of integer values
+    double dsum;        //sum of all values
+    bool isdbl;         //floating point values are accumulated
+    char *mval;         //BSON document {v : value} of `$min`, `$max` accumulators or NULL
+} _AGGSTATE;
+
+/* `$group` aggregation group */
+typedef struct {
+    char *id;           //BSON document {_id : key} of the first record of the group
+    _AGGSTATE st[];     //accumulators states
+} _AGGGRP;
+
+/* `$group` hash aggregation of matched records. See `_aggrec()` */
+typedef struct {
+    bson *kspec;        //group key specification {_id : spec}
+    _AGGACC *accs;      //accumulators
+    int anum;           //number of accumulators
+    TCMAP *groups;      //normalized group key => *_AGGGRP
+    uint64_t mem;       //approximate memory size of `groups`
+    int nruns;          //number of spilled runs of groups. See `_aggspill()`
+} _AGGCTX;
+
+/* batch of records matched by parallel full scan worker. See `_pscanmatch()` */
+typedef struct {
+    EJCOLL *coll;       //collection
+    EJQ *q;             //worker own copy of the query with its matching state and buffers
+    EJQF **qfs;         //condition fields of `q`
+    int qfsz;           //number of condition fields
+    TCLIST *recs;       //scanned records: primary key followed by the columns map
+    TCLIST *matched;    //matched records: primary key followed by the BSON data
+} _PSCANBATCH;
+
+/* parallel full scan. See `_pscannext()` */
+typedef struct {
+    TCHDB *hdb;         //collection records
+    TCHDBITER *iter;    //records iterator
+    int nthreads;       //number of worker threads and of batches in round
+    _PSCANBATCH *batches; //two rounds of `nthreads` batches: one is matched, other is read ahead
+    pthread_t *workers; //worker threads started once per scan. See `_pscanworker()`
+    int nworkers;       //number of started worker threads
+    pthread_mutex_t mtx; //guards the round hand-off fields below
+    pthread_cond_t wcond; //signaled when a round is started or the scan is disposed
+    pthread_cond_t dcond; //signaled when all batches of the running round are matched
+    int claimed;        //number of batches of the running round taken by workers
+    int pending;        //number of batches of the running round not matched yet
+    bool stop;          //workers must exit
+    int nread[2];       //number of records read into the round batches
+    int running;        //round matched by workers or -1
+    int done;           //round matched and returned to caller or -1
+    int next;           //next batch of the `done` round returned to caller
+    bool eof;           //no more records to read
+    TCXSTR *kbuf;       //primary key read buffer
+    TCXSTR *vbuf;       //columns map read buffer
+    TCLIST *matched;    //matched records of the last batch returned by `_pscannext()`
+    uint64_t nrecs;     //number of records read
+    uint64_t nbytes;    //number of bytes of records read
+} _PSCAN;
+
+/* compound index keys range. See `_qrycidxplan()` */
+typedef struct {
+    TDBIDX *idx;        //compound index
+    TCXSTR *lkey;       //lower bound prefix of keys
+    TCXSTR *ukey;       //upper bound prefix of keys
+    bool lincl;         //lower bound is inclusive
+    bool uincl;         //upper bound is inclusive
+    bool ordered;       //`$orderby` is served by the keys order
+    bool desc;          //keys are scanned backward
+    bool exact;         //keys range matches exactly all the query conditions
+    int ncond;          //number of index fields matched by the keys range
+} _CIDXSCAN;
+
+/* Query execution stages timed by `ejdbqryexplain()` */
+enum {
+    JBQSTPLAN,          //query preprocessing and index selection
+    JBQSTSCAN,          //records scan and matching
+    JBQSTSORT,          //result set sorting
+    JBQSTFINISH,        //$upsert, $skip, $max and deferred $do, $fields processing
+    JBQSTNUM            //number of stages
+};
+
+/* index candidate scored by query planner. See `_qrypreprocess()` */
+typedef struct {
+    const char *fpath;  //condition field path
+    const char *iname;  //index name
+    int score;          //index score
+} _QRYCAND;
+
 /* query execution context. See `_qryexecute()`*/
 typedef struct {
     bool imode;     //if true ifields are included otherwise excluded
@@ -94,8 +322,91 @@ typedef struct {
     TCLIST *res;    //result set
     TCXSTR *log;    //query debug log buffer
     TCLIST *didxctx; //deffered indexes context
+    uint32_t topk;  //if not zero `res` is a bounded heap of `topk` best ordered records
+    uint64_t *topkseq; //insertion sequence numbers of `topk` heap records, ties are ordered by them
+    int topkseqsz;     //allocated number of `topkseq` elements
+    uint64_t topkn;    //number of records pushed into `topk` heap
+    _EJBSORTCTX sctx; //result set order
+    uint64_t sortmem; //result set memory budget in bytes, zero if records are not spilled
+    uint64_t rssize;  //approximate memory size of records in `res`
+    TCLIST *runs;     //paths of spilled sorted run files. See `_sortspill()`
+    TCLIST *isect;    //indexed conditions *EJQF with intersected PK sets. See `_qryisectplan()`
+    TCLIST *orunion;  //indexed conditions *EJQF of root $or queries with united PK sets. See `_qryorplan()`
+    _CIDXSCAN *cidx;  //compound index keys range scan. See `_qrycidxplan()`
+    int scanthreads;  //number of full scan worker threads set by `$threads` hint
+    EJQPLAN *plan;    //plan cache of the prepared query. See `ejdbqueryprepare()`
+    _AGGCTX *agg;     //`$group` aggregation of matched records, they are not pushed into `res`
+    TCMAP *jcache;    //records of `$do $join` lookups: collection pointer + OID => BSON, empty if missing
+    bool jdefer;      //`$do` and `$fields` are applied to the final result set. See `_qryjoinprefetch()`
+    bson *explain;    //execution plan description filled if not NULL. See `ejdbqryexplain()`
+    TCLIST *cands;    //index candidates *_QRYCAND scored by planner if `explain` is set
+    int stage;        //current execution stage timed if `explain` is set or -1. See `_qrystage()`
+    double stimes[JBQSTNUM][2]; //wall and CPU seconds spent in execution stages
+    double smarks[2]; //wall and CPU seconds at the start of the current stage
+    const EJQ *srcq;  //query object passed by caller, checked for cancellation
+    double deadline;  //wall time in seconds the query must be finished until, zero if unlimited
+    uint64_t maxscan; //maximum number of index keys or records examined, zero if unlimited
+    uint32_t ticks;   //number of interruption checks. See `_qryinterrupted()`
+    int ecode;        //`JBEQLIMIT` or `JBEQCANCELLED` if the query has been interrupted
+    double started;   //wall time in seconds the query started at if the slow queries log is enabled
 } _QRYCTX;
 
+/* node of the conditions field path trie. See `_qrymcompile()` */
+typedef struct _MNODE _MNODE;
+struct _MNODE {
+    const char *key;    //field name, single section of the conditions field path
+    int keysz;          //field name length
+    EJQF **qfs;         //conditions ending at this node
+    int qfsnum;         //number of conditions ending at this node
+    _MNODE *child;      //first child node
+    _MNODE *next;       //next sibling node
+    uint32_t seen;      //sequence number of the last matched record having this field
+};
+
+/* query conditions compiled for the single pass matching. See `_qrymcompile()` */
+struct EJQMATCH {
+    _MNODE root;        //fields trie root, the record itself
+    EJQF **sqfs;        //conditions matched one by one by `_qrybsmatch()`
+    int sqfsnum;        //number of conditions matched one by one
+    int tnum;           //number of conditions in the fields trie
+    uint32_t seq;       //sequence number of the matched record
+};
+
+/* prepared query plan cache. See `ejdbqueryprepare()` */
+struct EJQPLAN {
+    TCLIST *params;     //placeholder conditions *EJQF in binding order
+    EJCOLL *coll;       //collection of the cached index meta
+    uint32_t igen;      //index meta generation of `coll` the cache is valid for
+    TCMAP *imeta;       //cached index meta: field path => bson data, empty if field is not indexed
+    TCXSTR *colbuf;     //query processing buffers reused between executions
+    TCXSTR *bsbuf;
+    TCXSTR *tmpbuf;
+};
+
+/* streaming query cursor. See `ejdbqrycursor()` */
+struct EJQCUR {
+    EJCOLL *coll;       //collection
+    _QRYCTX ctx;        //query execution context of streamed records
+    TCLIST *res;        //materialized result set if query cannot be streamed
+    _EJBSORTMERGE *merge; //final merge of spilled sorted runs of the materialized query
+    int pos;            //position of the next record in `res`
+    TCHDBITER *hdbiter; //full scan iterator
+    TCXSTR *pkbuf;      //primary key of the current record
+    BDBCUR *icur;       //main index cursor
+    TCXSTR *lkey;       //last main index key examined, cursor is repositioned past it on every fetch
+    TCMAP *lpks;        //primary keys of the examined records of `lkey`
+    _NUMKEYRANGE kr;    //binary number keys range of the main index
+    bool desc;          //main index keys are scanned backward
+    bool trim;          //main index keys have 3 bytes suffix
+    EJQF **qfs;         //condition fields array
+    int qfsz;           //number of condition fields
+    int anum;           //number of active conditions
+    uint32_t skip;      //number of matched records to skip
+    uint32_t max;       //maximum number of matched records including skipped ones
+    uint32_t count;     //number of matched records
+    bool eof;           //no more records
+};
+
 
 /* private function prototypes */
 static void _ejdbsetecode(EJDB *jb, int ecode, const char *filename, int line, const char *func);
@@ -117,6 +428,7 @@ static char* _bsonfpathrowldr(TCLIST *tokens, const char *rowdata, int rowdatasz
 static bool _createcoldb(const char *colname, EJDB *jb, EJCOLLOPTS *opts, TCTDB** res);
 static bool _addcoldb0(const char *colname, EJDB *jb, EJCOLLOPTS *opts, EJCOLL **res);
 static void _delcoldb(EJCOLL *cdb);
+static void _delsortruns(EJCOLL *coll);
 static void _delqfdata(const EJQ *q, const EJQF *ejqf);
 static bool _ejdbsavebsonimpl(EJCOLL *coll, bson *bs, bson_oid_t *oid, bool merge);
 static bool _updatebsonidx(EJCOLL *coll, const bson_oid_t *oid, const bson *bs,
@@ -124,17 +436,37 @@ static bool _updatebsonidx(EJCOLL *coll, const bson_oid_t *oid, const bson *bs,
 static bool _metasetopts(EJDB *jb, const char *colname, EJCOLLOPTS *opts);
 static bool _metagetopts(EJDB *jb, const char *colname, EJCOLLOPTS *opts);
 static bson* _metagetbson(EJDB *jb, const char *colname, int colnamesz, const char *mkey);
-static bson* _metagetbson2(EJCOLL *coll, const char *mkey) __attribute__((unused));
+static bson* _metagetbson2(EJCOLL *coll, const char *mkey);
 static bool _metasetbson(EJDB *jb, const char *colname, int colnamesz,
                          const char *mkey, bson *val, bool merge, bool mergeoverwrt);
 static bool _metasetbson2(EJCOLL *coll, const char *mkey, bson *val, bool merge, bool mergeoverwrt);
 static bson* _imetaidx(EJCOLL *coll, const char *ipath);
 static bool _qrypreprocess(_QRYCTX *ctx);
+static void _registerallqfields(TCLIST *reg, EJQ *q);
+static bool _qryplanattach(_QRYCTX *ctx, const EJQ *q);
+static bson* _qryimetaidx(_QRYCTX *ctx, const char *fpath);
+static void _qryplandel(EJQPLAN *plan);
+static void _qryisectplan(_QRYCTX *ctx, uint32_t skipflags);
+static TCLIST* _qryisectpks(_QRYCTX *ctx);
+static void _qryorplan(_QRYCTX *ctx, uint32_t skipflags);
+static TCLIST* _qryorpks(_QRYCTX *ctx);
+static void _qrycidxplan(_QRYCTX *ctx, uint32_t skipflags);
+static bool _qrycidxcovered(const _QRYCTX *ctx);
 static TCLIST* _parseqobj(EJDB *jb, EJQ *q, bson *qspec);
 static TCLIST* _parseqobj2(EJDB *jb, EJQ *q, const void *qspecbsdata);
 static int _parse_qobj_impl(EJDB *jb, EJQ *q, bson_iterator *it, TCLIST *qlist, 
                             TCLIST *pathStack, EJQF *pqf, int mgrp);
 static int _ejdbsoncmp(const TCLISTDATUM *d1, const TCLISTDATUM *d2, void *opaque);
+static void _ejdbsortres(TCLIST *res, EJQF **ofs, int ofsz, const uint64_t *seqs);
+static bool _sortspill(_QRYCTX *ctx);
+static bool _sortmerge(_QRYCTX *ctx, _EJBSORTMERGE *m);
+static bool _sortmergenext(_QRYCTX *ctx, _EJBSORTMERGE *m, TCLISTDATUM *d);
+static bool _sortmergeclose(_QRYCTX *ctx, _EJBSORTMERGE *m);
+static _AGGCTX* _aggnew(_QRYCTX *ctx, bson_iterator *it);
+static void _aggdel(_AGGCTX *agg);
+static bool _aggrec(_QRYCTX *ctx, const void *bsbuf, int bsbufsz);
+static bool _aggspill(_QRYCTX *ctx);
+static bool _aggfinish(_QRYCTX *ctx);
 static bool _qrycondcheckstrand(const char *vbuf, const TCLIST *tokens);
 static bool _qrycondcheckstror(const char *vbuf, const TCLIST *tokens);
 static bool _qrybsvalmatch(const EJQF *qf, bson_iterator *it, bool expandarrays, int *arridx);
@@ -143,24 +475,58 @@ static bool _qry_and_or_match(EJCOLL *coll, EJQ *ejq, const void *pkbuf, int pkb
 static bool _qryormatch2(EJCOLL *coll, EJQ *ejq, const void *bsbuf, int bsbufsz);
 static bool _qryormatch3(EJCOLL *coll, EJQ *ejq, EJQ *oq, const void *bsbuf, int bsbufsz);
 static bool _qryandmatch2(EJCOLL *coll, EJQ *ejq, const void *bsbuf, int bsbufsz);
+static bool _qryqfsmatch(EJQ *q, EJQF **qfs, int qfsz, const void *bsbuf, int bsbufsz);
+static void _qrymdel(EJQMATCH *m);
 static bool _qryallcondsmatch(EJQ *ejq, int anum, EJCOLL *coll, EJQF **qfs, 
                               int qfsz, const void *pkbuf, int pkbufsz);
 static EJQ* _qryaddand(EJDB *jb, EJQ *q, const void *andbsdata);
 static bool _qrydup(const EJQ *src, EJQ *target, uint32_t qflags);
 static void _qrydel(EJQ *q, bool freequery);
 static bool _pushprocessedbson(_QRYCTX *ctx, const void *bsbuf, int bsbufsz);
+static void _pushres(_QRYCTX *ctx, void *ptr, int size, bool malloced);
 static bool _exec_do(_QRYCTX *ctx, const void *bsbuf, bson *bsout);
+static const void* _qryjoinget(_QRYCTX *ctx, EJCOLL *coll, const bson_oid_t *oid);
+static int _qryjoinprefetch(_QRYCTX *ctx, TCLIST *res);
 static void _qryctxclear(_QRYCTX *ctx);
-static TCLIST* _qryexecute(EJCOLL *coll, const EJQ *q, uint32_t *count, int qflags, TCXSTR *log);
+static TCLIST* _qryexecute(EJCOLL *coll, const EJQ *q, uint32_t *count, int qflags, TCXSTR *log, bson *explain,
+                           EJQCUR *cur);
+static void _qrystage(_QRYCTX *ctx, int stage);
+static void _collstats(EJCOLL *coll, bson *bs);
+static void _histadd(EJCOLL *coll, int op, double started);
+static bool _qryinterrupted(_QRYCTX *ctx);
+static _PSCAN* _pscannew(_QRYCTX *ctx, TCHDBITER *iter);
+static bool _pscannext(_PSCAN *ps);
+static void _pscandel(_PSCAN *ps);
+static bool _qrycuropen(EJQCUR *cur, const EJQ *q, int qflags, TCXSTR *log);
+static bool _qrycurfetch(EJQCUR *cur);
+static const void* _qrycurnext(EJQCUR *cur, int *size);
 EJDB_INLINE void _nufetch(_EJDBNUM *nu, const char *sval, bson_type bt);
 EJDB_INLINE int _nucmp(_EJDBNUM *nu, const char *sval, bson_type bt);
 EJDB_INLINE int _nucmp2(_EJDBNUM *nu1, _EJDBNUM *nu2, bson_type bt);
+static void _numkeyl(char *kbuf, int64_t v);
+static void _numkeyd(char *kbuf, double v);
+static void _numkeys(char *kbuf, const char *sval);
+static void _numkeyqf(char *kbuf, const EJQF *qf);
+static bool _numkeyrange(const EJQF *qf, _NUMKEYRANGE *kr);
+static bool _qrycurstep(BDBCUR *cur, int (*cmp)(const char*, int, const char*, int, int),
+                        const char *key, int keysz, int trim);
+static uint64_t _qryskipkeys(BDBCUR *cur, const char *bkey, int bkeysz, int bsuffix, uint64_t num);
+static bool _bsonitnumkey(bson_iterator *it, char *kbuf);
+static double _numkeydec(const char *kbuf);
+static bool _isbinnumidx(EJCOLL *coll, const char *ipath);
+static int _cidxspecparse(const char *spec, int specsz, const char **fpaths, int *fpathszs, int *dirs);
+static char* _cidxkey(const void *bsdata, const char *spec, int specsz, int *vsz);
+static bool _cidxkeybson(const TDBIDX *idx, TCMAP *ifields, const char *kbuf, int kbufsz, 
+                         const void *pkbuf, int pkbufsz, bson *bs);
+static void _analyzeidx(EJCOLL *coll, TDBIDX *idx, bson *bs, int64_t *entries, TCXSTR *log);
+static bson* _qrydistinctidx(EJCOLL *coll, const char *fpath, EJQ *q, uint32_t *count, TCXSTR *log);
 static EJCOLL* _getcoll(EJDB *jb, const char *colname);
 static bool _exportcoll(EJCOLL *coll, const char *dpath, int flags, TCXSTR *log);
 static bool _importcoll(EJDB *jb, const char *bspath, TCLIST *cnames, int flags, TCXSTR *log);
 static EJCOLL* _createcollimpl(EJDB *jb, const char *colname, EJCOLLOPTS *opts);
 static bool _rmcollimpl(EJDB *jb, EJCOLL *coll, bool unlinkfile);
 static bool _setindeximpl(EJCOLL *coll, const char *fpath, int flags, bool nolock);
+static bool _setcidximpl(EJCOLL *coll, const char *spec, int flags, bool nolock);
 
 extern const char *utf8proc_errmsg(ssize_t errcode);
 
@@ -238,6 +604,14 @@ const char* ejdberrmsg(int ecode) {
             return "bson size exceeds the maximum allowed size limit";
         case JBEINVALIDCMD:
             return "invalid ejdb command specified";
+        case JBEQPARAM:
+            return "invalid or unbound query parameter";
+        case JBEQGROUP:
+            return "invalid $group hint";
+        case JBEQLIMIT:
+            return "query time or records scan limit exceeded";
+        case JBEQCANCELLED:
+            return "query cancelled";
         default:
             return tcerrmsg(ecode);
     }
@@ -272,6 +646,13 @@ EJDB* ejdbnew(void) {
         TCFREE(jb);
         return NULL;
     }
+    jb->rxcache = tcmdbnew();
+    jb->slthreshold = -1;
+    TCMALLOC(jb->slmtx, sizeof (pthread_mutex_t));
+    if (pthread_mutex_init(jb->slmtx, NULL) != 0) {
+        TCFREE(jb->slmtx);
+        jb->slmtx = NULL;
+    }
     return jb;
 }
 
@@ -283,6 +664,28 @@ void ejdbdel(EJDB *jb) {
         pthread_rwlock_destroy(jb->mmtx);
         TCFREE(jb->mmtx);
     }
+    if (jb->rxcache) {
+        tcmdbiterinit(jb->rxcache);
+        int ksz, vsz;
+        char *kbuf;
+        while ((kbuf = tcmdbiternext(jb->rxcache, &ksz)) != NULL) {
+            regex_t **vbuf = tcmdbget(jb->rxcache, kbuf, ksz, &vsz);
+            if (vbuf) {
+                regfree(*vbuf);
+                TCFREE(*vbuf);
+                TCFREE(vbuf);
+            }
+            TCFREE(kbuf);
+        }
+        tcmdbdel(jb->rxcache);
+    }
+    if (jb->slmtx) {
+        pthread_mutex_destroy(jb->slmtx);
+        TCFREE(jb->slmtx);
+    }
+    if (jb->slowlog) {
+        tclistdel(jb->slowlog);
+    }
     tctdbdel(jb->metadb);
     TCFREE(jb);
 }
@@ -293,6 +696,7 @@ bool ejdbclose(EJDB *jb) {
     for (int i = 0; i < jb->cdbsnum; ++i) {
         assert(jb->cdbs[i]);
         JBCLOCKMETHOD(jb->cdbs[i], true);
+        _delsortruns(jb->cdbs[i]);
         if (!tctdbclose(jb->cdbs[i]->tdb)) {
             rv = false;
         }
@@ -345,8 +749,8 @@ bool ejdbopen(EJDB *jb, const char *path, int mode) {
         if ((rv = tcisvalidutf8str(colname, strlen(colname)))) {
             EJCOLL *cdb;
             EJCOLLOPTS opts;
-            if ((rv = _metagetopts(jb, colname, &opts))) {
-                rv = _addcoldb0(colname, jb, &opts, &cdb);
+            if ((rv = _metagetopts(jb, colname, &opts)) && (rv = _addcoldb0(colname, jb, &opts, &cdb))) {
+                _delsortruns(cdb);
             }
         } else {
             _ejdbsetecode(jb, JBEMETANVALID, __FILE__, __LINE__, __func__);
@@ -448,9 +852,11 @@ bool ejdbsavebson2(EJCOLL *coll, bson *bs, bson_oid_t *oid, bool merge) {
         _ejdbsetecode(coll->jb, TCEINVALID, __FILE__, __LINE__, __func__);
         return false;
     }
+    double started = tctime();
     if (!JBCLOCKMETHOD(coll, true)) return false;
     bool rv = _ejdbsavebsonimpl(coll, bs, oid, merge);
     JBCUNLOCKMETHOD(coll);
+    _histadd(coll, JBHSAVE, started);
     return rv;
 }
 
@@ -466,6 +872,7 @@ bool ejdbrmbson(EJCOLL *coll, bson_oid_t *oid) {
         _ejdbsetecode(coll->jb, TCEINVALID, __FILE__, __LINE__, __func__);
         return false;
     }
+    double started = tctime();
     JBCLOCKMETHOD(coll, true);
     bool rv = true;
     const void *olddata;
@@ -481,6 +888,7 @@ bool ejdbrmbson(EJCOLL *coll, bson_oid_t *oid) {
     }
 finish:
     JBCUNLOCKMETHOD(coll);
+    _histadd(coll, JBHRM, started);
     if (rmap) {
         tcmapdel(rmap);
     }
@@ -493,6 +901,7 @@ bson* ejdbloadbson(EJCOLL *coll, const bson_oid_t *oid) {
         _ejdbsetecode(coll->jb, TCEINVALID, __FILE__, __LINE__, __func__);
         return NULL;
     }
+    double started = tctime();
     JBCLOCKMETHOD(coll, false);
     bson *ret = NULL;
     int datasz;
@@ -512,6 +921,7 @@ bson* ejdbloadbson(EJCOLL *coll, const bson_oid_t *oid) {
     bson_init_finished_data(ret, bsdata);
 finish:
     JBCUNLOCKMETHOD(coll);
+    _histadd(coll, JBHLOAD, started);
     if (cdata) {
         TCFREE(cdata);
     }
@@ -618,6 +1028,185 @@ EJQ* ejdbqueryhints(EJDB *jb, EJQ *q, const void *hintsbsdata) {
     return q;
 }
 
+EJQ* ejdbqueryprepare(EJDB *jb, EJQ *q) {
+    assert(jb && q);
+    if (q->plan) {
+        return q;
+    }
+    EJQPLAN *plan;
+    TCCALLOC(plan, 1, sizeof (*plan));
+    plan->params = tclistnew2(TCLISTINYNUM);
+    plan->imeta = tcmapnew2(TCMAPTINYBNUM);
+    TCLIST *alist = tclistnew2(TCLISTINYNUM);
+    _registerallqfields(alist, q);
+    for (int i = 0; i < TCLISTNUM(alist); ++i) {
+        EJQF *qf = *((EJQF**) TCLISTVALPTR(alist, i));
+        if ((qf->ftype != BSON_STRING && qf->ftype != BSON_OID) ||
+                (qf->tcop != TDBQCSTREQ && qf->tcop != TDBQCSTRBW) ||
+                qf->exprsz != 1 || *qf->expr != '?') {
+            continue;
+        }
+        // Placeholder stays unbound until `ejdbquerybind*()` call
+        TCFREE(qf->expr);
+        qf->expr = NULL;
+        qf->exprsz = 0;
+        qf->flags |= EJFPARAM;
+        TCLISTPUSH(plan->params, &qf, sizeof (qf));
+    }
+    tclistdel(alist);
+    q->plan = plan;
+    return q;
+}
+
+int ejdbqueryparams(const EJQ *q) {
+    assert(q);
+    return q->plan ? TCLISTNUM(q->plan->params) : 0;
+}
+
+/* Placeholder condition `pos` of the prepared query */
+static EJQF* _qryparam(EJDB *jb, EJQ *q, int pos) {
+    if (!q->plan || pos < 0 || pos >= TCLISTNUM(q->plan->params)) {
+        _ejdbsetecode(jb, JBEQPARAM, __FILE__, __LINE__, __func__);
+        return NULL;
+    }
+    EJQF *qf = *((EJQF**) TCLISTVALPTR(q->plan->params, pos));
+    if (qf->expr) {
+        TCFREE(qf->expr);
+        qf->expr = NULL;
+        qf->exprsz = 0;
+    }
+    return qf;
+}
+
+bool ejdbquerybindstr(EJDB *jb, EJQ *q, int pos, const char *val) {
+    assert(jb && q && val);
+    EJQF *qf = _qryparam(jb, q, pos);
+    if (!qf) {
+        return false;
+    }
+    if (qf->flags & EJCONDICASE) {
+        qf->exprsz = tcicaseformat(val, strlen(val), NULL, 0, &qf->expr);
+        if (qf->exprsz < 0) {
+            _ejdbsetecode(jb, qf->exprsz, __FILE__, __LINE__, __func__);
+            qf->expr = NULL;
+            qf->exprsz = 0;
+            return false;
+        }
+    } else {
+        qf->expr = tcstrdup(val);
+        qf->exprsz = strlen(qf->expr);
+    }
+    qf->ftype = BSON_STRING;
+    if (qf->flags & EJCONDSTARTWITH) {
+        qf->tcop = TDBQCSTRBW;
+    } else {
+        qf->tcop = TDBQCSTREQ;
+        if (!strcmp(JDBIDKEYNAME, qf->fpath)) {
+            qf->ftype = BSON_OID;
+        }
+    }
+    qf->exprlongval = 0;
+    qf->exprdblval = 0;
+    return true;
+}
+
+/* Set number operation of the bound placeholder the same way as `_parse_qobj_impl()` does */
+static void _qryparamnumop(EJQF *qf) {
+    qf->exprsz = strlen(qf->expr);
+    if (qf->flags & EJCOMPGT) {
+        qf->tcop = TDBQCNUMGT;
+    } else if (qf->flags & EJCOMPGTE) {
+        qf->tcop = TDBQCNUMGE;
+    } else if (qf->flags & EJCOMPLT) {
+        qf->tcop = TDBQCNUMLT;
+    } else if (qf->flags & EJCOMPLTE) {
+        qf->tcop = TDBQCNUMLE;
+    } else {
+        qf->tcop = TDBQCNUMEQ;
+    }
+}
+
+bool ejdbquerybindlong(EJDB *jb, EJQ *q, int pos, int64_t val) {
+    assert(jb && q);
+    EJQF *qf = _qryparam(jb, q, pos);
+    if (!qf) {
+        return false;
+    }
+    qf->ftype = BSON_LONG;
+    qf->exprlongval = val;
+    qf->exprdblval = val;
+    qf->expr = tcsprintf("%" PRId64, qf->exprlongval);
+    _qryparamnumop(qf);
+    return true;
+}
+
+bool ejdbquerybinddouble(EJDB *jb, EJQ *q, int pos, double val) {
+    assert(jb && q);
+    EJQF *qf = _qryparam(jb, q, pos);
+    if (!qf) {
+        return false;
+    }
+    qf->ftype = BSON_DOUBLE;
+    qf->exprdblval = val;
+    qf->exprlongval = (int64_t) val;
+    qf->expr = tcsprintf("%f", qf->exprdblval);
+    _qryparamnumop(qf);
+    return true;
+}
+
+bool ejdbsetslowlog(EJDB *jb, int64_t thresholdms, int size) {
+    assert(jb);
+    if (!jb->slmtx || pthread_mutex_lock(jb->slmtx) != 0) {
+        _ejdbsetecode(jb, TCETHREAD, __FILE__, __LINE__, __func__);
+        return false;
+    }
+    if (thresholdms < 0) {
+        __atomic_store_n(&jb->slthreshold, -1, __ATOMIC_RELAXED);
+        if (jb->slowlog) {
+            tclistdel(jb->slowlog);
+            jb->slowlog = NULL;
+        }
+    } else {
+        jb->slsize = (size > 0) ? size : JBSLOWLOGSIZE;
+        if (!jb->slowlog) {
+            jb->slowlog = tclistnew2(jb->slsize + 1);
+        }
+        while (TCLISTNUM(jb->slowlog) > jb->slsize) {
+            int sz;
+            TCFREE(tclistshift(jb->slowlog, &sz));
+        }
+        __atomic_store_n(&jb->slthreshold, thresholdms * 1000, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(jb->slmtx);
+    return true;
+}
+
+bson* ejdbslowlog(EJDB *jb, bool reset) {
+    assert(jb);
+    char nbuf[TCNUMBUFSIZ];
+    bson *ret = bson_create();
+    bson_init_as_query(ret);
+    if (jb->slmtx && pthread_mutex_lock(jb->slmtx) == 0) {
+        for (int i = 0; jb->slowlog && i < TCLISTNUM(jb->slowlog); ++i) {
+            bson entry;
+            bson_init_with_data(&entry, TCLISTVALPTR(jb->slowlog, i));
+            bson_numstrn(nbuf, TCNUMBUFSIZ, i);
+            bson_append_bson(ret, nbuf, &entry);
+        }
+        if (reset && jb->slowlog) {
+            tclistclear(jb->slowlog);
+        }
+        pthread_mutex_unlock(jb->slmtx);
+    }
+    bson_finish(ret);
+    return ret;
+}
+
+void ejdbqrycancel(EJQ *q, bool cancel) {
+    assert(q);
+    __atomic_store_n(&q->cancel, cancel ? 1 : 0, __ATOMIC_RELAXED);
+}
+
 void ejdbquerydel(EJQ *q) {
     _qrydel(q, true);
 }
@@ -627,6 +1216,119 @@ bool ejdbsetindex(EJCOLL *coll, const char *fpath, int flags) {
     return _setindeximpl(coll, fpath, flags, false);
 }
 
+bool ejdbsetcompoundindex(EJCOLL *coll, const char *fields, int flags) {
+    return _setcidximpl(coll, fields, flags, false);
+}
+
+bool ejdbanalyze(EJCOLL *coll, TCXSTR *log) {
+    assert(coll);
+    bool err = false;
+    char ikey[BSON_MAX_FPATH_LEN + 2];
+    JBENSUREOPENLOCK(coll->jb, false, false);
+    if (!JBCLOCKMETHOD(coll, true)) {
+        JBUNLOCKMETHOD(coll->jb);
+        return false;
+    }
+    TCTDB *tdb = coll->tdb;
+    if (tdb->wmode && !tctdbmemsync(tdb, false)) { // Flush token index caches into B+trees
+        err = true;
+    }
+    // Indexes are walked under the read lock, concurrent queries are not blocked
+    JBCUNLOCKMETHOD(coll);
+    if (!JBCLOCKMETHOD(coll, false)) {
+        JBUNLOCKMETHOD(coll->jb);
+        return false;
+    }
+    TCMAP *done = tcmapnew2(TCMAPTINYBNUM);
+    TCLIST *deltas = tclistnew2(TCLISTINYNUM); // Meta key followed by its stats BSON data
+    uint64_t records = tchdbrnum(tdb->hdb);
+    for (int i = 0; i < tdb->inum; ++i) {
+        const char *fpath = tdb->idxs[i].name + 1;
+        if (*tdb->idxs[i].name == '\0' || *tdb->idxs[i].name == 'c' || tcmapget2(done, fpath)) {
+            continue;
+        }
+        tcmapput2(done, fpath, "");
+        int fpathsz = strlen(fpath);
+        if (fpathsz > BSON_MAX_FPATH_LEN) {
+            continue;
+        }
+        memcpy(ikey + 1, fpath, fpathsz + 1);
+        ikey[0] = 'i';
+        // All index types of the field are analyzed together
+        // since their stats share the single field index meta
+        bson bsistats, bsdelta;
+        bson_init(&bsistats);
+        bson *bestbs = NULL;
+        int64_t bestentries = -1;
+        for (int j = i; j < tdb->inum; ++j) {
+            TDBIDX *idx = tdb->idxs + j;
+            if (strcmp(idx->name + 1, fpath)) {
+                continue;
+            }
+            char tname[2] = {*idx->name, '\0'};
+            int64_t entries = 0;
+            bson *bs = bson_create();
+            bson_init(bs);
+            _analyzeidx(coll, idx, bs, &entries, log);
+            bson_finish(bs);
+            bson_append_bson(&bsistats, tname, bs);
+            if (entries > bestentries) {
+                if (bestbs) bson_del(bestbs);
+                bestbs = bs;
+                bestentries = entries;
+            } else {
+                bson_del(bs);
+            }
+        }
+        bson_finish(&bsistats);
+        bson_init(&bsdelta);
+        if (bestbs) { // Field level stats are taken from the most populated index
+            bson_iterator it;
+            BSON_ITERATOR_INIT(&it, bestbs);
+            while (bson_iterator_next(&it) != BSON_EOO) {
+                const char *key = BSON_ITERATOR_KEY(&it);
+                if (!strcmp(key, "selectivity") || !strcmp(key, "avgreclen") ||
+                        !strcmp(key, "cardinality")) {
+                    bson_append_field_from_iterator(&it, &bsdelta);
+                }
+            }
+            bson_del(bestbs);
+        }
+        bson_append_long(&bsdelta, "records", records);
+        bson_append_bson(&bsdelta, "istats", &bsistats);
+        bson_append_date(&bsdelta, "analyzed", (bson_date_t) (tctime() * 1000));
+        bson_finish(&bsdelta);
+        TCLISTPUSH(deltas, ikey, strlen(ikey));
+        TCLISTPUSH(deltas, bson_data(&bsdelta), bson_size(&bsdelta));
+        bson_destroy(&bsdelta);
+        bson_destroy(&bsistats);
+    }
+    tcmapdel(done);
+    JBCUNLOCKMETHOD(coll);
+    // Index meta is written under the write lock like by other meta writers
+    if (!JBCLOCKMETHOD(coll, true)) {
+        tclistdel(deltas);
+        JBUNLOCKMETHOD(coll->jb);
+        return false;
+    }
+    for (int i = 0; i + 1 < TCLISTNUM(deltas); i += 2) {
+        const char *mkey = TCLISTVALPTR(deltas, i);
+        bson *imeta = _imetaidx(coll, mkey + 1);
+        if (imeta) { // Stats are saved only for indexes managed by ejdb
+            bson bsdelta;
+            bson_init_with_data(&bsdelta, TCLISTVALPTR(deltas, i + 1));
+            if (!_metasetbson2(coll, mkey, &bsdelta, true, true)) {
+                err = true;
+            }
+            bson_del(imeta);
+        }
+    }
+    tclistdel(deltas);
+    JBCUNLOCKMETHOD(coll);
+    JBUNLOCKMETHOD(coll->jb);
+    return !err;
+}
+
 uint32_t ejdbupdate(EJCOLL *coll, bson *qobj, 
                     bson *orqobjs, int orqobjsnum, 
                     bson *hints, TCXSTR *log) {
@@ -649,14 +1351,39 @@ EJQRESULT ejdbqryexecute(EJCOLL *coll, const EJQ *q,
         _ejdbsetecode(coll->jb, TCEINVALID, __FILE__, __LINE__, __func__);
         return NULL;
     }
+    double started = tctime();
+    JBCLOCKMETHOD(coll, (q->flags & EJQUPDATING) ? true : false);
+    _ejdbsetecode(coll->jb, TCESUCCESS, __FILE__, __LINE__, __func__);
+    if (ejdbecode(coll->jb) != TCESUCCESS) { // We are not in fatal state
+        JBCUNLOCKMETHOD(coll);
+        return NULL;
+    }
+    TCLIST *res = _qryexecute(coll, q, count, qflags, log, NULL, NULL);
+    JBCUNLOCKMETHOD(coll);
+    _histadd(coll, JBHQUERY, started);
+    return res;
+}
+
+EJQRESULT ejdbqryexplain(EJCOLL *coll, const EJQ *q, 
+                         uint32_t *count, int qflags, 
+                         bson *explain) {
+    assert(coll && q && q->qflist && explain);
+    bson_init(explain);
+    if (!JBISOPEN(coll->jb)) {
+        _ejdbsetecode(coll->jb, TCEINVALID, __FILE__, __LINE__, __func__);
+        bson_finish(explain);
+        return NULL;
+    }
     JBCLOCKMETHOD(coll, (q->flags & EJQUPDATING) ? true : false);
     _ejdbsetecode(coll->jb, TCESUCCESS, __FILE__, __LINE__, __func__);
     if (ejdbecode(coll->jb) != TCESUCCESS) { // We are not in fatal state
         JBCUNLOCKMETHOD(coll);
+        bson_finish(explain);
         return NULL;
     }
-    TCLIST *res = _qryexecute(coll, q, count, qflags, log);
+    TCLIST *res = _qryexecute(coll, q, count, qflags, NULL, explain, NULL);
     JBCUNLOCKMETHOD(coll);
+    bson_finish(explain);
     return res;
 }
 
@@ -694,6 +1421,10 @@ bson* ejdbqrydistinct(EJCOLL *coll, const char *fpath, bson *qobj,
         _ejdbsetecode(coll->jb, JBEQERROR, __FILE__, __LINE__, __func__);
         goto fail;
     }
+    rres = _qrydistinctidx(coll, fpath, q, count, log);
+    if (rres) {
+        goto fail;
+    }
     TCLIST *res = ejdbqryexecute(coll, q, &icount, 0, log);
     rres = bson_create();
     bson_init(rres);
@@ -755,6 +1486,109 @@ void ejdbqresultdispose(EJQRESULT qr) {
     }
 }
 
+EJQCUR* ejdbqrycursor(EJCOLL *coll, const EJQ *q, int qflags, TCXSTR *log) {
+    assert(coll && q && q->qflist);
+    if (!JBISOPEN(coll->jb)) {
+        _ejdbsetecode(coll->jb, TCEINVALID, __FILE__, __LINE__, __func__);
+        return NULL;
+    }
+    JBCLOCKMETHOD(coll, (q->flags & EJQUPDATING) ? true : false);
+    _ejdbsetecode(coll->jb, TCESUCCESS, __FILE__, __LINE__, __func__);
+    if (ejdbecode(coll->jb) != TCESUCCESS) { // We are not in fatal state
+        JBCUNLOCKMETHOD(coll);
+        return NULL;
+    }
+    EJQCUR *cur;
+    TCCALLOC(cur, 1, sizeof (*cur));
+    cur->coll = coll;
+    if (!_qrycuropen(cur, q, qflags, log)) { // Fallback to the materialized result set
+        uint32_t count = 0;
+        cur->res = _qryexecute(coll, q, &count, qflags, log, NULL, cur);
+        if (!cur->res && !cur->merge && ejdbecode(coll->jb) != TCESUCCESS) {
+            TCFREE(cur);
+            JBCUNLOCKMETHOD(coll);
+            return NULL;
+        }
+        cur->eof = (cur->res == NULL && cur->merge == NULL);
+        if (log) {
+            tcxstrprintf(log, "STREAMING CURSOR: %s\n", cur->merge ? "MERGE" : "NO");
+        }
+    }
+    JBCUNLOCKMETHOD(coll);
+    return cur;
+}
+
+const void* ejdbqrycurnext(EJQCUR *cur, int *size) {
+    assert(cur && size);
+    *size = 0;
+    if (cur->eof) {
+        return NULL;
+    }
+    if (cur->res) {
+        if (cur->pos >= TCLISTNUM(cur->res)) {
+            cur->eof = true;
+            return NULL;
+        }
+        return ejdbqresultbsondata(cur->res, cur->pos++, size);
+    }
+    if (cur->merge) { // Spilled sorted runs are read without locking
+        TCLISTDATUM d;
+        while (cur->count < cur->max && _sortmergenext(&cur->ctx, cur->merge, &d)) {
+            if (++cur->count > cur->skip) {
+                *size = d.size;
+                return d.ptr;
+            }
+        }
+        cur->eof = true;
+        return NULL;
+    }
+    EJCOLL *coll = cur->coll;
+    if (!JBISOPEN(coll->jb)) {
+        _ejdbsetecode(coll->jb, TCEINVALID, __FILE__, __LINE__, __func__);
+        return NULL;
+    }
+    if (!JBCLOCKMETHOD(coll, false)) {
+        return NULL;
+    }
+    const void *bsdata = _qrycurnext(cur, size);
+    JBCUNLOCKMETHOD(coll);
+    return bsdata;
+}
+
+void ejdbqrycurdel(EJQCUR *cur) {
+    if (!cur) {
+        return;
+    }
+    if (cur->hdbiter) {
+        tchdbiter2dispose(cur->coll->tdb->hdb, cur->hdbiter);
+    }
+    if (cur->icur) {
+        tcbdbcurdel(cur->icur);
+    }
+    if (cur->lkey) {
+        tcxstrdel(cur->lkey);
+    }
+    if (cur->lpks) {
+        tcmapdel(cur->lpks);
+    }
+    if (cur->pkbuf) {
+        tcxstrdel(cur->pkbuf);
+    }
+    if (cur->qfs) {
+        TCFREE(cur->qfs);
+    }
+    if (cur->res) {
+        tclistdel(cur->res);
+    }
+    if (cur->merge) {
+        _sortmergeclose(&cur->ctx, cur->merge);
+        TCFREE(cur->merge);
+        TCFREE(cur->ctx.sctx.ofs);
+    }
+    _qryctxclear(&cur->ctx);
+    TCFREE(cur);
+}
+
 bool ejdbsyncoll(EJCOLL *coll) {
     assert(coll);
     if (!JBISOPEN(coll->jb)) {
@@ -762,9 +1596,11 @@ bool ejdbsyncoll(EJCOLL *coll) {
         return false;
     }
     bool rv = false;
+    double started = tctime();
     if (!JBCLOCKMETHOD(coll, true)) return false;
     rv = tctdbsync(coll->tdb);
     JBCUNLOCKMETHOD(coll);
+    _histadd(coll, JBHSYNC, started);
     return rv;
 }
 
@@ -777,10 +1613,12 @@ bool ejdbsyncdb(EJDB *jb) {
     }
     for (int i = 0; i < jb->cdbsnum; ++i) {
         assert(jb->cdbs[i]);
+        double started = tctime();
         rv = JBCLOCKMETHOD(jb->cdbs[i], true);
         if (!rv) break;
         rv = tctdbsync(jb->cdbs[i]->tdb);
         JBCUNLOCKMETHOD(jb->cdbs[i]);
+        _histadd(jb->cdbs[i], JBHSYNC, started);
         if (!rv) break;
     }
     JBUNLOCKMETHOD(jb);
@@ -820,6 +1658,7 @@ bool ejdbtrancommit(EJCOLL *coll) {
         _ejdbsetecode(coll->jb, TCEINVALID, __FILE__, __LINE__, __func__);
         return false;
     }
+    double started = tctime();
     if (!JBCLOCKMETHOD(coll, true)) return false;
     if (!coll->tdb->open || !coll->tdb->wmode || !coll->tdb->tran) {
         _ejdbsetecode(coll->jb, TCEINVALID, __FILE__, __LINE__, __func__);
@@ -830,6 +1669,7 @@ bool ejdbtrancommit(EJCOLL *coll) {
     bool err = false;
     if (!tctdbtrancommitimpl(coll->tdb)) err = true;
     JBCUNLOCKMETHOD(coll);
+    _histadd(coll, JBHTRANCOMMIT, started);
     return !err;
 }
 
@@ -895,6 +1735,10 @@ bson* ejdbmeta(EJDB *jb) {
         bson_append_string(bs, "file", coll->tdb->hdb->path);
         bson_append_long(bs, "records", coll->tdb->hdb->rnum);
 
+        bson_append_start_object(bs, "stats"); // coll.stats
+        _collstats(coll, bs);
+        bson_append_finish_object(bs); // eof coll.stats
+
         bson_append_start_object(bs, "options"); // coll.options
         bson_append_long(bs, "buckets", coll->tdb->hdb->bnum);
         bson_append_long(bs, "cachedrecords", coll->tdb->hdb->rcnum);
@@ -907,6 +1751,7 @@ bson* ejdbmeta(EJDB *jb) {
             TDBIDX *idx = (coll->tdb->idxs + j);
             if (idx->type != TDBITLEXICAL &&
                     idx->type != TDBITDECIMAL &&
+                    idx->type != TDBITBINNUM &&
                     idx->type != TDBITTOKEN) {
                 continue;
             }
@@ -921,6 +1766,9 @@ bson* ejdbmeta(EJDB *jb) {
                 case TDBITDECIMAL:
                     bson_append_string(bs, "type", "decimal");
                     break;
+                case TDBITBINNUM:
+                    bson_append_string(bs, "type", (*idx->name == 'c') ? "compound" : "binary");
+                    break;
                 case TDBITTOKEN:
                     bson_append_string(bs, "type", "token");
                     break;
@@ -1087,35 +1935,449 @@ bson* ejdbcommand(EJDB *jb, bson *cmd) {
                 err = ejdberrmsg(ecode);
             }
             TCFREE(path);
-        } else if (!strcmp("ping", key)) {
+        } else if (!strcmp("analyze", key)) {
             xlog = tcxstrnew();
-            tcxstrprintf(xlog, "pong");
-        } else {
-            err = "Unknown command";
-            ecode = JBEINVALIDCMD;
-            goto finish;
-        }
-    }
-finish:
-    if (err) {
-        bson_append_string(ret, "error", err);
-        bson_append_int(ret, "errorCode", ecode);
-    }
-    if (xlog) {
-        bson_append_string(ret, "log", TCXSTRPTR(xlog));
-        tcxstrdel(xlog);
-    }
-    if (cnames) {
-        tclistdel(cnames);
-    }
-    bson_finish(ret);
-    return ret;
+            if (bt == BSON_OBJECT) {
+                bson_iterator sit;
+                BSON_ITERATOR_SUBITERATOR(&it, &sit);
+                if (bson_find_fieldpath_value("cnames", &sit) == BSON_ARRAY) {
+                    bson_iterator ait;
+                    BSON_ITERATOR_SUBITERATOR(&sit, &ait);
+                    while ((bt = bson_iterator_next(&ait)) != BSON_EOO) {
+                        if (bt == BSON_STRING) {
+                            if (cnames == NULL) {
+                                cnames = tclistnew();
+                            }
+                            const char *sv = bson_iterator_string(&ait);
+                            TCLISTPUSH(cnames, sv, strlen(sv));
+                        }
+                    }
+                }
+            }
+            if (cnames == NULL) {
+                TCLIST *colls = ejdbgetcolls(jb);
+                cnames = tclistnew();
+                for (int i = 0; colls && i < TCLISTNUM(colls); ++i) {
+                    EJCOLL *c = (EJCOLL*) TCLISTVALPTR(colls, i);
+                    TCLISTPUSH(cnames, c->cname, c->cnamesz);
+                }
+                if (colls) {
+                    tclistdel(colls);
+                }
+            }
+            for (int i = 0; i < TCLISTNUM(cnames); ++i) {
+                const char *cn = TCLISTVALPTR(cnames, i);
+                EJCOLL *coll = ejdbgetcoll(jb, cn);
+                if (!coll) {
+                    continue;
+                }
+                tcxstrprintf(xlog, "ANALYZE COLLECTION '%s'\n", cn);
+                if (!ejdbanalyze(coll, xlog)) {
+                    ecode = ejdbecode(jb);
+                    err = ejdberrmsg(ecode);
+                    goto finish;
+                }
+            }
+        } else if (!strcmp("slowlog", key)) {
+            bool reset = false;
+            if (bt == BSON_OBJECT) {
+                bson_iterator sit;
+                BSON_ITERATOR_SUBITERATOR(&it, &sit);
+                if (BSON_IS_NUM_TYPE(bson_find_fieldpath_value("threshold", &sit))) {
+                    int64_t threshold = bson_iterator_long(&sit);
+                    int size = 0;
+                    BSON_ITERATOR_SUBITERATOR(&it, &sit);
+                    if (BSON_IS_NUM_TYPE(bson_find_fieldpath_value("size", &sit))) {
+                        size = bson_iterator_int(&sit);
+                    }
+                    if (!ejdbsetslowlog(jb, threshold, size)) {
+                        ecode = ejdbecode(jb);
+                        err = ejdberrmsg(ecode);
+                        goto finish;
+                    }
+                }
+                BSON_ITERATOR_SUBITERATOR(&it, &sit);
+                if (bson_find_fieldpath_value("reset", &sit) == BSON_BOOL) {
+                    reset = bson_iterator_bool(&sit);
+                }
+            }
+            bson *entries = ejdbslowlog(jb, reset);
+            bson_iterator eit;
+            BSON_ITERATOR_INIT(&eit, entries);
+            bson_append_start_array(ret, "entries");
+            while (bson_iterator_next(&eit) != BSON_EOO) {
+                bson_append_field_from_iterator(&eit, ret);
+            }
+            bson_append_finish_array(ret);
+            bson_del(entries);
+        } else if (!strcmp("stats", key)) {
+            if (bt == BSON_OBJECT) {
+                bson_iterator sit;
+                BSON_ITERATOR_SUBITERATOR(&it, &sit);
+                if (bson_find_fieldpath_value("cnames", &sit) == BSON_ARRAY) {
+                    bson_iterator ait;
+                    BSON_ITERATOR_SUBITERATOR(&sit, &ait);
+                    while ((bt = bson_iterator_next(&ait)) != BSON_EOO) {
+                        if (bt == BSON_STRING) {
+                            if (cnames == NULL) {
+                                cnames = tclistnew();
+                            }
+                            const char *sv = bson_iterator_string(&ait);
+                            TCLISTPUSH(cnames, sv, strlen(sv));
+                        }
+                    }
+                }
+            }
+            TCLIST *colls = ejdbgetcolls(jb);
+            bson_append_start_object(ret, "stats");
+            for (int i = 0; colls && i < TCLISTNUM(colls); ++i) {
+                EJCOLL *c = (EJCOLL*) TCLISTVALPTR(colls, i);
+                bool found = (cnames == NULL);
+                for (int j = 0; !found && j < TCLISTNUM(cnames); ++j) {
+                    found = !strcmp(c->cname, TCLISTVALPTR(cnames, j));
+                }
+                if (!found || !JBCLOCKMETHOD(c, false)) {
+                    continue;
+                }
+                bson_append_start_object(ret, c->cname);
+                _collstats(c, ret);
+                bson_append_finish_object(ret);
+                JBCUNLOCKMETHOD(c);
+            }
+            bson_append_finish_object(ret);
+            if (colls) {
+                tclistdel(colls);
+            }
+        } else if (!strcmp("ping", key)) {
+            xlog = tcxstrnew();
+            tcxstrprintf(xlog, "pong");
+        } else {
+            err = "Unknown command";
+            ecode = JBEINVALIDCMD;
+            goto finish;
+        }
+    }
+finish:
+    if (err) {
+        bson_append_string(ret, "error", err);
+        bson_append_int(ret, "errorCode", ecode);
+    }
+    if (xlog) {
+        bson_append_string(ret, "log", TCXSTRPTR(xlog));
+        tcxstrdel(xlog);
+    }
+    if (cnames) {
+        tclistdel(cnames);
+    }
+    bson_finish(ret);
+    return ret;
 }
 
 /*************************************************************************************************
  * private features
  *************************************************************************************************/
 
+/* Returns the latency histogram bucket of `us` microseconds */
+static int _histbucket(uint64_t us) {
+    if (us < 4) {
+        return us;
+    }
+    int e = 63 - __builtin_clzll(us); // Power of two, e >= 2
+    int b = (e - 1) * 4 + ((us >> (e - 2)) & 3);
+    return MIN(b, JBHISTBUCKETS - 1);
+}
+
+/* Returns the upper bound in microseconds of values counted in the histogram bucket `b` */
+static uint64_t _histbound(int b) {
+    ++b; // Lower bound of the next bucket
+    if (b < 4) {
+        return b - 1;
+    }
+    int e = b / 4 + 1;
+    return ((uint64_t) (4 + b % 4) << (e - 2)) - 1;
+}
+
+/* Record the latency of the collection operation `op` started at `started` wall time */
+static void _histadd(EJCOLL *coll, int op, double started) {
+    EJHIST *h = &coll->hists[op];
+    double elapsed = tctime() - started;
+    uint64_t us = (elapsed > 0) ? (uint64_t) (elapsed * 1000000) : 0;
+    TCSTATADD(h->counts[_histbucket(us)], 1);
+    TCSTATADD(h->total, us);
+    uint64_t max = TCSTATGET(h->max);
+    while (us > max && !__atomic_compare_exchange_n(&h->max, &max, us, true,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Append the latency distribution of the histogram `h` into `bs` */
+static void _histbson(EJHIST *h, bson *bs) {
+    static const double pcts[] = {0.5, 0.99, 0.999};
+    static const char *pnames[] = {"p50", "p99", "p999"};
+    uint64_t counts[JBHISTBUCKETS];
+    uint64_t count = 0;
+    uint64_t max = TCSTATGET(h->max);
+    for (int i = 0; i < JBHISTBUCKETS; ++i) {
+        counts[i] = TCSTATGET(h->counts[i]);
+        count += counts[i];
+    }
+    bson_append_long(bs, "count", count);
+    bson_append_long(bs, "mean", count ? TCSTATGET(h->total) / count : 0);
+    for (int p = 0, b = 0; p < 3; ++p) {
+        uint64_t rank = (uint64_t) ceil(count * pcts[p]), sum = 0;
+        for (b = 0; b < JBHISTBUCKETS && (sum += counts[b]) < rank; ++b);
+        bson_append_long(bs, pnames[p], count ? MIN(_histbound(MIN(b, JBHISTBUCKETS - 1)), max) : 0);
+    }
+    bson_append_long(bs, "max", max);
+}
+
+/**
+ * Append engine counters of the collection `coll` and its indexes into `bs`.
+ * Counters are maintained with relaxed atomic increments in release builds.
+ */
+static void _collstats(EJCOLL *coll, bson *bs) {
+    TCHDB *hdb = coll->tdb->hdb;
+    uint64_t fsyncs = TCSTATGET(hdb->st_fsync);
+    uint64_t walbytes = TCSTATGET(hdb->st_walbytes);
+    uint64_t leafhit = 0, leafmiss = 0, leafsave = 0;
+    for (int i = 0; i < coll->tdb->inum; ++i) {
+        TDBIDX *idx = coll->tdb->idxs + i;
+        if (idx->type != TDBITLEXICAL && idx->type != TDBITDECIMAL &&
+                idx->type != TDBITBINNUM && idx->type != TDBITTOKEN) {
+            continue;
+        }
+        TCBDB *idb = (TCBDB*) idx->db;
+        leafhit += TCSTATGET(idb->st_leafhit);
+        leafmiss += TCSTATGET(idb->st_leafmiss);
+        leafsave += TCSTATGET(idb->st_saveleaf);
+        fsyncs += TCSTATGET(idb->hdb->st_fsync);
+        walbytes += TCSTATGET(idb->hdb->st_walbytes);
+    }
+    bson_append_long(bs, "queries", TCSTATGET(coll->st_queries));
+    bson_append_long(bs, "idxscans", TCSTATGET(coll->st_idxscans));
+    bson_append_long(bs, "fullscans", TCSTATGET(coll->st_fullscans));
+    bson_append_long(bs, "rechit", TCSTATGET(hdb->st_rechit));
+    bson_append_long(bs, "recmiss", TCSTATGET(hdb->st_recmiss));
+    bson_append_long(bs, "recread", TCSTATGET(hdb->st_readrec));
+    bson_append_long(bs, "recwrite", TCSTATGET(hdb->st_writerec));
+    bson_append_long(bs, "leafhit", leafhit);
+    bson_append_long(bs, "leafmiss", leafmiss);
+    bson_append_long(bs, "leafsave", leafsave);
+    bson_append_long(bs, "fsyncs", fsyncs);
+    bson_append_long(bs, "walbytes", walbytes);
+    static const char *hnames[JBHNUM] = {"save", "load", "query", "rm", "trancommit", "sync"};
+    bson_append_start_object(bs, "latency");
+    for (int i = 0; i < JBHNUM; ++i) {
+        bson_append_start_object(bs, hnames[i]);
+        _histbson(&coll->hists[i], bs);
+        bson_append_finish_object(bs);
+    }
+    bson_append_finish_object(bs);
+}
+
+/**
+ * Walk the B+tree of `idx` once collecting: number of index entries, number of distinct keys
+ * (cardinality), selectivity (cardinality / collection records), average key length and
+ * equi-depth histogram bounds. Results are appended into `bs`.
+ * Indexes of more than `JBANALYZEMAXKEYS` entries are sampled: `JBANALYZESAMPLES` pairs
+ * of adjacent keys are read at pseudo-random distances of a fixed seed skipping whole leaves
+ * in between, so stats of the same index are the same on every run,
+ * cardinality is estimated by the share of sampled pairs having different keys.
+ */
+static void _analyzeidx(EJCOLL *coll, TDBIDX *idx, bson *bs, int64_t *entries, TCXSTR *log) {
+    TCBDB *bdb = idx->db;
+    uint64_t records = tchdbrnum(coll->tdb->hdb);
+    uint64_t rnum = tcbdbrnum(bdb);
+    int trim = (idx->type == TDBITTOKEN) ? 0 : 3; // Key suffix: '\0' + 2 bytes of pk hash
+    int nbuckets = (rnum < JBANALYZEBUCKETS) ? rnum : JBANALYZEBUCKETS;
+    uint64_t nbound = (nbuckets > 0) ? (rnum / nbuckets) - 1 : 0;
+    uint64_t step = (rnum > JBANALYZEMAXKEYS) ? rnum / JBANALYZESAMPLES : 1;
+    uint64_t seed = JBANALYZESEED;
+    uint64_t pos = 0, ppos = 0, samples = 0, pairs = 0, diffs = 0, cardinality = 0, keybytes = 0;
+    int bucket = 0;
+    char nbuff[TCNUMBUFSIZ];
+    const char *kbuf;
+    int kbufsz;
+    TCXSTR *pkey = tcxstrnew();
+    BDBCUR *cur = tcbdbcurnew(bdb);
+
+    bson_append_start_array(bs, "histogram");
+    tcbdbcurfirst(cur);
+    while ((kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+        if (kbufsz >= trim) kbufsz -= trim;
+        keybytes += kbufsz;
+        if (samples > 0 && ppos + 1 == pos) { // Adjacent keys
+            pairs++;
+            if (TCXSTRSIZE(pkey) != kbufsz || memcmp(TCXSTRPTR(pkey), kbuf, kbufsz)) {
+                diffs++;
+            }
+        }
+        samples++;
+        ppos = pos;
+        tcxstrclear(pkey);
+        TCXSTRCAT(pkey, kbuf, kbufsz);
+        if (bucket < nbuckets && pos >= nbound) {
+            bson_numstrn(nbuff, TCNUMBUFSIZ, bucket);
+            if (idx->type == TDBITBINNUM && kbufsz >= JBNUMKEYSZ) {
+                bson_append_double(bs, nbuff, _numkeydec(kbuf));
+            } else if (idx->type == TDBITDECIMAL) {
+                bson_append_double(bs, nbuff, tcatof2(TCXSTRPTR(pkey)));
+            } else {
+                bson_append_string_n(bs, nbuff, kbuf, kbufsz);
+            }
+            bucket++;
+            nbound = ((uint64_t) (bucket + 1) * rnum) / nbuckets - 1;
+        }
+        pos++;
+        tcbdbcurnext(cur);
+        if (step > 2 && !(samples & 1)) { // Both keys of the sampled pair are read
+            // Gap of `step - 2` keys on average, fixed gaps alias with periodic key runs
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            pos += tcbdbcurskip(cur, NULL, 0, (seed >> 33) % (2 * (step - 2) + 1));
+        }
+    }
+    bson_append_finish_array(bs);
+    tcbdbcurdel(cur);
+    tcxstrdel(pkey);
+    if (samples > 0) { // Exact number of distinct keys if every pair of adjacent keys is compared
+        cardinality = 1 + (pairs ? (uint64_t) ((double) diffs * (pos - 1) / pairs + 0.5) : 0);
+    }
+
+    double selectivity = (records > 0) ? (double) cardinality / records : 0.0;
+    if (selectivity > 1.0) {
+        selectivity = 1.0; // Token indexes may have more keys than records
+    }
+    double avgreclen = (samples > 0) ? (double) keybytes / samples : 0.0;
+    bson_append_long(bs, "entries", pos);
+    bson_append_long(bs, "cardinality", cardinality);
+    bson_append_double(bs, "selectivity", selectivity);
+    bson_append_double(bs, "avgreclen", avgreclen);
+    bson_append_long(bs, "sampled", (step > 1) ? samples : 0);
+    *entries = pos;
+    if (log) {
+        tcxstrprintf(log, "ANALYZE INDEX '%s': ENTRIES: %" PRIu64 " CARDINALITY: %" PRIu64
+                     " SELECTIVITY: %.4f AVGRECLEN: %.2f SAMPLED: %" PRIu64 "\n",
+                     idx->name, pos, cardinality, selectivity, avgreclen, (step > 1) ? samples : 0);
+    }
+}
+
+/**
+ * Collect distinct values of `fpath` walking the keys of its string or number index.
+ * Records are read only for runs of equal index keys until one of them matches query `q`,
+ * then the rest of the run is skipped by the index cursor jump.
+ * Returns NULL if there is no index having a key for every collection record.
+ */
+static bson* _qrydistinctidx(EJCOLL *coll, const char *fpath, EJQ *q, uint32_t *count, TCXSTR *log) {
+    bool filter = ((q->orqlist && TCLISTNUM(q->orqlist) > 0) ||
+                   (q->andqlist && TCLISTNUM(q->andqlist) > 0));
+    for (int i = 0; i < TCLISTNUM(q->qflist); ++i) {
+        EJQF *qf = TCLISTVALPTR(q->qflist, i);
+        if (qf->flags & EJFPARAM) {
+            return NULL;
+        }
+        qf->jb = coll->jb;
+        if (qf->fpathsz > 0 && !(qf->flags & EJFEXCLUDED)) {
+            filter = true;
+        }
+    }
+    if (!JBISOPEN(coll->jb) || !JBCLOCKMETHOD(coll, false)) {
+        return NULL;
+    }
+    TDBIDX *idx = NULL;
+    uint64_t rnum = tchdbrnum(coll->tdb->hdb);
+    for (int i = 0; i < coll->tdb->inum; ++i) {
+        TDBIDX *cidx = coll->tdb->idxs + i;
+        if (!((*cidx->name == 'n' && cidx->type == TDBITBINNUM) ||
+              (*cidx->name == 's' && cidx->type == TDBITLEXICAL)) ||
+             strcmp(fpath, cidx->name + 1) || tcbdbrnum(cidx->db) != rnum) {
+            continue; // Index keys of every record are required: at most one key per record
+        }
+        if (!idx || cidx->type == TDBITBINNUM) {
+            idx = cidx;
+        }
+    }
+    if (!idx) {
+        JBCUNLOCKMETHOD(coll);
+        return NULL;
+    }
+    bool binnum = (idx->type == TDBITBINNUM);
+    int fplen = strlen(fpath);
+    int biind = 0;
+    char biindstr[TCNUMBUFSIZ];
+    uint64_t runs = 0, reads = 0, jumps = 0;
+    TCXSTR *colbuf = tcxstrnew();
+    TCXSTR *bsbuf = tcxstrnew();
+    TCXSTR *rkey = tcxstrnew();
+    TCLIST *rbufs = tclistnew2(TCLISTINYNUM);
+    bson *rres = bson_create();
+    bson_init(rres);
+
+    const char *kbuf, *vbuf;
+    int kbufsz, vbufsz;
+    BDBCUR *cur = tcbdbcurnew(idx->db);
+    tcbdbcurfirst(cur);
+    while ((kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+        kbufsz -= 3; // Key suffix: '\0' + 2 bytes of pk hash
+        tcxstrclear(rkey);
+        TCXSTRCAT(rkey, kbuf, kbufsz);
+        // Numbers, booleans and strings formatted as numbers share keys of string index,
+        // so all records of such run are read
+        bool ambig = (!binnum && strspn(TCXSTRPTR(rkey), "0123456789+-.eE") == kbufsz);
+        bool inrun = true, found = false;
+        tclistclear(rbufs);
+        runs++;
+        while (inrun && !found) {
+            vbuf = tcbdbcurval3(cur, &vbufsz);
+            tcxstrclear(colbuf);
+            tcxstrclear(bsbuf);
+            if (vbuf && tchdbgetintoxstr(coll->tdb->hdb, vbuf, vbufsz, colbuf) > 0 &&
+                tcmaploadoneintoxstr(TCXSTRPTR(colbuf), TCXSTRSIZE(colbuf),
+                                     JDBCOLBSON, JDBCOLBSONL, bsbuf) > 0) {
+                reads++;
+                bson_iterator it, rit;
+                BSON_ITERATOR_FROM_BUFFER(&it, TCXSTRPTR(bsbuf));
+                if ((!filter || _qryormatch3(coll, q, q, TCXSTRPTR(bsbuf), TCXSTRSIZE(bsbuf))) &&
+                    bson_find_fieldpath_value2(fpath, fplen, &it) != BSON_EOO) {
+                    bool dup = false;
+                    for (int i = 0; !dup && i < TCLISTNUM(rbufs); ++i) {
+                        BSON_ITERATOR_FROM_BUFFER(&rit, TCLISTVALPTR(rbufs, i));
+                        bson_find_fieldpath_value2(fpath, fplen, &rit);
+                        dup = !bson_compare_it_current(&rit, &it);
+                    }
+                    found = !ambig;
+                    if (!dup) {
+                        bson_numstrn(biindstr, TCNUMBUFSIZ, biind++);
+                        bson_append_field_from_iterator2(biindstr, &it, rres);
+                        if (ambig) {
+                            TCLISTPUSH(rbufs, TCXSTRPTR(bsbuf), TCXSTRSIZE(bsbuf));
+                        }
+                    }
+                }
+            }
+            tcbdbcurnext(cur);
+            kbuf = tcbdbcurkey3(cur, &kbufsz);
+            inrun = (kbuf && kbufsz - 3 == TCXSTRSIZE(rkey) && !memcmp(kbuf, TCXSTRPTR(rkey), kbufsz - 3));
+        }
+        if (inrun) { // Skip the rest of run, 0x01 byte follows '\0' of key suffix
+            TCXSTRCAT(rkey, "\x01", 1);
+            tcbdbcurjump(cur, TCXSTRPTR(rkey), TCXSTRSIZE(rkey));
+            jumps++;
+        }
+    }
+    tcbdbcurdel(cur);
+    JBCUNLOCKMETHOD(coll);
+    bson_finish(rres);
+    *count = biind;
+    if (log) {
+        tcxstrprintf(log, "DISTINCT INDEX: '%s' KEY RUNS: %" PRIu64 " RECORDS READ: %" PRIu64
+                     " INDEX JUMPS: %" PRIu64 "\n", idx->name, runs, reads, jumps);
+    }
+    tclistdel(rbufs);
+    tcxstrdel(rkey);
+    tcxstrdel(bsbuf);
+    tcxstrdel(colbuf);
+    return rres;
+}
+
 static bool _setindeximpl(EJCOLL *coll, const char *fpath, int flags, bool nolock) {
     assert(coll && fpath);
     bool rv = true;
@@ -1221,6 +2483,7 @@ static bool _setindeximpl(EJCOLL *coll, const char *fpath, int flags, bool noloc
     }
     _BSONIPATHROWLDR op;
     op.icase = false;
+    op.numkey = false;
     op.coll = coll;
     if (tcitype) {
         if (flags & JBIDXSTR) {
@@ -1265,7 +2528,10 @@ static bool _setindeximpl(EJCOLL *coll, const char *fpath, int flags, bool noloc
         }
         if (rv && (flags & JBIDXNUM) && (ibld || !(oldiflags & JBIDXNUM))) {
             ipath[0] = 'n';
-            rv = tctdbsetindexrldr(coll->tdb, ipath, TDBITDECIMAL, _bsonipathrowldr, &op);
+            op.icase = false;
+            op.numkey = true;
+            rv = tctdbsetindexrldr(coll->tdb, ipath, TDBITBINNUM, _bsonipathrowldr, &op);
+            op.numkey = false;
         }
         if (rv && (flags & JBIDXARR) && (ibld || !(oldiflags & JBIDXARR))) {
             ipath[0] = 'a';
@@ -1282,6 +2548,78 @@ finish:
     return rv;
 }
 
+static bool _setcidximpl(EJCOLL *coll, const char *spec, int flags, bool nolock) {
+    assert(coll && spec);
+    bool rv = true;
+    bson *imeta = NULL;
+    bool ibld = (flags & JBIDXREBLD);
+    bool idrop = (flags & (JBIDXDROP | JBIDXDROPALL));
+    bool iop = (flags & JBIDXOP);
+    char ikey[BSON_MAX_FPATH_LEN + 2]; // Add 2 bytes for 'c' prefix and '\0'term
+    const char *fpaths[JBCIDXMAXFIELDS];
+    int fpathszs[JBCIDXMAXFIELDS], dirs[JBCIDXMAXFIELDS];
+    int specsz = strlen(spec);
+    if (specsz > BSON_MAX_FPATH_LEN || _cidxspecparse(spec, specsz, fpaths, fpathszs, dirs) < 2) {
+        _ejdbsetecode(coll->jb, JBEFPATHINVALID, __FILE__, __LINE__, __func__);
+        return false;
+    }
+    memmove(ikey + 1, spec, specsz + 1);
+    ikey[0] = 'c';
+
+    if (!nolock) {
+        JBENSUREOPENLOCK(coll->jb, true, false);
+    }
+    imeta = _metagetbson2(coll, ikey);
+    if (!imeta) {
+        if (idrop) { // Cannot drop/optimize not existent index
+            if (!nolock) {
+                JBUNLOCKMETHOD(coll->jb);
+            }
+            goto finish;
+        }
+        iop = false; // New index will be created
+        ibld = true;
+        imeta = bson_create();
+        bson_init(imeta);
+        bson_append_string(imeta, "cpath", spec);
+        bson_finish(imeta);
+        rv = _metasetbson2(coll, ikey, imeta, false, false);
+    } else if (idrop) {
+        rv = _metasetbson2(coll, ikey, NULL, false, false);
+    }
+    if (!nolock) {
+        JBUNLOCKMETHOD(coll->jb);
+    }
+    if (!rv) {
+        goto finish;
+    }
+    if (!nolock) {
+        if (!JBCLOCKMETHOD(coll, true)) {
+            rv = false;
+            goto finish;
+        }
+    }
+    _BSONIPATHROWLDR op;
+    op.icase = false;
+    op.numkey = false;
+    op.coll = coll;
+    if (idrop) {
+        rv = tctdbsetindexrldr(coll->tdb, ikey, TDBITVOID, _bsonipathrowldr, &op);
+    } else if (iop) {
+        rv = tctdbsetindexrldr(coll->tdb, ikey, TDBITOPT, _bsonipathrowldr, &op);
+    } else if (ibld) { // Keys are compared with memcmp as binary number keys
+        rv = tctdbsetindexrldr(coll->tdb, ikey, TDBITBINNUM, _bsonipathrowldr, &op);
+    }
+    if (!nolock) {
+        JBCUNLOCKMETHOD(coll);
+    }
+finish:
+    if (imeta) {
+        bson_del(imeta);
+    }
+    return rv;
+}
+
 /**
  * In order to cleanup resources you need:
  *      _delcoldb(coll);
@@ -1455,6 +2793,19 @@ static bool _importcoll(EJDB *jb, const char *bspath,
     BSON_ITERATOR_INIT(&mbsonit, mbson);
     while ((bt = bson_iterator_next(&mbsonit)) != BSON_EOO) {
         const char *key = BSON_ITERATOR_KEY(&mbsonit);
+        if (bt == BSON_OBJECT && strlen(key) > 1 && key[0] == 'c') { // Compound index
+            bson_iterator sit;
+            BSON_ITERATOR_SUBITERATOR(&mbsonit, &sit);
+            if (bson_find_fieldpath_value("cpath", &sit) == BSON_STRING &&
+                    !_setcidximpl(coll, bson_iterator_string(&sit), 0, true)) {
+                err = true;
+                if (log) {
+                    tcxstrprintf(log, "\nERROR: Error creating collection index."
+                                      " Collection: '%s' Fields: '%s'", cname, bson_iterator_string(&sit));
+                }
+            }
+            continue;
+        }
         if (bt != BSON_OBJECT || strlen(key) < 2 || key[0] != 'i') {
             continue;
         }
@@ -1640,7 +2991,7 @@ wfinish:
         tcmapiterinit(cmeta);
         const char *mkey = NULL;
         while ((mkey = tcmapiternext2(cmeta)) != NULL) {
-            if (!mkey || (*mkey != 'i' && strcmp(mkey, "opts"))) {
+            if (!mkey || (*mkey != 'i' && *mkey != 'c' && strcmp(mkey, "opts"))) {
                 continue; // Only index & opts meta bsons allowing
             }
             bson *bs = _metagetbson(coll->jb, coll->cname, coll->cnamesz, mkey);
@@ -1854,6 +3205,14 @@ static void _qrydel(EJQ *q, bool freequery) {
         TCFREE(q->allqfields);
         q->allqfields = NULL;
     }
+    if (q->plan) {
+        _qryplandel(q->plan);
+        q->plan = NULL;
+    }
+    if (q->match) {
+        _qrymdel(q->match);
+        q->match = NULL;
+    }
     if (freequery) {
         TCFREE(q);
     }
@@ -2325,61 +3684,280 @@ static bool _qrybsmatch(EJQF *qf, const void *bsbuf, int bsbufsz) {
     return _qrybsrecurrmatch(qf, &ffpctx, 0);
 }
 
-static bool _qry_and_or_match(EJCOLL *coll, EJQ *ejq, const void *pkbuf, int pkbufsz) {
-    bool isor = (ejq->orqlist && TCLISTNUM(ejq->orqlist) > 0);
-    bool isand = (ejq->andqlist && TCLISTNUM(ejq->andqlist) > 0);
-    if (!isor && !isand) {
-        return true;
+static void _qrymnodedel(_MNODE *node) {
+    for (_MNODE *n = node->child, *next; n; n = next) {
+        next = n->next;
+        _qrymnodedel(n);
+        TCFREE(n);
     }
-    void *bsbuf = TCXSTRPTR(ejq->bsbuf);
-    int bsbufsz = TCXSTRSIZE(ejq->bsbuf);
+    if (node->qfs) {
+        TCFREE(node->qfs);
+    }
+}
 
-    if (!bsbuf || bsbufsz <= 0) {
-        tcxstrclear(ejq->colbuf);
-        tcxstrclear(ejq->bsbuf);
-        if (tchdbgetintoxstr(coll->tdb->hdb, pkbuf, pkbufsz, ejq->colbuf) <= 0) {
+static void _qrymdel(EJQMATCH *m) {
+    _qrymnodedel(&m->root);
+    if (m->sqfs) {
+        TCFREE(m->sqfs);
+    }
+    TCFREE(m);
+}
+
+/* Adds condition into the fields trie. Returns false if field path has empty sections */
+static bool _qrymadd(EJQMATCH *m, EJQF *qf) {
+    _MNODE *node = &m->root;
+    const char *fpath = qf->fpath;
+    const char *end = fpath + qf->fpathsz;
+    for (const char *key = fpath; key <= end;) {
+        const char *dot = memchr(key, '.', end - key);
+        int keysz = (dot ? dot : end) - key;
+        if (keysz < 1) {
             return false;
         }
-        if (tcmaploadoneintoxstr(TCXSTRPTR(ejq->colbuf), TCXSTRSIZE(ejq->colbuf), 
-                                 JDBCOLBSON, JDBCOLBSONL, ejq->bsbuf) <= 0) {
-            return false;
+        _MNODE *n = node->child, *last = NULL;
+        for (; n && (n->keysz != keysz || memcmp(n->key, key, keysz)); last = n, n = n->next);
+        if (!n) {
+            TCCALLOC(n, 1, sizeof (*n));
+            n->key = key;
+            n->keysz = keysz;
+            if (last) {
+                last->next = n;
+            } else {
+                node->child = n;
+            }
         }
-        bsbufsz = TCXSTRSIZE(ejq->bsbuf);
-        bsbuf = TCXSTRPTR(ejq->bsbuf);
-    }
-    if (isand && !_qryandmatch2(coll, ejq, bsbuf, bsbufsz)) {
-        return false;
-    } else if (isor) {
-        return _qryormatch2(coll, ejq, bsbuf, bsbufsz);
-    } else {
-        return true;
+        node = n;
+        key += keysz + 1;
     }
+    TCREALLOC(node->qfs, node->qfs, (node->qfsnum + 1) * sizeof (EJQF*));
+    node->qfs[node->qfsnum++] = qf;
+    return true;
 }
 
-static bool _qryormatch3(EJCOLL *coll, EJQ *ejq, EJQ *oq, const void *bsbuf, int bsbufsz) {
-    int j = 0;
-    int jm = TCLISTNUM(oq->qflist);
-    for (; j < jm; ++j) {
-        EJQF *qf = TCLISTVALPTR(oq->qflist, j);
-        assert(qf);
-        qf->mflags = qf->flags;
-        if (qf->mflags & EJFEXCLUDED) {
+/**
+ * Compile query conditions into the trie of their field paths matched by a single pass
+ * over the record instead of a record lookup per condition. `$elemMatch`, update `$(query)`
+ * and `TDBQTRUE` conditions are left for `_qrybsmatch()`. Conditions excluded from
+ * matching are skipped. Trie is not built if it holds less than two conditions.
+ */
+static EJQMATCH* _qrymcompile(EJQF **qfs, int qfsz) {
+    EJQMATCH *m;
+    TCCALLOC(m, 1, sizeof (*m));
+    TCMALLOC(m->sqfs, (qfsz + 1) * sizeof (EJQF*));
+    for (int i = 0; i < qfsz; ++i) {
+        EJQF *qf = qfs[i];
+        if (qf->flags & EJFEXCLUDED) {
             continue;
         }
-        if (!_qrybsmatch(qf, bsbuf, bsbufsz)) {
-            break;
+        if (qf->tcop == TDBQTRUE || qf->elmatchgrp > 0 || qf->uslots || 
+                qf->fpathsz < 1 || !_qrymadd(m, qf)) {
+            m->sqfs[m->sqfsnum++] = qf;
+        } else {
+            m->tnum++;
         }
     }
-    if (j == jm) { //all fields in oq are matched
-        if (oq->andqlist && TCLISTNUM(oq->andqlist) > 0 &&
-                !_qryandmatch2(coll, oq, bsbuf, bsbufsz)) { //we have nested $and fields
-            return false;
+    if (m->tnum < 2) {
+        _qrymnodedel(&m->root);
+        memset(&m->root, 0, sizeof (m->root));
+        m->tnum = 0;
+    }
+    return m;
+}
+
+/* Marks all descendants of `node` as seen and matches their conditions one by one */
+static bool _qrymsubtreematch(EJQMATCH *m, _MNODE *node, const void *bsbuf, int bsbufsz) {
+    for (_MNODE *n = node->child; n; n = n->next) {
+        n->seen = m->seq;
+        for (int i = 0; i < n->qfsnum; ++i) {
+            if (!_qrybsmatch(n->qfs[i], bsbuf, bsbufsz)) {
+                return false;
+            }
         }
-        if (oq->orqlist && TCLISTNUM(oq->orqlist) &&
-                !_qryormatch2(coll, oq, bsbuf, bsbufsz)) { //we have nested $or fields
+        if (!_qrymsubtreematch(m, n, bsbuf, bsbufsz)) {
             return false;
         }
-        return true;
+    }
+    return true;
+}
+
+/**
+ * Match conditions of the `node` children against the fields of the record object `it`
+ * the same way as `_qrybsrecurrmatch()` does. Returns 1 if all conditions of found fields
+ * are matched, 0 if not matched and -1 if the record has duplicated or dotted keys,
+ * so conditions must be matched one by one.
+ */
+static int _qrymnodematch(EJQMATCH *m, _MNODE *node, bson_iterator *it, const void *bsbuf, int bsbufsz) {
+    bson_type bt;
+    while ((bt = bson_iterator_next(it)) != BSON_EOO) {
+        const char *key = BSON_ITERATOR_KEY(it);
+        _MNODE *n = node->child;
+        while (n && (*n->key != *key || strncmp(n->key, key, n->keysz) || key[n->keysz] != '\0')) {
+            n = n->next;
+        }
+        if (!n) {
+            if (strchr(key, '.')) { // Dotted key may be matched by the field path
+                return -1;
+            }
+            continue;
+        }
+        if (n->seen == m->seq) { // Duplicated key
+            return -1;
+        }
+        n->seen = m->seq;
+        for (int i = 0; i < n->qfsnum; ++i) {
+            EJQF *qf = n->qfs[i];
+            bool ret;
+            if (bt == BSON_UNDEFINED || bt == BSON_NULL) {
+                ret = qf->negate;
+            } else if (qf->tcop == TDBQCEXIST) {
+                ret = !qf->negate;
+            } else {
+                int mpos = -1;
+                bson_iterator vit = *it;
+                ret = _qrybsvalmatch(qf, &vit, true, &mpos);
+            }
+            if (!ret) {
+                return 0;
+            }
+        }
+        if (!n->child) {
+            continue;
+        }
+        if (bt == BSON_OBJECT) {
+            bson_iterator sit;
+            BSON_ITERATOR_SUBITERATOR(it, &sit);
+            int rv = _qrymnodematch(m, n, &sit, bsbuf, bsbufsz);
+            if (rv != 1) {
+                return rv;
+            }
+        } else if (bt == BSON_ARRAY) { // Array in the middle of field path
+            if (!_qrymsubtreematch(m, n, bsbuf, bsbufsz)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void _qrymnodereset(_MNODE *node) {
+    for (_MNODE *n = node->child; n; n = n->next) {
+        n->seen = 0;
+        _qrymnodereset(n);
+    }
+}
+
+/* Match conditions of fields missing in the record */
+static bool _qrymmissingmatch(EJQMATCH *m, _MNODE *node, bool missing) {
+    for (_MNODE *n = node->child; n; n = n->next) {
+        bool nmissing = (missing || n->seen != m->seq);
+        if (nmissing) {
+            for (int i = 0; i < n->qfsnum; ++i) {
+                if (!n->qfs[i]->negate) {
+                    return false;
+                }
+            }
+        }
+        if (!_qrymmissingmatch(m, n, nmissing)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Returns true if record `bsbuf` matches all conditions `qfs` of the query `q` */
+static bool _qryqfsmatch(EJQ *q, EJQF **qfs, int qfsz, const void *bsbuf, int bsbufsz) {
+    for (int i = 0; i < qfsz; ++i) qfs[i]->mflags = qfs[i]->flags; //reset matching flags
+    if (!q->match) {
+        q->match = _qrymcompile(qfs, qfsz);
+    }
+    EJQMATCH *m = q->match;
+    if (m->tnum > 0) {
+        if (++m->seq == 0) { // Sequence wrapped, reset trie nodes
+            _qrymnodereset(&m->root);
+            m->seq = 1;
+        }
+        bson_iterator it;
+        BSON_ITERATOR_FROM_BUFFER(&it, bsbuf);
+        int rv = _qrymnodematch(m, &m->root, &it, bsbuf, bsbufsz);
+        if (rv == 0 || (rv == 1 && !_qrymmissingmatch(m, &m->root, false))) {
+            return false;
+        }
+        if (rv == 1) {
+            for (int i = 0; i < m->sqfsnum; ++i) {
+                EJQF *qf = m->sqfs[i];
+                if (qf->mflags & EJFEXCLUDED) continue;
+                if (!_qrybsmatch(qf, bsbuf, bsbufsz)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+    for (int i = 0; i < qfsz; ++i) {
+        EJQF *qf = qfs[i];
+        if (qf->mflags & EJFEXCLUDED) continue;
+        if (!_qrybsmatch(qf, bsbuf, bsbufsz)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool _qry_and_or_match(EJCOLL *coll, EJQ *ejq, const void *pkbuf, int pkbufsz) {
+    bool isor = (ejq->orqlist && TCLISTNUM(ejq->orqlist) > 0);
+    bool isand = (ejq->andqlist && TCLISTNUM(ejq->andqlist) > 0);
+    if (!isor && !isand) {
+        return true;
+    }
+    void *bsbuf = TCXSTRPTR(ejq->bsbuf);
+    int bsbufsz = TCXSTRSIZE(ejq->bsbuf);
+
+    if (!bsbuf || bsbufsz <= 0) {
+        tcxstrclear(ejq->colbuf);
+        tcxstrclear(ejq->bsbuf);
+        if (tchdbgetintoxstr(coll->tdb->hdb, pkbuf, pkbufsz, ejq->colbuf) <= 0) {
+            return false;
+        }
+        if (tcmaploadoneintoxstr(TCXSTRPTR(ejq->colbuf), TCXSTRSIZE(ejq->colbuf), 
+                                 JDBCOLBSON, JDBCOLBSONL, ejq->bsbuf) <= 0) {
+            return false;
+        }
+        bsbufsz = TCXSTRSIZE(ejq->bsbuf);
+        bsbuf = TCXSTRPTR(ejq->bsbuf);
+    }
+    if (isand && !_qryandmatch2(coll, ejq, bsbuf, bsbufsz)) {
+        return false;
+    } else if (isor) {
+        return _qryormatch2(coll, ejq, bsbuf, bsbufsz);
+    } else {
+        return true;
+    }
+}
+
+static bool _qryormatch3(EJCOLL *coll, EJQ *ejq, EJQ *oq, const void *bsbuf, int bsbufsz) {
+    int j = 0;
+    int jm = TCLISTNUM(oq->qflist);
+    for (; j < jm; ++j) {
+        EJQF *qf = TCLISTVALPTR(oq->qflist, j);
+        assert(qf);
+        qf->mflags = qf->flags;
+        if (qf->mflags & EJFEXCLUDED) {
+            continue;
+        }
+        if (!_qrybsmatch(qf, bsbuf, bsbufsz)) {
+            break;
+        }
+    }
+    if (j == jm) { //all fields in oq are matched
+        if (oq->andqlist && TCLISTNUM(oq->andqlist) > 0 &&
+                !_qryandmatch2(coll, oq, bsbuf, bsbufsz)) { //we have nested $and fields
+            return false;
+        }
+        if (oq->orqlist && TCLISTNUM(oq->orqlist) &&
+                !_qryormatch2(coll, oq, bsbuf, bsbufsz)) { //we have nested $or fields
+            return false;
+        }
+        return true;
     }
     return false;
 }
@@ -2441,6 +4019,7 @@ static bool _qryallcondsmatch(
     EJCOLL *coll, EJQF **qfs, int qfsz,
     const void *pkbuf, int pkbufsz) {
     assert(ejq->colbuf && ejq->bsbuf);
+    ejq->nkeys++;
     if (!(ejq->flags & EJQUPDATING) && (ejq->flags & EJQONLYCOUNT) && anum < 1) {
         return true;
     }
@@ -2449,6 +4028,8 @@ static bool _qryallcondsmatch(
     if (tchdbgetintoxstr(coll->tdb->hdb, pkbuf, pkbufsz, ejq->colbuf) <= 0) {
         return false;
     }
+    ejq->nrecs++;
+    ejq->nbytes += TCXSTRSIZE(ejq->colbuf);
     if (tcmaploadoneintoxstr(TCXSTRPTR(ejq->colbuf), TCXSTRSIZE(ejq->colbuf), 
                              JDBCOLBSON, JDBCOLBSONL, ejq->bsbuf) <= 0) {
         return false;
@@ -2456,15 +4037,7 @@ static bool _qryallcondsmatch(
     if (anum < 1) {
         return true;
     }
-    for (int i = 0; i < qfsz; ++i) qfs[i]->mflags = qfs[i]->flags; //reset matching flags
-    for (int i = 0; i < qfsz; ++i) {
-        EJQF *qf = qfs[i];
-        if (qf->mflags & EJFEXCLUDED) continue;
-        if (!_qrybsmatch(qf, TCXSTRPTR(ejq->bsbuf), TCXSTRSIZE(ejq->bsbuf))) {
-            return false;
-        }
-    }
-    return true;
+    return _qryqfsmatch(ejq, qfs, qfsz, TCXSTRPTR(ejq->bsbuf), TCXSTRSIZE(ejq->bsbuf));
 }
 
 static EJQ* _qryaddand(EJDB *jb, EJQ *q, const void *andbsdata) {
@@ -2484,11 +4057,6 @@ static EJQ* _qryaddand(EJDB *jb, EJQ *q, const void *andbsdata) {
     return q;
 }
 
-typedef struct {
-    EJQF **ofs;
-    int ofsz;
-} _EJBSORTCTX;
-
 /* RS sorting comparison func */
 static int _ejdbsoncmp(const TCLISTDATUM *d1, const TCLISTDATUM *d2, void *opaque) {
     _EJBSORTCTX *ctx = opaque;
@@ -2504,1799 +4072,5388 @@ static int _ejdbsoncmp(const TCLISTDATUM *d1, const TCLISTDATUM *d2, void *opaqu
     return res;
 }
 
-EJDB_INLINE void _nufetch(_EJDBNUM *nu, const char *sval, bson_type bt) {
-    if (bt == BSON_INT || bt == BSON_LONG || bt == BSON_BOOL || bt == BSON_DATE) {
-        nu->inum = tcatoi(sval);
-    } else if (bt == BSON_DOUBLE) {
-        nu->dnum = tcatof(sval);
-    } else {
-        nu->inum = 0;
-        assert(0);
+/* Fill the precomputed sort key for `qf` field of `bsdata` record */
+static void _ejdbsortkey(_EJBSORTKEY *k, const void *bsdata, const EJQF *qf) {
+    BSON_ITERATOR_FROM_BUFFER(&k->it, bsdata);
+    bson_type bt = bson_find_fieldpath_value2(qf->fpath, qf->fpathsz, &k->it);
+    switch (bt) {
+        case BSON_INT:
+        case BSON_LONG:
+        case BSON_DATE:
+            k->kt = 'i';
+            k->v.inum = bson_iterator_long(&k->it);
+            break;
+        case BSON_DOUBLE:
+            k->kt = 'd';
+            k->v.dnum = bson_iterator_double_raw(&k->it);
+            break;
+        case BSON_STRING:
+        case BSON_SYMBOL:
+            k->kt = 's';
+            k->v.str.ptr = bson_iterator_string(&k->it);
+            k->v.str.len = bson_iterator_string_len(&k->it);
+            break;
+        default:
+            k->kt = 0;
+            break;
     }
 }
 
-EJDB_INLINE int _nucmp(_EJDBNUM *nu, const char *sval, bson_type bt) {
-    if (bt == BSON_INT || bt == BSON_LONG || bt == BSON_BOOL || bt == BSON_DATE) {
-        int64_t v = tcatoi(sval);
-        return (nu->inum > v) ? 1 : (nu->inum < v ? -1 : 0);
-    } else if (bt == BSON_DOUBLE) {
-        double v = tcatof(sval);
-        return (nu->dnum > v) ? 1 : (nu->dnum < v ? -1 : 0);
-    } else {
-        assert(0);
+/* Precomputed sort keys comparison func, same ordering as `_ejdbsoncmp()` */
+static int _ejdbsortreccmp(const void *a, const void *b, void *opaque) {
+    const _EJBSORTREC *r1 = a;
+    const _EJBSORTREC *r2 = b;
+    const _EJBSORTKCTX *kctx = opaque;
+    int res = 0;
+    for (int i = 0; !res && i < kctx->ksz; ++i) {
+        const _EJBSORTKEY *k1 = r1->keys + i;
+        const _EJBSORTKEY *k2 = r2->keys + i;
+        if (k1->kt && k1->kt == k2->kt) {
+            if (k1->kt == 'i') {
+                res = (k1->v.inum > k2->v.inum) ? 1 : ((k1->v.inum < k2->v.inum) ? -1 : 0);
+            } else if (k1->kt == 'd') {
+                res = (k1->v.dnum > k2->v.dnum) ? 1 : ((k1->v.dnum < k2->v.dnum) ? -1 : 0);
+            } else {
+                TCCMPLEXICAL(res, k1->v.str.ptr, k1->v.str.len, k2->v.str.ptr, k2->v.str.len);
+            }
+        } else { //Mixed or complex types
+            res = bson_compare_it_current(&k1->it, &k2->it);
+        }
+        res *= kctx->dirs[i];
     }
-    return 0;
+    if (!res) { // Sort is stable
+        res = (r1->seq > r2->seq) ? 1 : ((r1->seq < r2->seq) ? -1 : 0);
+    }
+    return res;
 }
 
-EJDB_INLINE int _nucmp2(_EJDBNUM *nu1, _EJDBNUM *nu2, bson_type bt) {
-    if (bt == BSON_INT || bt == BSON_LONG || bt == BSON_BOOL || bt == BSON_DATE) {
-        return (nu1->inum > nu2->inum) ? 1 : (nu1->inum < nu2->inum ? -1 : 0);
-    } else if (bt == BSON_DOUBLE) {
-        return (nu1->dnum > nu2->dnum) ? 1 : (nu1->dnum < nu2->dnum ? -1 : 0);
-    } else {
-        assert(0);
+/**
+ * Sort the result set by `$orderby` fields.
+ * Sort keys are extracted once per record then records are ordered
+ * by comparing the extracted keys instead of doing field path lookups
+ * on every comparison.
+ * Records with equal keys are ordered by insertion sequence numbers `seqs`
+ * or by their positions in the result set if `seqs` is NULL.
+ */
+static void _ejdbsortres(TCLIST *res, EJQF **ofs, int ofsz, const uint64_t *seqs) {
+    int ksz = 0;
+    int rnum = TCLISTNUM(res);
+    for (int i = 0; i < ofsz; ++i) {
+        if (!(ofs[i]->flags & EJFORDERUSED)) {
+            ksz++;
+        }
     }
-    return 0;
+    if ((ksz == 0 && !seqs) || rnum < 2) {
+        return;
+    }
+    _EJBSORTKCTX kctx;
+    _EJBSORTREC *recs;
+    _EJBSORTKEY *keys;
+    kctx.ksz = ksz;
+    TCMALLOC(kctx.dirs, sizeof(*kctx.dirs) * ksz);
+    TCMALLOC(recs, sizeof(*recs) * rnum);
+    TCMALLOC(keys, sizeof(*keys) * ksz * rnum);
+    for (int i = 0, j = 0; i < ofsz; ++i) {
+        if (!(ofs[i]->flags & EJFORDERUSED)) {
+            kctx.dirs[j++] = (ofs[i]->order >= 0 ? 1 : -1);
+        }
+    }
+    for (int i = 0; i < rnum; ++i) {
+        _EJBSORTREC *r = recs + i;
+        r->d = res->array[res->start + i];
+        r->keys = keys + (size_t) i * ksz;
+        r->seq = seqs ? seqs[i] : i;
+        for (int j = 0, k = 0; j < ofsz; ++j) {
+            if (!(ofs[j]->flags & EJFORDERUSED)) {
+                _ejdbsortkey(r->keys + k++, r->d.ptr, ofs[j]);
+            }
+        }
+    }
+    ejdbqsort(recs, rnum, sizeof(*recs), _ejdbsortreccmp, &kctx);
+    for (int i = 0; i < rnum; ++i) {
+        res->array[res->start + i] = recs[i].d;
+    }
+    TCFREE(keys);
+    TCFREE(recs);
+    TCFREE(kctx.dirs);
 }
 
-static void _qryfieldup(const EJQF *src, EJQF *target, uint32_t qflags) {
-    assert(src && target);
-    memset(target, 0, sizeof (*target));
-    target->exprdblval = src->exprdblval;
-    target->exprlongval = src->exprlongval;
-    target->flags = src->flags;
-    target->ftype = src->ftype;
-    target->negate = src->negate;
-    target->order = src->order;
-    target->orderseq = src->orderseq;
-    target->tcop = src->tcop;
-    target->elmatchgrp = src->elmatchgrp;
-    target->elmatchpos = src->elmatchpos;
+/**
+ * Path of a new run file placed next to the collection database files.
+ * Names are unique across processes sharing the database directory.
+ */
+static char* _sortrunpath(_QRYCTX *ctx) {
+    static uint32_t seq = 0;
+    return tcsprintf("%s.sort-%d-%u", tctdbpath(ctx->coll->tdb),
+                     (int) getpid(), __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+}
 
-    if (src->expr) {
-        TCMEMDUP(target->expr, src->expr, src->exprsz);
-        target->exprsz = src->exprsz;
+/* Open the run file `path` for reading or create it for writing if `wr` is true */
+static HANDLE _sortrunopen(_QRYCTX *ctx, const char *path, bool wr) {
+#ifndef _WIN32
+    HANDLE fd = wr ? open(path, O_RDWR | O_CREAT | O_TRUNC, JBFILEMODE) : open(path, O_RDONLY, JBFILEMODE);
+#else
+    HANDLE fd = CreateFile(path, wr ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE,
+                           NULL, wr ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+#endif
+    if (INVALIDHANDLE(fd)) {
+        _ejdbsetecode2(ctx->coll->jb, TCEOPEN, __FILE__, __LINE__, __func__, true);
     }
-    if (src->fpath) {
-        TCMEMDUP(target->fpath, src->fpath, src->fpathsz);
-        target->fpathsz = src->fpathsz;
+    return fd;
+}
+
+/* Close the written run file `fd`, the end of run is marked by the zero record size */
+static bool _sortrunend(_QRYCTX *ctx, HANDLE fd, bool err) {
+    int32_t eor = 0;
+    if (!err && !tcwrite(fd, &eor, sizeof(eor))) {
+        _ejdbsetecode2(ctx->coll->jb, TCEWRITE, __FILE__, __LINE__, __func__, true);
+        err = true;
     }
-    if (src->regex && (EJQINTERNAL & qflags)) {
-        //We cannot do deep copy of regex_t so do shallow copy only for internal query objects
-        target->regex = src->regex;
+    if (!CLOSEFH(fd)) {
+        _ejdbsetecode2(ctx->coll->jb, TCECLOSE, __FILE__, __LINE__, __func__, true);
+        err = true;
     }
-    if (src->exprlist) {
-        target->exprlist = tclistdup(src->exprlist);
+    return !err;
+}
+
+/* Write the `list` records into the new run file `path` */
+static bool _sortwriterun(_QRYCTX *ctx, const char *path, TCLIST *list) {
+    bool err = false;
+    HANDLE fd = _sortrunopen(ctx, path, true);
+    if (INVALIDHANDLE(fd)) {
+        return false;
     }
-    if (src->exprmap) {
-        target->exprmap = tcmapdup(src->exprmap);
+    for (int i = 0; i < TCLISTNUM(list); ++i) { // Records are BSON objects prefixed by their size
+        if (!tcwrite(fd, TCLISTVALPTR(list, i), TCLISTVALSIZ(list, i))) {
+            _ejdbsetecode2(ctx->coll->jb, TCEWRITE, __FILE__, __LINE__, __func__, true);
+            err = true;
+            break;
+        }
     }
-    if (src->updateobj) {
-        target->updateobj = bson_dup(src->updateobj);
+    if (!_sortrunend(ctx, fd, err)) {
+        err = true;
     }
-    if (src->ufields) {
-        target->ufields = tclistdup(src->ufields);
+    if (err) {
+        unlink(path);
     }
-    if (src->uslots) {
-        target->uslots = tclistdup(src->uslots);
+    return !err;
+}
+
+/**
+ * Sort the result set records and spill them into a new run file.
+ * Called when the result set exceeds the `sortmem` budget.
+ * If spilling fails records are kept in memory and the budget is disabled.
+ */
+static bool _sortspill(_QRYCTX *ctx) {
+    TCLIST *res = ctx->res;
+    _ejdbsortres(res, ctx->sctx.ofs, ctx->sctx.ofsz, NULL);
+    char *path = _sortrunpath(ctx);
+    if (!_sortwriterun(ctx, path, res)) {
+        TCFREE(path);
+        ctx->sortmem = 0;
+        return false;
+    }
+    if (!ctx->runs) {
+        ctx->runs = tclistnew2(TCLISTINYNUM);
     }
+    tclistpushmalloc(ctx->runs, path, strlen(path));
+    tclistclear(res);
+    ctx->rssize = 0;
+    return true;
 }
 
-/* Clone query object */
-static bool _qrydup(const EJQ *src, EJQ *target, uint32_t qflags) {
-    assert(src && target);
-    memset(target, 0, sizeof (*target));
-    target->flags = src->flags | qflags;
-    target->max = src->max;
-    target->skip = src->skip;
-    if (src->qflist) {
-        target->qflist = tclistnew2(TCLISTNUM(src->qflist));
-        for (int i = 0; i < TCLISTNUM(src->qflist); ++i) {
-            EJQF qf;
-            _qryfieldup(TCLISTVALPTR(src->qflist, i), &qf, qflags);
-            qf.q = target;
-            TCLISTPUSH(target->qflist, &qf, sizeof (qf));
+/* Read the next run record into `run->d`, returns false if the run is exhausted */
+static bool _sortrunnext(_QRYCTX *ctx, _EJBSORTRUN *run) {
+    if (INVALIDHANDLE(run->fd)) {
+        if (run->midx >= TCLISTNUM(run->mlist)) {
+            return false;
         }
+        run->d = run->mlist->array[run->mlist->start + run->midx++];
+        return true;
     }
-    if (src->hints) {
-        target->hints = bson_dup(src->hints);
+    int32_t bsz;
+    if (!tcread(run->fd, &bsz, sizeof(bsz)) || (bsz != 0 && TCHTOIL(bsz) < 5)) {
+        _ejdbsetecode2(ctx->coll->jb, TCEREAD, __FILE__, __LINE__, __func__, true);
+        run->err = true;
+        return false;
     }
-    if (src->ifields) {
-        target->ifields = tcmapdup(src->ifields);
+    if (bsz == 0) { // End of run
+        return false;
     }
-    if (src->orqlist) {
-        target->orqlist = tclistnew2(TCLISTNUM(src->orqlist));
-        for (int i = 0; i < TCLISTNUM(src->orqlist); ++i) {
-            EJQ *q;
-            TCMALLOC(q, sizeof(*q));
-            if (_qrydup(*((EJQ**) TCLISTVALPTR(src->orqlist, i)), q, qflags)) {
-                TCLISTPUSH(target->orqlist, &q, sizeof (q));
-            } else {
-                _qrydel(q, true);
+    int rsz = TCHTOIL(bsz);
+    if (rsz > run->bsiz) {
+        run->bsiz = rsz;
+        TCREALLOC(run->buf, run->buf, run->bsiz);
+    }
+    memcpy(run->buf, &bsz, sizeof(bsz));
+    if (!tcread(run->fd, run->buf + sizeof(bsz), rsz - sizeof(bsz))) {
+        _ejdbsetecode2(ctx->coll->jb, TCEREAD, __FILE__, __LINE__, __func__, true);
+        run->err = true;
+        return false;
+    }
+    run->d.ptr = run->buf;
+    run->d.size = rsz;
+    return true;
+}
+
+/* Sift down the root of runs heap: the run with the least current record is kept at the root */
+static void _sortrunsiftdown(_QRYCTX *ctx, _EJBSORTRUN **heap, int num) {
+    int i = 0;
+    while (true) {
+        int l = 2 * i + 1, r = l + 1, w = i;
+        if (l < num && _ejdbsoncmp(&heap[l]->d, &heap[w]->d, &ctx->sctx) < 0) w = l;
+        if (r < num && _ejdbsoncmp(&heap[r]->d, &heap[w]->d, &ctx->sctx) < 0) w = r;
+        if (w == i) break;
+        _EJBSORTRUN *tmp = heap[i];
+        heap[i] = heap[w];
+        heap[w] = tmp;
+        i = w;
+    }
+}
+
+/**
+ * Open the streaming k-way merge of the first `pnum` run files of `ctx->runs`
+ * and the optional in-memory sorted run `mlist`.
+ * The merge must be closed by `_sortmergeclose()` even if opening fails.
+ */
+static bool _sortmergeopen(_QRYCTX *ctx, int pnum, TCLIST *mlist, _EJBSORTMERGE *m) {
+    memset(m, 0, sizeof(*m));
+    m->pnum = pnum;
+    TCMALLOC(m->runs, sizeof(*m->runs) * (pnum + 1));
+    TCMALLOC(m->heap, sizeof(*m->heap) * (pnum + 1));
+    memset(m->runs, 0, sizeof(*m->runs) * (pnum + 1));
+    for (int i = 0; i <= pnum; ++i) {
+        m->runs[i].fd = INVALID_HANDLE_VALUE;
+    }
+    for (int i = 0; i <= pnum; ++i) {
+        _EJBSORTRUN *run = m->runs + i;
+        if (i == pnum) {
+            if (!mlist) {
+                break;
             }
+            run->mlist = mlist;
+        } else {
+            run->fd = _sortrunopen(ctx, TCLISTVALPTR(ctx->runs, i), false);
+            if (INVALIDHANDLE(run->fd)) {
+                return false;
+            }
+        }
+        if (_sortrunnext(ctx, run)) { // Sift up the new heap leaf
+            _EJBSORTRUN **heap = m->heap;
+            heap[m->hnum] = run;
+            for (int j = m->hnum++; j > 0; ) {
+                int p = (j - 1) / 2;
+                if (_ejdbsoncmp(&heap[j]->d, &heap[p]->d, &ctx->sctx) >= 0) break;
+                _EJBSORTRUN *tmp = heap[j];
+                heap[j] = heap[p];
+                heap[p] = tmp;
+                j = p;
+            }
+        } else if (run->err) {
+            return false;
         }
     }
-    if (src->andqlist) {
-        target->andqlist = tclistnew2(TCLISTNUM(src->andqlist));
-        for (int i = 0; i < TCLISTNUM(src->andqlist); ++i) {
-            EJQ *q;
-            TCMALLOC(q, sizeof(*q));
-            if (_qrydup(*((EJQ**) TCLISTVALPTR(src->andqlist, i)), q, qflags)) {
-                tclistpush(target->andqlist, &q, sizeof (q));
-            } else {
-                _qrydel(q, true);
+    return true;
+}
+
+/**
+ * Fetch the next merged record into `d`, the record data is valid until the next call.
+ * Returns false if all runs are exhausted or reading of a run file failed.
+ */
+static bool _sortmergenext(_QRYCTX *ctx, _EJBSORTMERGE *m, TCLISTDATUM *d) {
+    if (m->taken && m->hnum > 0) {
+        _EJBSORTRUN *run = m->heap[0];
+        if (!_sortrunnext(ctx, run)) {
+            if (run->err) {
+                m->hnum = 0;
+                return false;
             }
+            m->heap[0] = m->heap[--m->hnum];
         }
+        _sortrunsiftdown(ctx, m->heap, m->hnum);
+    }
+    if (m->hnum < 1) {
+        return false;
     }
+    m->taken = true;
+    *d = m->heap[0]->d;
     return true;
 }
 
-typedef struct { /**> $do action visitor context */
-    EJQ *q;
-    EJDB *jb;
-    TCMAP *dfields;
-    bson *sbson;
-} _BSONDOVISITORCTX;
+/**
+ * Close the merge and remove its run files.
+ * Returns false if reading of a run file failed.
+ */
+static bool _sortmergeclose(_QRYCTX *ctx, _EJBSORTMERGE *m) {
+    bool err = false;
+    for (int i = 0; m->runs && i <= m->pnum; ++i) {
+        if (!INVALIDHANDLE(m->runs[i].fd)) {
+            CLOSEFH(m->runs[i].fd);
+        }
+        if (m->runs[i].buf) {
+            TCFREE(m->runs[i].buf);
+        }
+        err = err || m->runs[i].err;
+    }
+    for (int i = 0; i < m->pnum; ++i) {
+        int sp;
+        char *path = tclistshift(ctx->runs, &sp);
+        unlink(path);
+        TCFREE(path);
+    }
+    if (m->heap) {
+        TCFREE(m->heap);
+    }
+    if (m->runs) {
+        TCFREE(m->runs);
+    }
+    memset(m, 0, sizeof(*m));
+    return !err;
+}
 
-static bson_visitor_cmd_t _bsondovisitor(const char *ipath, int ipathlen,
-                                         const char *key, int keylen,
-                                         const bson_iterator *it, 
-                                         bool after, void *op) {
+/**
+ * Merge the first `pnum` run files of `ctx->runs` into the new run file `opath`.
+ * Merged run files are removed.
+ */
+static bool _sortmergeruns(_QRYCTX *ctx, int pnum, const char *opath) {
+    _EJBSORTMERGE m;
+    TCLISTDATUM d;
+    bool err = !_sortmergeopen(ctx, pnum, NULL, &m);
+    HANDLE ofd = _sortrunopen(ctx, opath, true);
+    if (INVALIDHANDLE(ofd)) {
+        err = true;
+    }
+    while (!err && _sortmergenext(ctx, &m, &d)) {
+        if (!tcwrite(ofd, d.ptr, d.size)) {
+            _ejdbsetecode2(ctx->coll->jb, TCEWRITE, __FILE__, __LINE__, __func__, true);
+            err = true;
+        }
+    }
+    if (!INVALIDHANDLE(ofd) && !_sortrunend(ctx, ofd, err)) {
+        err = true;
+    }
+    if (!_sortmergeclose(ctx, &m)) {
+        err = true;
+    }
+    return !err;
+}
 
-    assert(op);
-    _BSONDOVISITORCTX *ictx = op;
-    EJCOLL *coll;
-    TCMAP *dfields = ictx->dfields;
-    bson_type lbt = BSON_ITERATOR_TYPE(it), bt;
-    bson_iterator doit, bufit, sit;
-    int sp;
-    const char *sval;
-    const EJQF *dofield;
-    bson_visitor_cmd_t rv = BSON_VCMD_SKIP_AFTER;
+/**
+ * Open the final merge `m` of the spilled sorted runs and the in-memory records of the result set.
+ * If there are too many runs they are merged into larger runs first.
+ * The merge must be closed by `_sortmergeclose()` even if opening fails.
+ */
+static bool _sortmerge(_QRYCTX *ctx, _EJBSORTMERGE *m) {
+    assert(ctx->runs);
+    memset(m, 0, sizeof(*m));
+    _ejdbsortres(ctx->res, ctx->sctx.ofs, ctx->sctx.ofsz, NULL);
+    while (TCLISTNUM(ctx->runs) > JBSORTMERGEWAY) {
+        char *path = _sortrunpath(ctx);
+        if (!_sortmergeruns(ctx, JBSORTMERGEWAY, path)) {
+            unlink(path);
+            TCFREE(path);
+            return false;
+        }
+        tclistpushmalloc(ctx->runs, path, strlen(path));
+    }
+    return _sortmergeopen(ctx, TCLISTNUM(ctx->runs), ctx->res, m);
+}
 
-    switch (lbt) {
-        case BSON_OBJECT: {
-            bson_append_field_from_iterator(it, ictx->sbson);
-            rv = (BSON_VCMD_SKIP_AFTER | BSON_VCMD_SKIP_NESTED);
-            break;
+/**
+ * Parse `$group` hint specification pointed by `it`:
+ *
+ *      {_id : <key>, <field> : {<accumulator> : <operand>}, ...}
+ *
+ * Returns NULL and sets `JBEQGROUP` error code if specification is invalid.
+ */
+static _AGGCTX* _aggnew(_QRYCTX *ctx, bson_iterator *it) {
+    _AGGCTX *agg;
+    TCCALLOC(agg, 1, sizeof (*agg));
+    bson_iterator sit, ait;
+    bson_type bt;
+    int anum = 0;
+    BSON_ITERATOR_SUBITERATOR(it, &sit);
+    while (bson_iterator_next(&sit) != BSON_EOO) {
+        anum++;
+    }
+    TCCALLOC(agg->accs, anum + 1, sizeof (_AGGACC));
+    BSON_ITERATOR_SUBITERATOR(it, &sit);
+    while ((bt = bson_iterator_next(&sit)) != BSON_EOO) {
+        const char *key = BSON_ITERATOR_KEY(&sit);
+        if (!strcmp(key, JDBIDKEYNAME)) {
+            if (agg->kspec) {
+                goto fail;
+            }
+            agg->kspec = bson_create();
+            bson_init(agg->kspec);
+            bson_append_field_from_iterator(&sit, agg->kspec);
+            bson_finish(agg->kspec);
+            continue;
         }
-        case BSON_STRING:
-        case BSON_OID:
-        case BSON_ARRAY: {
-            dofield = tcmapget(dfields, ipath, ipathlen, &sp);
-            if (!dofield) {
-                if (lbt == BSON_ARRAY) {
-                    bson_append_field_from_iterator(it, ictx->sbson);
-                    rv = (BSON_VCMD_SKIP_AFTER | BSON_VCMD_SKIP_NESTED);
-                } else {
-                    bson_append_field_from_iterator(it, ictx->sbson);
-                }
-                break;
-            }
-            assert(dofield->updateobj && (dofield->flags & EJCONDOIT));
-            BSON_ITERATOR_INIT(&doit, dofield->updateobj);
-            while ((bt = bson_iterator_next(&doit)) != BSON_EOO) {
-				const char *dofname = BSON_ITERATOR_KEY(&doit);
-				
-				if (bt == BSON_STRING && !strcmp("$join", dofname)) {
-					coll = _getcoll(ictx->jb, bson_iterator_string(&doit));
-					if (!coll) break;
-					bson_oid_t loid;
-					if (lbt == BSON_STRING) {
-						sval = bson_iterator_string(it);
-						if (!ejdbisvalidoidstr(sval)) break;
-						bson_oid_from_string(&loid, sval);
-					} else if (lbt == BSON_OID) {
-						loid = *(bson_iterator_oid(it));
-					}
-					if (lbt == BSON_STRING || lbt == BSON_OID) {
-						tcxstrclear(ictx->q->colbuf);
-						tcxstrclear(ictx->q->tmpbuf);
-						if (!tchdbgetintoxstr(coll->tdb->hdb, &loid, sizeof (loid), ictx->q->colbuf) ||
-								!tcmaploadoneintoxstr(TCXSTRPTR(ictx->q->colbuf), TCXSTRSIZE(ictx->q->colbuf),
-													  JDBCOLBSON, JDBCOLBSONL, ictx->q->tmpbuf)) {
-							break;
-						}
-						BSON_ITERATOR_FROM_BUFFER(&bufit, TCXSTRPTR(ictx->q->tmpbuf));
-						bson_append_object_from_iterator(BSON_ITERATOR_KEY(it), &bufit, ictx->sbson);
-						break;
-					}
-					if (lbt == BSON_ARRAY) {
-						BSON_ITERATOR_SUBITERATOR(it, &sit);
-						bson_append_start_array(ictx->sbson, BSON_ITERATOR_KEY(it));
-						while ((bt = bson_iterator_next(&sit)) != BSON_EOO) {
-							if (bt != BSON_STRING && bt != BSON_OID) {
-								bson_append_field_from_iterator(&sit, ictx->sbson);
-								continue;
-							}
-							if (bt == BSON_STRING) {
-								sval = bson_iterator_string(&sit);
-								if (!ejdbisvalidoidstr(sval)) break;
-								bson_oid_from_string(&loid, sval);
-							} else if (bt == BSON_OID) {
-								loid = *(bson_iterator_oid(&sit));
-							}
-							tcxstrclear(ictx->q->colbuf);
-							tcxstrclear(ictx->q->tmpbuf);
-							if (!tchdbgetintoxstr(coll->tdb->hdb, &loid, sizeof (loid), ictx->q->colbuf) ||
-									!tcmaploadoneintoxstr(TCXSTRPTR(ictx->q->colbuf), TCXSTRSIZE(ictx->q->colbuf),
-														  JDBCOLBSON, JDBCOLBSONL, ictx->q->tmpbuf)) {
-								bson_append_field_from_iterator(&sit, ictx->sbson);
-								continue;
-							}
-							BSON_ITERATOR_FROM_BUFFER(&bufit, TCXSTRPTR(ictx->q->tmpbuf));
-							bson_append_object_from_iterator(BSON_ITERATOR_KEY(&sit), &bufit, ictx->sbson);
-						}
-						bson_append_finish_array(ictx->sbson);
-						rv = (BSON_VCMD_SKIP_AFTER | BSON_VCMD_SKIP_NESTED);
-					}
-					
-				} else if (lbt == BSON_ARRAY && 
-                           (bt == BSON_ARRAY || BSON_IS_NUM_TYPE(bt)) && 
-                           !strcmp("$slice", dofname)) {
-								
-					bson_append_start_array(ictx->sbson, BSON_ITERATOR_KEY(it));
-					int skip = 0, limit, idx = 0, i;
-					char nbuff[TCNUMBUFSIZ];
-					
-					if (bt == BSON_ARRAY) { // $slice : [skip, limit]
-						bson_type bt2;
-						bson_iterator sit2;
-						BSON_ITERATOR_SUBITERATOR(&doit, &sit2);
-						
-						bt2 = bson_find_fieldpath_value2("0", 1, &sit2);
-						if (!BSON_IS_NUM_TYPE(bt2)) {
-							bson_append_field_from_iterator(it, ictx->sbson);
-							break;
-						}
-						skip = bson_iterator_int(&sit2);
-						
-						bt2 = bson_find_fieldpath_value2("1", 1, &sit2);
-						if (!BSON_IS_NUM_TYPE(bt2)) {
-							bson_append_field_from_iterator(it, ictx->sbson);
-							break;
-						}
-						limit = abs(bson_iterator_int(&sit2));
-					} else { // $slice : limit
-						limit = abs(bson_iterator_int(&doit));
-					}
-					
-					if (skip < 0) {
-						int cnt = 0;
-						BSON_ITERATOR_SUBITERATOR(it, &sit);
-						while (bson_iterator_next(&sit) != BSON_EOO) ++cnt;
-						skip = cnt + skip % cnt;
-						if (skip == cnt) {
-							skip = 0;
-						}
-					}
-					
-					limit = (limit <= INT_MAX - skip) ? limit + skip : INT_MAX;
-					BSON_ITERATOR_SUBITERATOR(it, &sit);
-					for (i = 0; idx < limit && (bt = bson_iterator_next(&sit)) != BSON_EOO; ++idx) {
-						if (idx >= skip) {
-							bson_numstrn(nbuff, TCNUMBUFSIZ, i++);
-							bson_append_field_from_iterator2(nbuff, &sit, ictx->sbson);
-						}
-					}
-					bson_append_finish_array(ictx->sbson);
-					rv = (BSON_VCMD_SKIP_AFTER | BSON_VCMD_SKIP_NESTED);
-				}
-			}
-            break;
+        if (*key == '$' || bt != BSON_OBJECT) {
+            goto fail;
+        }
+        BSON_ITERATOR_SUBITERATOR(&sit, &ait);
+        if ((bt = bson_iterator_next(&ait)) == BSON_EOO) {
+            goto fail;
+        }
+        _AGGACC *acc = agg->accs + agg->anum++;
+        acc->name = tcstrdup(key);
+        const char *op = BSON_ITERATOR_KEY(&ait);
+        if (!strcmp(op, "$sum")) {
+            acc->op = JBAGGSUM;
+        } else if (!strcmp(op, "$avg")) {
+            acc->op = JBAGGAVG;
+        } else if (!strcmp(op, "$min")) {
+            acc->op = JBAGGMIN;
+        } else if (!strcmp(op, "$max")) {
+            acc->op = JBAGGMAX;
+        } else if (!strcmp(op, "$count")) {
+            acc->op = JBAGGCOUNT;
+        } else {
+            goto fail;
+        }
+        if (acc->op == JBAGGCOUNT) { // {$count : {}}
+            acc->cval = 1;
+            acc->cint = true;
+        } else if (bt == BSON_STRING && *bson_iterator_string(&ait) == '$') {
+            acc->fpath = tcstrdup(bson_iterator_string(&ait) + 1);
+            acc->fpathsz = strlen(acc->fpath);
+        } else if (acc->op == JBAGGSUM && BSON_IS_NUM_TYPE(bt)) { // {$sum : 1}
+            acc->cval = bson_iterator_double(&ait);
+            acc->cint = (bt != BSON_DOUBLE);
+        } else {
+            goto fail;
+        }
+        if (bson_iterator_next(&ait) != BSON_EOO) {
+            goto fail;
         }
-        default:
-            bson_append_field_from_iterator(it, ictx->sbson);
-
     }
-    return rv;
+    if (!agg->kspec) {
+        goto fail;
+    }
+    agg->groups = tcmapnew();
+    return agg;
+
+fail:
+    _ejdbsetecode(ctx->coll->jb, JBEQGROUP, __FILE__, __LINE__, __func__);
+    _aggdel(agg);
+    return NULL;
 }
 
-static bool _pushprocessedbson(_QRYCTX *ctx, const void *bsbuf, int bsbufsz) {
-    assert(bsbuf && bsbufsz);
-    if (!ctx->dfields && !ctx->ifields && !ctx->q->ifields) { 
-        // Trivial case: no $do operations or $fields
-        tclistpush(ctx->res, bsbuf, bsbufsz);
-        return true;
+static void _agggrpdel(_AGGCTX *agg, _AGGGRP *grp) {
+    for (int i = 0; i < agg->anum; ++i) {
+        if (grp->st[i].mval) {
+            TCFREE(grp->st[i].mval);
+        }
     }
-    bool rv = true;
-    EJDB *jb = ctx->coll->jb;
-    EJQ *q = ctx->q;
-    TCMAP *ifields = ctx->ifields;
-    int sp;
-    char bstack[JBSBUFFERSZ];
-    bson bsout;
-    bson_init_on_stack(&bsout, bstack, bsbufsz, JBSBUFFERSZ);
+    if (grp->id) {
+        TCFREE(grp->id);
+    }
+    TCFREE(grp);
+}
 
-    if (ctx->dfields) { // $do fields exists
-        rv = _exec_do(ctx, bsbuf, &bsout);
+/* Remove all groups of `$group` aggregation */
+static void _aggclear(_AGGCTX *agg) {
+    const char *kbuf;
+    int kbufsz, sp;
+    tcmapiterinit(agg->groups);
+    while ((kbuf = tcmapiternext(agg->groups, &kbufsz)) != NULL) {
+        _AGGGRP *grp;
+        memcpy(&grp, tcmapiterval(kbuf, &sp), sizeof (grp));
+        _agggrpdel(agg, grp);
+    }
+    tcmapclear(agg->groups);
+    agg->mem = 0;
+}
+
+static void _aggdel(_AGGCTX *agg) {
+    if (agg->groups) {
+        _aggclear(agg);
+        tcmapdel(agg->groups);
+    }
+    for (int i = 0; i < agg->anum; ++i) {
+        TCFREE(agg->accs[i].name);
+        if (agg->accs[i].fpath) {
+            TCFREE(agg->accs[i].fpath);
+        }
+    }
+    TCFREE(agg->accs);
+    if (agg->kspec) {
+        bson_del(agg->kspec);
     }
+    TCFREE(agg);
+}
 
-    if (rv && (ifields || q->ifields)) { // $fields hints
-    
-        TCMAP *_ifields = ifields;
-        TCMAP *_fkfields = NULL; // Fields with overriden keys
-        char* inbuf = (bsout.finished) ? bsout.data : (char*) bsbuf;
-        if (bsout.finished) {
-            bson_init_size(&bsout, bson_size(&bsout));
-        }
-        if (q->ifields) { // We have positional $(projection)
-            assert(ctx->imode == true); // Ensure we are in include mode
-            if (!_ifields) {
-                _ifields = tcmapnew2(q->ifields->bnum);
-            } else {
-                _ifields = tcmapdup(ifields);
-            }
-            _fkfields = tcmapnew2(TCMAPTINYBNUM);
-            for (int i = 0; i < TCLISTNUM(q->qflist); ++i) {
-                EJQF *qf = TCLISTVALPTR(q->qflist, i);
-                const char *dfpath = tcmapget(q->ifields, qf->fpath, qf->fpathsz, &sp);
-                if (dfpath) {
-                    TCXSTR *ifield = tcxstrnew3(sp + 10);
-                    bson_iterator it;
-                    BSON_ITERATOR_FROM_BUFFER(&it, inbuf);
-                    FFPCTX ctx = {
-                        .fpath = qf->fpath,
-                        .fplen = qf->fpathsz,
-                        .input = &it,
-                        .stopnestedarr = true,
-                        .stopos = 0,
-                        .mpos = -1,
-                        .dpos = -1
-                    };
-                    const char *dpos = strchr(dfpath, '$');
-                    assert(dpos);
-                    ctx.dpos = (dpos - dfpath) - 1;
-                    qf->mflags = (qf->flags & ~EJFEXCLUDED);
-                    if (!_qrybsrecurrmatch(qf, &ctx, 0)) {
-                        assert(false); // Something went wrong, it should never be happen
-                    } else if (ctx.mpos >= 0) {
-                        tcxstrcat(ifield, dfpath, (dpos - dfpath));
-                        tcxstrprintf(ifield, "%d", ctx.mpos);
-                        tcmapput(_fkfields, TCXSTRPTR(ifield), TCXSTRSIZE(ifield), "0", strlen("0"));
-                        tcxstrcat(ifield, dpos + 1, sp - (dpos - dfpath) - 1);
-                        tcmapput(_ifields, TCXSTRPTR(ifield), TCXSTRSIZE(ifield), &yes, sizeof (yes));
-                    } else {
-                        assert(false); // Something went wrong, it should never be happen
-                    }
-                    tcxstrdel(ifield);
-                }
-            }
-        }
-        
-        BSONSTRIPCTX sctx = {
-            .ifields = _ifields,
-            .fkfields = _fkfields,
-            .imode = ctx->imode,
-            .bsbuf = inbuf,
-            .bsout = &bsout,
-            .matched = 0
-        };
-        
-        if (bson_strip2(&sctx) != BSON_OK) {
-            _ejdbsetecode(jb, JBEINVALIDBSON, __FILE__, __LINE__, __func__);
-        }
-        if (inbuf != bsbuf && inbuf != bstack) {
-            TCFREE(inbuf);
-        }
-        if (_ifields != ifields) {
-            tcmapdel(_ifields);
-        }
-        if (_fkfields) {
-            tcmapdel(_fkfields);
-        }
-    }
-
-    if (rv) {
-        assert(bsout.finished);
-        if (bsout.flags & BSON_FLAG_STACK_ALLOCATED) {
-            TCLISTPUSH(ctx->res, bsout.data, bson_size(&bsout));
+/**
+ * Append the group key field `name` evaluated by key specification `sit` over record `bsbuf`.
+ * Strings prefixed by '$' are field paths of record, objects are compound keys, other values are constants.
+ * If `norm` is true numbers having integer values are appended as long integers, so they are grouped together.
+ */
+static void _aggkeyval(const char *name, const bson_iterator *sit, const void *bsbuf, bson *kb, bool norm) {
+    bson_type bt = BSON_ITERATOR_TYPE(sit);
+    if (bt == BSON_STRING && *bson_iterator_string(sit) == '$') {
+        bson_iterator it;
+        BSON_ITERATOR_FROM_BUFFER(&it, bsbuf);
+        bt = bson_find_fieldpath_value(bson_iterator_string(sit) + 1, &it);
+        if (bt == BSON_EOO || bt == BSON_UNDEFINED) {
+            bson_append_null(kb, name);
+        } else if (norm && (bt == BSON_INT || bt == BSON_LONG)) {
+            bson_append_long(kb, name, bson_iterator_long(&it));
+        } else if (norm && bt == BSON_DOUBLE && bson_iterator_double(&it) == (int64_t) bson_iterator_double(&it)) {
+            bson_append_long(kb, name, (int64_t) bson_iterator_double(&it));
         } else {
-            tclistpushmalloc(ctx->res, bsout.data, bson_size(&bsout));
+            bson_append_field_from_iterator2(name, &it, kb);
         }
+    } else if (bt == BSON_OBJECT) {
+        bson_iterator ssit;
+        BSON_ITERATOR_SUBITERATOR(sit, &ssit);
+        bson_append_start_object(kb, name);
+        while (bson_iterator_next(&ssit) != BSON_EOO) {
+            _aggkeyval(BSON_ITERATOR_KEY(&ssit), &ssit, bsbuf, kb, norm);
+        }
+        bson_append_finish_object(kb);
     } else {
-        bson_destroy(&bsout);
+        bson_append_field_from_iterator2(name, sit, kb);
     }
-    return rv;
 }
 
-static bool _exec_do(_QRYCTX *ctx, const void *bsbuf, bson *bsout) {
-    assert(ctx && ctx->dfields);
-    
-    _BSONDOVISITORCTX ictx = {
-        .q = ctx->q,
-        .jb = ctx->coll->jb,
-        .dfields = ctx->dfields,
-        .sbson = bsout
-    };
-    
+/* Put the value `it` into the `$min`, `$max` accumulator state if it is better, returns memory size change */
+static int _aggmvalput(const _AGGACC *acc, _AGGSTATE *st, const bson_iterator *it) {
+    int msz = 0;
+    if (st->mval) {
+        bson_iterator mit;
+        bson_find_from_buffer(&mit, st->mval, "v");
+        int cmp = bson_compare_it_current(it, &mit);
+        if ((acc->op == JBAGGMIN) ? (cmp >= 0) : (cmp <= 0)) {
+            return 0;
+        }
+        msz = bson_size2(st->mval);
+        TCFREE(st->mval);
+    }
+    bson mb;
+    bson_init(&mb);
+    bson_append_field_from_iterator2("v", it, &mb);
+    bson_finish(&mb);
+    st->mval = mb.data; // Take the BSON data
+    return bson_size(&mb) - msz;
+}
+
+/* Accumulate the record `bsbuf` into the state `st` of accumulator `acc`, returns memory size change */
+static int _aggaccum(const _AGGACC *acc, _AGGSTATE *st, const void *bsbuf) {
+    if (!acc->fpath) { // Constant
+        st->n++;
+        st->isum += (int64_t) acc->cval;
+        st->dsum += acc->cval;
+        st->isdbl = st->isdbl || !acc->cint;
+        return 0;
+    }
     bson_iterator it;
     BSON_ITERATOR_FROM_BUFFER(&it, bsbuf);
-    bson_visit_fields(&it, 0, _bsondovisitor, &ictx);
-    if (bson_finish(bsout) != BSON_OK) {
-        _ejdbsetecode(ctx->coll->jb, JBEINVALIDBSON, __FILE__, __LINE__, __func__);
-        return false;
+    bson_type bt = bson_find_fieldpath_value2(acc->fpath, acc->fpathsz, &it);
+    if (acc->op == JBAGGMIN || acc->op == JBAGGMAX) {
+        if (bt == BSON_EOO || bt == BSON_NULL || bt == BSON_UNDEFINED) {
+            return 0;
+        }
+        st->n++;
+        return _aggmvalput(acc, st, &it);
+    }
+    if (bt == BSON_INT || bt == BSON_LONG) { // Non number values are ignored
+        int64_t v = bson_iterator_long(&it);
+        st->n++;
+        st->isum += v;
+        st->dsum += v;
+    } else if (bt == BSON_DOUBLE) {
+        st->n++;
+        st->dsum += bson_iterator_double(&it);
+        st->isdbl = true;
     }
-    return true;
+    return 0;
 }
 
-// Create update BSON object for $set/$unset/$inc operations
-static bson* _qfgetupdateobj(const EJQF *qf) {
-    assert(qf->updateobj);
-    if (!qf->ufields || TCLISTNUM(qf->ufields) < 1) { // We do not ref $(query) fields.
-        return qf->updateobj;
+/* Push the matched record `bsbuf` into its `$group` aggregation group */
+static bool _aggrec(_QRYCTX *ctx, const void *bsbuf, int bsbufsz) {
+    _AGGCTX *agg = ctx->agg;
+    bson_iterator sit;
+    char kstack[JBSBUFFERSZ];
+    bson kb;
+    bson_init_on_stack(&kb, kstack, 64, JBSBUFFERSZ);
+    BSON_ITERATOR_INIT(&sit, agg->kspec);
+    bson_iterator_next(&sit);
+    _aggkeyval(JDBIDKEYNAME, &sit, bsbuf, &kb, true);
+    bson_finish(&kb);
+    int sp;
+    _AGGGRP *grp;
+    const void *gp = tcmapget(agg->groups, bson_data(&kb), bson_size(&kb), &sp);
+    if (gp) {
+        memcpy(&grp, gp, sizeof (grp));
+    } else {
+        TCCALLOC(grp, 1, sizeof (*grp) + agg->anum * sizeof (_AGGSTATE));
+        bson ib;
+        bson_init(&ib);
+        _aggkeyval(JDBIDKEYNAME, &sit, bsbuf, &ib, false);
+        bson_finish(&ib);
+        grp->id = ib.data; // Take the BSON data
+        tcmapput(agg->groups, bson_data(&kb), bson_size(&kb), &grp, sizeof (grp));
+        agg->mem += bson_size(&kb) + bson_size(&ib) +
+                    sizeof (*grp) + agg->anum * sizeof (_AGGSTATE) + JBAGGGRPOVERHEAD;
+    }
+    bson_destroy(&kb);
+    for (int i = 0; i < agg->anum; ++i) {
+        agg->mem += _aggaccum(agg->accs + i, grp->st + i, bsbuf);
+    }
+    if (ctx->sortmem && agg->mem > ctx->sortmem && !_aggspill(ctx) && ctx->log) {
+        tcxstrprintf(ctx->log, "GROUP SPILL FAILED: MEMORY BUDGET DISABLED\n");
     }
-    const EJQ *q = qf->q;
-    char pbuf[BSON_MAX_FPATH_LEN + 1];
-    int ppos = 0;
+    return true;
+}
+
+/* Serialize the group `grp` having normalized key `kbuf` into BSON document of spilled run */
+static void _aggstatebson(_AGGCTX *agg, const char *kbuf, int kbufsz, const _AGGGRP *grp, bson *bs) {
+    char nbuf[TCNUMBUFSIZ];
+    bson_init(bs);
+    bson_append_binary(bs, "k", BSON_BIN_BINARY, kbuf, kbufsz);
+    bson_append_binary(bs, "i", BSON_BIN_BINARY, grp->id, bson_size2(grp->id));
+    bson_append_start_array(bs, "s");
+    for (int i = 0; i < agg->anum; ++i) {
+        const _AGGSTATE *st = grp->st + i;
+        bson_numstrn(nbuf, TCNUMBUFSIZ, i);
+        bson_append_start_object(bs, nbuf);
+        bson_append_long(bs, "n", st->n);
+        bson_append_long(bs, "i", st->isum);
+        bson_append_double(bs, "d", st->dsum);
+        bson_append_bool(bs, "f", st->isdbl);
+        if (st->mval) {
+            bson_append_binary(bs, "v", BSON_BIN_BINARY, st->mval, bson_size2(st->mval));
+        }
+        bson_append_finish_object(bs);
+    }
+    bson_append_finish_array(bs);
+    bson_finish(bs);
+}
+
+/* Normalized group key of the spilled run record `sdata` */
+static const char* _aggstatekey(const void *sdata, int *kbufsz) {
     bson_iterator it;
-    bson_type bt;
-    bson *ret =  bson_create();
-    bson_init(ret);
-    for (int i = 0; i < TCLISTNUM(qf->ufields); ++i) {
-        const char *uf = TCLISTVALPTR(qf->ufields, i);
-        for (int j = 0; *(q->allqfields + j) != '\0'; ++j) {
-            const EJQF *kqf = *(q->allqfields + j);
-            if (kqf == qf || kqf->uslots == NULL || TCLISTNUM(kqf->uslots) < 1) {
-                continue;
-            }
-            for (int k = 0; k < TCLISTNUM(kqf->uslots); ++k) {
-                USLOT *uslot = TCLISTVALPTR(kqf->uslots, k);
-                if (uslot->op == uf && uslot->mpos >= 0) {
-                    char *dp = strchr(uf, '$');
-                    assert(dp);
-                    ppos = (dp - uf);
-                    assert(ppos == uslot->dpos + 1);
-                    if (ppos < 1 || ppos >= BSON_MAX_FPATH_LEN - 1) {
-                        break;
-                    }
-                    memcpy(pbuf, uf, ppos);
-                    int wl = bson_numstrn(pbuf + ppos, (BSON_MAX_FPATH_LEN - ppos), uslot->mpos);
-                    if (wl >= BSON_MAX_FPATH_LEN - ppos) { // Output is truncated
-                        break;
-                    }
-                    ppos += wl;
-                    // Copy suffix
-                    for (int fpos = (dp - uf) + 1; ppos < BSON_MAX_FPATH_LEN && *(uf + fpos) != '\0';) {
-                        pbuf[ppos++] = *(uf + fpos++);
-                    }
-                    assert(ppos <= BSON_MAX_FPATH_LEN);
-                    pbuf[ppos] = '\0';
+    bson_find_from_buffer(&it, sdata, "k");
+    *kbufsz = bson_iterator_bin_len(&it);
+    return bson_iterator_bin_data(&it);
+}
 
-                    bt = bson_find(&it, qf->updateobj, uf);
-                    if (bt == BSON_EOO) {
-                        assert(false);
-                        break;
-                    }
-                    bson_append_field_from_iterator2(pbuf, &it, ret);
-                    break;
-                }
+/* Merge the spilled run record `sdata` into the group `grp` */
+static void _aggstatemerge(_AGGCTX *agg, _AGGGRP *grp, const void *sdata) {
+    bson_iterator it, sit, ait;
+    if (!grp->id) {
+        bson_find_from_buffer(&it, sdata, "i");
+        TCMEMDUP(grp->id, bson_iterator_bin_data(&it), bson_iterator_bin_len(&it));
+    }
+    bson_find_from_buffer(&it, sdata, "s");
+    BSON_ITERATOR_SUBITERATOR(&it, &sit);
+    for (int i = 0; i < agg->anum && bson_iterator_next(&sit) == BSON_OBJECT; ++i) {
+        _AGGSTATE *st = grp->st + i;
+        BSON_ITERATOR_SUBITERATOR(&sit, &ait);
+        while (bson_iterator_next(&ait) != BSON_EOO) {
+            const char *key = BSON_ITERATOR_KEY(&ait);
+            if (*key == 'n') {
+                st->n += bson_iterator_long(&ait);
+            } else if (*key == 'i') {
+                st->isum += bson_iterator_long(&ait);
+            } else if (*key == 'd') {
+                st->dsum += bson_iterator_double(&ait);
+            } else if (*key == 'f') {
+                st->isdbl = st->isdbl || bson_iterator_bool(&ait);
+            } else if (*key == 'v') {
+                bson_iterator vit;
+                bson_find_from_buffer(&vit, bson_iterator_bin_data(&ait), "v");
+                _aggmvalput(agg->accs + i, st, &vit);
             }
         }
     }
-    BSON_ITERATOR_INIT(&it, qf->updateobj);
-    while ((bt = bson_iterator_next(&it)) != BSON_EOO) {
-        const char *key = bson_iterator_key(&it);
-        if (strchr(key, '$') == NULL) {
-            bson_append_field_from_iterator2(key, &it, ret);
+}
+
+/* Append the integer value as int if it fits otherwise as long */
+static void _aggappendnum(bson *bs, const char *name, int64_t v) {
+    if (v >= INT32_MIN && v <= INT32_MAX) {
+        bson_append_int(bs, name, (int32_t) v);
+    } else {
+        bson_append_long(bs, name, v);
+    }
+}
+
+/* Append the final group document of `grp` into the result set `res` */
+static void _aggpushgrp(_AGGCTX *agg, const _AGGGRP *grp, TCLIST *res) {
+    bson bs;
+    bson_iterator it;
+    bson_init(&bs);
+    BSON_ITERATOR_FROM_BUFFER(&it, grp->id);
+    if (bson_iterator_next(&it) != BSON_EOO) {
+        bson_append_field_from_iterator(&it, &bs);
+    }
+    for (int i = 0; i < agg->anum; ++i) {
+        const _AGGACC *acc = agg->accs + i;
+        const _AGGSTATE *st = grp->st + i;
+        if (acc->op == JBAGGCOUNT) {
+            _aggappendnum(&bs, acc->name, st->n);
+        } else if (acc->op == JBAGGSUM) {
+            if (st->isdbl) {
+                bson_append_double(&bs, acc->name, st->dsum);
+            } else {
+                _aggappendnum(&bs, acc->name, st->isum);
+            }
+        } else if (acc->op == JBAGGAVG && st->n > 0) {
+            bson_append_double(&bs, acc->name, st->dsum / st->n);
+        } else if (st->mval) {
+            bson_find_from_buffer(&it, st->mval, "v");
+            bson_append_field_from_iterator2(acc->name, &it, &bs);
+        } else {
+            bson_append_null(&bs, acc->name);
         }
     }
-    bson_finish(ret);
-    return ret;
+    bson_finish(&bs);
+    tclistpushmalloc(res, bs.data, bson_size(&bs));
 }
 
-static bool _qryupdate(_QRYCTX *ctx, void *bsbuf, int bsbufsz) {
-    assert(ctx && ctx->q && (ctx->q->flags & EJQUPDATING) && bsbuf && ctx->didxctx);
+/* Groups serialized into spilled run records ordered by normalized group keys */
+static TCLIST* _aggstates(_AGGCTX *agg) {
+    const char *kbuf;
+    int kbufsz, sp;
+    TCLIST *keys = tcmapkeys(agg->groups);
+    TCLIST *states = tclistnew2(TCLISTNUM(keys) + 1);
+    tclistsort(keys);
+    for (int i = 0; i < TCLISTNUM(keys); ++i) {
+        _AGGGRP *grp;
+        TCLISTVAL(kbuf, keys, i, kbufsz);
+        memcpy(&grp, tcmapget(agg->groups, kbuf, kbufsz, &sp), sizeof (grp));
+        bson bs;
+        _aggstatebson(agg, kbuf, kbufsz, grp, &bs);
+        tclistpushmalloc(states, bs.data, bson_size(&bs));
+    }
+    tclistdel(keys);
+    return states;
+}
 
-    bool rv = true;
-    int update = 0;
-    EJCOLL *coll = ctx->coll;
-    EJQ *q = ctx->q;
-    bson_oid_t *oid;
-    bson_type bt, bt2;
-    bson_iterator it, it2;
-    TCMAP *rowm = NULL;
+/**
+ * Spill the groups of `$group` aggregation into a new run file ordered by group keys.
+ * Called when the groups exceed the `sortmem` budget.
+ * If spilling fails groups are kept in memory and the budget is disabled.
+ */
+static bool _aggspill(_QRYCTX *ctx) {
+    _AGGCTX *agg = ctx->agg;
+    TCLIST *states = _aggstates(agg);
+    char *path = _sortrunpath(ctx);
+    bool rv = _sortwriterun(ctx, path, states);
+    tclistdel(states);
+    if (!rv) {
+        TCFREE(path);
+        ctx->sortmem = 0;
+        return false;
+    }
+    if (!ctx->runs) {
+        ctx->runs = tclistnew2(TCLISTINYNUM);
+    }
+    tclistpushmalloc(ctx->runs, path, strlen(path));
+    _aggclear(agg);
+    agg->nruns++;
+    return true;
+}
 
-    if (q->flags & EJQDROPALL) { // Records will be dropped
-        bt = bson_find_from_buffer(&it, bsbuf, JDBIDKEYNAME);
-        if (bt != BSON_OID) {
-            _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
-            return false;
+static int _aggrunscmp(const _EJBSORTRUN *r1, const _EJBSORTRUN *r2) {
+    int k1sz, k2sz;
+    const char *k1 = _aggstatekey(r1->d.ptr, &k1sz);
+    const char *k2 = _aggstatekey(r2->d.ptr, &k2sz);
+    int rv = memcmp(k1, k2, MIN(k1sz, k2sz));
+    return rv ? rv : (k1sz - k2sz);
+}
+
+/* Sift down the root of spilled runs heap: the run with the least group key is kept at the root */
+static void _aggrunsiftdown(_EJBSORTRUN **heap, int num) {
+    int i = 0;
+    while (true) {
+        int l = 2 * i + 1, r = l + 1, w = i;
+        if (l < num && _aggrunscmp(heap[l], heap[w]) < 0) w = l;
+        if (r < num && _aggrunscmp(heap[r], heap[w]) < 0) w = r;
+        if (w == i) break;
+        _EJBSORTRUN *tmp = heap[i];
+        heap[i] = heap[w];
+        heap[w] = tmp;
+        i = w;
+    }
+}
+
+/**
+ * Streaming k-way merge of the first `pnum` spilled runs of `ctx->runs`
+ * and the optional in-memory run `mlist`, records of the same group are merged.
+ * Final group documents are pushed into the `out` list if it is not NULL,
+ * otherwise merged groups are written into the `opath` run file.
+ * Merged run files are removed.
+ */
+static bool _aggmergeruns(_QRYCTX *ctx, int pnum, TCLIST *mlist, TCLIST *out, const char *opath) {
+    _AGGCTX *agg = ctx->agg;
+    bool err = false;
+    int hnum = 0;
+    _EJBSORTRUN *runs, **heap;
+    _AGGGRP *grp;
+    TCXSTR *gkey = tcxstrnew();
+    TCCALLOC(grp, 1, sizeof (*grp) + agg->anum * sizeof (_AGGSTATE));
+    TCCALLOC(runs, pnum + 1, sizeof(*runs));
+    TCMALLOC(heap, sizeof(*heap) * (pnum + 1));
+    for (int i = 0; i <= pnum; ++i) {
+        runs[i].fd = INVALID_HANDLE_VALUE;
+    }
+    HANDLE ofd = INVALID_HANDLE_VALUE;
+    if (!out) {
+        ofd = _sortrunopen(ctx, opath, true);
+        if (INVALIDHANDLE(ofd)) {
+            err = true;
+            goto finish;
         }
-        oid = bson_iterator_oid(&it);
-        assert(oid);
-        if (ctx->log) {
-            char xoid[25];
-            bson_oid_to_string(oid, xoid);
-            tcxstrprintf(ctx->log, "$DROPALL ON: %s\n", xoid);
+    }
+    for (int i = 0; i <= pnum; ++i) {
+        _EJBSORTRUN *run = runs + i;
+        if (i == pnum) {
+            if (!mlist) {
+                break;
+            }
+            run->mlist = mlist;
+        } else {
+            run->fd = _sortrunopen(ctx, TCLISTVALPTR(ctx->runs, i), false);
+            if (INVALIDHANDLE(run->fd)) {
+                err = true;
+                goto finish;
+            }
         }
-        const void *olddata;
-        int olddatasz = 0;
-        TCMAP *rmap = tctdbget(coll->tdb, oid, sizeof (*oid));
-        if (rmap) {
-            olddata = tcmapget3(rmap, JDBCOLBSON, JDBCOLBSONL, &olddatasz);
-            if (!_updatebsonidx(coll, oid, NULL, olddata, olddatasz, ctx->didxctx) ||
-                    !tctdbout(coll->tdb, oid, sizeof (*oid))) {
-                rv = false;
+        if (_sortrunnext(ctx, run)) { // Sift up the new heap leaf
+            heap[hnum] = run;
+            for (int j = hnum++; j > 0; ) {
+                int p = (j - 1) / 2;
+                if (_aggrunscmp(heap[j], heap[p]) >= 0) break;
+                _EJBSORTRUN *tmp = heap[j];
+                heap[j] = heap[p];
+                heap[p] = tmp;
+                j = p;
             }
-            tcmapdel(rmap);
         }
-        return rv;
     }
-    
-    //Apply update operation
-    bson bsout;
-    bson_init_size(&bsout, 0);
+    while (hnum > 0 || TCXSTRSIZE(gkey) > 0) {
+        int kbufsz = 0;
+        const char *kbuf = (hnum > 0) ? _aggstatekey(heap[0]->d.ptr, &kbufsz) : NULL;
+        if (TCXSTRSIZE(gkey) > 0 &&
+            (!kbuf || kbufsz != TCXSTRSIZE(gkey) || memcmp(kbuf, TCXSTRPTR(gkey), kbufsz))) {
+            // All records of the current group are merged
+            if (out) {
+                _aggpushgrp(agg, grp, out);
+            } else {
+                bson bs;
+                _aggstatebson(agg, TCXSTRPTR(gkey), TCXSTRSIZE(gkey), grp, &bs);
+                if (!tcwrite(ofd, bson_data(&bs), bson_size(&bs))) {
+                    _ejdbsetecode2(ctx->coll->jb, TCEWRITE, __FILE__, __LINE__, __func__, true);
+                    err = true;
+                }
+                bson_destroy(&bs);
+            }
+            for (int i = 0; i < agg->anum; ++i) {
+                if (grp->st[i].mval) {
+                    TCFREE(grp->st[i].mval);
+                }
+            }
+            TCFREE(grp->id);
+            memset(grp, 0, sizeof (*grp) + agg->anum * sizeof (_AGGSTATE));
+            tcxstrclear(gkey);
+        }
+        if (!kbuf || err) {
+            break;
+        }
+        if (TCXSTRSIZE(gkey) == 0) {
+            TCXSTRCAT(gkey, kbuf, kbufsz);
+        }
+        _EJBSORTRUN *run = heap[0];
+        _aggstatemerge(agg, grp, run->d.ptr);
+        if (!_sortrunnext(ctx, run)) {
+            heap[0] = heap[--hnum];
+        }
+        _aggrunsiftdown(heap, hnum);
+    }
 
-    const EJQF *setqf = NULL;                   // $set 
-    const EJQF *unsetqf = NULL;                 // $unset
-    const EJQF *incqf = NULL;                   // $inc
-	const EJQF *renameqf = NULL;                // $rename
-    const EJQF *addsetqf[2] = {NULL};           // $addToSet, $addToSetAll
-    const EJQF *pushqf[2] = {NULL};             // $push, $pushAll
-    const EJQF *pullqf[2] = {NULL};             // $pull, $pullAll
-
-    for (int i = 0; i < TCLISTNUM(q->qflist); ++i) {
-        
-        const EJQF *qf = TCLISTVALPTR(q->qflist, i);
-        const uint32_t flags = qf->flags;
-        
-        if (qf->updateobj == NULL) {
-            continue;
-        } 
-        if (flags & EJCONDSET) {                // $set
-            setqf = qf;
-        } else if (flags & EJCONDUNSET) {       // $unset
-            unsetqf = qf;
-        } else if (flags & EJCONDINC) {         // $inc
-            incqf = qf;
-        } else if (flags & EJCONDRENAME) {      // $rename
-			renameqf = qf;
-		} else if (flags & EJCONDADDSET) {      // $addToSet, $addToSetAll
-            if (flags & EJCONDALL) {
-                addsetqf[1] = qf;
-            } else {
-                addsetqf[0] = qf;
-            }
-        } else if (flags & EJCONDPUSH) {        // $push, $pushAll
-            if (flags & EJCONDALL) {
-                pushqf[1] = qf;
-            } else {
-                pushqf[0] = qf;
-            }
-        } else if (flags & EJCONDPULL) {        // $pull, $pullAll
-            if (flags & EJCONDALL) {
-                pullqf[1] = qf;
-            } else {
-                pullqf[0] = qf;
-            }
+finish:
+    for (int i = 0; i <= pnum; ++i) {
+        if (!INVALIDHANDLE(runs[i].fd)) {
+            CLOSEFH(runs[i].fd);
+        }
+        if (runs[i].buf) {
+            TCFREE(runs[i].buf);
         }
+        err = err || runs[i].err;
     }
-    
-	if (renameqf) {
-        char *inbuf = (bsout.finished) ? bsout.data : bsbuf;
-        if (bsout.finished) {
-            // Reinit `bsout`, `inbuf` already points to `bsout.data` and will be freed later
-            bson_init_size(&bsout, bson_size(&bsout));
+    if (!INVALIDHANDLE(ofd) && !_sortrunend(ctx, ofd, err)) {
+        err = true;
+    }
+    for (int i = 0; i < pnum; ++i) {
+        int sp;
+        char *path = tclistshift(ctx->runs, &sp);
+        unlink(path);
+        TCFREE(path);
+    }
+    _agggrpdel(agg, grp);
+    tcxstrdel(gkey);
+    TCFREE(heap);
+    TCFREE(runs);
+    return !err;
+}
+
+/**
+ * Push the final group documents of `$group` aggregation into the result set
+ * ordered by normalized group keys. Spilled runs of groups are merged.
+ */
+static bool _aggfinish(_QRYCTX *ctx) {
+    _AGGCTX *agg = ctx->agg;
+    TCLIST *res = ctx->res;
+    if (!ctx->runs) {
+        const char *kbuf;
+        int kbufsz, sp;
+        TCLIST *keys = tcmapkeys(agg->groups);
+        tclistsort(keys);
+        for (int i = 0; i < TCLISTNUM(keys); ++i) {
+            _AGGGRP *grp;
+            TCLISTVAL(kbuf, keys, i, kbufsz);
+            memcpy(&grp, tcmapget(agg->groups, kbuf, kbufsz, &sp), sizeof (grp));
+            _aggpushgrp(agg, grp, res);
+        }
+        tclistdel(keys);
+        _aggclear(agg);
+        return true;
+    }
+    TCLIST *states = _aggstates(agg);
+    _aggclear(agg);
+    bool rv = true;
+    while (rv && TCLISTNUM(ctx->runs) > JBSORTMERGEWAY) {
+        char *path = _sortrunpath(ctx);
+        rv = _aggmergeruns(ctx, JBSORTMERGEWAY, NULL, NULL, path);
+        if (rv) {
+            tclistpushmalloc(ctx->runs, path, strlen(path));
         } else {
-            assert(bsout.data == NULL);
-            bson_init_size(&bsout, bsbufsz);
+            unlink(path);
+            TCFREE(path);
         }
-		bson *updobj = _qfgetupdateobj(renameqf);
-        TCMAP *rfields = tcmapnew2(TCMAPTINYBNUM);
-        BSON_ITERATOR_INIT(&it, updobj);
-        while ((bt = bson_iterator_next(&it)) != BSON_EOO) {
-            if (bt != BSON_STRING) {
-                continue;
-            }
-            const char *nfpath = bson_iterator_string(&it);
-            int nlen = bson_iterator_string_len(&it);
-            if (nlen == 0) {
-                continue;
+    }
+    if (rv) {
+        rv = _aggmergeruns(ctx, TCLISTNUM(ctx->runs), states, res, NULL);
+    }
+    tclistdel(states);
+    return rv;
+}
+
+EJDB_INLINE void _nufetch(_EJDBNUM *nu, const char *sval, bson_type bt) {
+    if (bt == BSON_INT || bt == BSON_LONG || bt == BSON_BOOL || bt == BSON_DATE) {
+        nu->inum = tcatoi(sval);
+    } else if (bt == BSON_DOUBLE) {
+        nu->dnum = tcatof(sval);
+    } else {
+        nu->inum = 0;
+        assert(0);
+    }
+}
+
+EJDB_INLINE int _nucmp(_EJDBNUM *nu, const char *sval, bson_type bt) {
+    if (bt == BSON_INT || bt == BSON_LONG || bt == BSON_BOOL || bt == BSON_DATE) {
+        int64_t v = tcatoi(sval);
+        return (nu->inum > v) ? 1 : (nu->inum < v ? -1 : 0);
+    } else if (bt == BSON_DOUBLE) {
+        double v = tcatof(sval);
+        return (nu->dnum > v) ? 1 : (nu->dnum < v ? -1 : 0);
+    } else {
+        assert(0);
+    }
+    return 0;
+}
+
+EJDB_INLINE int _nucmp2(_EJDBNUM *nu1, _EJDBNUM *nu2, bson_type bt) {
+    if (bt == BSON_INT || bt == BSON_LONG || bt == BSON_BOOL || bt == BSON_DATE) {
+        return (nu1->inum > nu2->inum) ? 1 : (nu1->inum < nu2->inum ? -1 : 0);
+    } else if (bt == BSON_DOUBLE) {
+        return (nu1->dnum > nu2->dnum) ? 1 : (nu1->dnum < nu2->dnum ? -1 : 0);
+    } else {
+        assert(0);
+    }
+    return 0;
+}
+
+/**
+ * Encode number into the memcmp-sortable key used by `TDBITBINNUM` indexes.
+ * The key is the big-endian IEEE 754 double with the sign bit flipped
+ * (all bits inverted for negative values) followed by the big-endian residual
+ * of int64 to double conversion biased by 0x8000. The residual keeps distinct
+ * int64 values beyond 2^53 ordered while int and double keys stay comparable.
+ */
+static void _numkeyenc(char *kbuf, double d, int residual) {
+    uint64_t u;
+    if (d == 0.0) {
+        d = 0.0; // -0.0 and 0.0 share the key
+    }
+    memcpy(&u, &d, sizeof (u));
+    u = (u & 0x8000000000000000ULL) ? ~u : (u | 0x8000000000000000ULL);
+    for (int i = 7; i >= 0; --i) {
+        kbuf[i] = (char) (u & 0xff);
+        u >>= 8;
+    }
+    uint16_t r = (uint16_t) (residual + 0x8000);
+    kbuf[8] = (char) (r >> 8);
+    kbuf[9] = (char) (r & 0xff);
+}
+
+/* Decode number key produced by `_numkeyenc()` */
+static double _numkeydec(const char *kbuf) {
+    uint64_t u = 0;
+    double d;
+    for (int i = 0; i < 8; ++i) {
+        u = (u << 8) | (unsigned char) kbuf[i];
+    }
+    u = (u & 0x8000000000000000ULL) ? (u & ~0x8000000000000000ULL) : ~u;
+    memcpy(&d, &u, sizeof (d));
+    int residual = ((((unsigned char) kbuf[8]) << 8) | ((unsigned char) kbuf[9])) - 0x8000;
+    return d + residual;
+}
+
+static void _numkeyl(char *kbuf, int64_t v) {
+    double d = (double) v;
+    int residual;
+    if (d >= 9223372036854775808.0) { // Rounded above INT64_MAX
+        residual = (int) ((v - INT64_MAX) - 1);
+    } else {
+        residual = (int) (v - (int64_t) d);
+    }
+    _numkeyenc(kbuf, d, residual);
+}
+
+static void _numkeyd(char *kbuf, double v) {
+    _numkeyenc(kbuf, v, 0);
+}
+
+static void _numkeys(char *kbuf, const char *sval) {
+    long double v = tcatof2(sval);
+    if (v >= -9223372036854775808.0L && v < 9223372036854775808.0L && v == (int64_t) v) {
+        _numkeyl(kbuf, (int64_t) v);
+    } else {
+        _numkeyd(kbuf, (double) v);
+    }
+}
+
+static void _numkeyqf(char *kbuf, const EJQF *qf) {
+    if (qf->ftype == BSON_DOUBLE) {
+        _numkeyd(kbuf, qf->exprdblval);
+    } else {
+        _numkeyl(kbuf, qf->exprlongval);
+    }
+}
+
+/**
+ * Fill the binary keys range matched by number condition `qf`.
+ * Returns false if condition cannot be served by binary keys range.
+ * `kr->keys` list must be freed by caller.
+ */
+static bool _numkeyrange(const EJQF *qf, _NUMKEYRANGE *kr) {
+    memset(kr, 0, sizeof(*kr));
+    kr->lincl = kr->uincl = true;
+    switch (qf->tcop) {
+        case TDBQCNUMEQ:
+            _numkeyqf(kr->lkey, qf);
+            memcpy(kr->ukey, kr->lkey, JBNUMKEYSZ);
+            kr->haslow = kr->hasup = true;
+            break;
+        case TDBQCNUMGT:
+        case TDBQCNUMGE:
+            _numkeyqf(kr->lkey, qf);
+            kr->haslow = true;
+            kr->lincl = (qf->tcop == TDBQCNUMGE);
+            break;
+        case TDBQCNUMLT:
+        case TDBQCNUMLE:
+            _numkeyqf(kr->ukey, qf);
+            kr->hasup = true;
+            kr->uincl = (qf->tcop == TDBQCNUMLE);
+            break;
+        case TDBQCNUMBT:
+            assert(qf->exprlist && TCLISTNUM(qf->exprlist) == 2);
+            _numkeys(kr->lkey, tclistval2(qf->exprlist, 0));
+            _numkeys(kr->ukey, tclistval2(qf->exprlist, 1));
+            if (memcmp(kr->lkey, kr->ukey, JBNUMKEYSZ) > 0) {
+                char swap[JBNUMKEYSZ];
+                memcpy(swap, kr->lkey, JBNUMKEYSZ);
+                memcpy(kr->lkey, kr->ukey, JBNUMKEYSZ);
+                memcpy(kr->ukey, swap, JBNUMKEYSZ);
+            }
+            kr->haslow = kr->hasup = true;
+            break;
+        case TDBQCNUMOREQ:
+            assert(qf->exprlist);
+            kr->keys = tclistnew2(TCLISTNUM(qf->exprlist));
+            for (int i = 0; i < TCLISTNUM(qf->exprlist); ++i) {
+                const char *token;
+                int tsiz;
+                TCLISTVAL(token, qf->exprlist, i, tsiz);
+                if (tsiz < 1) continue;
+                _numkeys(kr->lkey, token);
+                TCLISTPUSH(kr->keys, kr->lkey, JBNUMKEYSZ);
+            }
+            tclistsort(kr->keys);
+            for (int i = 1; i < TCLISTNUM(kr->keys); i++) {
+                if (!memcmp(TCLISTVALPTR(kr->keys, i), TCLISTVALPTR(kr->keys, i - 1), JBNUMKEYSZ)) {
+                    TCFREE(tclistremove2(kr->keys, i));
+                    i--;
+                }
             }
-            tcmapputkeep(rfields, 
-                         BSON_ITERATOR_KEY(&it), strlen(BSON_ITERATOR_KEY(&it)), 
-                         nfpath, nlen);
-        }
-        int rencnt;
-        if (bson_rename(rfields, inbuf, &bsout, &rencnt) != BSON_OK) {
-            rv = false;
-            _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);    
-        }
-        if (rencnt > 0) {
-            update++;
-        }
-        tcmapdel(rfields);
-        bson_finish(&bsout);
-        if (inbuf != bsbuf) {
-            TCFREE(inbuf);
+            kr->haslow = kr->hasup = true;
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+/* Compare lexical index key `kbuf` having `trim` bytes of pk hash suffix with `key` value */
+static int _lexkeycmp(const char *kbuf, int kbufsz, const char *key, int keysz, int trim) {
+    kbufsz -= trim;
+    int rv = memcmp(kbuf, key, MIN(kbufsz, keysz));
+    return rv ? rv : (kbufsz - keysz);
+}
+
+/* Compare decimal index key `kbuf` with `key` number string */
+static int _deckeycmp(const char *kbuf, int kbufsz, const char *key, int keysz, int trim) {
+    long double knum = tcatof2(kbuf);
+    long double xnum = tcatof2(key);
+    return (knum < xnum) ? -1 : (knum > xnum) ? 1 : 0;
+}
+
+/* Compare binary number index key `kbuf` with `JBNUMKEYSZ` bytes `key` */
+static int _binkeycmp(const char *kbuf, int kbufsz, const char *key, int keysz, int trim) {
+    if (kbufsz < JBNUMKEYSZ) return -1;
+    return memcmp(kbuf, key, JBNUMKEYSZ);
+}
+
+/**
+ * Merge step of sorted `$in` keys against index: moves cursor `cur` forward
+ * to the first index key not less than `key`. Keys of index leaf
+ * are cheap to step over, so at most `JBMERGESTEPS` keys are stepped over
+ * before returning false, caller should reposition cursor by jump then.
+ */
+static bool _qrycurstep(BDBCUR *cur, int (*cmp)(const char*, int, const char*, int, int),
+                        const char *key, int keysz, int trim) {
+    const char *kbuf;
+    int kbufsz;
+    for (int i = 0; (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL; ++i) {
+        if (cmp(kbuf, kbufsz, key, keysz, trim) >= 0) {
+            return true;
         }
-        if (updobj != renameqf->updateobj) {
-            bson_del(updobj);
+        if (i == JBMERGESTEPS) {
+            return false;
         }
-        if (!rv) {
-            goto finish;
+        tcbdbcurnext(cur);
+    }
+    return true; // No more keys in index
+}
+
+/**
+ * Move index cursor `cur` forward over at most `num` keys less than
+ * the bound key `bkey` followed by `bsuffix` byte if `bsuffix` is not negative.
+ * Keys are counted by whole index leaves. See `tcbdbcurskip()`
+ * Returns the number of keys moved over.
+ */
+static uint64_t _qryskipkeys(BDBCUR *cur, const char *bkey, int bkeysz, int bsuffix, uint64_t num) {
+    if (!bkey) {
+        return tcbdbcurskip(cur, NULL, 0, num);
+    }
+    char sbuf[JBSTRINOPBUFFERSZ];
+    char *buf = sbuf;
+    if (bkeysz + 1 > JBSTRINOPBUFFERSZ) {
+        TCMALLOC(buf, bkeysz + 1);
+    }
+    memcpy(buf, bkey, bkeysz);
+    if (bsuffix >= 0) {
+        buf[bkeysz++] = bsuffix;
+    }
+    uint64_t rv = tcbdbcurskip(cur, buf, bkeysz, num);
+    if (buf != sbuf) {
+        TCFREE(buf);
+    }
+    return rv;
+}
+
+/* Fill `kbuf` with binary number key of value pointed by `it`, returns false for non numbers */
+static bool _bsonitnumkey(bson_iterator *it, char *kbuf) {
+    bson_type bt = BSON_ITERATOR_TYPE(it);
+    if (bt == BSON_INT || bt == BSON_LONG || bt == BSON_BOOL || bt == BSON_DATE) {
+        _numkeyl(kbuf, bson_iterator_long(it));
+    } else if (bt == BSON_DOUBLE) {
+        _numkeyd(kbuf, bson_iterator_double(it));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool _isbinnumidx(EJCOLL *coll, const char *ipath) {
+    for (int i = 0; i < coll->tdb->inum; ++i) {
+        TDBIDX *idx = coll->tdb->idxs + i;
+        if (idx->type == TDBITBINNUM && !strcmp(idx->name, ipath)) {
+            return true;
         }
-	}
-    
-    if (unsetqf) { //$unset
-        char *inbuf = (bsout.finished) ? bsout.data : bsbuf;
-        if (bsout.finished) {
-            bson_init_size(&bsout, bson_size(&bsout));
-        } else {
-            assert(bsout.data == NULL);
-            bson_init_size(&bsout, bsbufsz);
+    }
+    return false;
+}
+
+/**
+ * Parse compound index `spec`: comma separated list of field paths,
+ * field path prefixed by '-' is indexed in descending order.
+ * Returns the number of fields or -1 if `spec` is invalid.
+ */
+static int _cidxspecparse(const char *spec, int specsz, const char **fpaths, int *fpathszs, int *dirs) {
+    int fnum = 0;
+    const char *sp = spec;
+    const char *ep = spec + specsz;
+    while (true) {
+        if (fnum == JBCIDXMAXFIELDS) {
+            return -1;
         }
-        int matched;
-        bson *updobj = _qfgetupdateobj(unsetqf);
-        TCMAP *ifields = tcmapnew2(TCMAPTINYBNUM);
-        BSON_ITERATOR_INIT(&it, updobj);
-        while ((bt = bson_iterator_next(&it)) != BSON_EOO) {
-            const char *fpath = BSON_ITERATOR_KEY(&it);
-            tcmapput(ifields, fpath, strlen(fpath), &yes, sizeof(yes));
+        const char *fp = memchr(sp, ',', ep - sp);
+        if (!fp) {
+            fp = ep;
         }
-        if (bson_strip(ifields, false, inbuf, &bsout, &matched) != BSON_OK) {
-            rv = false;
-            _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
+        dirs[fnum] = 1;
+        if (sp < fp && *sp == '-') {
+            dirs[fnum] = -1;
+            sp++;
         }
-        if (matched > 0) {
-            update++;
+        if (sp == fp) { // Empty field path
+            return -1;
         }
-        tcmapdel(ifields);
-        bson_finish(&bsout);
-        if (inbuf != bsbuf) {
-            TCFREE(inbuf);
+        fpaths[fnum] = sp;
+        fpathszs[fnum] = fp - sp;
+        fnum++;
+        if (fp == ep) {
+            break;
         }
-        if (updobj != unsetqf->updateobj) {
-            bson_del(updobj);
+        sp = fp + 1;
+    }
+    return fnum;
+}
+
+/**
+ * Append the component of compound index key.
+ * Strings are stored with '\0' bytes escaped as "\0\xff" and terminated by "\0\x01",
+ * so keys of several components keep memcmp order.
+ * Components of descending fields are stored with all bits inverted.
+ */
+static void _cidxkeycat(TCXSTR *key, char tag, const char *vbuf, int vsiz, bool desc) {
+    int sp = TCXSTRSIZE(key);
+    TCXSTRCAT(key, &tag, 1);
+    if (tag == JBCIDXTSTR) {
+        for (int i = 0; i < vsiz; ) {
+            const char *zp = memchr(vbuf + i, '\0', vsiz - i);
+            int len = zp ? (zp - (vbuf + i)) : (vsiz - i);
+            TCXSTRCAT(key, vbuf + i, len);
+            i += len;
+            if (zp) {
+                TCXSTRCAT(key, "\0\xff", 2);
+                i++;
+            }
         }
-        if (!rv) {
-            goto finish;
+        TCXSTRCAT(key, "\0\x01", 2);
+    } else if (vsiz > 0) {
+        TCXSTRCAT(key, vbuf, vsiz);
+    }
+    if (desc) {
+        for (int i = sp; i < TCXSTRSIZE(key); ++i) {
+            key->ptr[i] = ~key->ptr[i];
         }
     }
+}
 
-    if (setqf) { //$set
-        update++;
-        bson *updobj = _qfgetupdateobj(setqf);
-        char *inbuf = (bsout.finished) ? bsout.data : bsbuf;
-        if (bsout.finished) {
-            bson_init_size(&bsout, bson_size(&bsout));
+/**
+ * Build the key of compound index `spec` for the BSON record `bsdata`.
+ * Key components are followed by the BSON types of the field values, one byte per field,
+ * so the field values can be restored from the key. See `_cidxkeybson()`.
+ * Records having arrays, objects or other not indexable values
+ * in the indexed fields get the single byte `JBCIDXMULTI` key.
+ */
+static char* _cidxkey(const void *bsdata, const char *spec, int specsz, int *vsz) {
+    const char *fpaths[JBCIDXMAXFIELDS];
+    int fpathszs[JBCIDXMAXFIELDS], dirs[JBCIDXMAXFIELDS];
+    int fnum = _cidxspecparse(spec, specsz, fpaths, fpathszs, dirs);
+    if (fnum < 1) {
+        *vsz = 0;
+        return NULL;
+    }
+    TCXSTR *key = tcxstrnew();
+    char nkey[JBNUMKEYSZ];
+    char types[JBCIDXMAXFIELDS];
+    bson_iterator it;
+    for (int i = 0; i < fnum; ++i) {
+        BSON_ITERATOR_FROM_BUFFER(&it, bsdata);
+        bson_type bt = bson_find_fieldpath_value2(fpaths[i], fpathszs[i], &it);
+        types[i] = bt;
+        if (bt == BSON_EOO || BSON_IS_NULL_TYPE(bt)) {
+            _cidxkeycat(key, JBCIDXTNULL, NULL, 0, (dirs[i] < 0));
+        } else if (_bsonitnumkey(&it, nkey)) {
+            _cidxkeycat(key, JBCIDXTNUM, nkey, JBNUMKEYSZ, (dirs[i] < 0));
+        } else if (bt == BSON_STRING) {
+            _cidxkeycat(key, JBCIDXTSTR, bson_iterator_string(&it), 
+                        bson_iterator_string_len(&it) - 1, (dirs[i] < 0));
         } else {
-            assert(bsout.data == NULL);
-            bson_init_size(&bsout, bsbufsz);
-        }
-        int err = bson_merge_fieldpaths(inbuf, bson_data(updobj), &bsout);
-        if (err) {
-            rv = false;
-            _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
-        }
-        bson_finish(&bsout);
-        if (inbuf != bsbuf) {
-            TCFREE(inbuf);
-        }
-        if (updobj != setqf->updateobj) {
-            bson_del(updobj);
-        }
-        if (bson_check_duplicate_keys(&bsout)) {
-            bson bstmp;
-            bson_copy(&bstmp, &bsout);
-            bson_destroy(&bsout);
-            bson_init(&bsout);
-            bson_fix_duplicate_keys(&bstmp, &bsout);
-            bson_finish(&bsout);
-            bson_destroy(&bstmp);
-        }
-        if (!rv) {
-            goto finish;
+            tcxstrclear(key);
+            tcxstrcat(key, "\xff", 1);
+            fnum = 0;
+            break;
         }
     }
+    TCXSTRCAT(key, types, fnum);
+    *vsz = TCXSTRSIZE(key);
+    return tcxstrtomalloc(key);
+}
 
-    if (incqf) { // $inc
-        bson bsmerge; // holds missing $inc fieldpaths in object
-        bson_init_size(&bsmerge, 0);
-        bson *updobj = _qfgetupdateobj(incqf);
-        if (!bsout.data) {
-            bson_create_from_buffer2(&bsout, bsbuf, bsbufsz);
+/* Decode int64 value of binary number key produced by `_numkeyl()` */
+static int64_t _numkeydecl(const char *kbuf) {
+    char dkey[JBNUMKEYSZ];
+    memcpy(dkey, kbuf, JBNUMKEYSZ - 2);
+    dkey[JBNUMKEYSZ - 2] = (char) 0x80; // Zero residual
+    dkey[JBNUMKEYSZ - 1] = 0x00;
+    double d = _numkeydec(dkey);
+    int residual = ((((unsigned char) kbuf[8]) << 8) | ((unsigned char) kbuf[9])) - 0x8000;
+    if (d >= 9223372036854775808.0) { // See `_numkeyl()`
+        return INT64_MAX + (residual + 1);
+    }
+    return (int64_t) d + residual;
+}
+
+/**
+ * Build the BSON record `bs` with `_id` and field values restored from compound index key.
+ * Only fields registered in `ifields` are restored.
+ * `kbuf` is the key without the 3 bytes suffix. Returns false if key cannot be decoded.
+ */
+static bool _cidxkeybson(const TDBIDX *idx, TCMAP *ifields, const char *kbuf, int kbufsz, 
+                         const void *pkbuf, int pkbufsz, bson *bs) {
+    const char *fpaths[JBCIDXMAXFIELDS];
+    int fpathszs[JBCIDXMAXFIELDS], dirs[JBCIDXMAXFIELDS];
+    int fnum = _cidxspecparse(idx->name + 1, strlen(idx->name + 1), fpaths, fpathszs, dirs);
+    if (fnum < 1 || kbufsz < fnum || pkbufsz != sizeof (bson_oid_t)) {
+        return false;
+    }
+    int sp;
+    bool rv = true;
+    char fpath[BSON_MAX_FPATH_LEN + 1];
+    const unsigned char *rp = (const unsigned char*) kbuf;
+    const unsigned char *tp = rp + kbufsz - fnum; // Field types
+    TCXSTR *sbuf = tcxstrnew();
+    bson_init(bs);
+    if (tcmapget(ifields, JDBIDKEYNAME, JDBIDKEYNAMEL, &sp)) {
+        bson_append_oid(bs, JDBIDKEYNAME, pkbuf);
+    }
+    for (int i = 0; rv && i < fnum; ++i) {
+        unsigned char inv = (dirs[i] < 0) ? 0xff : 0x00;
+        if (rp >= tp) {
+            rv = false;
+            break;
         }
-        BSON_ITERATOR_INIT(&it, updobj);
-        while ((bt = bson_iterator_next(&it)) != BSON_EOO) {
-            if (!BSON_IS_NUM_TYPE(bt)) {
-                continue;
+        bool inc = (tcmapget(ifields, fpaths[i], fpathszs[i], &sp) != NULL);
+        memcpy(fpath, fpaths[i], fpathszs[i]);
+        fpath[fpathszs[i]] = '\0';
+        int tag = *rp++ ^ inv;
+        if (tag == JBCIDXTNUM) {
+            char nkey[JBNUMKEYSZ];
+            if (tp - rp < JBNUMKEYSZ) {
+                rv = false;
+                break;
             }
-            BSON_ITERATOR_INIT(&it2, &bsout);
-            bt2 = bson_find_fieldpath_value(BSON_ITERATOR_KEY(&it), &it2);
-            if (bt2 == BSON_EOO) { // found a missing field
-                if (!bsmerge.data) {
-                    bson_init_size(&bsmerge, bson_size(updobj));
-                }
-                if (bt == BSON_DOUBLE) {
-                    bson_append_double(&bsmerge, BSON_ITERATOR_KEY(&it), bson_iterator_double(&it));
-                } else {
-                    bson_append_long(&bsmerge, BSON_ITERATOR_KEY(&it), bson_iterator_long(&it));
-                }
+            for (int j = 0; j < JBNUMKEYSZ; ++j) {
+                nkey[j] = *rp++ ^ inv;
             }
-            if (!BSON_IS_NUM_TYPE(bt2)) {
+            if (!inc) {
                 continue;
             }
-            if (bt2 == BSON_DOUBLE) {
-                double v = bson_iterator_double(&it2);
-                if (bt == BSON_DOUBLE) {
-                    v += bson_iterator_double(&it);
-                } else {
-                    v += bson_iterator_long(&it);
-                }
-                if (bson_inplace_set_double(&it2, v)) {
+            switch (tp[i]) {
+                case BSON_INT:
+                    bson_append_int(bs, fpath, (int) _numkeydecl(nkey));
+                    break;
+                case BSON_LONG:
+                    bson_append_long(bs, fpath, _numkeydecl(nkey));
+                    break;
+                case BSON_DATE:
+                    bson_append_date(bs, fpath, (bson_date_t) _numkeydecl(nkey));
+                    break;
+                case BSON_BOOL:
+                    bson_append_bool(bs, fpath, (_numkeydecl(nkey) != 0));
+                    break;
+                case BSON_DOUBLE:
+                    bson_append_double(bs, fpath, _numkeydec(nkey));
+                    break;
+                default:
                     rv = false;
-                    _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
                     break;
-                }
-                update++;
-            } else {
-                int64_t v = bson_iterator_long(&it2);
-                v += bson_iterator_long(&it);
-                if (bson_inplace_set_long(&it2, v)) {
+            }
+        } else if (tag == JBCIDXTSTR) {
+            tcxstrclear(sbuf);
+            while (true) {
+                if (rp >= tp) {
                     rv = false;
-                    _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
                     break;
                 }
-                update++;
-            }
-        }
-        
-        if (rv && 
-            bsmerge.data && 
-            bson_finish(&bsmerge) == BSON_OK) {
-            
-            bson_finish(&bsout);
-            char *inbuf = bsout.data;
-            bson_init_size(&bsout, bson_size(&bsout));
-            if (bson_merge_fieldpaths(inbuf, bsmerge.data, &bsout) != BSON_OK) {
-                rv = false;
-                 _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
-            } else {
-                update++;
-            }
-            if (inbuf != bsbuf) {
-                TCFREE(inbuf);
-            }
-        }
-        
-        bson_finish(&bsout);
-        bson_destroy(&bsmerge);
-        if (updobj != incqf->updateobj) {
-            bson_del(updobj);
-        }
-        if (bson_check_duplicate_keys(&bsout)) {
-            bson bstmp;
-            bson_copy(&bstmp, &bsout);
-            bson_destroy(&bsout);
-            bson_init(&bsout);
-            bson_fix_duplicate_keys(&bstmp, &bsout);
-            bson_finish(&bsout);
-            bson_destroy(&bstmp);
-        }
-        if (!rv) {
-            goto finish;
-        }
-    }
-
-    for (int i = 0; i < 2; ++i) { // $pull $pullAll
-        const EJQF *qf = pullqf[i];
-        if (!qf) continue;
-        char *inbuf = (bsout.finished) ? bsout.data : bsbuf;
-        if (bson_find_merged_arrays(bson_data(qf->updateobj), inbuf, (qf->flags & EJCONDALL))) {
-            if (bsout.finished) {
-                bson_init_size(&bsout, bson_size(&bsout));
-            } else {
-                assert(bsout.data == NULL);
-                bson_init_size(&bsout, bsbufsz);
+                unsigned char c = *rp++ ^ inv;
+                if (c == '\0') { // Escaped '\0' or string terminator
+                    if (rp >= tp) {
+                        rv = false;
+                        break;
+                    }
+                    c = *rp++ ^ inv;
+                    if (c == 0x01) {
+                        break;
+                    }
+                    c = '\0';
+                }
+                TCXSTRCAT(sbuf, &c, 1);
             }
-            // $pull $pullAll merge
-            if (bson_merge_arrays(bson_data(qf->updateobj), inbuf, 
-                                  BSON_MERGE_ARRAY_PULL, (qf->flags & EJCONDALL), &bsout)) {
-                rv = false;
-                _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
+            if (rv && inc) {
+                bson_append_string_n(bs, fpath, TCXSTRPTR(sbuf), TCXSTRSIZE(sbuf));
             }
-            if (inbuf != bsbuf) {
-                TCFREE(inbuf);
+        } else if (tag == JBCIDXTNULL) {
+            if (inc && tp[i] == BSON_NULL) {
+                bson_append_null(bs, fpath);
+            } else if (inc && tp[i] == BSON_UNDEFINED) {
+                bson_append_undefined(bs, fpath);
             }
-            bson_finish(&bsout);
-            update++;
-        }
-        if (!rv) {
-            goto finish;
-        }
-    }
-    
-    for (int i = 0; i < 2; ++i) { // $push $pushAll
-        const EJQF *qf = pushqf[i];
-        if (!qf) continue;
-        char *inbuf = (bsout.finished) ? bsout.data : bsbuf;
-        if (bsout.finished) {
-            bson_init_size(&bsout, bson_size(&bsout));
         } else {
-            assert(bsout.data == NULL);
-            bson_init_size(&bsout, bsbufsz);
-        }
-        // $push $pushAll merge
-        if (bson_merge_arrays(bson_data(qf->updateobj), inbuf, 
-                              BSON_MERGE_ARRAY_PUSH, (qf->flags & EJCONDALL), &bsout)) {
             rv = false;
-            _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
-        }
-        if (inbuf != bsbuf) {
-            TCFREE(inbuf);
-        }
-        bson_finish(&bsout);
-        update++;
-    }
-
-    for (int i = 0; i < 2; ++i) { // $addToSet $addToSetAll
-        const EJQF *qf = addsetqf[i];
-        if (!qf) continue;
-        char *inbuf = (bsout.finished) ? bsout.data : bsbuf;
-        if ((qf->flags & EJCONDALL) || bson_find_unmerged_arrays(bson_data(qf->updateobj), inbuf)) {
-            // Missing $addToSet element in some array field found
-            if (bsout.finished) {
-                bson_init_size(&bsout, bson_size(&bsout));
-            } else {
-                assert(bsout.data == NULL);
-                bson_init_size(&bsout, bsbufsz);
-            }
-            // $addToSet $addToSetAll merge
-            if (bson_merge_arrays(bson_data(qf->updateobj), inbuf, 
-                                  BSON_MERGE_ARRAY_ADDSET, (qf->flags & EJCONDALL), &bsout)) {
-                rv = false;
-                _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
-            }
-            if (inbuf != bsbuf) {
-                TCFREE(inbuf);
-            }
-            bson_finish(&bsout);
-            update++;
-        }
-        if (!rv) {
-            goto finish;
         }
     }
-    
-    // Finishing document update
-    if (!update || !rv) {
-        goto finish;
-    }
-    if (bsout.err) { // Resulting BSON is OK?
-        rv = false;
-        _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
-        goto finish;
-    }
-    if (bson_size(&bsout) == 0) { // Record was not updated
-        goto finish;
-    }
-    // Perform updating
-    bt = bson_find_from_buffer(&it, bsbuf, JDBIDKEYNAME);
-    if (bt != BSON_OID) {
-        rv = false;
-        _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
-        goto finish;
-    }
-    oid = bson_iterator_oid(&it);
-    rowm = tcmapnew2(TCMAPTINYBNUM);
-    tcmapput(rowm, JDBCOLBSON, JDBCOLBSONL, bson_data(&bsout), bson_size(&bsout));
-    rv = tctdbput(coll->tdb, oid, sizeof (*oid), rowm);
+    tcxstrdel(sbuf);
     if (rv) {
-        rv = _updatebsonidx(coll, oid, &bsout, bsbuf, bsbufsz, ctx->didxctx);
+        bson_finish(bs);
+        rv = !bs->err;
+    }
+    if (!rv) {
+        bson_destroy(bs);
     }
+    return rv;
+}
 
-finish:
-    bson_destroy(&bsout);
-    if (rowm) {
-        tcmapdel(rowm);
+/* Compare the compound index key with the keys range bound prefix */
+static int _cidxkeycmp(const char *kbuf, int kbufsz, const char *bbuf, int bbufsz) {
+    int rv = memcmp(kbuf, bbuf, MIN(kbufsz, bbufsz));
+    if (rv == 0 && kbufsz < bbufsz) {
+        rv = -1;
     }
     return rv;
 }
 
-/** Query */
-static TCLIST* _qryexecute(EJCOLL *coll, const EJQ *_q, 
-                           uint32_t *outcount, 
-                           int qflags, TCXSTR *log) {
-                               
-    assert(coll && coll->tdb && coll->tdb->hdb);
-    *outcount = 0;
+/* Returns true if compound index contains `JBCIDXMULTI` keys */
+static bool _cidxhasmulti(const TDBIDX *idx) {
+    int kbufsz;
+    BDBCUR *cur = tcbdbcurnew(idx->db);
+    tcbdbcurjump(cur, "\xff", 1);
+    const char *kbuf = tcbdbcurkey3(cur, &kbufsz);
+    bool rv = (kbuf && kbufsz > 0 && (unsigned char) *kbuf == JBCIDXMULTI);
+    tcbdbcurdel(cur);
+    return rv;
+}
 
-    _QRYCTX ctx = {NULL};
-    EJQ *q; //Clone the query object
-    TCMALLOC(q, sizeof (*q));
-    if (!_qrydup(_q, q, EJQINTERNAL)) {
-        TCFREE(q);
-        return NULL;
+static void _qryfieldup(const EJQF *src, EJQF *target, uint32_t qflags) {
+    assert(src && target);
+    memset(target, 0, sizeof (*target));
+    target->exprdblval = src->exprdblval;
+    target->exprlongval = src->exprlongval;
+    target->flags = src->flags;
+    target->ftype = src->ftype;
+    target->negate = src->negate;
+    target->order = src->order;
+    target->orderseq = src->orderseq;
+    target->tcop = src->tcop;
+    target->elmatchgrp = src->elmatchgrp;
+    target->elmatchpos = src->elmatchpos;
+
+    if (src->expr) {
+        TCMEMDUP(target->expr, src->expr, src->exprsz);
+        target->exprsz = src->exprsz;
     }
-    ctx.log = log;
-    ctx.q = q;
-    ctx.qflags = qflags;
-    ctx.coll = coll;
-    if (!_qrypreprocess(&ctx)) {
-        _qryctxclear(&ctx);
-        return NULL;
+    if (src->fpath) {
+        TCMEMDUP(target->fpath, src->fpath, src->fpathsz);
+        target->fpathsz = src->fpathsz;
     }
-    bool all = false; // If True we need all records to fetch (sorting)
-    TCHDB *hdb = coll->tdb->hdb;
-    TCLIST *res = ctx.res;
-    EJQF *mqf = ctx.mqf;
-
-    int sz = 0;         // Generic size var
-    int anum = 0;       // Number of active conditions
-    int ofsz = 0;       // Order fields count
-    int aofsz = 0;      // Active order fields count
-    const int qfsz = TCLISTNUM(q->qflist); // Number of all condition fields
-    EJQF **ofs = NULL;  // Order fields
-    EJQF **qfs = NULL;  // Condition fields array
-    if (qfsz > 0) {
-        TCMALLOC(qfs, qfsz * sizeof (EJQF*));
+    if (src->regex && ((EJQINTERNAL & qflags) || (src->flags & EJFRXSHARED))) {
+        //We cannot do deep copy of regex_t so do shallow copy only for internal query objects
+        //and regular expressions owned by the database regex cache
+        target->regex = src->regex;
     }
+    if (src->rxprefix) {
+        TCMEMDUP(target->rxprefix, src->rxprefix, src->rxprefixsz);
+        target->rxprefixsz = src->rxprefixsz;
+    }
+    if (src->exprlist) {
+        target->exprlist = tclistdup(src->exprlist);
+    }
+    if (src->exprmap) {
+        target->exprmap = tcmapdup(src->exprmap);
+    }
+    if (src->updateobj) {
+        target->updateobj = bson_dup(src->updateobj);
+    }
+    if (src->ufields) {
+        target->ufields = tclistdup(src->ufields);
+    }
+    if (src->uslots) {
+        target->uslots = tclistdup(src->uslots);
+    }
+}
 
-    const void *kbuf;
-    int kbufsz;
-    const void *vbuf;
-    int vbufsz;
-
-    uint32_t count = 0; // Current count
-    uint32_t max = (q->max > 0) ? q->max : UINT_MAX;
-    uint32_t skip = q->skip;
-    const TDBIDX *midx = mqf ? mqf->idx : NULL;
-
-    if (midx) { // Main index used for ordering
-        if (mqf->orderseq == 1 &&
-                !(mqf->tcop == TDBQCSTRAND || 
-                mqf->tcop == TDBQCSTROR || mqf->tcop == TDBQCSTRNUMOR)) {
-                    
-            mqf->flags |= EJFORDERUSED;
+/* Clone query object */
+static bool _qrydup(const EJQ *src, EJQ *target, uint32_t qflags) {
+    assert(src && target);
+    memset(target, 0, sizeof (*target));
+    target->flags = src->flags | qflags;
+    target->max = src->max;
+    target->skip = src->skip;
+    if (src->qflist) {
+        target->qflist = tclistnew2(TCLISTNUM(src->qflist));
+        for (int i = 0; i < TCLISTNUM(src->qflist); ++i) {
+            EJQF qf;
+            _qryfieldup(TCLISTVALPTR(src->qflist, i), &qf, qflags);
+            qf.q = target;
+            TCLISTPUSH(target->qflist, &qf, sizeof (qf));
         }
     }
-    for (int i = 0; i < qfsz; ++i) {
-        EJQF *qf = TCLISTVALPTR(q->qflist, i);
-        assert(qf);
-        if (log) {
-            if (qf->exprmap) {
-                tcxstrprintf(log, "USING HASH TOKENS IN: %s\n", qf->fpath);
-            }
-            if (qf->flags & EJCONDOIT) {
-                tcxstrprintf(log, "FIELD: %s HAS $do OPERATION\n", qf->fpath);
-            }
-        }
-        qf->jb = coll->jb;
-        qfs[i] = qf;
-        if (qf->fpathsz > 0 && !(qf->flags & EJFEXCLUDED)) {
-            anum++;
-        }
-        if (qf->orderseq) {
-            ofsz++;
-            if (q->flags & EJQONLYCOUNT) {
-                qf->flags |= EJFORDERUSED;
+    if (src->hints) {
+        target->hints = bson_dup(src->hints);
+    }
+    if (src->ifields) {
+        target->ifields = tcmapdup(src->ifields);
+    }
+    if (src->orqlist) {
+        target->orqlist = tclistnew2(TCLISTNUM(src->orqlist));
+        for (int i = 0; i < TCLISTNUM(src->orqlist); ++i) {
+            EJQ *q;
+            TCMALLOC(q, sizeof(*q));
+            if (_qrydup(*((EJQ**) TCLISTVALPTR(src->orqlist, i)), q, qflags)) {
+                TCLISTPUSH(target->orqlist, &q, sizeof (q));
+            } else {
+                _qrydel(q, true);
             }
         }
     }
-    if (ofsz > 0) { // Collect order fields array
-        TCMALLOC(ofs, ofsz * sizeof (EJQF*));
-        for (int i = 0; i < ofsz; ++i) {
-            for (int j = 0; j < qfsz; ++j) {
-                if (qfs[j]->orderseq == i + 1) { // orderseq starts with 1
-                    ofs[i] = qfs[j];
-                    if (!(ofs[i]->flags & EJFORDERUSED)) {
-                        aofsz++;
-                        if (ctx.ifields) { // Force order field to be included in result set
-                            if (ctx.imode) { // add field to the included set
-                                tcmapputkeep(ctx.ifields, ofs[i]->fpath, 
-                                             ofs[i]->fpathsz, &yes, sizeof (yes));
-                            } else { // remove field from excluded
-                                tcmapout(ctx.ifields, ofs[i]->fpath, ofs[i]->fpathsz);
-                            }
-                        }
-                    }
-                    break;
-                }
+    if (src->andqlist) {
+        target->andqlist = tclistnew2(TCLISTNUM(src->andqlist));
+        for (int i = 0; i < TCLISTNUM(src->andqlist); ++i) {
+            EJQ *q;
+            TCMALLOC(q, sizeof(*q));
+            if (_qrydup(*((EJQ**) TCLISTVALPTR(src->andqlist, i)), q, qflags)) {
+                tclistpush(target->andqlist, &q, sizeof (q));
+            } else {
+                _qrydel(q, true);
             }
         }
-        for (int i = 0; i < ofsz; ++i) assert(ofs[i] != NULL);
     }
+    return true;
+}
 
-    if ((q->flags & EJQONLYCOUNT) && qfsz == 0 &&
-            (q->orqlist == NULL || TCLISTNUM(q->orqlist) < 1) &&
-            (q->andqlist == NULL || TCLISTNUM(q->andqlist) < 1)) { // primitive count(*) query
-        count = coll->tdb->hdb->rnum;
-        if (log) {
-            tcxstrprintf(log, "SIMPLE COUNT(*): %u\n", count);
-        }
-        goto finish;
-    }
+typedef struct { /**> $do action visitor context */
+    _QRYCTX *ctx;
+    EJDB *jb;
+    TCMAP *dfields;
+    bson *sbson;
+} _BSONDOVISITORCTX;
 
-    if (!(q->flags & EJQONLYCOUNT) && aofsz > 0 && (!midx || mqf->orderseq != 1)) { 
-        // Main index is not the main order field
-        all = true; // Need all records for ordering for some other fields
+/* Load the `oid` record of `$join` collection `coll` through the query join cache, returns NULL if not found */
+static const void* _qryjoinget(_QRYCTX *ctx, EJCOLL *coll, const bson_oid_t *oid) {
+    char kbuf[sizeof (coll) + sizeof (*oid)];
+    int sp;
+    memcpy(kbuf, &coll, sizeof (coll));
+    memcpy(kbuf + sizeof (coll), oid, sizeof (*oid));
+    if (!ctx->jcache) {
+        ctx->jcache = tcmapnew();
+    }
+    const void *bsdata = tcmapget(ctx->jcache, kbuf, sizeof (kbuf), &sp);
+    if (bsdata) {
+        return (sp > 0) ? bsdata : NULL;
     }
+    EJQ *q = ctx->q;
+    tcxstrclear(q->colbuf);
+    tcxstrclear(q->tmpbuf);
+    if (!tchdbgetintoxstr(coll->tdb->hdb, oid, sizeof (*oid), q->colbuf) ||
+        !tcmaploadoneintoxstr(TCXSTRPTR(q->colbuf), TCXSTRSIZE(q->colbuf),
+                              JDBCOLBSON, JDBCOLBSONL, q->tmpbuf)) {
+        tcxstrclear(q->tmpbuf); // Missing records are cached as empty values
+    }
+    if (tcmapmsiz(ctx->jcache) > JBJOINCACHESZ) { // Drop the oldest half of cached records
+        tcmapcutfront(ctx->jcache, TCMAPRNUM(ctx->jcache) / 2 + 1);
+    }
+    tcmapput(ctx->jcache, kbuf, sizeof (kbuf), TCXSTRPTR(q->tmpbuf), TCXSTRSIZE(q->tmpbuf));
+    bsdata = tcmapget(ctx->jcache, kbuf, sizeof (kbuf), &sp);
+    return (sp > 0) ? bsdata : NULL;
+}
 
-    if (log) {
-        tcxstrprintf(log, "UPDATING MODE: %s\n", (q->flags & EJQUPDATING) ? "YES" : "NO");
-        tcxstrprintf(log, "MAX: %u\n", max);
-        tcxstrprintf(log, "SKIP: %u\n", skip);
-        tcxstrprintf(log, "COUNT ONLY: %s\n", (q->flags & EJQONLYCOUNT) ? "YES" : "NO");
-        tcxstrprintf(log, "MAIN IDX: '%s'\n", midx ? midx->name : "NONE");
-        tcxstrprintf(log, "ORDER FIELDS: %d\n", ofsz);
-        tcxstrprintf(log, "ACTIVE CONDITIONS: %d\n", anum);
-        tcxstrprintf(log, "ROOT $OR QUERIES: %d\n", ((q->orqlist) ? TCLISTNUM(q->orqlist) : 0));
-        tcxstrprintf(log, "ROOT $AND QUERIES: %d\n", ((q->andqlist) ? TCLISTNUM(q->andqlist) : 0));
-        tcxstrprintf(log, "FETCH ALL: %s\n", all ? "YES" : "NO");
+/* `$join` reference collected by `_qryjoinprefetch()` */
+typedef struct {
+    EJCOLL *coll;       //joined collection
+    uint64_t bidx;      //hash bucket index of the OID
+    bson_oid_t oid;     //referenced OID
+} _JOINREF;
+
+static int _qryjoinrefcmp(const void *a, const void *b) {
+    const _JOINREF *r1 = a;
+    const _JOINREF *r2 = b;
+    if (r1->coll != r2->coll) {
+        return ((uintptr_t) r1->coll < (uintptr_t) r2->coll) ? -1 : 1;
+    }
+    return (r1->bidx < r2->bidx) ? -1 : (r1->bidx > r2->bidx ? 1 : 0);
+}
+
+/* Collect the not cached OID referenced by `it` value into `refs` map */
+static void _qryjoinref(_QRYCTX *ctx, EJCOLL *coll, const bson_iterator *it, TCMAP *refs) {
+    _JOINREF ref;
+    bson_type bt = BSON_ITERATOR_TYPE(it);
+    if (bt == BSON_STRING) {
+        if (!ejdbisvalidoidstr(bson_iterator_string(it))) {
+            return;
+        }
+        bson_oid_from_string(&ref.oid, bson_iterator_string(it));
+    } else if (bt == BSON_OID) {
+        ref.oid = *(bson_iterator_oid(it));
+    } else {
+        return;
     }
-    if (max < UINT_MAX - skip) {
-        max += skip;
+    char kbuf[sizeof (coll) + sizeof (ref.oid)];
+    int sp;
+    memcpy(kbuf, &coll, sizeof (coll));
+    memcpy(kbuf + sizeof (coll), &ref.oid, sizeof (ref.oid));
+    if (ctx->jcache && tcmapget(ctx->jcache, kbuf, sizeof (kbuf), &sp)) {
+        return;
     }
-    if (max == 0) {
-        goto finish;
+    ref.coll = coll;
+    ref.bidx = tchdbkeybidx(coll->tdb->hdb, &ref.oid, sizeof (ref.oid));
+    tcmapputkeep(refs, kbuf, sizeof (kbuf), &ref, sizeof (ref));
+}
+
+/**
+ * Read the records referenced by `$do $join` fields of the result set `res` into the join cache.
+ * References are de-duplicated over the whole result set and read in the hash bucket order
+ * of their collections. Returns the number of records read.
+ */
+static int _qryjoinprefetch(_QRYCTX *ctx, TCLIST *res) {
+    TCMAP *refs = tcmapnew();
+    const char *fpath;
+    int fpathsz, sp;
+    tcmapiterinit(ctx->dfields);
+    while ((fpath = tcmapiternext(ctx->dfields, &fpathsz)) != NULL) {
+        const EJQF *dofield = tcmapiterval(fpath, &sp);
+        bson_iterator doit, it, sit;
+        EJCOLL *coll = NULL;
+        BSON_ITERATOR_INIT(&doit, dofield->updateobj);
+        while (bson_iterator_next(&doit) != BSON_EOO) {
+            if (BSON_ITERATOR_TYPE(&doit) == BSON_STRING && !strcmp("$join", BSON_ITERATOR_KEY(&doit))) {
+                coll = _getcoll(ctx->coll->jb, bson_iterator_string(&doit));
+            }
+        }
+        if (!coll) {
+            continue;
+        }
+        for (int i = 0; i < TCLISTNUM(res); ++i) { // Joined fields are the top level fields
+            bson_type bt = bson_find_from_buffer(&it, TCLISTVALPTR(res, i), fpath);
+            if (bt == BSON_ARRAY) {
+                BSON_ITERATOR_SUBITERATOR(&it, &sit);
+                while (bson_iterator_next(&sit) != BSON_EOO) {
+                    _qryjoinref(ctx, coll, &sit, refs);
+                }
+            } else {
+                _qryjoinref(ctx, coll, &it, refs);
+            }
+        }
     }
-    if (!midx && (!mqf || !(mqf->flags & EJFPKMATCHING))) { 
-        // Missing main index & no PK matching
-        goto fullscan;
+    int rnum = TCMAPRNUM(refs);
+    _JOINREF *rarr;
+    TCMALLOC(rarr, sizeof (*rarr) * (rnum + 1));
+    const char *rkbuf;
+    int rkbufsz;
+    tcmapiterinit(refs);
+    for (int i = 0; (rkbuf = tcmapiternext(refs, &rkbufsz)) != NULL; ++i) {
+        memcpy(rarr + i, tcmapiterval(rkbuf, &sp), sizeof (*rarr));
     }
-    if (log) {
-        tcxstrprintf(log, "MAIN IDX TCOP: %d\n", mqf->tcop);
+    qsort(rarr, rnum, sizeof (*rarr), _qryjoinrefcmp);
+    for (int i = 0; i < rnum; ++i) {
+        _qryjoinget(ctx, rarr[i].coll, &rarr[i].oid);
     }
+    TCFREE(rarr);
+    tcmapdel(refs);
+    return rnum;
+}
 
-#define JBQREGREC(_pkbuf, _pkbufsz, _bsbuf, _bsbufsz)   \
-    ++count; \
-    if (q->flags & EJQUPDATING) { \
-        _qryupdate(&ctx, (_bsbuf), (_bsbufsz)); \
-    } \
-    if (!(q->flags & EJQONLYCOUNT) && (all || count > skip)) { \
-        _pushprocessedbson(&ctx, (_bsbuf), (_bsbufsz)); \
-    }
-    // eof #define JBQREGREC
+static bson_visitor_cmd_t _bsondovisitor(const char *ipath, int ipathlen,
+                                         const char *key, int keylen,
+                                         const bson_iterator *it, 
+                                         bool after, void *op) {
 
-    bool trim = (midx && *midx->name != '\0');
-    if (anum > 0 && !(mqf->flags & EJFEXCLUDED) && !(mqf->uslots && TCLISTNUM(mqf->uslots) > 0)) {
-        anum--;
-        mqf->flags |= EJFEXCLUDED;
-    }
+    assert(op);
+    _BSONDOVISITORCTX *ictx = op;
+    EJCOLL *coll;
+    TCMAP *dfields = ictx->dfields;
+    bson_type lbt = BSON_ITERATOR_TYPE(it), bt;
+    bson_iterator doit, bufit, sit;
+    int sp;
+    const char *sval;
+    const EJQF *dofield;
+    bson_visitor_cmd_t rv = BSON_VCMD_SKIP_AFTER;
 
-    if (mqf->flags & EJFPKMATCHING) { // PK matching
-        if (log) {
-            tcxstrprintf(log, "PRIMARY KEY MATCHING: TRUE\n");
+    switch (lbt) {
+        case BSON_OBJECT: {
+            bson_append_field_from_iterator(it, ictx->sbson);
+            rv = (BSON_VCMD_SKIP_AFTER | BSON_VCMD_SKIP_NESTED);
+            break;
         }
-        assert(mqf->expr);
-        if (mqf->tcop == TDBQCSTREQ) {
-            do {
-                bson_oid_t oid;
-                bson_oid_from_string(&oid, mqf->expr);
+        case BSON_STRING:
+        case BSON_OID:
+        case BSON_ARRAY: {
+            dofield = tcmapget(dfields, ipath, ipathlen, &sp);
+            if (!dofield) {
+                if (lbt == BSON_ARRAY) {
+                    bson_append_field_from_iterator(it, ictx->sbson);
+                    rv = (BSON_VCMD_SKIP_AFTER | BSON_VCMD_SKIP_NESTED);
+                } else {
+                    bson_append_field_from_iterator(it, ictx->sbson);
+                }
+                break;
+            }
+            assert(dofield->updateobj && (dofield->flags & EJCONDOIT));
+            BSON_ITERATOR_INIT(&doit, dofield->updateobj);
+            while ((bt = bson_iterator_next(&doit)) != BSON_EOO) {
+				const char *dofname = BSON_ITERATOR_KEY(&doit);
+				
+				if (bt == BSON_STRING && !strcmp("$join", dofname)) {
+					coll = _getcoll(ictx->jb, bson_iterator_string(&doit));
+					if (!coll) break;
+					bson_oid_t loid;
+					if (lbt == BSON_STRING) {
+						sval = bson_iterator_string(it);
+						if (!ejdbisvalidoidstr(sval)) break;
+						bson_oid_from_string(&loid, sval);
+					} else if (lbt == BSON_OID) {
+						loid = *(bson_iterator_oid(it));
+					}
+					if (lbt == BSON_STRING || lbt == BSON_OID) {
+						const void *jbsdata = _qryjoinget(ictx->ctx, coll, &loid);
+						if (!jbsdata) {
+							break;
+						}
+						BSON_ITERATOR_FROM_BUFFER(&bufit, jbsdata);
+						bson_append_object_from_iterator(BSON_ITERATOR_KEY(it), &bufit, ictx->sbson);
+						break;
+					}
+					if (lbt == BSON_ARRAY) {
+						BSON_ITERATOR_SUBITERATOR(it, &sit);
+						bson_append_start_array(ictx->sbson, BSON_ITERATOR_KEY(it));
+						while ((bt = bson_iterator_next(&sit)) != BSON_EOO) {
+							if (bt != BSON_STRING && bt != BSON_OID) {
+								bson_append_field_from_iterator(&sit, ictx->sbson);
+								continue;
+							}
+							if (bt == BSON_STRING) {
+								sval = bson_iterator_string(&sit);
+								if (!ejdbisvalidoidstr(sval)) break;
+								bson_oid_from_string(&loid, sval);
+							} else if (bt == BSON_OID) {
+								loid = *(bson_iterator_oid(&sit));
+							}
+							const void *jbsdata = _qryjoinget(ictx->ctx, coll, &loid);
+							if (!jbsdata) {
+								bson_append_field_from_iterator(&sit, ictx->sbson);
+								continue;
+							}
+							BSON_ITERATOR_FROM_BUFFER(&bufit, jbsdata);
+							bson_append_object_from_iterator(BSON_ITERATOR_KEY(&sit), &bufit, ictx->sbson);
+						}
+						bson_append_finish_array(ictx->sbson);
+						rv = (BSON_VCMD_SKIP_AFTER | BSON_VCMD_SKIP_NESTED);
+					}
+					
+				} else if (lbt == BSON_ARRAY && 
+                           (bt == BSON_ARRAY || BSON_IS_NUM_TYPE(bt)) && 
+                           !strcmp("$slice", dofname)) {
+								
+					bson_append_start_array(ictx->sbson, BSON_ITERATOR_KEY(it));
+					int skip = 0, limit, idx = 0, i;
+					char nbuff[TCNUMBUFSIZ];
+					
+					if (bt == BSON_ARRAY) { // $slice : [skip, limit]
+						bson_type bt2;
+						bson_iterator sit2;
+						BSON_ITERATOR_SUBITERATOR(&doit, &sit2);
+						
+						bt2 = bson_find_fieldpath_value2("0", 1, &sit2);
+						if (!BSON_IS_NUM_TYPE(bt2)) {
+							bson_append_field_from_iterator(it, ictx->sbson);
+							break;
+						}
+						skip = bson_iterator_int(&sit2);
+						
+						bt2 = bson_find_fieldpath_value2("1", 1, &sit2);
+						if (!BSON_IS_NUM_TYPE(bt2)) {
+							bson_append_field_from_iterator(it, ictx->sbson);
+							break;
+						}
+						limit = abs(bson_iterator_int(&sit2));
+					} else { // $slice : limit
+						limit = abs(bson_iterator_int(&doit));
+					}
+					
+					if (skip < 0) {
+						int cnt = 0;
+						BSON_ITERATOR_SUBITERATOR(it, &sit);
+						while (bson_iterator_next(&sit) != BSON_EOO) ++cnt;
+						skip = cnt + skip % cnt;
+						if (skip == cnt) {
+							skip = 0;
+						}
+					}
+					
+					limit = (limit <= INT_MAX - skip) ? limit + skip : INT_MAX;
+					BSON_ITERATOR_SUBITERATOR(it, &sit);
+					for (i = 0; idx < limit && (bt = bson_iterator_next(&sit)) != BSON_EOO; ++idx) {
+						if (idx >= skip) {
+							bson_numstrn(nbuff, TCNUMBUFSIZ, i++);
+							bson_append_field_from_iterator2(nbuff, &sit, ictx->sbson);
+						}
+					}
+					bson_append_finish_array(ictx->sbson);
+					rv = (BSON_VCMD_SKIP_AFTER | BSON_VCMD_SKIP_NESTED);
+				}
+			}
+            break;
+        }
+        default:
+            bson_append_field_from_iterator(it, ictx->sbson);
+
+    }
+    return rv;
+}
+
+/**
+ * Compare records `i` and `j` of `topk` heap.
+ * Of records with equal keys the later inserted one is worse as in the stable full sort.
+ */
+static int _topkcmp(_QRYCTX *ctx, TCLISTDATUM *heap, int i, int j) {
+    int rv = _ejdbsoncmp(heap + i, heap + j, &ctx->sctx);
+    if (!rv) {
+        rv = (ctx->topkseq[i] > ctx->topkseq[j]) ? 1 : ((ctx->topkseq[i] < ctx->topkseq[j]) ? -1 : 0);
+    }
+    return rv;
+}
+
+/* Swap records `i` and `j` of `topk` heap along with their sequence numbers */
+static void _topkswap(_QRYCTX *ctx, TCLISTDATUM *heap, int i, int j) {
+    TCLISTDATUM tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+    uint64_t seq = ctx->topkseq[i];
+    ctx->topkseq[i] = ctx->topkseq[j];
+    ctx->topkseq[j] = seq;
+}
+
+/* Sift down the root of `topk` heap: the worst ordered record is kept at the root */
+static void _topksiftdown(_QRYCTX *ctx, TCLISTDATUM *heap, int num) {
+    int i = 0;
+    while (true) {
+        int l = 2 * i + 1, r = l + 1, w = i;
+        if (l < num && _topkcmp(ctx, heap, l, w) > 0) w = l;
+        if (r < num && _topkcmp(ctx, heap, r, w) > 0) w = r;
+        if (w == i) break;
+        _topkswap(ctx, heap, i, w);
+        i = w;
+    }
+}
+
+/* Push record into result set, `ptr` is taken by the list if `malloced` */
+static void _pushres(_QRYCTX *ctx, void *ptr, int size, bool malloced) {
+    TCLIST *res = ctx->res;
+    if (ctx->topk && TCLISTNUM(res) >= ctx->topk) { // Replace the worst record
+        TCLISTDATUM *heap = res->array + res->start;
+        TCFREE(heap[0].ptr);
+        if (malloced) {
+            heap[0].ptr = ptr;
+        } else {
+            TCMEMDUP(heap[0].ptr, ptr, size);
+        }
+        heap[0].size = size;
+        ctx->topkseq[0] = ctx->topkn++;
+        _topksiftdown(ctx, heap, TCLISTNUM(res));
+        return;
+    }
+    if (malloced) {
+        tclistpushmalloc(res, ptr, size);
+    } else {
+        TCLISTPUSH(res, ptr, size);
+    }
+    if (ctx->sortmem) {
+        ctx->rssize += size + sizeof(TCLISTDATUM);
+        if (ctx->rssize > ctx->sortmem) {
+            _sortspill(ctx);
+        }
+    }
+    if (ctx->topk) { // Sift up the new heap leaf
+        TCLISTDATUM *heap = res->array + res->start;
+        int num = TCLISTNUM(res);
+        if (num > ctx->topkseqsz) {
+            ctx->topkseqsz = tclmin(tclmax(ctx->topkseqsz * 2, TCLISTINYNUM), ctx->topk);
+            TCREALLOC(ctx->topkseq, ctx->topkseq, sizeof(*ctx->topkseq) * ctx->topkseqsz);
+        }
+        ctx->topkseq[num - 1] = ctx->topkn++;
+        for (int i = num - 1; i > 0; ) {
+            int p = (i - 1) / 2;
+            if (_topkcmp(ctx, heap, i, p) <= 0) break;
+            _topkswap(ctx, heap, i, p);
+            i = p;
+        }
+    }
+}
+
+static bool _pushprocessedbson(_QRYCTX *ctx, const void *bsbuf, int bsbufsz) {
+    assert(bsbuf && bsbufsz);
+    if (ctx->agg) { // Matched records are grouped instead of being returned
+        return _aggrec(ctx, bsbuf, bsbufsz);
+    }
+    if (ctx->topk && TCLISTNUM(ctx->res) >= ctx->topk) {
+        // Heap is full: reject records not better than the worst one before any processing
+        TCLISTDATUM d = {.ptr = (char*) bsbuf, .size = bsbufsz};
+        if (_ejdbsoncmp(&d, ctx->res->array + ctx->res->start, &ctx->sctx) >= 0) {
+            return true;
+        }
+    }
+    if (ctx->jdefer || (!ctx->dfields && !ctx->ifields && !ctx->q->ifields)) {
+        // Trivial case: no $do operations or $fields or they are applied to the final result set
+        _pushres(ctx, (void*) bsbuf, bsbufsz, false);
+        return true;
+    }
+    bool rv = true;
+    EJDB *jb = ctx->coll->jb;
+    EJQ *q = ctx->q;
+    TCMAP *ifields = ctx->ifields;
+    int sp;
+    char bstack[JBSBUFFERSZ];
+    bson bsout;
+    bson_init_on_stack(&bsout, bstack, bsbufsz, JBSBUFFERSZ);
+
+    if (ctx->dfields) { // $do fields exists
+        rv = _exec_do(ctx, bsbuf, &bsout);
+    }
+
+    if (rv && (ifields || q->ifields)) { // $fields hints
+    
+        TCMAP *_ifields = ifields;
+        TCMAP *_fkfields = NULL; // Fields with overriden keys
+        char* inbuf = (bsout.finished) ? bsout.data : (char*) bsbuf;
+        if (bsout.finished) {
+            bson_init_size(&bsout, bson_size(&bsout));
+        }
+        if (q->ifields) { // We have positional $(projection)
+            assert(ctx->imode == true); // Ensure we are in include mode
+            if (!_ifields) {
+                _ifields = tcmapnew2(q->ifields->bnum);
+            } else {
+                _ifields = tcmapdup(ifields);
+            }
+            _fkfields = tcmapnew2(TCMAPTINYBNUM);
+            for (int i = 0; i < TCLISTNUM(q->qflist); ++i) {
+                EJQF *qf = TCLISTVALPTR(q->qflist, i);
+                const char *dfpath = tcmapget(q->ifields, qf->fpath, qf->fpathsz, &sp);
+                if (dfpath) {
+                    TCXSTR *ifield = tcxstrnew3(sp + 10);
+                    bson_iterator it;
+                    BSON_ITERATOR_FROM_BUFFER(&it, inbuf);
+                    FFPCTX ctx = {
+                        .fpath = qf->fpath,
+                        .fplen = qf->fpathsz,
+                        .input = &it,
+                        .stopnestedarr = true,
+                        .stopos = 0,
+                        .mpos = -1,
+                        .dpos = -1
+                    };
+                    const char *dpos = strchr(dfpath, '$');
+                    assert(dpos);
+                    ctx.dpos = (dpos - dfpath) - 1;
+                    qf->mflags = (qf->flags & ~EJFEXCLUDED);
+                    if (!_qrybsrecurrmatch(qf, &ctx, 0)) {
+                        assert(false); // Something went wrong, it should never be happen
+                    } else if (ctx.mpos >= 0) {
+                        tcxstrcat(ifield, dfpath, (dpos - dfpath));
+                        tcxstrprintf(ifield, "%d", ctx.mpos);
+                        tcmapput(_fkfields, TCXSTRPTR(ifield), TCXSTRSIZE(ifield), "0", strlen("0"));
+                        tcxstrcat(ifield, dpos + 1, sp - (dpos - dfpath) - 1);
+                        tcmapput(_ifields, TCXSTRPTR(ifield), TCXSTRSIZE(ifield), &yes, sizeof (yes));
+                    } else {
+                        assert(false); // Something went wrong, it should never be happen
+                    }
+                    tcxstrdel(ifield);
+                }
+            }
+        }
+        
+        BSONSTRIPCTX sctx = {
+            .ifields = _ifields,
+            .fkfields = _fkfields,
+            .imode = ctx->imode,
+            .bsbuf = inbuf,
+            .bsout = &bsout,
+            .matched = 0
+        };
+        
+        if (bson_strip2(&sctx) != BSON_OK) {
+            _ejdbsetecode(jb, JBEINVALIDBSON, __FILE__, __LINE__, __func__);
+        }
+        if (inbuf != bsbuf && inbuf != bstack) {
+            TCFREE(inbuf);
+        }
+        if (_ifields != ifields) {
+            tcmapdel(_ifields);
+        }
+        if (_fkfields) {
+            tcmapdel(_fkfields);
+        }
+    }
+
+    if (rv) {
+        assert(bsout.finished);
+        if (bsout.flags & BSON_FLAG_STACK_ALLOCATED) {
+            _pushres(ctx, bsout.data, bson_size(&bsout), false);
+        } else {
+            _pushres(ctx, bsout.data, bson_size(&bsout), true);
+        }
+    } else {
+        bson_destroy(&bsout);
+    }
+    return rv;
+}
+
+static bool _exec_do(_QRYCTX *ctx, const void *bsbuf, bson *bsout) {
+    assert(ctx && ctx->dfields);
+    
+    _BSONDOVISITORCTX ictx = {
+        .ctx = ctx,
+        .jb = ctx->coll->jb,
+        .dfields = ctx->dfields,
+        .sbson = bsout
+    };
+    
+    bson_iterator it;
+    BSON_ITERATOR_FROM_BUFFER(&it, bsbuf);
+    bson_visit_fields(&it, 0, _bsondovisitor, &ictx);
+    if (bson_finish(bsout) != BSON_OK) {
+        _ejdbsetecode(ctx->coll->jb, JBEINVALIDBSON, __FILE__, __LINE__, __func__);
+        return false;
+    }
+    return true;
+}
+
+// Create update BSON object for $set/$unset/$inc operations
+static bson* _qfgetupdateobj(const EJQF *qf) {
+    assert(qf->updateobj);
+    if (!qf->ufields || TCLISTNUM(qf->ufields) < 1) { // We do not ref $(query) fields.
+        return qf->updateobj;
+    }
+    const EJQ *q = qf->q;
+    char pbuf[BSON_MAX_FPATH_LEN + 1];
+    int ppos = 0;
+    bson_iterator it;
+    bson_type bt;
+    bson *ret =  bson_create();
+    bson_init(ret);
+    for (int i = 0; i < TCLISTNUM(qf->ufields); ++i) {
+        const char *uf = TCLISTVALPTR(qf->ufields, i);
+        for (int j = 0; *(q->allqfields + j) != '\0'; ++j) {
+            const EJQF *kqf = *(q->allqfields + j);
+            if (kqf == qf || kqf->uslots == NULL || TCLISTNUM(kqf->uslots) < 1) {
+                continue;
+            }
+            for (int k = 0; k < TCLISTNUM(kqf->uslots); ++k) {
+                USLOT *uslot = TCLISTVALPTR(kqf->uslots, k);
+                if (uslot->op == uf && uslot->mpos >= 0) {
+                    char *dp = strchr(uf, '$');
+                    assert(dp);
+                    ppos = (dp - uf);
+                    assert(ppos == uslot->dpos + 1);
+                    if (ppos < 1 || ppos >= BSON_MAX_FPATH_LEN - 1) {
+                        break;
+                    }
+                    memcpy(pbuf, uf, ppos);
+                    int wl = bson_numstrn(pbuf + ppos, (BSON_MAX_FPATH_LEN - ppos), uslot->mpos);
+                    if (wl >= BSON_MAX_FPATH_LEN - ppos) { // Output is truncated
+                        break;
+                    }
+                    ppos += wl;
+                    // Copy suffix
+                    for (int fpos = (dp - uf) + 1; ppos < BSON_MAX_FPATH_LEN && *(uf + fpos) != '\0';) {
+                        pbuf[ppos++] = *(uf + fpos++);
+                    }
+                    assert(ppos <= BSON_MAX_FPATH_LEN);
+                    pbuf[ppos] = '\0';
+
+                    bt = bson_find(&it, qf->updateobj, uf);
+                    if (bt == BSON_EOO) {
+                        assert(false);
+                        break;
+                    }
+                    bson_append_field_from_iterator2(pbuf, &it, ret);
+                    break;
+                }
+            }
+        }
+    }
+    BSON_ITERATOR_INIT(&it, qf->updateobj);
+    while ((bt = bson_iterator_next(&it)) != BSON_EOO) {
+        const char *key = bson_iterator_key(&it);
+        if (strchr(key, '$') == NULL) {
+            bson_append_field_from_iterator2(key, &it, ret);
+        }
+    }
+    bson_finish(ret);
+    return ret;
+}
+
+/* Returns true if the value of field `fpath` is a part of keys of some index of `coll` */
+static bool _fpathindexed(EJCOLL *coll, const char *fpath, int fpathsz) {
+    const char *ipaths[JBCIDXMAXFIELDS];
+    int ipathszs[JBCIDXMAXFIELDS], dirs[JBCIDXMAXFIELDS];
+    for (int i = 0; i < coll->tdb->inum; ++i) {
+        const char *iname = coll->tdb->idxs[i].name;
+        int inum = 1;
+        if (*iname == 'c') { // Compound index
+            inum = _cidxspecparse(iname + 1, strlen(iname + 1), ipaths, ipathszs, dirs);
+        } else {
+            ipaths[0] = iname + 1;
+            ipathszs[0] = strlen(iname + 1);
+        }
+        for (int j = 0; j < inum; ++j) { // Index of the field itself or of its parent object or array
+            if (ipathszs[j] <= fpathsz && !memcmp(ipaths[j], fpath, ipathszs[j]) &&
+                    (ipathszs[j] == fpathsz || fpath[ipathszs[j]] == '.')) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Returns the offset of BSON data in the stored row of a record with `bsdatasz` sized BSON.
+ * Rows are serialized maps with JDBCOLBSON as the first column, see `tcmapdump()`.
+ */
+static int _rowbsonoff(int bsdatasz) {
+    char nbuf[TCNUMBUFSIZ];
+    int ksz, vsz;
+    TCSETVNUMBUF(ksz, nbuf, JDBCOLBSONL);
+    TCSETVNUMBUF(vsz, nbuf, bsdatasz);
+    return ksz + JDBCOLBSONL + vsz;
+}
+
+/**
+ * Apply `$set` and `$inc` of fixed size values (int, long, double, bool) in place:
+ * only the changed bytes of the stored record are overwritten and
+ * indexes are updated only if some of the changed fields is indexed.
+ * Returns -1 if the update is not applicable in place, 0 on error, 1 if the record is updated.
+ */
+static int _qryupdateinplace(_QRYCTX *ctx, const EJQF *setqf, const EJQF *incqf, const void *bsbuf, int bsbufsz) {
+    EJCOLL *coll = ctx->coll;
+    if (coll->tdb->hdb->zmode) { // Compressed records can not be patched
+        return -1;
+    }
+    bson_iterator it, it2;
+    bson_type bt, bt2;
+    if (bson_find_from_buffer(&it, bsbuf, JDBIDKEYNAME) != BSON_OID) {
+        return -1;
+    }
+    bson_oid_t *oid = bson_iterator_oid(&it);
+    int rv = 1;
+    int poff = bsbufsz, pend = 0; // Patched region of BSON data
+    bool indexed = false;
+    char *nbuf;
+    TCMEMDUP(nbuf, bsbuf, bsbufsz);
+    const EJQF *qfs[2] = {setqf, incqf};
+    for (int i = 0; rv > 0 && i < 2; ++i) {
+        if (!qfs[i]) {
+            continue;
+        }
+        bson *updobj = _qfgetupdateobj(qfs[i]);
+        BSON_ITERATOR_INIT(&it, updobj);
+        while ((bt = bson_iterator_next(&it)) != BSON_EOO) {
+            const char *fpath = BSON_ITERATOR_KEY(&it);
+            BSON_ITERATOR_FROM_BUFFER(&it2, nbuf);
+            bt2 = bson_find_fieldpath_value(fpath, &it2);
+            if (qfs[i] == setqf) { // $set of the value of the same type
+                if (bt != bt2 || !(BSON_IS_NUM_TYPE(bt) || bt == BSON_BOOL)) {
+                    rv = -1;
+                    break;
+                }
+            } else { // $inc
+                if (!BSON_IS_NUM_TYPE(bt)) {
+                    continue;
+                }
+                if (bt2 == BSON_EOO) { // Missing field will be added
+                    rv = -1;
+                    break;
+                }
+                if (!BSON_IS_NUM_TYPE(bt2)) {
+                    continue;
+                }
+            }
+            char *vp = (char*) bson_iterator_value(&it2);
+            int vsz = (bt2 == BSON_BOOL) ? 1 : (bt2 == BSON_INT) ? 4 : 8;
+            if (qfs[i] == setqf) {
+                memcpy(vp, bson_iterator_value(&it), vsz);
+            } else {
+                int err;
+                if (bt2 == BSON_DOUBLE) {
+                    double v = bson_iterator_double(&it2);
+                    v += (bt == BSON_DOUBLE) ? bson_iterator_double(&it) : bson_iterator_long(&it);
+                    err = bson_inplace_set_double(&it2, v);
+                } else {
+                    err = bson_inplace_set_long(&it2, bson_iterator_long(&it2) + bson_iterator_long(&it));
+                }
+                if (err) {
+                    _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
+                    rv = 0;
+                    break;
+                }
+            }
+            poff = MIN(poff, (int) (vp - nbuf));
+            pend = MAX(pend, (int) (vp - nbuf) + vsz);
+            if (!indexed) {
+                indexed = _fpathindexed(coll, fpath, strlen(fpath));
+            }
+        }
+        if (updobj != qfs[i]->updateobj) {
+            bson_del(updobj);
+        }
+    }
+    if (rv > 0 && poff < pend && memcmp(nbuf + poff, (const char*) bsbuf + poff, pend - poff)) {
+        if (!tchdbputpart(coll->tdb->hdb, oid, sizeof (*oid), _rowbsonoff(bsbufsz) + poff, nbuf + poff, pend - poff)) {
+            rv = 0;
+        } else if (indexed) {
+            bson bsnew;
+            bson_init_with_data(&bsnew, nbuf);
+            if (!_updatebsonidx(coll, oid, &bsnew, bsbuf, bsbufsz, ctx->didxctx)) {
+                rv = 0;
+            }
+        }
+    }
+    TCFREE(nbuf);
+    return rv;
+}
+
+static bool _qryupdate(_QRYCTX *ctx, const void *bsbuf, int bsbufsz) {
+    assert(ctx && ctx->q && (ctx->q->flags & EJQUPDATING) && bsbuf && ctx->didxctx);
+
+    bool rv = true;
+    int update = 0;
+    EJCOLL *coll = ctx->coll;
+    EJQ *q = ctx->q;
+    bson_oid_t *oid;
+    bson_type bt, bt2;
+    bson_iterator it, it2;
+    TCMAP *rowm = NULL;
+
+    if (q->flags & EJQDROPALL) { // Records will be dropped
+        bt = bson_find_from_buffer(&it, bsbuf, JDBIDKEYNAME);
+        if (bt != BSON_OID) {
+            _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
+            return false;
+        }
+        oid = bson_iterator_oid(&it);
+        assert(oid);
+        if (ctx->log) {
+            char xoid[25];
+            bson_oid_to_string(oid, xoid);
+            tcxstrprintf(ctx->log, "$DROPALL ON: %s\n", xoid);
+        }
+        const void *olddata;
+        int olddatasz = 0;
+        TCMAP *rmap = tctdbget(coll->tdb, oid, sizeof (*oid));
+        if (rmap) {
+            olddata = tcmapget3(rmap, JDBCOLBSON, JDBCOLBSONL, &olddatasz);
+            if (!_updatebsonidx(coll, oid, NULL, olddata, olddatasz, ctx->didxctx) ||
+                    !tctdbout(coll->tdb, oid, sizeof (*oid))) {
+                rv = false;
+            }
+            tcmapdel(rmap);
+        }
+        return rv;
+    }
+    
+    //Apply update operation
+    bson bsout;
+    bson_init_size(&bsout, 0);
+
+    const EJQF *setqf = NULL;                   // $set 
+    const EJQF *unsetqf = NULL;                 // $unset
+    const EJQF *incqf = NULL;                   // $inc
+	const EJQF *renameqf = NULL;                // $rename
+    const EJQF *addsetqf[2] = {NULL};           // $addToSet, $addToSetAll
+    const EJQF *pushqf[2] = {NULL};             // $push, $pushAll
+    const EJQF *pullqf[2] = {NULL};             // $pull, $pullAll
+
+    for (int i = 0; i < TCLISTNUM(q->qflist); ++i) {
+        
+        const EJQF *qf = TCLISTVALPTR(q->qflist, i);
+        const uint32_t flags = qf->flags;
+        
+        if (qf->updateobj == NULL) {
+            continue;
+        } 
+        if (flags & EJCONDSET) {                // $set
+            setqf = qf;
+        } else if (flags & EJCONDUNSET) {       // $unset
+            unsetqf = qf;
+        } else if (flags & EJCONDINC) {         // $inc
+            incqf = qf;
+        } else if (flags & EJCONDRENAME) {      // $rename
+			renameqf = qf;
+		} else if (flags & EJCONDADDSET) {      // $addToSet, $addToSetAll
+            if (flags & EJCONDALL) {
+                addsetqf[1] = qf;
+            } else {
+                addsetqf[0] = qf;
+            }
+        } else if (flags & EJCONDPUSH) {        // $push, $pushAll
+            if (flags & EJCONDALL) {
+                pushqf[1] = qf;
+            } else {
+                pushqf[0] = qf;
+            }
+        } else if (flags & EJCONDPULL) {        // $pull, $pullAll
+            if (flags & EJCONDALL) {
+                pullqf[1] = qf;
+            } else {
+                pullqf[0] = qf;
+            }
+        }
+    }
+    if ((setqf || incqf) && !renameqf && !unsetqf && !addsetqf[0] && !addsetqf[1] &&
+            !pushqf[0] && !pushqf[1] && !pullqf[0] && !pullqf[1]) {
+        int ipres = _qryupdateinplace(ctx, setqf, incqf, bsbuf, bsbufsz);
+        if (ipres >= 0) {
+            bson_destroy(&bsout);
+            return (ipres > 0);
+        }
+    }
+
+    
+	if (renameqf) {
+        const char *inbuf = (bsout.finished) ? bsout.data : bsbuf;
+        if (bsout.finished) {
+            // Reinit `bsout`, `inbuf` already points to `bsout.data` and will be freed later
+            bson_init_size(&bsout, bson_size(&bsout));
+        } else {
+            assert(bsout.data == NULL);
+            bson_init_size(&bsout, bsbufsz);
+        }
+		bson *updobj = _qfgetupdateobj(renameqf);
+        TCMAP *rfields = tcmapnew2(TCMAPTINYBNUM);
+        BSON_ITERATOR_INIT(&it, updobj);
+        while ((bt = bson_iterator_next(&it)) != BSON_EOO) {
+            if (bt != BSON_STRING) {
+                continue;
+            }
+            const char *nfpath = bson_iterator_string(&it);
+            int nlen = bson_iterator_string_len(&it);
+            if (nlen == 0) {
+                continue;
+            }
+            tcmapputkeep(rfields, 
+                         BSON_ITERATOR_KEY(&it), strlen(BSON_ITERATOR_KEY(&it)), 
+                         nfpath, nlen);
+        }
+        int rencnt;
+        if (bson_rename(rfields, inbuf, &bsout, &rencnt) != BSON_OK) {
+            rv = false;
+            _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);    
+        }
+        if (rencnt > 0) {
+            update++;
+        }
+        tcmapdel(rfields);
+        bson_finish(&bsout);
+        if (inbuf != bsbuf) {
+            TCFREE((char*) inbuf);
+        }
+        if (updobj != renameqf->updateobj) {
+            bson_del(updobj);
+        }
+        if (!rv) {
+            goto finish;
+        }
+	}
+    
+    if (unsetqf) { //$unset
+        const char *inbuf = (bsout.finished) ? bsout.data : bsbuf;
+        if (bsout.finished) {
+            bson_init_size(&bsout, bson_size(&bsout));
+        } else {
+            assert(bsout.data == NULL);
+            bson_init_size(&bsout, bsbufsz);
+        }
+        int matched;
+        bson *updobj = _qfgetupdateobj(unsetqf);
+        TCMAP *ifields = tcmapnew2(TCMAPTINYBNUM);
+        BSON_ITERATOR_INIT(&it, updobj);
+        while ((bt = bson_iterator_next(&it)) != BSON_EOO) {
+            const char *fpath = BSON_ITERATOR_KEY(&it);
+            tcmapput(ifields, fpath, strlen(fpath), &yes, sizeof(yes));
+        }
+        if (bson_strip(ifields, false, inbuf, &bsout, &matched) != BSON_OK) {
+            rv = false;
+            _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
+        }
+        if (matched > 0) {
+            update++;
+        }
+        tcmapdel(ifields);
+        bson_finish(&bsout);
+        if (inbuf != bsbuf) {
+            TCFREE((char*) inbuf);
+        }
+        if (updobj != unsetqf->updateobj) {
+            bson_del(updobj);
+        }
+        if (!rv) {
+            goto finish;
+        }
+    }
+
+    if (setqf) { //$set
+        update++;
+        bson *updobj = _qfgetupdateobj(setqf);
+        const char *inbuf = (bsout.finished) ? bsout.data : bsbuf;
+        if (bsout.finished) {
+            bson_init_size(&bsout, bson_size(&bsout));
+        } else {
+            assert(bsout.data == NULL);
+            bson_init_size(&bsout, bsbufsz);
+        }
+        int err = bson_merge_fieldpaths(inbuf, bson_data(updobj), &bsout);
+        if (err) {
+            rv = false;
+            _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
+        }
+        bson_finish(&bsout);
+        if (inbuf != bsbuf) {
+            TCFREE((char*) inbuf);
+        }
+        if (updobj != setqf->updateobj) {
+            bson_del(updobj);
+        }
+        if (bson_check_duplicate_keys(&bsout)) {
+            bson bstmp;
+            bson_copy(&bstmp, &bsout);
+            bson_destroy(&bsout);
+            bson_init(&bsout);
+            bson_fix_duplicate_keys(&bstmp, &bsout);
+            bson_finish(&bsout);
+            bson_destroy(&bstmp);
+        }
+        if (!rv) {
+            goto finish;
+        }
+    }
+
+    if (incqf) { // $inc
+        bson bsmerge; // holds missing $inc fieldpaths in object
+        bson_init_size(&bsmerge, 0);
+        bson *updobj = _qfgetupdateobj(incqf);
+        if (!bsout.data) {
+            bson_create_from_buffer2(&bsout, bsbuf, bsbufsz);
+        }
+        BSON_ITERATOR_INIT(&it, updobj);
+        while ((bt = bson_iterator_next(&it)) != BSON_EOO) {
+            if (!BSON_IS_NUM_TYPE(bt)) {
+                continue;
+            }
+            BSON_ITERATOR_INIT(&it2, &bsout);
+            bt2 = bson_find_fieldpath_value(BSON_ITERATOR_KEY(&it), &it2);
+            if (bt2 == BSON_EOO) { // found a missing field
+                if (!bsmerge.data) {
+                    bson_init_size(&bsmerge, bson_size(updobj));
+                }
+                if (bt == BSON_DOUBLE) {
+                    bson_append_double(&bsmerge, BSON_ITERATOR_KEY(&it), bson_iterator_double(&it));
+                } else {
+                    bson_append_long(&bsmerge, BSON_ITERATOR_KEY(&it), bson_iterator_long(&it));
+                }
+            }
+            if (!BSON_IS_NUM_TYPE(bt2)) {
+                continue;
+            }
+            if (bt2 == BSON_DOUBLE) {
+                double v = bson_iterator_double(&it2);
+                if (bt == BSON_DOUBLE) {
+                    v += bson_iterator_double(&it);
+                } else {
+                    v += bson_iterator_long(&it);
+                }
+                if (bson_inplace_set_double(&it2, v)) {
+                    rv = false;
+                    _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
+                    break;
+                }
+                update++;
+            } else {
+                int64_t v = bson_iterator_long(&it2);
+                v += bson_iterator_long(&it);
+                if (bson_inplace_set_long(&it2, v)) {
+                    rv = false;
+                    _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
+                    break;
+                }
+                update++;
+            }
+        }
+        
+        if (rv && 
+            bsmerge.data && 
+            bson_finish(&bsmerge) == BSON_OK) {
+            
+            bson_finish(&bsout);
+            char *inbuf = bsout.data;
+            bson_init_size(&bsout, bson_size(&bsout));
+            if (bson_merge_fieldpaths(inbuf, bsmerge.data, &bsout) != BSON_OK) {
+                rv = false;
+                 _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
+            } else {
+                update++;
+            }
+            if (inbuf != bsbuf) {
+                TCFREE(inbuf);
+            }
+        }
+        
+        bson_finish(&bsout);
+        bson_destroy(&bsmerge);
+        if (updobj != incqf->updateobj) {
+            bson_del(updobj);
+        }
+        if (bson_check_duplicate_keys(&bsout)) {
+            bson bstmp;
+            bson_copy(&bstmp, &bsout);
+            bson_destroy(&bsout);
+            bson_init(&bsout);
+            bson_fix_duplicate_keys(&bstmp, &bsout);
+            bson_finish(&bsout);
+            bson_destroy(&bstmp);
+        }
+        if (!rv) {
+            goto finish;
+        }
+    }
+
+    for (int i = 0; i < 2; ++i) { // $pull $pullAll
+        const EJQF *qf = pullqf[i];
+        if (!qf) continue;
+        const char *inbuf = (bsout.finished) ? bsout.data : bsbuf;
+        if (bson_find_merged_arrays(bson_data(qf->updateobj), inbuf, (qf->flags & EJCONDALL))) {
+            if (bsout.finished) {
+                bson_init_size(&bsout, bson_size(&bsout));
+            } else {
+                assert(bsout.data == NULL);
+                bson_init_size(&bsout, bsbufsz);
+            }
+            // $pull $pullAll merge
+            if (bson_merge_arrays(bson_data(qf->updateobj), inbuf, 
+                                  BSON_MERGE_ARRAY_PULL, (qf->flags & EJCONDALL), &bsout)) {
+                rv = false;
+                _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
+            }
+            if (inbuf != bsbuf) {
+                TCFREE((char*) inbuf);
+            }
+            bson_finish(&bsout);
+            update++;
+        }
+        if (!rv) {
+            goto finish;
+        }
+    }
+    
+    for (int i = 0; i < 2; ++i) { // $push $pushAll
+        const EJQF *qf = pushqf[i];
+        if (!qf) continue;
+        const char *inbuf = (bsout.finished) ? bsout.data : bsbuf;
+        if (bsout.finished) {
+            bson_init_size(&bsout, bson_size(&bsout));
+        } else {
+            assert(bsout.data == NULL);
+            bson_init_size(&bsout, bsbufsz);
+        }
+        // $push $pushAll merge
+        if (bson_merge_arrays(bson_data(qf->updateobj), inbuf, 
+                              BSON_MERGE_ARRAY_PUSH, (qf->flags & EJCONDALL), &bsout)) {
+            rv = false;
+            _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
+        }
+        if (inbuf != bsbuf) {
+            TCFREE((char*) inbuf);
+        }
+        bson_finish(&bsout);
+        update++;
+    }
+
+    for (int i = 0; i < 2; ++i) { // $addToSet $addToSetAll
+        const EJQF *qf = addsetqf[i];
+        if (!qf) continue;
+        const char *inbuf = (bsout.finished) ? bsout.data : bsbuf;
+        if ((qf->flags & EJCONDALL) || bson_find_unmerged_arrays(bson_data(qf->updateobj), inbuf)) {
+            // Missing $addToSet element in some array field found
+            if (bsout.finished) {
+                bson_init_size(&bsout, bson_size(&bsout));
+            } else {
+                assert(bsout.data == NULL);
+                bson_init_size(&bsout, bsbufsz);
+            }
+            // $addToSet $addToSetAll merge
+            if (bson_merge_arrays(bson_data(qf->updateobj), inbuf, 
+                                  BSON_MERGE_ARRAY_ADDSET, (qf->flags & EJCONDALL), &bsout)) {
+                rv = false;
+                _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
+            }
+            if (inbuf != bsbuf) {
+                TCFREE((char*) inbuf);
+            }
+            bson_finish(&bsout);
+            update++;
+        }
+        if (!rv) {
+            goto finish;
+        }
+    }
+    
+    // Finishing document update
+    if (!update || !rv) {
+        goto finish;
+    }
+    if (bsout.err) { // Resulting BSON is OK?
+        rv = false;
+        _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
+        goto finish;
+    }
+    if (bson_size(&bsout) == 0) { // Record was not updated
+        goto finish;
+    }
+    // Perform updating
+    bt = bson_find_from_buffer(&it, bsbuf, JDBIDKEYNAME);
+    if (bt != BSON_OID) {
+        rv = false;
+        _ejdbsetecode(coll->jb, JBEQUPDFAILED, __FILE__, __LINE__, __func__);
+        goto finish;
+    }
+    oid = bson_iterator_oid(&it);
+    rowm = tcmapnew2(TCMAPTINYBNUM);
+    tcmapput(rowm, JDBCOLBSON, JDBCOLBSONL, bson_data(&bsout), bson_size(&bsout));
+    rv = tctdbput(coll->tdb, oid, sizeof (*oid), rowm);
+    if (rv) {
+        rv = _updatebsonidx(coll, oid, &bsout, bsbuf, bsbufsz, ctx->didxctx);
+    }
+
+finish:
+    bson_destroy(&bsout);
+    if (rowm) {
+        tcmapdel(rowm);
+    }
+    return rv;
+}
+
+/* Match records of the full scan batch */
+static void _pscanmatch(_PSCANBATCH *b) {
+    EJQ *q = b->q;
+    for (int i = 0; i + 1 < TCLISTNUM(b->recs); i += 2) {
+        const char *pkbuf, *cbuf;
+        int pkbufsz, cbufsz;
+        TCLISTVAL(pkbuf, b->recs, i, pkbufsz);
+        TCLISTVAL(cbuf, b->recs, i + 1, cbufsz);
+        tcxstrclear(q->bsbuf);
+        if (tcmaploadoneintoxstr(cbuf, cbufsz, JDBCOLBSON, JDBCOLBSONL, q->bsbuf) <= 0) {
+            continue;
+        }
+        bool matched = _qryqfsmatch(q, b->qfs, b->qfsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+        if (matched && _qry_and_or_match(b->coll, q, pkbuf, pkbufsz)) {
+            TCLISTPUSH(b->matched, pkbuf, pkbufsz);
+            if (q->flags & EJQONLYCOUNT) {
+                TCLISTPUSH(b->matched, "", 0);
+            } else {
+                TCLISTPUSH(b->matched, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+            }
+        }
+    }
+}
+
+/* Worker thread: takes batches of the running round until the scan is disposed */
+static void* _pscanworker(void *op) {
+    _PSCAN *ps = op;
+    pthread_mutex_lock(&ps->mtx);
+    while (true) {
+        while (!ps->stop && ps->claimed >= ps->nthreads) {
+            pthread_cond_wait(&ps->wcond, &ps->mtx);
+        }
+        if (ps->stop) {
+            break;
+        }
+        _PSCANBATCH *b = ps->batches + ps->running * ps->nthreads + ps->claimed++;
+        pthread_mutex_unlock(&ps->mtx);
+        _pscanmatch(b);
+        pthread_mutex_lock(&ps->mtx);
+        if (--ps->pending == 0) {
+            pthread_cond_signal(&ps->dcond);
+        }
+    }
+    pthread_mutex_unlock(&ps->mtx);
+    return NULL;
+}
+
+/**
+ * Create parallel full scan over records of `iter`.
+ * Every batch gets its own copy of the preprocessed query, so workers
+ * do not share matching state. Worker threads are started once and wait
+ * for rounds of batches. Returns NULL if the query cannot be copied.
+ */
+static _PSCAN* _pscannew(_QRYCTX *ctx, TCHDBITER *iter) {
+    _PSCAN *ps;
+    TCCALLOC(ps, 1, sizeof (*ps));
+    ps->hdb = ctx->coll->tdb->hdb;
+    ps->iter = iter;
+    ps->nthreads = ctx->scanthreads;
+    ps->running = ps->done = -1;
+    ps->claimed = ps->nthreads;
+    ps->kbuf = tcxstrnew3(sizeof (bson_oid_t) + 1);
+    ps->vbuf = tcxstrnew3(1024);
+    pthread_mutex_init(&ps->mtx, NULL);
+    pthread_cond_init(&ps->wcond, NULL);
+    pthread_cond_init(&ps->dcond, NULL);
+    TCCALLOC(ps->batches, 2 * ps->nthreads, sizeof (_PSCANBATCH));
+    for (int i = 0; i < 2 * ps->nthreads; ++i) {
+        _PSCANBATCH *b = ps->batches + i;
+        b->coll = ctx->coll;
+        b->recs = tclistnew2(2 * JBPSCANBATCH);
+        b->matched = tclistnew2(TCLISTINYNUM);
+        TCMALLOC(b->q, sizeof (*b->q));
+        if (!_qrydup(ctx->q, b->q, EJQINTERNAL)) {
+            TCFREE(b->q);
+            b->q = NULL;
+            _pscandel(ps);
+            return NULL;
+        }
+        b->q->colbuf = tcxstrnew3(1024);
+        b->q->bsbuf = tcxstrnew3(1024);
+        b->q->tmpbuf = tcxstrnew();
+        b->qfsz = TCLISTNUM(b->q->qflist);
+        if (b->qfsz > 0) {
+            TCMALLOC(b->qfs, b->qfsz * sizeof (EJQF*));
+        }
+        for (int j = 0; j < b->qfsz; ++j) {
+            b->qfs[j] = TCLISTVALPTR(b->q->qflist, j);
+            b->qfs[j]->jb = ctx->coll->jb;
+        }
+    }
+    TCMALLOC(ps->workers, ps->nthreads * sizeof (pthread_t));
+    while (ps->nworkers < ps->nthreads &&
+            pthread_create(ps->workers + ps->nworkers, NULL, _pscanworker, ps) == 0) {
+        ps->nworkers++;
+    }
+    return ps;
+}
+
+/* Read the next records into batches of the `round` */
+static void _pscanread(_PSCAN *ps, int round) {
+    TCXSTR *kbuf = ps->kbuf, *vbuf = ps->vbuf;
+    ps->nread[round] = 0;
+    for (int i = 0; i < ps->nthreads; ++i) {
+        _PSCANBATCH *b = ps->batches + round * ps->nthreads + i;
+        tclistclear(b->recs);
+        tclistclear(b->matched);
+        for (int j = 0; !ps->eof && j < JBPSCANBATCH; ++j) {
+            tcxstrclear(kbuf);
+            tcxstrclear(vbuf);
+            if (!tchdbiter2next(ps->hdb, ps->iter, kbuf, vbuf)) {
+                ps->eof = true;
+                break;
+            }
+            TCLISTPUSH(b->recs, TCXSTRPTR(kbuf), TCXSTRSIZE(kbuf));
+            TCLISTPUSH(b->recs, TCXSTRPTR(vbuf), TCXSTRSIZE(vbuf));
+            ps->nread[round]++;
+            ps->nrecs++;
+            ps->nbytes += TCXSTRSIZE(vbuf);
+        }
+    }
+}
+
+/* Hand batches of the `round` over to workers, they are matched in the caller thread if there are no workers */
+static void _pscanstart(_PSCAN *ps, int round) {
+    ps->running = round;
+    if (ps->nworkers < 1) {
+        for (int i = 0; i < ps->nthreads; ++i) {
+            _pscanmatch(ps->batches + round * ps->nthreads + i);
+        }
+        return;
+    }
+    pthread_mutex_lock(&ps->mtx);
+    ps->claimed = 0;
+    ps->pending = ps->nthreads;
+    pthread_cond_broadcast(&ps->wcond);
+    pthread_mutex_unlock(&ps->mtx);
+}
+
+/* Wait for workers of the running round */
+static void _pscanjoin(_PSCAN *ps) {
+    pthread_mutex_lock(&ps->mtx);
+    while (ps->pending > 0) {
+        pthread_cond_wait(&ps->dcond, &ps->mtx);
+    }
+    pthread_mutex_unlock(&ps->mtx);
+    ps->running = -1;
+}
+
+/**
+ * Move to the next batch of matched records.
+ * Records are read by the caller thread and matched by worker threads,
+ * while workers match one round of batches the next round is read ahead.
+ * Batches are returned in the scan order, so results are the same
+ * as of sequential full scan. Returns false if there are no more records.
+ */
+static bool _pscannext(_PSCAN *ps) {
+    while (true) {
+        if (ps->done >= 0 && ps->next < ps->nthreads) {
+            ps->matched = ps->batches[ps->done * ps->nthreads + ps->next++].matched;
+            return true;
+        }
+        int round = (ps->done >= 0) ? ps->done : 0; // Round free for reading
+        if (ps->running < 0) {
+            if (ps->eof) {
+                ps->matched = NULL;
+                return false;
+            }
+            _pscanread(ps, round);
+            _pscanstart(ps, round);
+            round ^= 1;
+        }
+        if (!ps->eof) {
+            _pscanread(ps, round);
+        } else {
+            ps->nread[round] = 0;
+        }
+        ps->done = ps->running;
+        ps->next = 0;
+        _pscanjoin(ps);
+        if (ps->nread[round] > 0) {
+            _pscanstart(ps, round);
+        }
+    }
+}
+
+static void _pscandel(_PSCAN *ps) {
+    if (ps->running >= 0) {
+        _pscanjoin(ps);
+    }
+    pthread_mutex_lock(&ps->mtx);
+    ps->stop = true;
+    pthread_cond_broadcast(&ps->wcond);
+    pthread_mutex_unlock(&ps->mtx);
+    for (int i = 0; i < ps->nworkers; ++i) {
+        pthread_join(ps->workers[i], NULL);
+    }
+    if (ps->workers) {
+        TCFREE(ps->workers);
+    }
+    pthread_mutex_destroy(&ps->mtx);
+    pthread_cond_destroy(&ps->wcond);
+    pthread_cond_destroy(&ps->dcond);
+    for (int i = 0; i < 2 * ps->nthreads; ++i) {
+        _PSCANBATCH *b = ps->batches + i;
+        if (b->q) {
+            ejdbquerydel(b->q);
+        }
+        if (b->qfs) {
+            TCFREE(b->qfs);
+        }
+        if (b->recs) {
+            tclistdel(b->recs);
+            tclistdel(b->matched);
+        }
+    }
+    TCFREE(ps->batches);
+    tcxstrdel(ps->kbuf);
+    tcxstrdel(ps->vbuf);
+    TCFREE(ps);
+}
+
+/* Finish the current execution stage and start the next `stage` if it is not negative */
+static void _qrystage(_QRYCTX *ctx, int stage) {
+    if (!ctx->explain) {
+        return;
+    }
+    double wall = tctime();
+    double cpu = (double) clock() / CLOCKS_PER_SEC;
+    if (ctx->stage >= 0) {
+        ctx->stimes[ctx->stage][0] += wall - ctx->smarks[0];
+        ctx->stimes[ctx->stage][1] += cpu - ctx->smarks[1];
+    }
+    ctx->stage = stage;
+    ctx->smarks[0] = wall;
+    ctx->smarks[1] = cpu;
+}
+
+/**
+ * Returns true if the query has been cancelled or exceeded its limits
+ * and sets `JBEQLIMIT` or `JBEQCANCELLED` error code.
+ * Called by every iteration of the scan loops, the deadline is checked
+ * once per `JBQDEADLINETICKS` calls.
+ */
+static bool _qryinterrupted(_QRYCTX *ctx) {
+    if (ctx->ecode) {
+        return true;
+    }
+    const EJQ *q = ctx->q;
+    if (__atomic_load_n(&ctx->srcq->cancel, __ATOMIC_RELAXED)) {
+        ctx->ecode = JBEQCANCELLED;
+    } else if (ctx->maxscan > 0 && MAX(q->nkeys, q->nrecs) > ctx->maxscan) {
+        ctx->ecode = JBEQLIMIT;
+    } else if (ctx->deadline > 0 && (++ctx->ticks % JBQDEADLINETICKS) == 0 && tctime() > ctx->deadline) {
+        ctx->ecode = JBEQLIMIT;
+    } else {
+        return false;
+    }
+    _ejdbsetecode(ctx->coll->jb, ctx->ecode, __FILE__, __LINE__, __func__);
+    if (ctx->log) {
+        tcxstrprintf(ctx->log, "QUERY INTERRUPTED: %s\n", ejdberrmsg(ctx->ecode));
+    }
+    return true;
+}
+
+/* Returns records access method of the query, `access` is set by fullscan and simple count */
+static const char* _qryaccess(_QRYCTX *ctx, const char *access) {
+    if (access) {
+        return access;
+    }
+    return ctx->cidx ? "compound" : (ctx->isect ? "intersection" : (ctx->orunion ? "union" :
+           ((ctx->mqf && (ctx->mqf->flags & EJFPKMATCHING)) ? "pk" : "index")));
+}
+
+/* Returns the name of the single index used by the query or NULL */
+static const char* _qryidxname(_QRYCTX *ctx, const char *access) {
+    if (ctx->cidx) {
+        return ctx->cidx->idx->name;
+    } else if (ctx->mqf && ctx->mqf->idx && !ctx->isect && !ctx->orunion && !strstr(access, "fullscan")) {
+        return ctx->mqf->idx->name;
+    }
+    return NULL;
+}
+
+/* Append the execution plan description of the finished query into `ctx->explain` */
+static void _qryexplain(_QRYCTX *ctx, const char *access, const char *sortmode, int sortruns,
+                        uint32_t matched, uint32_t count) {
+    static const char *stages[JBQSTNUM] = {"plan", "scan", "sort", "finish"};
+    bson *bs = ctx->explain;
+    EJQ *q = ctx->q;
+    char nbuf[TCNUMBUFSIZ];
+    TCLIST *iqfs = ctx->isect ? ctx->isect : ctx->orunion;
+    access = _qryaccess(ctx, access);
+    const char *iname = _qryidxname(ctx, access);
+    bson_append_string(bs, "collection", ctx->coll->cname);
+    bson_append_string(bs, "access", access);
+    if (iname) {
+        bson_append_string(bs, "index", iname);
+    } else {
+        bson_append_null(bs, "index");
+    }
+    if (iqfs) {
+        bson_append_start_array(bs, "indexes");
+        for (int i = 0; i < TCLISTNUM(iqfs); ++i) {
+            bson_numstrn(nbuf, TCNUMBUFSIZ, i);
+            bson_append_string(bs, nbuf, (*(EJQF**) TCLISTVALPTR(iqfs, i))->idx->name);
+        }
+        bson_append_finish_array(bs);
+    }
+    bson_append_start_array(bs, "candidates");
+    for (int i = 0; ctx->cands && i < TCLISTNUM(ctx->cands); ++i) {
+        const _QRYCAND *cand = TCLISTVALPTR(ctx->cands, i);
+        bson_numstrn(nbuf, TCNUMBUFSIZ, i);
+        bson_append_start_object(bs, nbuf);
+        bson_append_string(bs, "field", cand->fpath);
+        bson_append_string(bs, "index", cand->iname);
+        bson_append_int(bs, "score", cand->score);
+        bson_append_finish_object(bs);
+    }
+    bson_append_finish_array(bs);
+    bson_append_long(bs, "keys", q->nkeys);
+    bson_append_long(bs, "records", q->nrecs);
+    bson_append_long(bs, "bytes", q->nbytes);
+    bson_append_long(bs, "matched", matched);
+    bson_append_long(bs, "returned", ctx->res ? TCLISTNUM(ctx->res) : count);
+    bson_append_string(bs, "sort", sortmode);
+    if (sortruns > 0) {
+        bson_append_int(bs, "sortruns", sortruns);
+    }
+    bson_append_start_object(bs, "stages"); // Stage times in milliseconds
+    for (int i = 0; i < JBQSTNUM; ++i) {
+        bson_append_start_object(bs, stages[i]);
+        bson_append_double(bs, "wall", ctx->stimes[i][0] * 1000);
+        bson_append_double(bs, "cpu", ctx->stimes[i][1] * 1000);
+        bson_append_finish_object(bs);
+    }
+    bson_append_finish_object(bs);
+}
+
+/* Returns the operator name of the query condition `qf` used in query shapes */
+static const char* _qryshapeop(const EJQF *qf) {
+    switch (qf->tcop) {
+        case TDBQCSTREQ:
+        case TDBQCNUMEQ:
+            return "$eq";
+        case TDBQCSTRBW:
+        case TDBQCSTRORBW:
+            return "$begin";
+        case TDBQCSTRAND:
+            return "$strand";
+        case TDBQCSTROR:
+            return "$stror";
+        case TDBQCSTROREQ:
+        case TDBQCNUMOREQ:
+        case TDBQCSTRNUMOR:
+            return "$in";
+        case TDBQCSTRRX:
+            return "$regex";
+        case TDBQCNUMGT:
+            return "$gt";
+        case TDBQCNUMGE:
+            return "$gte";
+        case TDBQCNUMLT:
+            return "$lt";
+        case TDBQCNUMLE:
+            return "$lte";
+        case TDBQCNUMBT:
+            return "$bt";
+        case TDBQCEXIST:
+            return "$exists";
+        default:
+            return "$op";
+    }
+}
+
+/**
+ * Append the normalized shape of the query `q` with operands stripped into `xstr`:
+ *
+ *      {a:$gt,b:!$in,c.d:$eq} $or[{e:$eq}|{f:$lt}] $orderby{a:1} $set
+ *
+ * Conditions are sorted by field paths, so queries differing only in the
+ * order of conditions and operand values share the same shape.
+ */
+static void _qryshape(const EJQ *q, TCXSTR *xstr) {
+    TCLIST *conds = tclistnew2(TCLISTNUM(q->qflist) + 1);
+    TCLIST *ops = tclistnew2(TCLISTINYNUM);
+    int onum = 0;
+    for (int i = 0; i < TCLISTNUM(q->qflist); ++i) {
+        const EJQF *qf = TCLISTVALPTR(q->qflist, i);
+        if (qf->orderseq > onum) {
+            onum = qf->orderseq;
+        }
+        if (*qf->fpath == '$') { // Update, $do and other control operations
+            TCLISTPUSH(ops, qf->fpath, qf->fpathsz);
+        } else if (qf->tcop != TDBQTRUE) { // Not a synthetic $orderby field
+            char *cond = tcsprintf("%s:%s%s", qf->fpath, qf->negate ? "!" : "", _qryshapeop(qf));
+            tclistpushmalloc(conds, cond, strlen(cond));
+        }
+    }
+    tclistsort(conds);
+    tcxstrcat(xstr, "{", 1);
+    for (int i = 0; i < TCLISTNUM(conds); ++i) {
+        if (i > 0) {
+            tcxstrcat(xstr, ",", 1);
+        }
+        tcxstrcat(xstr, TCLISTVALPTR(conds, i), TCLISTVALSIZ(conds, i));
+    }
+    tcxstrcat(xstr, "}", 1);
+    const TCLIST *sqlists[] = {q->orqlist, q->andqlist};
+    const char *sqnames[] = {" $or[", " $and["};
+    for (int i = 0; i < 2; ++i) {
+        if (!sqlists[i] || TCLISTNUM(sqlists[i]) < 1) {
+            continue;
+        }
+        tcxstrcat2(xstr, sqnames[i]);
+        for (int j = 0; j < TCLISTNUM(sqlists[i]); ++j) {
+            if (j > 0) {
+                tcxstrcat(xstr, "|", 1);
+            }
+            _qryshape(*((EJQ**) TCLISTVALPTR(sqlists[i], j)), xstr);
+        }
+        tcxstrcat(xstr, "]", 1);
+    }
+    if (onum > 0) {
+        tcxstrcat2(xstr, " $orderby{");
+        for (int seq = 1; seq <= onum; ++seq) {
+            for (int i = 0; i < TCLISTNUM(q->qflist); ++i) {
+                const EJQF *qf = TCLISTVALPTR(q->qflist, i);
+                if (qf->orderseq == seq) {
+                    tcxstrprintf(xstr, "%s%s:%d", (seq > 1) ? "," : "", qf->fpath, qf->order);
+                    break;
+                }
+            }
+        }
+        tcxstrcat(xstr, "}", 1);
+    }
+    tclistsort(ops);
+    for (int i = 0; i < TCLISTNUM(ops); ++i) {
+        tcxstrprintf(xstr, " %s", TCLISTVALPTR(ops, i));
+    }
+    tclistdel(ops);
+    tclistdel(conds);
+}
+
+/* Record the finished query into the slow queries log if it exceeded the threshold */
+static void _qryslowlog(_QRYCTX *ctx, const char *access, uint32_t matched) {
+    EJDB *jb = ctx->coll->jb;
+    EJQ *q = ctx->q;
+    double now = tctime();
+    int64_t threshold = __atomic_load_n(&jb->slthreshold, __ATOMIC_RELAXED);
+    if (threshold < 0 || (now - ctx->started) * 1000000 < threshold) {
+        return;
+    }
+    TCXSTR *shape = tcxstrnew();
+    _qryshape(q, shape);
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a hash of the shape
+    for (int i = 0; i < TCXSTRSIZE(shape); ++i) {
+        hash = (hash ^ ((const unsigned char*) TCXSTRPTR(shape))[i]) * 1099511628211ULL;
+    }
+    char fingerprint[17];
+    snprintf(fingerprint, sizeof (fingerprint), "%016" PRIx64, hash);
+    access = _qryaccess(ctx, access);
+    const char *iname = _qryidxname(ctx, access);
+    bson entry;
+    bson_init(&entry);
+    bson_append_double(&entry, "ts", now);
+    bson_append_string(&entry, "collection", ctx->coll->cname);
+    bson_append_string(&entry, "fingerprint", fingerprint);
+    bson_append_string(&entry, "shape", TCXSTRPTR(shape));
+    bson_append_string(&entry, "access", access);
+    if (iname) {
+        bson_append_string(&entry, "index", iname);
+    } else {
+        bson_append_null(&entry, "index");
+    }
+    bson_append_long(&entry, "keys", q->nkeys);
+    bson_append_long(&entry, "records", q->nrecs);
+    bson_append_long(&entry, "matched", matched);
+    bson_append_double(&entry, "ms", (now - ctx->started) * 1000);
+    bson_append_bool(&entry, "update", (q->flags & EJQUPDATING));
+    bson_append_int(&entry, "errorCode", ctx->ecode);
+    bson_finish(&entry);
+    if (pthread_mutex_lock(jb->slmtx) == 0) {
+        if (jb->slowlog) {
+            TCLISTPUSH(jb->slowlog, bson_data(&entry), bson_size(&entry));
+            while (TCLISTNUM(jb->slowlog) > jb->slsize) {
+                int sz;
+                TCFREE(tclistshift(jb->slowlog, &sz));
+            }
+        }
+        pthread_mutex_unlock(jb->slmtx);
+    }
+    bson_destroy(&entry);
+    tcxstrdel(shape);
+}
+
+/** Query */
+static TCLIST* _qryexecute(EJCOLL *coll, const EJQ *_q,  
+                           uint32_t *outcount, 
+                           int qflags, TCXSTR *log, bson *explain,
+                           EJQCUR *cur) {
+                               
+    assert(coll && coll->tdb && coll->tdb->hdb);
+    *outcount = 0;
+
+    _QRYCTX ctx = {NULL};
+    EJQ *q; //Clone the query object
+    TCMALLOC(q, sizeof (*q));
+    if (!_qrydup(_q, q, EJQINTERNAL)) {
+        TCFREE(q);
+        return NULL;
+    }
+    ctx.log = log;
+    ctx.q = q;
+    ctx.qflags = qflags;
+    ctx.coll = coll;
+    ctx.explain = explain;
+    ctx.stage = -1;
+    ctx.srcq = _q;
+    if (__atomic_load_n(&coll->jb->slthreshold, __ATOMIC_RELAXED) >= 0) {
+        ctx.started = tctime();
+    }
+    _qrystage(&ctx, JBQSTPLAN);
+    if (!_qryplanattach(&ctx, _q) || !_qrypreprocess(&ctx)) {
+        _qryctxclear(&ctx);
+        return NULL;
+    }
+    _qrystage(&ctx, JBQSTSCAN);
+    const char *access = NULL; // Records access method reported by explain
+    const char *sortmode = "none"; // Result set sorting reported by explain
+    int sortruns = 0;
+    bool all = false; // If True we need all records to fetch (sorting)
+    TCHDB *hdb = coll->tdb->hdb;
+    TCLIST *res = ctx.res;
+    EJQF *mqf = ctx.mqf;
+
+    int sz = 0;         // Generic size var
+    int anum = 0;       // Number of active conditions
+    int ofsz = 0;       // Order fields count
+    int aofsz = 0;      // Active order fields count
+    const int qfsz = TCLISTNUM(q->qflist); // Number of all condition fields
+    EJQF **ofs = NULL;  // Order fields
+    EJQF **qfs = NULL;  // Condition fields array
+    if (qfsz > 0) {
+        TCMALLOC(qfs, qfsz * sizeof (EJQF*));
+    }
+
+    const void *kbuf;
+    int kbufsz;
+    const void *vbuf;
+    int vbufsz;
+
+    uint32_t count = 0; // Current count
+    uint32_t max = (q->max > 0) ? q->max : UINT_MAX;
+    uint32_t skip = q->skip;
+    const TDBIDX *midx = mqf ? mqf->idx : NULL;
+
+    if (midx && !ctx.isect) { // Main index used for ordering
+        if (mqf->orderseq == 1 &&
+                !(mqf->tcop == TDBQCSTRAND ||
+                mqf->tcop == TDBQCSTROR || mqf->tcop == TDBQCSTRNUMOR) &&
+                !(mqf->tcop == TDBQCSTRRX && mqf->order < 0)) {
+                    
+            mqf->flags |= EJFORDERUSED;
+        }
+    }
+    for (int i = 0; i < qfsz; ++i) {
+        EJQF *qf = TCLISTVALPTR(q->qflist, i);
+        assert(qf);
+        if (log) {
+            if (qf->exprmap) {
+                tcxstrprintf(log, "USING HASH TOKENS IN: %s\n", qf->fpath);
+            }
+            if (qf->flags & EJCONDOIT) {
+                tcxstrprintf(log, "FIELD: %s HAS $do OPERATION\n", qf->fpath);
+            }
+        }
+        qf->jb = coll->jb;
+        qfs[i] = qf;
+        if (qf->fpathsz > 0 && !(qf->flags & EJFEXCLUDED)) {
+            anum++;
+        }
+        if (qf->orderseq) {
+            ofsz++;
+            if (q->flags & EJQONLYCOUNT) {
+                qf->flags |= EJFORDERUSED;
+            }
+        }
+    }
+    if (ofsz > 0) { // Collect order fields array
+        TCMALLOC(ofs, ofsz * sizeof (EJQF*));
+        for (int i = 0; i < ofsz; ++i) {
+            for (int j = 0; j < qfsz; ++j) {
+                if (qfs[j]->orderseq == i + 1) { // orderseq starts with 1
+                    ofs[i] = qfs[j];
+                    if (!(ofs[i]->flags & EJFORDERUSED)) {
+                        aofsz++;
+                        if (ctx.ifields) { // Force order field to be included in result set
+                            if (ctx.imode) { // add field to the included set
+                                tcmapputkeep(ctx.ifields, ofs[i]->fpath, 
+                                             ofs[i]->fpathsz, &yes, sizeof (yes));
+                            } else { // remove field from excluded
+                                tcmapout(ctx.ifields, ofs[i]->fpath, ofs[i]->fpathsz);
+                            }
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+        for (int i = 0; i < ofsz; ++i) assert(ofs[i] != NULL);
+    }
+
+    if ((q->flags & EJQONLYCOUNT) && qfsz == 0 &&
+            (q->orqlist == NULL || TCLISTNUM(q->orqlist) < 1) &&
+            (q->andqlist == NULL || TCLISTNUM(q->andqlist) < 1)) { // primitive count(*) query
+        count = coll->tdb->hdb->rnum;
+        access = "count";
+        if (log) {
+            tcxstrprintf(log, "SIMPLE COUNT(*): %u\n", count);
+        }
+        goto finish;
+    }
+
+    if (!(q->flags & EJQONLYCOUNT) && aofsz > 0 && (!midx || ctx.isect || mqf->orderseq != 1)) { 
+        // Main index is not the main order field
+        all = true; // Need all records for ordering for some other fields
+    }
+
+    if (log) {
+        tcxstrprintf(log, "UPDATING MODE: %s\n", (q->flags & EJQUPDATING) ? "YES" : "NO");
+        tcxstrprintf(log, "MAX: %u\n", max);
+        tcxstrprintf(log, "SKIP: %u\n", skip);
+        tcxstrprintf(log, "COUNT ONLY: %s\n", (q->flags & EJQONLYCOUNT) ? "YES" : "NO");
+        if (ctx.plan) {
+            tcxstrprintf(log, "PREPARED QUERY PARAMS: %d\n", TCLISTNUM(ctx.plan->params));
+        }
+        tcxstrprintf(log, "MAIN IDX: '%s'\n", midx ? midx->name : "NONE");
+        if (ctx.isect) {
+            tcxstrprintf(log, "INDEX INTERSECTION:");
+            for (int i = 0; i < TCLISTNUM(ctx.isect); ++i) {
+                tcxstrprintf(log, " '%s'", (*(EJQF**) TCLISTVALPTR(ctx.isect, i))->idx->name);
+            }
+            tcxstrprintf(log, "\n");
+        }
+        tcxstrprintf(log, "ORDER FIELDS: %d\n", ofsz);
+        tcxstrprintf(log, "ACTIVE CONDITIONS: %d\n", anum);
+        tcxstrprintf(log, "ROOT $OR QUERIES: %d\n", ((q->orqlist) ? TCLISTNUM(q->orqlist) : 0));
+        tcxstrprintf(log, "ROOT $AND QUERIES: %d\n", ((q->andqlist) ? TCLISTNUM(q->andqlist) : 0));
+        tcxstrprintf(log, "FETCH ALL: %s\n", all ? "YES" : "NO");
+    }
+    if (max < UINT_MAX - skip) {
+        max += skip;
+    }
+    if (max == 0) {
+        goto finish;
+    }
+    ctx.sctx.ofs = ofs;
+    ctx.sctx.ofsz = ofsz;
+    bool doorder = false; // Records are ordered by values of $do fields
+    for (int i = 0; ctx.dfields && !doorder && i < ofsz; ++i) {
+        const char *fpath;
+        int fpathsz;
+        tcmapiterinit(ctx.dfields);
+        while (!doorder && (fpath = tcmapiternext(ctx.dfields, &fpathsz)) != NULL) {
+            doorder = (!strncmp(ofs[i]->fpath, fpath, fpathsz) &&
+                       (ofs[i]->fpath[fpathsz] == '\0' || ofs[i]->fpath[fpathsz] == '.'));
+        }
+    }
+    if (all && max < UINT_MAX && res && !doorder) {
+        // Keep only `skip + max` best ordered records during scan
+        ctx.topk = max;
+        if (log) {
+            tcxstrprintf(log, "TOP-K HEAP: %u\n", max);
+        }
+    }
+    if (!ctx.agg && (ctx.topk || aofsz <= 0 || !res)) { // Records spilling is only needed for final sorting
+        ctx.sortmem = 0;
+    }
+    if (ctx.dfields && res && !ctx.agg && !doorder) {
+        // $do $join lookups are batched over the final result set
+        ctx.jdefer = true;
+    }
+    if (!midx && !ctx.orunion && !ctx.cidx && (!mqf || !(mqf->flags & EJFPKMATCHING))) { 
+        // Missing main index & no PK matching
+        goto fullscan;
+    }
+    if (log && mqf) {
+        tcxstrprintf(log, "MAIN IDX TCOP: %d\n", mqf->tcop);
+    }
+
+#define JBQREGREC(_pkbuf, _pkbufsz, _bsbuf, _bsbufsz)   \
+    ++count; \
+    if (q->flags & EJQUPDATING) { \
+        _qryupdate(&ctx, (_bsbuf), (_bsbufsz)); \
+    } \
+    if (!(q->flags & EJQONLYCOUNT) && (all || count > skip)) { \
+        _pushprocessedbson(&ctx, (_bsbuf), (_bsbufsz)); \
+    }
+    // eof #define JBQREGREC
+
+    //Scan loops continue until enough records are found or the query is interrupted
+#define JBQNEXT ((all || count < max) && !_qryinterrupted(&ctx))
+
+    //Skip or count index keys less than the bound key without reading records
+#define JBQSKIPKEYS(_cur, _bkey, _bkeysz, _bsuffix) \
+    if (keysonly) { \
+        uint64_t _n = _qryskipkeys((_cur), (_bkey), (_bkeysz), (_bsuffix), \
+                                   (q->flags & EJQONLYCOUNT) ? (max - count) : ((skip > count) ? (skip - count) : 0)); \
+        count += _n; \
+        q->nkeys += _n; \
+        if (log) { \
+            tcxstrprintf(log, "INDEX KEYS SKIPPED: %" PRIu64 "\n", _n); \
+        } \
+    }
+    // eof #define JBQSKIPKEYS
+
+    if (ctx.orunion) { // Fetch records of united $or PK sets
+        TCLIST *pks = _qryorpks(&ctx);
+        if (log) {
+            tcxstrprintf(log, "$OR INDEX UNION:");
+            for (int i = 0; i < TCLISTNUM(ctx.orunion); ++i) {
+                tcxstrprintf(log, " '%s'", (*(EJQF**) TCLISTVALPTR(ctx.orunion, i))->idx->name);
+            }
+            tcxstrprintf(log, "\nUNITED PKS: %d\n", TCLISTNUM(pks));
+        }
+        for (int i = 0; JBQNEXT && i < TCLISTNUM(pks); ++i) {
+            TCLISTVAL(vbuf, pks, i, vbufsz);
+            tcxstrclear(q->colbuf);
+            tcxstrclear(q->bsbuf);
+            if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                    
+                JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+            }
+        }
+        tclistdel(pks);
+        if (q->flags & EJQONLYCOUNT) {
+            goto finish;
+        } else {
+            goto sorting;
+        }
+    }
+
+    if (ctx.cidx) { // Compound index keys range scan
+        _CIDXSCAN *cs = ctx.cidx;
+        const char *lkey = TCXSTRPTR(cs->lkey);
+        const char *ukey = TCXSTRPTR(cs->ukey);
+        int lkeysz = TCXSTRSIZE(cs->lkey);
+        int ukeysz = TCXSTRSIZE(cs->ukey);
+        // Records are not read if the keys range matches exactly all conditions
+        // and only the indexed fields are requested
+        bool covered = cs->exact && !(q->flags & EJQUPDATING) &&
+                       ((q->flags & EJQONLYCOUNT) || _qrycidxcovered(&ctx));
+        if (log) {
+            tcxstrprintf(log, "COMPOUND IDX: '%s'\n", cs->idx->name);
+            tcxstrprintf(log, "COMPOUND IDX CONDITIONS: %d\n", cs->ncond);
+            tcxstrprintf(log, "COMPOUND IDX ORDER: %s\n", 
+                         cs->ordered ? (cs->desc ? "DESC" : "ASC") : "NONE");
+            tcxstrprintf(log, "COMPOUND IDX COVERED: %s\n", covered ? "YES" : "NO");
+        }
+        BDBCUR *cur = tcbdbcurnew(cs->idx->db);
+        TCXSTR *jkey = tcxstrnew();
+        TCXSTRCAT(jkey, cs->desc ? ukey : lkey, cs->desc ? ukeysz : lkeysz);
+        if (cs->desc ? cs->uincl : !cs->lincl) { // Jump over all keys prefixed by the bound
+            TCXSTRCAT(jkey, "\xff", 1);
+        }
+        if (cs->desc) {
+            tcbdbcurjumpback(cur, TCXSTRPTR(jkey), TCXSTRSIZE(jkey));
+        } else {
+            tcbdbcurjump(cur, TCXSTRPTR(jkey), TCXSTRSIZE(jkey));
+        }
+        tcxstrdel(jkey);
+        while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+            int lcmp = _cidxkeycmp(kbuf, kbufsz, lkey, lkeysz);
+            int ucmp = _cidxkeycmp(kbuf, kbufsz, ukey, ukeysz);
+            if (cs->desc ? (lcmp < 0 || (lcmp == 0 && !cs->lincl)) : (ucmp > 0 || (ucmp == 0 && !cs->uincl))) {
+                break;
+            }
+            if ((lcmp > 0 || (lcmp == 0 && cs->lincl)) && (ucmp < 0 || (ucmp == 0 && cs->uincl))) {
+                bson bsout;
+                vbuf = tcbdbcurval3(cur, &vbufsz);
+                if (covered && (q->flags & EJQONLYCOUNT)) {
+                    q->nkeys++;
+                    JBQREGREC(vbuf, vbufsz, NULL, 0);
+                } else if (covered && 
+                           _cidxkeybson(cs->idx, ctx.ifields, kbuf, kbufsz - 3, vbuf, vbufsz, &bsout)) {
+                               
+                    q->nkeys++;
+                    JBQREGREC(vbuf, vbufsz, bson_data(&bsout), bson_size(&bsout));
+                    bson_destroy(&bsout);
+                } else if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                           _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                        
+                    JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                }
+            }
+            if (cs->desc) {
+                tcbdbcurprev(cur);
+            } else {
+                tcbdbcurnext(cur);
+            }
+        }
+        // Records with not indexable values are checked one by one,
+        // there are no such records if `$orderby` is served by index
+        tcbdbcurjump(cur, "\xff", 1);
+        while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL && 
+                kbufsz > 0 && *(unsigned char*) kbuf == JBCIDXMULTI) {
+            vbuf = tcbdbcurval3(cur, &vbufsz);
+            if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                    
+                JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+            }
+            tcbdbcurnext(cur);
+        }
+        tcbdbcurdel(cur);
+        if (q->flags & EJQONLYCOUNT) {
+            goto finish;
+        } else {
+            goto sorting;
+        }
+    }
+
+    bool trim = (midx && *midx->name != '\0');
+    if (anum > 0 && !(mqf->flags & EJFEXCLUDED) && !(mqf->uslots && TCLISTNUM(mqf->uslots) > 0) &&
+            mqf->tcop != TDBQCSTRRX) { // Regular expression is still matched on records of its prefix range
+        anum--;
+        mqf->flags |= EJFEXCLUDED;
+    }
+    // Main index keys are counted and skipped by index leaves
+    // if the index serves all conditions of query
+    bool keysonly = (anum < 1 && !all && !ctx.isect && !(q->flags & EJQUPDATING) &&
+                     !(q->orqlist && TCLISTNUM(q->orqlist) > 0) &&
+                     !(q->andqlist && TCLISTNUM(q->andqlist) > 0));
+
+    if (ctx.isect) { // Fetch records of intersected PK sets
+        TCLIST *pks = _qryisectpks(&ctx);
+        if (log) {
+            tcxstrprintf(log, "INTERSECTED PKS: %d\n", TCLISTNUM(pks));
+        }
+        for (int i = 0; JBQNEXT && i < TCLISTNUM(pks); ++i) {
+            TCLISTVAL(vbuf, pks, i, vbufsz);
+            if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                    
+                JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+            }
+        }
+        tclistdel(pks);
+    } else if (mqf->flags & EJFPKMATCHING) { // PK matching
+        if (log) {
+            tcxstrprintf(log, "PRIMARY KEY MATCHING: TRUE\n");
+        }
+        assert(mqf->expr);
+        if (mqf->tcop == TDBQCSTREQ) {
+            do {
+                bson_oid_t oid;
+                bson_oid_from_string(&oid, mqf->expr);
                 tcxstrclear(q->colbuf);
                 tcxstrclear(q->bsbuf);
                 sz = tchdbgetintoxstr(coll->tdb->hdb, &oid, sizeof (oid), q->colbuf);
                 if (sz <= 0) {
                     break;
                 }
-                sz = tcmaploadoneintoxstr(TCXSTRPTR(q->colbuf), TCXSTRSIZE(q->colbuf), 
-                                          JDBCOLBSON, JDBCOLBSONL, q->bsbuf);
-                if (sz <= 0) {
-                    break;
+                q->nrecs++;
+                q->nbytes += sz;
+                sz = tcmaploadoneintoxstr(TCXSTRPTR(q->colbuf), TCXSTRSIZE(q->colbuf), 
+                                          JDBCOLBSON, JDBCOLBSONL, q->bsbuf);
+                if (sz <= 0) {
+                    break;
+                }
+                bool matched = _qryqfsmatch(q, qfs, qfsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                if (matched && _qry_and_or_match(coll, q, &oid, sizeof (oid))) {
+                    JBQREGREC(&oid, sizeof (oid), TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                }
+            } while (false);
+        } else if (mqf->tcop == TDBQCSTROREQ) {
+            TCLIST *tokens = mqf->exprlist;
+            assert(tokens);
+            tclistsort(tokens);
+            for (int i = 1; i < TCLISTNUM(tokens); i++) {
+                if (!strcmp(TCLISTVALPTR(tokens, i), TCLISTVALPTR(tokens, i - 1))) {
+                    TCFREE(tclistremove2(tokens, i));
+                    i--;
+                }
+            }
+            int tnum = TCLISTNUM(tokens);
+            for (int i = 0; JBQNEXT && i < tnum; i++) {
+                bson_oid_t oid;
+                const char *token;
+                int tsiz;
+                TCLISTVAL(token, tokens, i, tsiz);
+                if (tsiz < 1) {
+                    continue;
+                }
+                bson_oid_from_string(&oid, token);
+                tcxstrclear(q->bsbuf);
+                tcxstrclear(q->colbuf);
+                sz = tchdbgetintoxstr(coll->tdb->hdb, &oid, sizeof (oid), q->colbuf);
+                if (sz <= 0) {
+                    continue;
+                }
+                q->nrecs++;
+                q->nbytes += sz;
+                sz = tcmaploadoneintoxstr(TCXSTRPTR(q->colbuf), TCXSTRSIZE(q->colbuf), 
+                                          JDBCOLBSON, JDBCOLBSONL, q->bsbuf);
+                if (sz <= 0) {
+                    continue;
+                }
+                bool matched = _qryqfsmatch(q, qfs, qfsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                if (matched && _qry_and_or_match(coll, q, &oid, sizeof (oid))) {
+                    JBQREGREC(&oid, sizeof (oid), TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                }
+            }
+        } else {
+            assert(0);
+        }
+    } else if (mqf->tcop == TDBQTRUE) {
+        BDBCUR *cur = tcbdbcurnew(midx->db);
+        if (mqf->order >= 0) {
+            tcbdbcurfirst(cur);
+            JBQSKIPKEYS(cur, NULL, 0, -1);
+        } else {
+            tcbdbcurlast(cur);
+        }
+        while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+            if (trim) kbufsz -= 3;
+            vbuf = tcbdbcurval3(cur, &vbufsz);
+            if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                    
+                JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+            }
+            if (mqf->order >= 0) {
+                tcbdbcurnext(cur);
+            } else {
+                tcbdbcurprev(cur);
+            }
+        }
+        tcbdbcurdel(cur);
+    } else if (mqf->tcop == TDBQCSTREQ) { /* String is equal to */
+        assert(midx->type == TDBITLEXICAL);
+        char *expr = mqf->expr;
+        int exprsz = mqf->exprsz;
+        BDBCUR *cur = tcbdbcurnew(midx->db);
+        tcbdbcurjump(cur, expr, exprsz + trim);
+        JBQSKIPKEYS(cur, expr, exprsz, trim ? 0x01 : 0x00); // Key suffix is '\0' + 2 bytes of pk hash
+        while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+            if (trim) kbufsz -= 3;
+            if (kbufsz == exprsz && !memcmp(kbuf, expr, exprsz)) {
+                vbuf = tcbdbcurval3(cur, &vbufsz);
+                if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                    _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                        
+                    JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                }
+            } else {
+                break;
+            }
+            tcbdbcurnext(cur);
+        }
+        tcbdbcurdel(cur);
+    } else if (mqf->tcop == TDBQCSTRBW) { /* String begins with */
+        assert(midx->type == TDBITLEXICAL);
+        char *expr = mqf->expr;
+        int exprsz = mqf->exprsz;
+        BDBCUR *cur = tcbdbcurnew(midx->db);
+        tcbdbcurjump(cur, expr, exprsz + trim);
+        JBQSKIPKEYS(cur, expr, exprsz, 0xff); // 0xff byte is never found in UTF-8 strings
+        while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+            if (trim) kbufsz -= 3;
+            if (kbufsz >= exprsz && !memcmp(kbuf, expr, exprsz)) {
+                vbuf = tcbdbcurval3(cur, &vbufsz);
+                if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                    _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                        
+                    JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
                 }
-                bool matched = true;
-                for (int i = 0; i < qfsz; ++i) qfs[i]->mflags = qfs[i]->flags;
-                for (int i = 0; i < qfsz; ++i) {
-                    EJQF *qf = qfs[i];
-                    if (qf->mflags & EJFEXCLUDED) continue;
-                    if (!_qrybsmatch(qf, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf))) {
-                        matched = false;
-                        break;
+            } else {
+                break;
+            }
+            tcbdbcurnext(cur);
+        }
+        tcbdbcurdel(cur);
+    } else if (mqf->tcop == TDBQCSTRRX) { /* Anchored regular expression, keys begin with its literal prefix */
+        assert(midx->type == TDBITLEXICAL);
+        char *expr = mqf->rxprefix;
+        int exprsz = mqf->rxprefixsz;
+        BDBCUR *cur = tcbdbcurnew(midx->db);
+        tcbdbcurjump(cur, expr, exprsz + trim);
+        while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+            if (trim) kbufsz -= 3;
+            if (kbufsz >= exprsz && !memcmp(kbuf, expr, exprsz)) {
+                vbuf = tcbdbcurval3(cur, &vbufsz);
+                if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) &&
+                    _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+
+                    JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                }
+            } else {
+                break;
+            }
+            tcbdbcurnext(cur);
+        }
+        tcbdbcurdel(cur);
+    } else if (mqf->tcop == TDBQCSTRORBW) { /* String begins with one token in */
+        assert(mqf->ftype == BSON_ARRAY);
+        assert(midx->type == TDBITLEXICAL);
+        BDBCUR *cur = tcbdbcurnew(midx->db);
+        TCLIST *tokens = mqf->exprlist;
+        assert(tokens);
+        tclistsort(tokens);
+        for (int i = 1; i < TCLISTNUM(tokens); i++) {
+            if (!strcmp(TCLISTVALPTR(tokens, i), TCLISTVALPTR(tokens, i - 1))) {
+                TCFREE(tclistremove2(tokens, i));
+                i--;
+            }
+        }
+        if (mqf->order < 0 && (mqf->flags & EJFORDERUSED)) {
+            tclistinvert(tokens);
+        }
+        int tnum = TCLISTNUM(tokens);
+        for (int i = 0; JBQNEXT && i < tnum; i++) {
+            const char *token;
+            int tsiz;
+            TCLISTVAL(token, tokens, i, tsiz);
+            if (tsiz < 1) continue;
+            tcbdbcurjump(cur, token, tsiz + trim);
+            while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+                if (trim) kbufsz -= 3;
+                if (kbufsz >= tsiz && !memcmp(kbuf, token, tsiz)) {
+                    vbuf = tcbdbcurval3(cur, &vbufsz);
+                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                            
+                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
                     }
+                } else {
+                    break;
                 }
-                if (matched && _qry_and_or_match(coll, q, &oid, sizeof (oid))) {
-                    JBQREGREC(&oid, sizeof (oid), TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                tcbdbcurnext(cur);
+            }
+        }
+        tcbdbcurdel(cur);
+    } else if (mqf->tcop == TDBQCSTROREQ) { /* String is equal to at least one token in */
+        assert(mqf->ftype == BSON_ARRAY);
+        assert(midx->type == TDBITLEXICAL);
+        BDBCUR *cur = tcbdbcurnew(midx->db);
+        TCLIST *tokens = mqf->exprlist;
+        assert(tokens);
+        tclistsort(tokens);
+        for (int i = 1; i < TCLISTNUM(tokens); i++) {
+            if (!strcmp(TCLISTVALPTR(tokens, i), TCLISTVALPTR(tokens, i - 1))) {
+                TCFREE(tclistremove2(tokens, i));
+                i--;
+            }
+        }
+        bool desc = (mqf->order < 0 && (mqf->flags & EJFORDERUSED));
+        if (desc) {
+            tclistinvert(tokens);
+        }
+        int tnum = TCLISTNUM(tokens);
+        int jumps = 0;
+        for (int i = 0; JBQNEXT && i < tnum; i++) {
+            const char *token;
+            int tsiz;
+            TCLISTVAL(token, tokens, i, tsiz);
+            if (tsiz < 1) continue;
+            if (desc || !jumps || !_qrycurstep(cur, _lexkeycmp, token, tsiz, trim ? 3 : 0)) {
+                tcbdbcurjump(cur, token, tsiz + trim);
+                jumps++;
+            }
+            while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+                if (trim) kbufsz -= 3;
+                if (kbufsz == tsiz && !memcmp(kbuf, token, tsiz)) {
+                    vbuf = tcbdbcurval3(cur, &vbufsz);
+                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                            
+                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                    }
+                } else {
+                    break;
                 }
-            } while (false);
-        } else if (mqf->tcop == TDBQCSTROREQ) {
-            TCLIST *tokens = mqf->exprlist;
-            assert(tokens);
-            tclistsort(tokens);
-            for (int i = 1; i < TCLISTNUM(tokens); i++) {
-                if (!strcmp(TCLISTVALPTR(tokens, i), TCLISTVALPTR(tokens, i - 1))) {
-                    TCFREE(tclistremove2(tokens, i));
-                    i--;
+                tcbdbcurnext(cur);
+            }
+        }
+        tcbdbcurdel(cur);
+        if (log) {
+            tcxstrprintf(log, "$IN KEYS: %d INDEX JUMPS: %d\n", tnum, jumps);
+        }
+    } else if (midx->type == TDBITBINNUM) { /* Number conditions over binary keys */
+        _NUMKEYRANGE kr;
+        bool desc = (mqf->order < 0 && (mqf->flags & EJFORDERUSED));
+        if (!_numkeyrange(mqf, &kr)) {
+            assert(0);
+        }
+        if (kr.keys && desc) {
+            tclistinvert(kr.keys);
+        }
+        BDBCUR *cur = tcbdbcurnew(midx->db);
+        int rnum = kr.keys ? TCLISTNUM(kr.keys) : 1;
+        int jumps = 0;
+        for (int i = 0; JBQNEXT && i < rnum; ++i, ++jumps) {
+            if (kr.keys) {
+                memcpy(kr.lkey, TCLISTVALPTR(kr.keys, i), JBNUMKEYSZ);
+                memcpy(kr.ukey, kr.lkey, JBNUMKEYSZ);
+            }
+            if (kr.keys && !desc && jumps && _qrycurstep(cur, _binkeycmp, kr.lkey, JBNUMKEYSZ, 0)) {
+                jumps--; // Sorted `$in` keys are merged with index keys
+            } else if (desc && kr.hasup) { // Key suffix is '\0' + 2 bytes of pk hash
+                memset(kr.ukey + JBNUMKEYSZ, 0xff, 3);
+                tcbdbcurjumpback(cur, kr.ukey, JBNUMKEYSZ + 3);
+            } else if (desc) {
+                tcbdbcurlast(cur);
+            } else if (kr.haslow) {
+                tcbdbcurjump(cur, kr.lkey, JBNUMKEYSZ);
+            } else {
+                tcbdbcurfirst(cur);
+            }
+            if (keysonly && !kr.keys && !desc) {
+                if (kr.haslow && !kr.lincl) { // Keys equal to the lower bound are not in the range
+                    _qryskipkeys(cur, kr.lkey, JBNUMKEYSZ, 0x01, UINT64_MAX);
                 }
+                JBQSKIPKEYS(cur, kr.hasup ? kr.ukey : NULL, JBNUMKEYSZ, kr.uincl ? 0x01 : -1);
             }
-            int tnum = TCLISTNUM(tokens);
-            for (int i = 0; (all || count < max) && i < tnum; i++) {
-                bool matched = true;
-                bson_oid_t oid;
-                const char *token;
-                int tsiz;
-                TCLISTVAL(token, tokens, i, tsiz);
-                if (tsiz < 1) {
-                    continue;
+            while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+                if (kbufsz < JBNUMKEYSZ) break;
+                int lcmp = kr.haslow ? memcmp(kbuf, kr.lkey, JBNUMKEYSZ) : 1;
+                int ucmp = kr.hasup ? memcmp(kbuf, kr.ukey, JBNUMKEYSZ) : -1;
+                if (desc ? (lcmp < 0 || (lcmp == 0 && !kr.lincl)) : (ucmp > 0 || (ucmp == 0 && !kr.uincl))) {
+                    break;
                 }
-                bson_oid_from_string(&oid, token);
-                tcxstrclear(q->bsbuf);
-                tcxstrclear(q->colbuf);
-                sz = tchdbgetintoxstr(coll->tdb->hdb, &oid, sizeof (oid), q->colbuf);
-                if (sz <= 0) {
-                    continue;
+                if ((lcmp > 0 || (lcmp == 0 && kr.lincl)) && (ucmp < 0 || (ucmp == 0 && kr.uincl))) {
+                    vbuf = tcbdbcurval3(cur, &vbufsz);
+                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                            
+                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                    }
                 }
-                sz = tcmaploadoneintoxstr(TCXSTRPTR(q->colbuf), TCXSTRSIZE(q->colbuf), 
-                                          JDBCOLBSON, JDBCOLBSONL, q->bsbuf);
-                if (sz <= 0) {
-                    continue;
+                if (desc) {
+                    tcbdbcurprev(cur);
+                } else {
+                    tcbdbcurnext(cur);
                 }
-                for (int i = 0; i < qfsz; ++i) qfs[i]->mflags = qfs[i]->flags;
-                for (int i = 0; i < qfsz; ++i) {
-                    EJQF *qf = qfs[i];
-                    if (qf->mflags & EJFEXCLUDED) continue;
-                    if (!_qrybsmatch(qf, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf))) {
-                        matched = false;
-                        break;
+            }
+        }
+        tcbdbcurdel(cur);
+        if (kr.keys) {
+            if (log) {
+                tcxstrprintf(log, "$IN KEYS: %d INDEX JUMPS: %d\n", rnum, jumps);
+            }
+            tclistdel(kr.keys);
+        }
+    } else if (mqf->tcop == TDBQCNUMEQ) { /* Number is equal to */
+        assert(midx->type == TDBITDECIMAL);
+        char *expr = mqf->expr;
+        int exprsz = mqf->exprsz;
+        BDBCUR *cur = tcbdbcurnew(midx->db);
+        _EJDBNUM num;
+        _nufetch(&num, expr, mqf->ftype);
+        tctdbqryidxcurjumpnum(cur, expr, exprsz, true);
+        while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+            if (_nucmp(&num, kbuf, mqf->ftype) == 0) {
+                vbuf = tcbdbcurval3(cur, &vbufsz);
+                if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                    _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                        
+                    JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                }
+            } else {
+                break;
+            }
+            tcbdbcurnext(cur);
+        }
+        tcbdbcurdel(cur);
+    } else if (mqf->tcop == TDBQCNUMGT || mqf->tcop == TDBQCNUMGE) {
+        /* Number is greater than | number is greater than or equal to */
+        assert(midx->type == TDBITDECIMAL);
+        char *expr = mqf->expr;
+        int exprsz = mqf->exprsz;
+        BDBCUR *cur = tcbdbcurnew(midx->db);
+        _EJDBNUM xnum;
+        _nufetch(&xnum, expr, mqf->ftype);
+        if (mqf->order < 0 && (mqf->flags & EJFORDERUSED)) { //DESC
+            tcbdbcurlast(cur);
+            while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+                _EJDBNUM knum;
+                _nufetch(&knum, kbuf, mqf->ftype);
+                int cmp = _nucmp2(&knum, &xnum, mqf->ftype);
+                if (cmp < 0) break;
+                if (cmp > 0 || (mqf->tcop == TDBQCNUMGE && cmp >= 0)) {
+                    vbuf = tcbdbcurval3(cur, &vbufsz);
+                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                            
+                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
                     }
                 }
-                if (matched && _qry_and_or_match(coll, q, &oid, sizeof (oid))) {
-                    JBQREGREC(&oid, sizeof (oid), TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                tcbdbcurprev(cur);
+            }
+        } else { // ASC
+            tctdbqryidxcurjumpnum(cur, expr, exprsz, true);
+            while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+                _EJDBNUM knum;
+                _nufetch(&knum, kbuf, mqf->ftype);
+                int cmp = _nucmp2(&knum, &xnum, mqf->ftype);
+                if (cmp > 0 || (mqf->tcop == TDBQCNUMGE && cmp >= 0)) {
+                    vbuf = tcbdbcurval3(cur, &vbufsz);
+                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                            
+                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                    }
+                }
+                tcbdbcurnext(cur);
+            }
+        }
+        tcbdbcurdel(cur);
+    } else if (mqf->tcop == TDBQCNUMLT || mqf->tcop == TDBQCNUMLE) {
+        /* Number is less than | number is less than or equal to */
+        assert(midx->type == TDBITDECIMAL);
+        char *expr = mqf->expr;
+        int exprsz = mqf->exprsz;
+        BDBCUR *cur = tcbdbcurnew(midx->db);
+        _EJDBNUM xnum;
+        _nufetch(&xnum, expr, mqf->ftype);
+        if (mqf->order >= 0) { //ASC
+            tcbdbcurfirst(cur);
+            while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+                _EJDBNUM knum;
+                _nufetch(&knum, kbuf, mqf->ftype);
+                int cmp = _nucmp2(&knum, &xnum, mqf->ftype);
+                if (cmp > 0) break;
+                if (cmp < 0 || (cmp <= 0 && mqf->tcop == TDBQCNUMLE)) {
+                    vbuf = tcbdbcurval3(cur, &vbufsz);
+                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                            
+                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                    }
                 }
+                tcbdbcurnext(cur);
             }
         } else {
-            assert(0);
+            tctdbqryidxcurjumpnum(cur, expr, exprsz, false);
+            while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+                _EJDBNUM knum;
+                _nufetch(&knum, kbuf, mqf->ftype);
+                int cmp = _nucmp2(&knum, &xnum, mqf->ftype);
+                if (cmp < 0 || (cmp <= 0 && mqf->tcop == TDBQCNUMLE)) {
+                    vbuf = tcbdbcurval3(cur, &vbufsz);
+                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                            
+                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                    }
+                }
+                tcbdbcurprev(cur);
+            }
         }
-    } else if (mqf->tcop == TDBQTRUE) {
-        BDBCUR *cur = tcbdbcurnew(midx->db);
-        if (mqf->order >= 0) {
-            tcbdbcurfirst(cur);
-        } else {
-            tcbdbcurlast(cur);
+        tcbdbcurdel(cur);
+    } else if (mqf->tcop == TDBQCNUMBT) { /* Number is between two tokens of */
+        assert(mqf->ftype == BSON_ARRAY);
+        assert(midx->type == TDBITDECIMAL);
+        assert(mqf->exprlist);
+        TCLIST *tokens = mqf->exprlist;
+        assert(TCLISTNUM(tokens) == 2);
+        const char *expr;
+        int exprsz;
+        long double lower = tcatof2(tclistval2(tokens, 0));
+        long double upper = tcatof2(tclistval2(tokens, 1));
+        expr = tclistval2(tokens, (lower > upper) ? 1 : 0);
+        exprsz = strlen(expr);
+        if (lower > upper) {
+            long double swap = lower;
+            lower = upper;
+            upper = swap;
         }
-        while ((all || count < max) && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
-            if (trim) kbufsz -= 3;
+        BDBCUR *cur = tcbdbcurnew(midx->db);
+        tctdbqryidxcurjumpnum(cur, expr, exprsz, true);
+        while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+            if (tcatof2(kbuf) > upper) break;
             vbuf = tcbdbcurval3(cur, &vbufsz);
             if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
                 _qry_and_or_match(coll, q, vbuf, vbufsz)) {
                     
                 JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
             }
-            if (mqf->order >= 0) {
+            tcbdbcurnext(cur);
+        }
+        tcbdbcurdel(cur);
+        if (!all && !(q->flags & EJQONLYCOUNT) && 
+            mqf->order < 0 && (mqf->flags & EJFORDERUSED)) { //DESC
+            
+            tclistinvert(res);
+        }
+    } else if (mqf->tcop == TDBQCNUMOREQ) { /* Number is equal to at least one token in */
+        assert(mqf->ftype == BSON_ARRAY);
+        assert(midx->type == TDBITDECIMAL);
+        BDBCUR *cur = tcbdbcurnew(midx->db);
+        TCLIST *tokens = mqf->exprlist;
+        assert(tokens);
+        tclistsortex(tokens, tdbcmppkeynumasc);
+        for (int i = 1; i < TCLISTNUM(tokens); i++) {
+            if (tcatof2(TCLISTVALPTR(tokens, i)) == tcatof2(TCLISTVALPTR(tokens, i - 1))) {
+                TCFREE(tclistremove2(tokens, i));
+                i--;
+            }
+        }
+        bool desc = (mqf->order < 0 && (mqf->flags & EJFORDERUSED));
+        if (desc) {
+            tclistinvert(tokens);
+        }
+        int tnum = TCLISTNUM(tokens);
+        int jumps = 0;
+        for (int i = 0; JBQNEXT && i < tnum; i++) {
+            const char *token;
+            int tsiz;
+            TCLISTVAL(token, tokens, i, tsiz);
+            if (tsiz < 1) continue;
+            long double xnum = tcatof2(token);
+            if (desc || !jumps || !_qrycurstep(cur, _deckeycmp, token, tsiz, 0)) {
+                tctdbqryidxcurjumpnum(cur, token, tsiz, true);
+                jumps++;
+            }
+            while (JBQNEXT && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+                if (tcatof2(kbuf) == xnum) {
+                    vbuf = tcbdbcurval3(cur, &vbufsz);
+                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
+                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
+                            
+                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                    }
+                } else {
+                    break;
+                }
                 tcbdbcurnext(cur);
-            } else {
-                tcbdbcurprev(cur);
             }
         }
         tcbdbcurdel(cur);
-    } else if (mqf->tcop == TDBQCSTREQ) { /* String is equal to */
-        assert(midx->type == TDBITLEXICAL);
-        char *expr = mqf->expr;
-        int exprsz = mqf->exprsz;
-        BDBCUR *cur = tcbdbcurnew(midx->db);
-        tcbdbcurjump(cur, expr, exprsz + trim);
-        while ((all || count < max) && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
-            if (trim) kbufsz -= 3;
-            if (kbufsz == exprsz && !memcmp(kbuf, expr, exprsz)) {
-                vbuf = tcbdbcurval3(cur, &vbufsz);
-                if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
-                    _qry_and_or_match(coll, q, vbuf, vbufsz)) {
-                        
-                    JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+        if (log) {
+            tcxstrprintf(log, "$IN KEYS: %d INDEX JUMPS: %d\n", tnum, jumps);
+        }
+    } else if (mqf->tcop == TDBQCSTRAND || mqf->tcop == TDBQCSTROR || mqf->tcop == TDBQCSTRNUMOR) {
+        /* String includes all tokens in | string includes at least one token in */
+        assert(midx->type == TDBITTOKEN);
+        assert(mqf->ftype == BSON_ARRAY);
+        TCLIST *tokens = mqf->exprlist;
+        assert(tokens);
+        if (mqf->tcop == TDBQCSTRNUMOR) {
+            tclistsortex(tokens, tdbcmppkeynumasc);
+            for (int i = 1; i < TCLISTNUM(tokens); i++) {
+                if (tcatof2(TCLISTVALPTR(tokens, i)) == tcatof2(TCLISTVALPTR(tokens, i - 1))) {
+                    TCFREE(tclistremove2(tokens, i));
+                    i--;
+                }
+            }
+        } else {
+            tclistsort(tokens);
+            for (int i = 1; i < TCLISTNUM(tokens); i++) {
+                if (!strcmp(TCLISTVALPTR(tokens, i), TCLISTVALPTR(tokens, i - 1))) {
+                    TCFREE(tclistremove2(tokens, i));
+                    i--;
+                }
+            }
+        }
+        TCMAP *tres = tctdbidxgetbytokens(coll->tdb, midx, tokens, mqf->tcop, log);
+        tcmapiterinit(tres);
+        while (JBQNEXT && (kbuf = tcmapiternext(tres, &kbufsz)) != NULL) {
+            if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, kbuf, kbufsz) && 
+                _qry_and_or_match(coll, q, kbuf, kbufsz)) {
+                    
+                JBQREGREC(kbuf, kbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+            }
+        }
+        tcmapdel(tres);
+    }
+
+    if (q->flags & EJQONLYCOUNT) {
+        goto finish;
+    } else {
+        goto sorting;
+    }
+
+fullscan: /* Full scan */
+    assert(count == 0);
+    assert(!res || TCLISTNUM(res) == 0);
+    access = "fullscan";
+
+    if ((q->flags & EJQDROPALL) && (q->flags & EJQONLYCOUNT)) {
+        // If we are in primitive $dropall case. Query: {$dropall:true}
+        if (qfsz == 1 && qfs[0]->tcop == TDBQTRUE) { //single $dropall field
+            if (log) {
+                tcxstrprintf(log, "VANISH WHOLE COLLECTION ON $dropall\n");
+            }
+            // Write lock already acquired so use impl
+            count = coll->tdb->hdb->rnum;
+            if (!tctdbvanish(coll->tdb)) {
+                count = 0;
+            }
+            goto finish;
+        }
+    }
+
+    if (log) {
+        tcxstrprintf(log, "RUN FULLSCAN\n");
+    }
+    TCMAP *updkeys = (q->flags & EJQUPDATING) ? tcmapnew2(100 * 1024) : NULL;
+    TCHDBITER *hdbiter = tchdbiter2init(hdb);
+    if (!hdbiter) {
+        goto finish;
+    }
+    _PSCAN *ps = NULL;
+    if (ctx.scanthreads > 1 && !updkeys && hdb->rnum > JBPSCANBATCH) {
+        ps = _pscannew(&ctx, hdbiter);
+    }
+    if (ps) { // Parallel full scan
+        access = "parallel fullscan";
+        if (log) {
+            tcxstrprintf(log, "PARALLEL FULLSCAN THREADS: %d\n", ps->nthreads);
+        }
+        while (JBQNEXT && _pscannext(ps)) {
+            q->nrecs += ps->nrecs; // Records read so far are checked against `$maxscan`
+            q->nbytes += ps->nbytes;
+            ps->nrecs = ps->nbytes = 0;
+            for (int i = 0; JBQNEXT && i + 1 < TCLISTNUM(ps->matched); i += 2) {
+                TCLISTVAL(kbuf, ps->matched, i, kbufsz);
+                TCLISTVAL(vbuf, ps->matched, i + 1, vbufsz);
+                JBQREGREC(kbuf, kbufsz, vbuf, vbufsz);
+            }
+        }
+        q->nrecs += ps->nrecs;
+        q->nbytes += ps->nbytes;
+        _pscandel(ps);
+        tchdbiter2dispose(hdb, hdbiter);
+        goto sorting;
+    }
+    TCXSTR *skbuf = tcxstrnew3(sizeof (bson_oid_t) + 1);
+    tcxstrclear(q->colbuf);
+    tcxstrclear(q->bsbuf);
+    int rows = 0;
+    while (JBQNEXT && tchdbiter2next(hdb, hdbiter, skbuf, q->colbuf)) {
+        ++rows;
+        q->nrecs++;
+        q->nbytes += TCXSTRSIZE(q->colbuf);
+        sz = tcmaploadoneintoxstr(TCXSTRPTR(q->colbuf), TCXSTRSIZE(q->colbuf), 
+                                  JDBCOLBSON, JDBCOLBSONL, q->bsbuf);
+        if (sz <= 0) {
+            goto wfinish;
+        }
+        bool matched = _qryqfsmatch(q, qfs, qfsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+        if (matched && _qry_and_or_match(coll, q, TCXSTRPTR(skbuf), TCXSTRSIZE(skbuf))) {
+            if (updkeys) { // We are in updating mode
+                if (tcmapputkeep(updkeys, TCXSTRPTR(skbuf), 
+                                 TCXSTRSIZE(skbuf), &yes, sizeof (yes))) {
+                                     
+                    JBQREGREC(TCXSTRPTR(skbuf), TCXSTRSIZE(skbuf), 
+                              TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
                 }
             } else {
-                break;
+                JBQREGREC(TCXSTRPTR(skbuf), TCXSTRSIZE(skbuf), 
+                          TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
             }
-            tcbdbcurnext(cur);
         }
-        tcbdbcurdel(cur);
-    } else if (mqf->tcop == TDBQCSTRBW) { /* String begins with */
-        assert(midx->type == TDBITLEXICAL);
-        char *expr = mqf->expr;
-        int exprsz = mqf->exprsz;
-        BDBCUR *cur = tcbdbcurnew(midx->db);
-        tcbdbcurjump(cur, expr, exprsz + trim);
-        while ((all || count < max) && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
-            if (trim) kbufsz -= 3;
-            if (kbufsz >= exprsz && !memcmp(kbuf, expr, exprsz)) {
-                vbuf = tcbdbcurval3(cur, &vbufsz);
-                if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
-                    _qry_and_or_match(coll, q, vbuf, vbufsz)) {
-                        
-                    JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+wfinish:
+        tcxstrclear(skbuf);
+        tcxstrclear(q->colbuf);
+        tcxstrclear(q->bsbuf);
+    }
+    tchdbiter2dispose(hdb, hdbiter);
+    tcxstrdel(skbuf);
+    if (updkeys) {
+        tcmapdel(updkeys);
+    }
+
+sorting: /* Sorting resultset */
+    if (!res || aofsz <= 0 || ctx.ecode) { // No sorting needed
+        goto finish;
+    }
+    _qrystage(&ctx, JBQSTSORT);
+    sortmode = ctx.topk ? "topk" : "memory";
+    if (ctx.runs) { // Merge spilled sorted runs
+        sortmode = "spill";
+        sortruns = TCLISTNUM(ctx.runs);
+        if (log) {
+            tcxstrprintf(log, "SORT SPILLED RUNS: %d\n", TCLISTNUM(ctx.runs));
+        }
+        _EJBSORTMERGE merge;
+        bool rv = _sortmerge(&ctx, &merge);
+        if (rv && cur && !ctx.jdefer) { // Final merge is streamed by the query cursor
+            TCMALLOC(cur->merge, sizeof(merge));
+            memcpy(cur->merge, &merge, sizeof(merge));
+            cur->skip = skip;
+            cur->max = max;
+            goto finish;
+        }
+        TCLIST *mres = tclistnew2(TCLISTINYNUM);
+        TCLISTDATUM d;
+        for (uint32_t i = 0; rv && i < max && _sortmergenext(&ctx, &merge, &d); ++i) {
+            if (i >= skip) {
+                TCLISTPUSH(mres, d.ptr, d.size);
+            }
+        }
+        if (!_sortmergeclose(&ctx, &merge)) {
+            rv = false;
+        }
+        tclistdel(res);
+        ctx.res = res = mres;
+        all = false; // Skipped records are not merged
+        if (!rv) {
+            ctx.ecode = JBEQRSSORTING;
+            _ejdbsetecode(coll->jb, ctx.ecode, __FILE__, __LINE__, __func__);
+            if (log) {
+                tcxstrprintf(log, "SORT MERGE FAILED\n");
+            }
+        }
+    } else {
+        _ejdbsortres(res, ofs, ofsz, ctx.topk ? ctx.topkseq : NULL);
+    }
+
+finish:
+    _qrystage(&ctx, JBQSTFINISH);
+    if (ofsz > 0 && aofsz <= 0) {
+        sortmode = "index";
+    }
+    // Check $upsert operation
+    if (count == 0 && (q->flags & EJQUPDATING) && !ctx.ecode) { // Finding the $upsert qf if no updates maden
+        for (int i = 0; i < qfsz; ++i) {
+            if (qfs[i]->flags & EJCONDUPSERT) {
+                bson *updateobj = qfs[i]->updateobj;
+                assert(updateobj);
+                bson_oid_t oid;
+                if (_ejdbsavebsonimpl(coll, updateobj, &oid, false)) {
+                    bson *nbs = bson_create();
+                    bson_init_size(nbs, 
+                                   bson_size(updateobj) + 
+                                   (strlen(JDBIDKEYNAME) + 1/*key*/ + 1/*type*/ + sizeof (oid)));
+                    bson_append_oid(nbs, JDBIDKEYNAME, &oid);
+                    bson_ensure_space(nbs, bson_size(updateobj) - 4);
+                    bson_append(nbs, bson_data(updateobj) + 4, 
+                                bson_size(updateobj) - (4 + 1/*BSON_EOO*/));
+                    bson_finish(nbs);
+                    if (nbs->err) {
+                        _ejdbsetecode(coll->jb, JBEINVALIDBSON, __FILE__, __LINE__, __func__);
+                        break;
+                    }
+                    ++count;
+                    if (!(q->flags & EJQONLYCOUNT) && (all || count > skip)) {
+                        _pushprocessedbson(&ctx, bson_data(nbs), bson_size(nbs));
+                    }
+                    bson_del(nbs);
                 }
-            } else {
                 break;
             }
-            tcbdbcurnext(cur);
         }
-        tcbdbcurdel(cur);
-    } else if (mqf->tcop == TDBQCSTRORBW) { /* String begins with one token in */
-        assert(mqf->ftype == BSON_ARRAY);
-        assert(midx->type == TDBITLEXICAL);
-        BDBCUR *cur = tcbdbcurnew(midx->db);
-        TCLIST *tokens = mqf->exprlist;
-        assert(tokens);
-        tclistsort(tokens);
-        for (int i = 1; i < TCLISTNUM(tokens); i++) {
-            if (!strcmp(TCLISTVALPTR(tokens, i), TCLISTVALPTR(tokens, i - 1))) {
-                TCFREE(tclistremove2(tokens, i));
-                i--;
+    } // EOF $upsert
+
+    if (ctx.agg && res) { // Matched records are replaced by their groups
+        if (log) {
+            tcxstrprintf(log, "GROUPED RECORDS: %u SPILLED RUNS: %d\n", count, ctx.agg->nruns);
+        }
+        if (!_aggfinish(&ctx)) { // Merging of spilled groups failed, partial groups are not returned
+            ctx.ecode = JBEQERROR;
+            _ejdbsetecode(coll->jb, ctx.ecode, __FILE__, __LINE__, __func__);
+            if (log) {
+                tcxstrprintf(log, "GROUP MERGE FAILED\n");
             }
         }
-        if (mqf->order < 0 && (mqf->flags & EJFORDERUSED)) {
-            tclistinvert(tokens);
+        count = TCLISTNUM(res);
+    }
+
+    // Revert max
+    if (max < UINT_MAX && max > skip) {
+        max = max - skip;
+    }
+    if (res && !(cur && cur->merge)) { // Records of the streamed merge are skipped by cursor
+        if (all) { // Skipping results after full sorting with skip > 0
+            for (int i = 0; i < skip && res->num > 0; ++i) {
+                TCFREE(res->array[res->start].ptr);
+                ++(res->start);
+                --(res->num);
+            }
         }
-        int tnum = TCLISTNUM(tokens);
-        for (int i = 0; (all || count < max) && i < tnum; i++) {
-            const char *token;
-            int tsiz;
-            TCLISTVAL(token, tokens, i, tsiz);
-            if (tsiz < 1) continue;
-            tcbdbcurjump(cur, token, tsiz + trim);
-            while ((all || count < max) && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
-                if (trim) kbufsz -= 3;
-                if (kbufsz >= tsiz && !memcmp(kbuf, token, tsiz)) {
-                    vbuf = tcbdbcurval3(cur, &vbufsz);
-                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
-                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
-                            
-                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
-                    }
-                } else {
-                    break;
-                }
-                tcbdbcurnext(cur);
+        if ((res->start & 0xff) == 0 && res->start > (res->num >> 1)) {
+            memmove(res->array, res->array + res->start, res->num * sizeof (res->array[0]));
+            res->start = 0;
+        }
+        if (TCLISTNUM(res) > max) { // truncate results if max specified
+            int end = res->start + res->num;
+            TCLISTDATUM *array = res->array;
+            for (int i = (res->start + max); i < end; i++) {
+                TCFREE(array[i].ptr);
+                --(res->num);
             }
         }
-        tcbdbcurdel(cur);
-    } else if (mqf->tcop == TDBQCSTROREQ) { /* String is equal to at least one token in */
-        assert(mqf->ftype == BSON_ARRAY);
-        assert(midx->type == TDBITLEXICAL);
-        BDBCUR *cur = tcbdbcurnew(midx->db);
-        TCLIST *tokens = mqf->exprlist;
-        assert(tokens);
-        tclistsort(tokens);
-        for (int i = 1; i < TCLISTNUM(tokens); i++) {
-            if (!strcmp(TCLISTVALPTR(tokens, i), TCLISTVALPTR(tokens, i - 1))) {
-                TCFREE(tclistremove2(tokens, i));
-                i--;
+    }
+    if (ctx.jdefer && res && !ctx.ecode) { // Apply $do and $fields to the final result set
+        int rnum = _qryjoinprefetch(&ctx, res);
+        if (log) {
+            tcxstrprintf(log, "$join PREFETCHED RECORDS: %d\n", rnum);
+        }
+        ctx.jdefer = false;
+        ctx.topk = 0;
+        ctx.sortmem = 0;
+        ctx.res = tclistnew2(TCLISTNUM(res) + 1);
+        for (int i = 0; i < TCLISTNUM(res); ++i) {
+            _pushprocessedbson(&ctx, TCLISTVALPTR(res, i), TCLISTVALSIZ(res, i));
+        }
+        tclistdel(res);
+        res = ctx.res;
+    }
+    uint32_t matched = count;
+    count = (skip < count) ? count - skip : 0;
+    if (count > max) {
+        count = max;
+    }
+    *outcount = count;
+    if (explain) {
+        _qrystage(&ctx, -1);
+        _qryexplain(&ctx, access, sortmode, sortruns, matched, count);
+    }
+    if (ctx.started > 0) {
+        _qryslowlog(&ctx, access, matched);
+    }
+    TCSTATADD(coll->st_queries, 1);
+    if (access && strstr(access, "fullscan")) {
+        TCSTATADD(coll->st_fullscans, 1);
+    } else if (!access) {
+        TCSTATADD(coll->st_idxscans, 1);
+    }
+    if (log) {
+        if (q->match && q->match->tnum > 0) {
+            tcxstrprintf(log, "SINGLE PASS CONDITIONS: %d\n", q->match->tnum);
+        }
+        tcxstrprintf(log, "RS COUNT: %u\n", count);
+        tcxstrprintf(log, "RS SIZE: %d\n", (res ? TCLISTNUM(res) : 0));
+        tcxstrprintf(log, "FINAL SORTING: %s\n", 
+                           ((q->flags & EJQONLYCOUNT) || aofsz <= 0) ? "NO" : "YES");
+    }
+
+    // Apply deffered index changes
+    if (ctx.didxctx) {
+        for (int i = TCLISTNUM(ctx.didxctx) - 1; i >= 0; --i) {
+            _DEFFEREDIDXCTX *di = TCLISTVALPTR(ctx.didxctx, i);
+            assert(di);
+            if (di->rmap) {
+                tctdbidxout2(coll->tdb, &(di->oid), sizeof (di->oid), di->rmap);
+                tcmapdel(di->rmap);
+            }
+            if (di->imap) {
+                tctdbidxput2(coll->tdb, &(di->oid), sizeof (di->oid), di->imap);
+                tcmapdel(di->imap);
             }
         }
-        if (mqf->order < 0 && (mqf->flags & EJFORDERUSED)) {
-            tclistinvert(tokens);
+    }
+    // Cleanup
+    if (qfs) {
+        TCFREE(qfs);
+    }
+    if (cur && cur->merge) { // Context of the streamed merge is moved into the cursor
+        cur->ctx = ctx;
+        return NULL;
+    }
+    if (ofs) {
+        TCFREE(ofs);
+    }
+    if (ctx.ecode) { // Interrupted query has no result
+        *outcount = 0;
+        ctx.res = res;
+        res = NULL;
+    } else {
+        ctx.res = NULL; // Save res from deleting in `_qryctxclear()`
+    }
+    _qryctxclear(&ctx);
+#undef JBQREGREC
+#undef JBQNEXT
+    return res;
+}
+
+static void _qryctxclear(_QRYCTX *ctx) {
+    if (ctx->dfields) {
+        tcmapdel(ctx->dfields);
+    }
+    if (ctx->ifields) {
+        tcmapdel(ctx->ifields);
+    }
+    if (ctx->q) {
+        EJQPLAN *plan = ctx->plan;
+        if (plan && !plan->colbuf && ctx->q->colbuf) { // Give buffers back to the prepared query
+            plan->colbuf = ctx->q->colbuf;
+            plan->bsbuf = ctx->q->bsbuf;
+            plan->tmpbuf = ctx->q->tmpbuf;
+            ctx->q->colbuf = ctx->q->bsbuf = ctx->q->tmpbuf = NULL;
         }
-        int tnum = TCLISTNUM(tokens);
-        for (int i = 0; (all || count < max) && i < tnum; i++) {
-            const char *token;
-            int tsiz;
-            TCLISTVAL(token, tokens, i, tsiz);
-            if (tsiz < 1) continue;
-            tcbdbcurjump(cur, token, tsiz + trim);
-            while ((all || count < max) && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
-                if (trim) kbufsz -= 3;
-                if (kbufsz == tsiz && !memcmp(kbuf, token, tsiz)) {
-                    vbuf = tcbdbcurval3(cur, &vbufsz);
-                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
-                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
-                            
-                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
-                    }
-                } else {
-                    break;
-                }
-                tcbdbcurnext(cur);
+        ejdbquerydel(ctx->q);
+    }
+    if (ctx->res) {
+        tclistdel(ctx->res);
+    }
+    if (ctx->didxctx) {
+        tclistdel(ctx->didxctx);
+    }
+    if (ctx->isect) {
+        tclistdel(ctx->isect);
+    }
+    if (ctx->orunion) {
+        tclistdel(ctx->orunion);
+    }
+    if (ctx->cidx) {
+        tcxstrdel(ctx->cidx->lkey);
+        tcxstrdel(ctx->cidx->ukey);
+        TCFREE(ctx->cidx);
+    }
+    if (ctx->agg) {
+        _aggdel(ctx->agg);
+    }
+    if (ctx->jcache) {
+        tcmapdel(ctx->jcache);
+    }
+    if (ctx->cands) {
+        tclistdel(ctx->cands);
+    }
+    if (ctx->topkseq) {
+        TCFREE(ctx->topkseq);
+    }
+    if (ctx->runs) {
+        for (int i = 0; i < TCLISTNUM(ctx->runs); ++i) {
+            unlink(TCLISTVALPTR(ctx->runs, i));
+        }
+        tclistdel(ctx->runs);
+    }
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+/**
+ * Prepare query cursor streaming records straight from the collection records iterator
+ * or from the main index keys range. Returns false if query is executed in updating or
+ * count mode, needs the final sorting or its main index cannot be scanned incrementally.
+ * In this case the cursor iterates over the materialized result set.
+ */
+static bool _qrycuropen(EJQCUR *cur, const EJQ *_q, int qflags, TCXSTR *log) {
+    _QRYCTX *ctx = &cur->ctx;
+    EJCOLL *coll = cur->coll;
+    EJQ *q;
+    TCMALLOC(q, sizeof (*q));
+    if (!_qrydup(_q, q, EJQINTERNAL)) {
+        TCFREE(q);
+        return false;
+    }
+    ctx->q = q;
+    ctx->qflags = qflags;
+    ctx->coll = coll;
+    if (!_qryplanattach(ctx, _q) || !_qrypreprocess(ctx)) {
+        goto fail;
+    }
+    EJQF *mqf = ctx->mqf;
+    const TDBIDX *midx = mqf ? mqf->idx : NULL;
+    if ((q->flags & (EJQUPDATING | EJQONLYCOUNT | EJQDROPALL)) ||
+            ctx->isect || ctx->orunion || ctx->cidx || ctx->agg || (mqf && !midx)) {
+        goto fail;
+    }
+    if (midx && mqf->orderseq == 1 &&
+            !(mqf->tcop == TDBQCSTRAND || mqf->tcop == TDBQCSTROR || mqf->tcop == TDBQCSTRNUMOR) &&
+            !(mqf->tcop == TDBQCSTRRX && mqf->order < 0)) {
+        mqf->flags |= EJFORDERUSED;
+    }
+    cur->qfsz = TCLISTNUM(q->qflist);
+    if (cur->qfsz > 0) {
+        TCMALLOC(cur->qfs, cur->qfsz * sizeof (EJQF*));
+    }
+    for (int i = 0; i < cur->qfsz; ++i) {
+        EJQF *qf = TCLISTVALPTR(q->qflist, i);
+        if (qf->orderseq && !(qf->flags & EJFORDERUSED)) { // Final sorting is needed
+            goto fail;
+        }
+        qf->jb = coll->jb;
+        cur->qfs[i] = qf;
+        if (qf->fpathsz > 0 && !(qf->flags & EJFEXCLUDED)) {
+            cur->anum++;
+        }
+    }
+    if (midx) {
+        cur->trim = (*midx->name != '\0');
+        if (mqf->tcop == TDBQTRUE) {
+            cur->desc = (mqf->order < 0);
+        } else if (mqf->tcop == TDBQCSTREQ || mqf->tcop == TDBQCSTRBW) {
+            assert(midx->type == TDBITLEXICAL);
+        } else if (midx->type == TDBITBINNUM && _numkeyrange(mqf, &cur->kr)) {
+            if (cur->kr.keys) { // `$in` keys are not streamed
+                tclistdel(cur->kr.keys);
+                goto fail;
             }
+            cur->desc = (mqf->order < 0 && (mqf->flags & EJFORDERUSED));
+        } else {
+            goto fail;
         }
-        tcbdbcurdel(cur);
-    } else if (mqf->tcop == TDBQCNUMEQ) { /* Number is equal to */
-        assert(midx->type == TDBITDECIMAL);
-        char *expr = mqf->expr;
-        int exprsz = mqf->exprsz;
-        BDBCUR *cur = tcbdbcurnew(midx->db);
-        _EJDBNUM num;
-        _nufetch(&num, expr, mqf->ftype);
-        tctdbqryidxcurjumpnum(cur, expr, exprsz, true);
-        while ((all || count < max) && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
-            if (_nucmp(&num, kbuf, mqf->ftype) == 0) {
-                vbuf = tcbdbcurval3(cur, &vbufsz);
-                if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
-                    _qry_and_or_match(coll, q, vbuf, vbufsz)) {
-                        
-                    JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
-                }
+        if (cur->anum > 0 && !(mqf->flags & EJFEXCLUDED) && !(mqf->uslots && TCLISTNUM(mqf->uslots) > 0)) {
+            cur->anum--;
+            mqf->flags |= EJFEXCLUDED;
+        }
+        _NUMKEYRANGE *kr = &cur->kr;
+        cur->icur = tcbdbcurnew(midx->db);
+        if (mqf->tcop == TDBQTRUE) {
+            if (cur->desc) {
+                tcbdbcurlast(cur->icur);
             } else {
-                break;
-            }
-            tcbdbcurnext(cur);
+                tcbdbcurfirst(cur->icur);
+            }
+        } else if (mqf->tcop == TDBQCSTREQ || mqf->tcop == TDBQCSTRBW) {
+            tcbdbcurjump(cur->icur, mqf->expr, mqf->exprsz + cur->trim);
+        } else if (cur->desc && kr->hasup) { // Key suffix is '\0' + 2 bytes of pk hash
+            memset(kr->ukey + JBNUMKEYSZ, 0xff, 3);
+            tcbdbcurjumpback(cur->icur, kr->ukey, JBNUMKEYSZ + 3);
+        } else if (cur->desc) {
+            tcbdbcurlast(cur->icur);
+        } else if (kr->haslow) {
+            tcbdbcurjump(cur->icur, kr->lkey, JBNUMKEYSZ);
+        } else {
+            tcbdbcurfirst(cur->icur);
         }
-        tcbdbcurdel(cur);
-    } else if (mqf->tcop == TDBQCNUMGT || mqf->tcop == TDBQCNUMGE) {
-        /* Number is greater than | number is greater than or equal to */
-        assert(midx->type == TDBITDECIMAL);
-        char *expr = mqf->expr;
-        int exprsz = mqf->exprsz;
-        BDBCUR *cur = tcbdbcurnew(midx->db);
-        _EJDBNUM xnum;
-        _nufetch(&xnum, expr, mqf->ftype);
-        if (mqf->order < 0 && (mqf->flags & EJFORDERUSED)) { //DESC
-            tcbdbcurlast(cur);
-            while ((all || count < max) && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
-                _EJDBNUM knum;
-                _nufetch(&knum, kbuf, mqf->ftype);
-                int cmp = _nucmp2(&knum, &xnum, mqf->ftype);
-                if (cmp < 0) break;
-                if (cmp > 0 || (mqf->tcop == TDBQCNUMGE && cmp >= 0)) {
-                    vbuf = tcbdbcurval3(cur, &vbufsz);
-                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
-                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
-                            
-                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
-                    }
-                }
-                tcbdbcurprev(cur);
+        cur->lkey = tcxstrnew();
+        cur->lpks = tcmapnew2(TCMAPTINYBNUM);
+    } else {
+        cur->hdbiter = tchdbiter2init(coll->tdb->hdb);
+        cur->eof = (cur->hdbiter == NULL);
+    }
+    cur->pkbuf = tcxstrnew3(sizeof (bson_oid_t) + 1);
+    cur->skip = q->skip;
+    cur->max = (q->max > 0) ? q->max : UINT_MAX;
+    if (cur->max < UINT_MAX - cur->skip) {
+        cur->max += cur->skip;
+    }
+    ctx->sortmem = 0;
+    if (log) {
+        tcxstrprintf(log, "MAX: %u\n", cur->max);
+        tcxstrprintf(log, "SKIP: %u\n", cur->skip);
+        tcxstrprintf(log, "MAIN IDX: '%s'\n", midx ? midx->name : "NONE");
+        if (midx) {
+            tcxstrprintf(log, "MAIN IDX TCOP: %d\n", mqf->tcop);
+        } else {
+            tcxstrprintf(log, "RUN FULLSCAN\n");
+        }
+        tcxstrprintf(log, "ACTIVE CONDITIONS: %d\n", cur->anum);
+        tcxstrprintf(log, "STREAMING CURSOR: YES\n");
+    }
+    return true;
+
+fail:
+    if (cur->qfs) {
+        TCFREE(cur->qfs);
+    }
+    cur->qfs = NULL;
+    cur->qfsz = 0;
+    cur->anum = 0;
+    _qryctxclear(ctx);
+    return false;
+}
+
+/**
+ * Reposition the main index cursor past the last examined key `cur->lkey` and its examined records.
+ * The collection is unlocked between fetches, so the index leaves may have been changed
+ * and the position kept by the index cursor is not reliable.
+ */
+static void _qrycurseek(EJQCUR *cur) {
+    BDBCUR *icur = cur->icur;
+    const char *kbuf;
+    int kbufsz, vbufsz, sp;
+    const void *vbuf;
+    if (cur->desc) {
+        tcbdbcurjumpback(icur, TCXSTRPTR(cur->lkey), TCXSTRSIZE(cur->lkey));
+    } else {
+        tcbdbcurjump(icur, TCXSTRPTR(cur->lkey), TCXSTRSIZE(cur->lkey));
+    }
+    while ((kbuf = tcbdbcurkey3(icur, &kbufsz)) != NULL && kbufsz == TCXSTRSIZE(cur->lkey) &&
+            !memcmp(kbuf, TCXSTRPTR(cur->lkey), kbufsz)) {
+        vbuf = tcbdbcurval3(icur, &vbufsz);
+        if (!vbuf || !tcmapget(cur->lpks, vbuf, vbufsz, &sp)) {
+            break;
+        }
+        if (cur->desc) {
+            tcbdbcurprev(icur);
+        } else {
+            tcbdbcurnext(icur);
+        }
+    }
+}
+
+/**
+ * Move query cursor to the next matched record.
+ * The record is loaded into the `bsbuf` query buffer and its primary key into `cur->pkbuf`.
+ * Returns false if there are no more records.
+ */
+static bool _qrycurfetch(EJQCUR *cur) {
+    EJCOLL *coll = cur->coll;
+    EJQ *q = cur->ctx.q;
+    EJQF **qfs = cur->qfs;
+    int qfsz = cur->qfsz;
+    if (cur->hdbiter) { // Full scan
+        TCHDB *hdb = coll->tdb->hdb;
+        while (true) {
+            tcxstrclear(cur->pkbuf);
+            tcxstrclear(q->colbuf);
+            tcxstrclear(q->bsbuf);
+            if (!tchdbiter2next(hdb, cur->hdbiter, cur->pkbuf, q->colbuf)) {
+                return false;
             }
-        } else { // ASC
-            tctdbqryidxcurjumpnum(cur, expr, exprsz, true);
-            while ((all || count < max) && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
-                _EJDBNUM knum;
-                _nufetch(&knum, kbuf, mqf->ftype);
-                int cmp = _nucmp2(&knum, &xnum, mqf->ftype);
-                if (cmp > 0 || (mqf->tcop == TDBQCNUMGE && cmp >= 0)) {
-                    vbuf = tcbdbcurval3(cur, &vbufsz);
-                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
-                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
-                            
-                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
-                    }
-                }
-                tcbdbcurnext(cur);
+            if (tcmaploadoneintoxstr(TCXSTRPTR(q->colbuf), TCXSTRSIZE(q->colbuf), 
+                                     JDBCOLBSON, JDBCOLBSONL, q->bsbuf) <= 0) {
+                continue;
+            }
+            bool matched = _qryqfsmatch(q, qfs, qfsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+            if (matched && _qry_and_or_match(coll, q, TCXSTRPTR(cur->pkbuf), TCXSTRSIZE(cur->pkbuf))) {
+                return true;
             }
         }
-        tcbdbcurdel(cur);
-    } else if (mqf->tcop == TDBQCNUMLT || mqf->tcop == TDBQCNUMLE) {
-        /* Number is less than | number is less than or equal to */
-        assert(midx->type == TDBITDECIMAL);
-        char *expr = mqf->expr;
-        int exprsz = mqf->exprsz;
-        BDBCUR *cur = tcbdbcurnew(midx->db);
-        _EJDBNUM xnum;
-        _nufetch(&xnum, expr, mqf->ftype);
-        if (mqf->order >= 0) { //ASC
-            tcbdbcurfirst(cur);
-            while ((all || count < max) && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
-                _EJDBNUM knum;
-                _nufetch(&knum, kbuf, mqf->ftype);
-                int cmp = _nucmp2(&knum, &xnum, mqf->ftype);
-                if (cmp > 0) break;
-                if (cmp < 0 || (cmp <= 0 && mqf->tcop == TDBQCNUMLE)) {
-                    vbuf = tcbdbcurval3(cur, &vbufsz);
-                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
-                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
-                            
-                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
-                    }
-                }
-                tcbdbcurnext(cur);
+    }
+    EJQF *mqf = cur->ctx.mqf;
+    _NUMKEYRANGE *kr = &cur->kr;
+    const char *kbuf;
+    int kbufsz;
+    const void *vbuf;
+    int vbufsz;
+    if (TCXSTRSIZE(cur->lkey) > 0) {
+        _qrycurseek(cur);
+    }
+    while ((kbuf = tcbdbcurkey3(cur->icur, &kbufsz)) != NULL) {
+        if (kbufsz != TCXSTRSIZE(cur->lkey) || memcmp(kbuf, TCXSTRPTR(cur->lkey), kbufsz)) {
+            tcxstrclear(cur->lkey);
+            TCXSTRCAT(cur->lkey, kbuf, kbufsz);
+            tcmapclear(cur->lpks);
+        }
+        bool inrange = true;
+        if (mqf->tcop == TDBQTRUE) {
+            // All keys
+        } else if (mqf->tcop == TDBQCSTREQ) {
+            if (cur->trim) kbufsz -= 3;
+            if (kbufsz != mqf->exprsz || memcmp(kbuf, mqf->expr, mqf->exprsz)) {
+                break;
+            }
+        } else if (mqf->tcop == TDBQCSTRBW) {
+            if (cur->trim) kbufsz -= 3;
+            if (kbufsz < mqf->exprsz || memcmp(kbuf, mqf->expr, mqf->exprsz)) {
+                break;
             }
         } else {
-            tctdbqryidxcurjumpnum(cur, expr, exprsz, false);
-            while ((all || count < max) && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
-                _EJDBNUM knum;
-                _nufetch(&knum, kbuf, mqf->ftype);
-                int cmp = _nucmp2(&knum, &xnum, mqf->ftype);
-                if (cmp < 0 || (cmp <= 0 && mqf->tcop == TDBQCNUMLE)) {
-                    vbuf = tcbdbcurval3(cur, &vbufsz);
-                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
-                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
-                            
-                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
-                    }
-                }
-                tcbdbcurprev(cur);
+            if (kbufsz < JBNUMKEYSZ) break;
+            int lcmp = kr->haslow ? memcmp(kbuf, kr->lkey, JBNUMKEYSZ) : 1;
+            int ucmp = kr->hasup ? memcmp(kbuf, kr->ukey, JBNUMKEYSZ) : -1;
+            if (cur->desc ? (lcmp < 0 || (lcmp == 0 && !kr->lincl)) : (ucmp > 0 || (ucmp == 0 && !kr->uincl))) {
+                break;
             }
+            inrange = (lcmp > 0 || (lcmp == 0 && kr->lincl)) && (ucmp < 0 || (ucmp == 0 && kr->uincl));
         }
-        tcbdbcurdel(cur);
-    } else if (mqf->tcop == TDBQCNUMBT) { /* Number is between two tokens of */
-        assert(mqf->ftype == BSON_ARRAY);
-        assert(midx->type == TDBITDECIMAL);
-        assert(mqf->exprlist);
-        TCLIST *tokens = mqf->exprlist;
-        assert(TCLISTNUM(tokens) == 2);
-        const char *expr;
-        int exprsz;
-        long double lower = tcatof2(tclistval2(tokens, 0));
-        long double upper = tcatof2(tclistval2(tokens, 1));
-        expr = tclistval2(tokens, (lower > upper) ? 1 : 0);
-        exprsz = strlen(expr);
-        if (lower > upper) {
-            long double swap = lower;
-            lower = upper;
-            upper = swap;
+        tcxstrclear(cur->pkbuf);
+        vbuf = tcbdbcurval3(cur->icur, &vbufsz);
+        if (vbuf) {
+            tcmapputkeep(cur->lpks, vbuf, vbufsz, "", 0);
         }
-        BDBCUR *cur = tcbdbcurnew(midx->db);
-        tctdbqryidxcurjumpnum(cur, expr, exprsz, true);
-        while ((all || count < max) && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
-            if (tcatof2(kbuf) > upper) break;
-            vbuf = tcbdbcurval3(cur, &vbufsz);
-            if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
-                _qry_and_or_match(coll, q, vbuf, vbufsz)) {
-                    
-                JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
-            }
-            tcbdbcurnext(cur);
+        if (inrange && vbuf) {
+            TCXSTRCAT(cur->pkbuf, vbuf, vbufsz);
         }
-        tcbdbcurdel(cur);
-        if (!all && !(q->flags & EJQONLYCOUNT) && 
-            mqf->order < 0 && (mqf->flags & EJFORDERUSED)) { //DESC
+        if (cur->desc) {
+            tcbdbcurprev(cur->icur);
+        } else {
+            tcbdbcurnext(cur->icur);
+        }
+        if (inrange && 
+            _qryallcondsmatch(q, cur->anum, coll, qfs, qfsz, TCXSTRPTR(cur->pkbuf), TCXSTRSIZE(cur->pkbuf)) && 
+            _qry_and_or_match(coll, q, TCXSTRPTR(cur->pkbuf), TCXSTRSIZE(cur->pkbuf))) {
             
-            tclistinvert(res);
+            return true;
         }
-    } else if (mqf->tcop == TDBQCNUMOREQ) { /* Number is equal to at least one token in */
-        assert(mqf->ftype == BSON_ARRAY);
-        assert(midx->type == TDBITDECIMAL);
-        BDBCUR *cur = tcbdbcurnew(midx->db);
-        TCLIST *tokens = mqf->exprlist;
-        assert(tokens);
-        tclistsortex(tokens, tdbcmppkeynumasc);
-        for (int i = 1; i < TCLISTNUM(tokens); i++) {
-            if (tcatof2(TCLISTVALPTR(tokens, i)) == tcatof2(TCLISTVALPTR(tokens, i - 1))) {
-                TCFREE(tclistremove2(tokens, i));
-                i--;
+    }
+    return false;
+}
+
+/* Returns the next record of the streaming query cursor. See `ejdbqrycurnext()` */
+static const void* _qrycurnext(EJQCUR *cur, int *size) {
+    _QRYCTX *ctx = &cur->ctx;
+    EJQ *q = ctx->q;
+    tclistclear(ctx->res);
+    while (TCLISTNUM(ctx->res) == 0) {
+        if (cur->count >= cur->max || !_qrycurfetch(cur)) {
+            cur->eof = true;
+            return NULL;
+        }
+        if (++cur->count > cur->skip) {
+            _pushprocessedbson(ctx, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+        }
+    }
+    return tclistval(ctx->res, 0, size);
+}
+
+static TDBIDX* _qryfindidx(EJCOLL *coll, EJQF *qf, bson *idxmeta) {
+    TCTDB *tdb = coll->tdb;
+    char p = '\0';
+    switch (qf->tcop) {
+        case TDBQCSTREQ:
+        case TDBQCSTRBW:
+        case TDBQCSTROREQ:
+        case TDBQCSTRORBW:
+            p = (qf->flags & EJCONDICASE) ? 'i' : 's'; // lexical string index
+            break;
+        case TDBQCSTRRX:
+            if (qf->rxprefixsz > 0) { // anchored expression, range scan of its literal prefix
+                p = (qf->flags & EJFRXICASE) ? 'i' : 's';
+            }
+            break;
+        case TDBQCNUMEQ:
+        case TDBQCNUMGT:
+        case TDBQCNUMGE:
+        case TDBQCNUMLT:
+        case TDBQCNUMLE:
+        case TDBQCNUMBT:
+        case TDBQCNUMOREQ:
+            p = 'n'; // number index
+            break;
+        case TDBQCSTRAND:
+        case TDBQCSTROR:
+            p = 'a'; // token index
+            break;
+        case TDBQTRUE:
+            p = 'o'; // take first appropriate index
+            break;
+    }
+    if (p == '\0' || !qf->fpath || !qf->fpathsz) {
+        return NULL;
+    }
+    for (int i = 0; i < tdb->inum; ++i) {
+        TDBIDX *idx = tdb->idxs + i;
+        assert(idx);
+        if (p == 'o') {
+            if (*idx->name == 'a' || *idx->name == 'i' || *idx->name == 'c') { 
+                // token, icase or compound index not the best solution here
+                continue;
+            }
+        } else if (*idx->name != p) {
+            continue;
+        }
+        if (!strcmp(qf->fpath, idx->name + 1)) {
+            return idx;
+        }
+    }
+    // No direct operation index. Any alternatives?
+    if (idxmeta &&
+            !(qf->flags & EJCONDICASE) && // Not a case insensitive query
+            (
+                qf->tcop == TDBQCSTREQ ||
+                qf->tcop == TDBQCSTROREQ ||
+                qf->tcop == TDBQCNUMOREQ ||
+                qf->tcop == TDBQCNUMEQ)
+       ) {
+        bson_iterator it;
+        bson_type bt = bson_find(&it, idxmeta, "iflags");
+        if (bt != BSON_INT) {
+            return NULL;
+        }
+        int iflags = bson_iterator_int(&it);
+        if (iflags & JBIDXARR) { // Array token index exists so convert qf into TDBQCSTROR
+            for (int i = 0; i < tdb->inum; ++i) {
+                TDBIDX *idx = tdb->idxs + i;
+                if (!strcmp(qf->fpath, idx->name + 1)) {
+                    if (qf->tcop == TDBQCSTREQ) {
+                        qf->tcop = TDBQCSTROR;
+                        qf->exprlist = tclistnew2(1);
+                        TCLISTPUSH(qf->exprlist, qf->expr, qf->exprsz);
+                        if (qf->expr) TCFREE(qf->expr);
+                        qf->expr = tclistdump(qf->exprlist, &qf->exprsz);
+                        qf->ftype = BSON_ARRAY;
+                        return idx;
+                    } else if (qf->tcop == TDBQCNUMEQ) {
+                        qf->tcop = TDBQCSTRNUMOR;
+                        qf->exprlist = tclistnew2(1);
+                        TCLISTPUSH(qf->exprlist, qf->expr, qf->exprsz);
+                        if (qf->expr) TCFREE(qf->expr);
+                        qf->expr = tclistdump(qf->exprlist, &qf->exprsz);
+                        qf->ftype = BSON_ARRAY;
+                        return idx;
+                    } else if (qf->tcop == TDBQCSTROREQ) {
+                        assert(qf->ftype == BSON_ARRAY);
+                        qf->tcop = TDBQCSTROR;
+                        return idx;
+                    } else if (qf->tcop == TDBQCNUMOREQ) {
+                        assert(qf->ftype == BSON_ARRAY);
+                        qf->tcop = TDBQCSTRNUMOR;
+                        return idx;
+                    }
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Estimate the number of index entries matched by the indexed condition `qf`
+ * using index statistics collected by `ejdbanalyze()`.
+ * Returns -1 if condition cannot be estimated or served by PK set. See `_qryidxpks()`
+ */
+static double _qryidxestimate(const EJQF *qf) {
+    if (!qf->idx || !qf->idxmeta || qf->negate) {
+        return -1;
+    }
+    const TDBIDX *idx = qf->idx;
+    bson_iterator it;
+    bson_type bt;
+    char spath[32];
+    int64_t entries = -1, cardinality = -1;
+    snprintf(spath, sizeof (spath), "istats.%c.entries", *idx->name);
+    BSON_ITERATOR_INIT(&it, qf->idxmeta);
+    bt = bson_find_fieldpath_value(spath, &it);
+    if (BSON_IS_NUM_TYPE(bt)) {
+        entries = bson_iterator_long(&it);
+    }
+    snprintf(spath, sizeof (spath), "istats.%c.cardinality", *idx->name);
+    BSON_ITERATOR_INIT(&it, qf->idxmeta);
+    bt = bson_find_fieldpath_value(spath, &it);
+    if (BSON_IS_NUM_TYPE(bt)) {
+        cardinality = bson_iterator_long(&it);
+    }
+    if (entries < 0 || cardinality <= 0) {
+        return -1;
+    }
+    double eqrows = (double) entries / cardinality; // Average entries per key
+    if (idx->type == TDBITLEXICAL) {
+        if (qf->tcop == TDBQCSTREQ) {
+            return eqrows;
+        } else if (qf->tcop == TDBQCSTROREQ) {
+            return MIN(entries, eqrows * TCLISTNUM(qf->exprlist));
+        }
+        return -1;
+    }
+    _NUMKEYRANGE kr;
+    if (idx->type != TDBITBINNUM || !_numkeyrange(qf, &kr)) {
+        return -1;
+    }
+    if (kr.keys) {
+        double est = MIN(entries, eqrows * TCLISTNUM(kr.keys));
+        tclistdel(kr.keys);
+        return est;
+    } else if (qf->tcop == TDBQCNUMEQ) {
+        return eqrows;
+    }
+    // Range conditions: count equi-depth histogram buckets overlapping the range
+    double lv = kr.haslow ? _numkeydec(kr.lkey) : -DBL_MAX;
+    double uv = kr.hasup ? _numkeydec(kr.ukey) : DBL_MAX;
+    double pv = -DBL_MAX;
+    int nb = 0, hits = 0;
+    bson_iterator sit;
+    snprintf(spath, sizeof (spath), "istats.%c.histogram", *idx->name);
+    BSON_ITERATOR_INIT(&it, qf->idxmeta);
+    bt = bson_find_fieldpath_value(spath, &it);
+    if (bt != BSON_ARRAY) {
+        return -1;
+    }
+    BSON_ITERATOR_SUBITERATOR(&it, &sit);
+    while ((bt = bson_iterator_next(&sit)) != BSON_EOO) {
+        double v = bson_iterator_double(&sit);
+        if (v >= lv && pv <= uv) {
+            hits++;
+        }
+        pv = v;
+        nb++;
+    }
+    if (nb == 0) {
+        return -1;
+    }
+    return MAX(1.0, (double) entries * hits / nb);
+}
+
+/**
+ * Choose the set of indexed conditions whose primary key sets
+ * will be intersected before fetching records.
+ * Intersection is used if the estimated cost of reading index entries
+ * and fetching intersected records is lower than the cost of the main index
+ * or the full collection scan.
+ */
+static void _qryisectplan(_QRYCTX *ctx, uint32_t skipflags) {
+    EJQ *q = ctx->q;
+    EJQF *mqf = ctx->mqf;
+    TCLIST *qflist = q->qflist;
+    if (mqf && (mqf->flags & EJFPKMATCHING)) {
+        return;
+    }
+    if (mqf && mqf->orderseq == 1 && q->max > 0) { // Ordered main index scan stops early
+        return;
+    }
+    int cnum = 0;
+    double records = -1;
+    EJQF **cqfs;
+    double *cests;
+    TCMALLOC(cqfs, sizeof (*cqfs) * TCLISTNUM(qflist));
+    TCMALLOC(cests, sizeof (*cests) * TCLISTNUM(qflist));
+    for (int i = 0; i < TCLISTNUM(qflist); ++i) {
+        EJQF *qf = TCLISTVALPTR(qflist, i);
+        if ((qf->flags & skipflags) || (qf->uslots && TCLISTNUM(qf->uslots) > 0)) {
+            continue;
+        }
+        double est = _qryidxestimate(qf);
+        if (est < 0) {
+            continue;
+        }
+        if (records < 0) {
+            bson_iterator it;
+            bson_type bt = bson_find(&it, qf->idxmeta, "records");
+            if (BSON_IS_NUM_TYPE(bt)) {
+                records = bson_iterator_long(&it);
             }
         }
-        if (mqf->order < 0 && (mqf->flags & EJFORDERUSED)) {
-            tclistinvert(tokens);
+        int j = cnum++;
+        for (; j > 0 && cests[j - 1] > est; --j) { // Keep candidates ordered by estimation
+            cqfs[j] = cqfs[j - 1];
+            cests[j] = cests[j - 1];
         }
-        int tnum = TCLISTNUM(tokens);
-        for (int i = 0; (all || count < max) && i < tnum; i++) {
-            const char *token;
-            int tsiz;
-            TCLISTVAL(token, tokens, i, tsiz);
-            if (tsiz < 1) continue;
-            long double xnum = tcatof2(token);
-            tctdbqryidxcurjumpnum(cur, token, tsiz, true);
-            while ((all || count < max) && (kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
-                if (tcatof2(kbuf) == xnum) {
-                    vbuf = tcbdbcurval3(cur, &vbufsz);
-                    if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, vbuf, vbufsz) && 
-                        _qry_and_or_match(coll, q, vbuf, vbufsz)) {
-                            
-                        JBQREGREC(vbuf, vbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
-                    }
-                } else {
+        cqfs[j] = qf;
+        cests[j] = est;
+    }
+    if (cnum < 2 || records <= 0) {
+        goto finish;
+    }
+    double mcost = records; // Cost of single index or full scan in record fetches
+    if (mqf) {
+        mcost = _qryidxestimate(mqf);
+        if (mcost < 0) { // Main index cannot be compared
+            goto finish;
+        }
+    }
+    int inum = 1;
+    double rows = cests[0]; // Estimated intersection size assuming independent conditions
+    double cost = cests[0] / JBISECTENTRYCOST;
+    for (int i = 1; i < cnum; ++i) {
+        double nrows = rows * cests[i] / records;
+        if (cests[i] / JBISECTENTRYCOST + nrows < rows) {
+            cost += cests[i] / JBISECTENTRYCOST;
+            rows = nrows;
+            cqfs[inum++] = cqfs[i];
+        }
+    }
+    cost += rows;
+    if (inum < 2 || cost >= mcost) {
+        goto finish;
+    }
+    ctx->isect = tclistnew2(inum);
+    for (int i = 0; i < inum; ++i) {
+        TCLISTPUSH(ctx->isect, &cqfs[i], sizeof (cqfs[i]));
+    }
+    ctx->mqf = cqfs[0];
+
+finish:
+    TCFREE(cqfs);
+    TCFREE(cests);
+}
+
+/* Sort the `pks` list and remove duplicated pks, `pks` is released */
+static TCLIST* _qrypksuniq(TCLIST *pks) {
+    tclistsort(pks);
+    TCLIST *upks = tclistnew2(TCLISTNUM(pks) + 1);
+    for (int i = 0; i < TCLISTNUM(pks); ++i) {
+        if (i > 0 && TCLISTVALSIZ(pks, i) == TCLISTVALSIZ(pks, i - 1) &&
+                !memcmp(TCLISTVALPTR(pks, i), TCLISTVALPTR(pks, i - 1), TCLISTVALSIZ(pks, i))) {
+            continue;
+        }
+        TCLISTPUSH(upks, TCLISTVALPTR(pks, i), TCLISTVALSIZ(pks, i));
+    }
+    tclistdel(pks);
+    return upks;
+}
+
+/* Collect sorted unique primary keys of records matched by indexed condition `qf` */
+static TCLIST* _qryidxpks(const EJQF *qf) {
+    const TDBIDX *idx = qf->idx;
+    TCLIST *pks = tclistnew();
+    BDBCUR *cur = tcbdbcurnew(idx->db);
+    const char *kbuf;
+    int kbufsz;
+    const void *vbuf;
+    int vbufsz;
+    if (idx->type == TDBITBINNUM) {
+        _NUMKEYRANGE kr;
+        _numkeyrange(qf, &kr);
+        int rnum = kr.keys ? TCLISTNUM(kr.keys) : 1;
+        for (int i = 0; i < rnum; ++i) {
+            if (kr.keys) {
+                memcpy(kr.lkey, TCLISTVALPTR(kr.keys, i), JBNUMKEYSZ);
+                memcpy(kr.ukey, kr.lkey, JBNUMKEYSZ);
+            }
+            if (kr.haslow) {
+                tcbdbcurjump(cur, kr.lkey, JBNUMKEYSZ);
+            } else {
+                tcbdbcurfirst(cur);
+            }
+            while ((kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL && kbufsz >= JBNUMKEYSZ) {
+                int lcmp = kr.haslow ? memcmp(kbuf, kr.lkey, JBNUMKEYSZ) : 1;
+                int ucmp = kr.hasup ? memcmp(kbuf, kr.ukey, JBNUMKEYSZ) : -1;
+                if (ucmp > 0 || (ucmp == 0 && !kr.uincl)) {
                     break;
                 }
+                if (lcmp > 0 || (lcmp == 0 && kr.lincl)) {
+                    vbuf = tcbdbcurval3(cur, &vbufsz);
+                    TCLISTPUSH(pks, vbuf, vbufsz);
+                }
                 tcbdbcurnext(cur);
             }
         }
-        tcbdbcurdel(cur);
-    } else if (mqf->tcop == TDBQCSTRAND || mqf->tcop == TDBQCSTROR || mqf->tcop == TDBQCSTRNUMOR) {
-        /* String includes all tokens in | string includes at least one token in */
-        assert(midx->type == TDBITTOKEN);
-        assert(mqf->ftype == BSON_ARRAY);
-        TCLIST *tokens = mqf->exprlist;
-        assert(tokens);
-        if (mqf->tcop == TDBQCSTRNUMOR) {
-            tclistsortex(tokens, tdbcmppkeynumasc);
-            for (int i = 1; i < TCLISTNUM(tokens); i++) {
-                if (tcatof2(TCLISTVALPTR(tokens, i)) == tcatof2(TCLISTVALPTR(tokens, i - 1))) {
-                    TCFREE(tclistremove2(tokens, i));
-                    i--;
-                }
+        if (kr.keys) {
+            tclistdel(kr.keys);
+        }
+    } else { // Lexical string index
+        assert(idx->type == TDBITLEXICAL);
+        int tnum = (qf->tcop == TDBQCSTROREQ) ? TCLISTNUM(qf->exprlist) : 1;
+        for (int i = 0; i < tnum; ++i) {
+            const char *token = qf->expr;
+            int tsiz = qf->exprsz;
+            if (qf->tcop == TDBQCSTROREQ) {
+                TCLISTVAL(token, qf->exprlist, i, tsiz);
             }
-        } else {
-            tclistsort(tokens);
-            for (int i = 1; i < TCLISTNUM(tokens); i++) {
-                if (!strcmp(TCLISTVALPTR(tokens, i), TCLISTVALPTR(tokens, i - 1))) {
-                    TCFREE(tclistremove2(tokens, i));
-                    i--;
+            tcbdbcurjump(cur, token, tsiz + 1);
+            while ((kbuf = tcbdbcurkey3(cur, &kbufsz)) != NULL) {
+                kbufsz -= 3; // Key suffix: '\0' + 2 bytes of pk hash
+                if (kbufsz != tsiz || memcmp(kbuf, token, tsiz)) {
+                    break;
                 }
+                vbuf = tcbdbcurval3(cur, &vbufsz);
+                TCLISTPUSH(pks, vbuf, vbufsz);
+                tcbdbcurnext(cur);
             }
         }
-        TCMAP *tres = tctdbidxgetbytokens(coll->tdb, midx, tokens, mqf->tcop, log);
-        tcmapiterinit(tres);
-        while ((all || count < max) && (kbuf = tcmapiternext(tres, &kbufsz)) != NULL) {
-            if (_qryallcondsmatch(q, anum, coll, qfs, qfsz, kbuf, kbufsz) && 
-                _qry_and_or_match(coll, q, kbuf, kbufsz)) {
-                    
-                JBQREGREC(kbuf, kbufsz, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
-            }
-        }
-        tcmapdel(tres);
-    }
-
-    if (q->flags & EJQONLYCOUNT) {
-        goto finish;
-    } else {
-        goto sorting;
     }
+    tcbdbcurdel(cur);
+    return _qrypksuniq(pks); // Array fields produce duplicated pks
+}
 
-fullscan: /* Full scan */
-    assert(count == 0);
-    assert(!res || TCLISTNUM(res) == 0);
-
-    if ((q->flags & EJQDROPALL) && (q->flags & EJQONLYCOUNT)) {
-        // If we are in primitive $dropall case. Query: {$dropall:true}
-        if (qfsz == 1 && qfs[0]->tcop == TDBQTRUE) { //single $dropall field
-            if (log) {
-                tcxstrprintf(log, "VANISH WHOLE COLLECTION ON $dropall\n");
-            }
-            // Write lock already acquired so use impl
-            count = coll->tdb->hdb->rnum;
-            if (!tctdbvanish(coll->tdb)) {
-                count = 0;
+/* Intersect sorted PK sets of `ctx->isect` indexed conditions */
+static TCLIST* _qryisectpks(_QRYCTX *ctx) {
+    TCLIST *res = NULL;
+    for (int i = 0; i < TCLISTNUM(ctx->isect); ++i) {
+        const EJQF *qf = *(EJQF**) TCLISTVALPTR(ctx->isect, i);
+        TCLIST *pks = _qryidxpks(qf);
+        if (!res) {
+            res = pks;
+            continue;
+        }
+        TCLIST *ires = tclistnew2(MIN(TCLISTNUM(res), TCLISTNUM(pks)) + 1);
+        for (int j = 0, k = 0; j < TCLISTNUM(res) && k < TCLISTNUM(pks); ) {
+            int cv;
+            TCCMPLEXICAL(cv, TCLISTVALPTR(res, j), TCLISTVALSIZ(res, j),
+                         TCLISTVALPTR(pks, k), TCLISTVALSIZ(pks, k));
+            if (cv < 0) {
+                ++j;
+            } else if (cv > 0) {
+                ++k;
+            } else {
+                TCLISTPUSH(ires, TCLISTVALPTR(res, j), TCLISTVALSIZ(res, j));
+                ++j;
+                ++k;
             }
-            goto finish;
+        }
+        tclistdel(res);
+        tclistdel(pks);
+        res = ires;
+        if (TCLISTNUM(res) == 0) {
+            break;
         }
     }
+    return res;
+}
 
-    if (log) {
-        tcxstrprintf(log, "RUN FULLSCAN\n");
-    }
-    TCMAP *updkeys = (q->flags & EJQUPDATING) ? tcmapnew2(100 * 1024) : NULL;
-    TCHDBITER *hdbiter = tchdbiter2init(hdb);
-    if (!hdbiter) {
-        goto finish;
+/**
+ * Choose an indexed condition for every root `$or` query so
+ * the `$or` can be served by the union of their PK sets.
+ * Used only if the query has no main index and every `$or` query has
+ * a condition served by a lexical string or a binary number index.
+ */
+static void _qryorplan(_QRYCTX *ctx, uint32_t skipflags) {
+    EJQ *q = ctx->q;
+    if (ctx->mqf || !q->orqlist || TCLISTNUM(q->orqlist) < 1) {
+        return;
     }
-    TCXSTR *skbuf = tcxstrnew3(sizeof (bson_oid_t) + 1);
-    tcxstrclear(q->colbuf);
-    tcxstrclear(q->bsbuf);
-    int rows = 0;
-    while ((all || count < max) && tchdbiter2next(hdb, hdbiter, skbuf, q->colbuf)) {
-        ++rows;
-        sz = tcmaploadoneintoxstr(TCXSTRPTR(q->colbuf), TCXSTRSIZE(q->colbuf), 
-                                  JDBCOLBSON, JDBCOLBSONL, q->bsbuf);
-        if (sz <= 0) {
-            goto wfinish;
-        }
-        bool matched = true;
-        for (int i = 0; i < qfsz; ++i) qfs[i]->mflags = qfs[i]->flags;
-        for (int i = 0; i < qfsz; ++i) {
-            EJQF *qf = qfs[i];
-            if (qf->mflags & EJFEXCLUDED) {
+    int onum = TCLISTNUM(q->orqlist);
+    double records = -1, ests = 0;
+    TCLIST *oqfs = tclistnew2(onum);
+    for (int i = 0; i < onum; ++i) {
+        EJQ *oq = *((EJQ**) TCLISTVALPTR(q->orqlist, i));
+        EJQF *bqf = NULL; // Best indexed condition of `oq`
+        double best = -1;
+        for (int j = 0; j < TCLISTNUM(oq->qflist); ++j) {
+            EJQF *qf = TCLISTVALPTR(oq->qflist, j);
+            if ((qf->flags & skipflags) || qf->negate || (qf->uslots && TCLISTNUM(qf->uslots) > 0)) {
                 continue;
             }
-            if (!_qrybsmatch(qf, TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf))) {
-                matched = false;
-                break;
+            if (!qf->idxmeta) {
+                qf->idxmeta = _qryimetaidx(ctx, qf->fpath);
+                if (!qf->idxmeta) {
+                    continue;
+                }
             }
-        }
-        if (matched && _qry_and_or_match(coll, q, TCXSTRPTR(skbuf), TCXSTRSIZE(skbuf))) {
-            if (updkeys) { // We are in updating mode
-                if (tcmapputkeep(updkeys, TCXSTRPTR(skbuf), 
-                                 TCXSTRSIZE(skbuf), &yes, sizeof (yes))) {
-                                     
-                    JBQREGREC(TCXSTRPTR(skbuf), TCXSTRSIZE(skbuf), 
-                              TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+            bson_iterator it;
+            bson_type bt = bson_find(&it, qf->idxmeta, "iflags");
+            if (bt != BSON_INT || (bson_iterator_int(&it) & JBIDXARR)) {
+                continue; // Array token index converts the condition, see `_qryfindidx()`
+            }
+            if (!qf->idx) {
+                qf->idx = _qryfindidx(ctx->coll, qf, qf->idxmeta);
+            }
+            _NUMKEYRANGE kr;
+            if (!qf->idx) {
+                continue;
+            } else if (qf->idx->type == TDBITLEXICAL) {
+                if (qf->tcop != TDBQCSTREQ && qf->tcop != TDBQCSTROREQ) {
+                    continue;
+                }
+            } else if (qf->idx->type == TDBITBINNUM && _numkeyrange(qf, &kr)) {
+                if (kr.keys) {
+                    tclistdel(kr.keys);
                 }
             } else {
-                JBQREGREC(TCXSTRPTR(skbuf), TCXSTRSIZE(skbuf), 
-                          TCXSTRPTR(q->bsbuf), TCXSTRSIZE(q->bsbuf));
+                continue;
+            }
+            // Conditions with the least estimated number of entries or exact ones are preferred
+            double est = _qryidxestimate(qf);
+            if (est < 0) {
+                est = (qf->tcop == TDBQCSTREQ || qf->tcop == TDBQCNUMEQ) ? 0 : DBL_MAX;
+            }
+            if (!bqf || est < best) {
+                bqf = qf;
+                best = est;
+            }
+            if (records < 0) {
+                bt = bson_find(&it, qf->idxmeta, "records");
+                if (BSON_IS_NUM_TYPE(bt)) {
+                    records = bson_iterator_long(&it);
+                }
             }
         }
-wfinish:
-        tcxstrclear(skbuf);
-        tcxstrclear(q->colbuf);
-        tcxstrclear(q->bsbuf);
+        if (!bqf) { // Not indexed $or query
+            tclistdel(oqfs);
+            return;
+        }
+        ests += best;
+        TCLISTPUSH(oqfs, &bqf, sizeof (bqf));
     }
-    tchdbiter2dispose(hdb, hdbiter);
-    tcxstrdel(skbuf);
-    if (updkeys) {
-        tcmapdel(updkeys);
+    if (records > 0 && ests * (1.0 + 1.0 / JBISECTENTRYCOST) >= records) {
+        tclistdel(oqfs); // Full scan is cheaper
+        return;
     }
+    ctx->orunion = oqfs;
+}
 
-sorting: /* Sorting resultset */
-    if (!res || aofsz <= 0) { // No sorting needed
-        goto finish;
+/* Unite PK sets of `ctx->orunion` indexed conditions */
+static TCLIST* _qryorpks(_QRYCTX *ctx) {
+    TCLIST *res = tclistnew();
+    for (int i = 0; i < TCLISTNUM(ctx->orunion); ++i) {
+        const EJQF *qf = *(EJQF**) TCLISTVALPTR(ctx->orunion, i);
+        TCLIST *pks = _qryidxpks(qf);
+        for (int j = 0; j < TCLISTNUM(pks); ++j) {
+            TCLISTPUSH(res, TCLISTVALPTR(pks, j), TCLISTVALSIZ(pks, j));
+        }
+        tclistdel(pks);
     }
-    _EJBSORTCTX sctx; // Sorting context
-    sctx.ofs = ofs;
-    sctx.ofsz = ofsz;
-    ejdbqsortlist(res, _ejdbsoncmp, &sctx);
+    return _qrypksuniq(res);
+}
 
-finish:
-    // Check $upsert operation
-    if (count == 0 && (q->flags & EJQUPDATING)) { // Finding the $upsert qf if no updates maden
-        for (int i = 0; i < qfsz; ++i) {
-            if (qfs[i]->flags & EJCONDUPSERT) {
-                bson *updateobj = qfs[i]->updateobj;
-                assert(updateobj);
-                bson_oid_t oid;
-                if (_ejdbsavebsonimpl(coll, updateobj, &oid, false)) {
-                    bson *nbs = bson_create();
-                    bson_init_size(nbs, 
-                                   bson_size(updateobj) + 
-                                   (strlen(JDBIDKEYNAME) + 1/*key*/ + 1/*type*/ + sizeof (oid)));
-                    bson_append_oid(nbs, JDBIDKEYNAME, &oid);
-                    bson_ensure_space(nbs, bson_size(updateobj) - 4);
-                    bson_append(nbs, bson_data(updateobj) + 4, 
-                                bson_size(updateobj) - (4 + 1/*BSON_EOO*/));
-                    bson_finish(nbs);
-                    if (nbs->err) {
-                        _ejdbsetecode(coll->jb, JBEINVALIDBSON, __FILE__, __LINE__, __func__);
-                        break;
-                    }
-                    ++count;
-                    if (!(q->flags & EJQONLYCOUNT) && (all || count > skip)) {
-                        _pushprocessedbson(&ctx, bson_data(nbs), bson_size(nbs));
-                    }
-                    bson_del(nbs);
-                }
-                break;
-            }
-        }
-    } // EOF $upsert
+/* Returns true if condition `qf` on the `fpath` field can bound compound index keys */
+static bool _qrycidxcond(const EJQF *qf, uint32_t skipflags, const char *fpath, int fpathsz) {
+    return (!(qf->flags & (skipflags | EJCONDICASE)) && !qf->negate && qf->elmatchgrp <= 0 &&
+            !(qf->uslots && TCLISTNUM(qf->uslots) > 0) &&
+            qf->fpathsz == fpathsz && !memcmp(qf->fpath, fpath, fpathsz));
+}
 
-    // Revert max
-    if (max < UINT_MAX && max > skip) {
-        max = max - skip;
+/* Build the keys range of compound index `idx` matched by query conditions */
+static _CIDXSCAN* _qrycidxscan(_QRYCTX *ctx, TDBIDX *idx, uint32_t skipflags, EJQF **ofs, int ofsz) {
+    TCLIST *qflist = ctx->q->qflist;
+    const char *fpaths[JBCIDXMAXFIELDS];
+    int fpathszs[JBCIDXMAXFIELDS], dirs[JBCIDXMAXFIELDS];
+    int fnum = _cidxspecparse(idx->name + 1, strlen(idx->name + 1), fpaths, fpathszs, dirs);
+    if (fnum < 2) {
+        return NULL;
     }
-    if (res) {
-        if (all) { // Skipping results after full sorting with skip > 0
-            for (int i = 0; i < skip && res->num > 0; ++i) {
-                TCFREE(res->array[res->start].ptr);
-                ++(res->start);
-                --(res->num);
+    _CIDXSCAN *cs;
+    TCCALLOC(cs, 1, sizeof (*cs));
+    cs->idx = idx;
+    cs->lkey = tcxstrnew();
+    cs->ukey = tcxstrnew();
+    cs->lincl = cs->uincl = true;
+    int nused = 0;
+    EJQF *used[JBCIDXMAXFIELDS + 1]; // Conditions applied by the keys range
+    int neq = 0;
+    for (; neq < fnum; ++neq) { // Equality conditions prefix
+        EJQF *eqf = NULL;
+        for (int i = 0; !eqf && i < TCLISTNUM(qflist); ++i) {
+            EJQF *qf = TCLISTVALPTR(qflist, i);
+            if (_qrycidxcond(qf, skipflags, fpaths[neq], fpathszs[neq]) &&
+                    ((qf->tcop == TDBQCSTREQ && qf->ftype == BSON_STRING) || qf->tcop == TDBQCNUMEQ)) {
+                eqf = qf;
+            }
+        }
+        if (!eqf) {
+            break;
+        }
+        used[nused++] = eqf;
+        if (eqf->tcop == TDBQCSTREQ) {
+            _cidxkeycat(cs->lkey, JBCIDXTSTR, eqf->expr, eqf->exprsz, (dirs[neq] < 0));
+        } else {
+            char nkey[JBNUMKEYSZ];
+            _numkeyqf(nkey, eqf);
+            _cidxkeycat(cs->lkey, JBCIDXTNUM, nkey, JBNUMKEYSZ, (dirs[neq] < 0));
+        }
+    }
+    TCXSTRCAT(cs->ukey, TCXSTRPTR(cs->lkey), TCXSTRSIZE(cs->lkey));
+    cs->ncond = neq;
+    if (neq < fnum) { // Number range on the field next to equality prefix
+        _NUMKEYRANGE kr, lr, ur;
+        EJQF *lqf = NULL, *uqf = NULL;
+        bool haslow = false, hasup = false;
+        memset(&lr, 0, sizeof (lr));
+        memset(&ur, 0, sizeof (ur));
+        for (int i = 0; i < TCLISTNUM(qflist); ++i) {
+            EJQF *qf = TCLISTVALPTR(qflist, i);
+            if (!_qrycidxcond(qf, skipflags, fpaths[neq], fpathszs[neq]) || !_numkeyrange(qf, &kr)) {
+                continue;
+            }
+            if (kr.keys) { // $in conditions are not served
+                tclistdel(kr.keys);
+                continue;
+            }
+            if (kr.haslow && !haslow) {
+                lr = kr;
+                lqf = qf;
+                haslow = true;
+            }
+            if (kr.hasup && !hasup) {
+                ur = kr;
+                uqf = qf;
+                hasup = true;
             }
         }
-        if ((res->start & 0xff) == 0 && res->start > (res->num >> 1)) {
-            memmove(res->array, res->array + res->start, res->num * sizeof (res->array[0]));
-            res->start = 0;
+        if (lqf) {
+            used[nused++] = lqf;
         }
-        if (TCLISTNUM(res) > max) { // truncate results if max specified
-            int end = res->start + res->num;
-            TCLISTDATUM *array = res->array;
-            for (int i = (res->start + max); i < end; i++) {
-                TCFREE(array[i].ptr);
-                --(res->num);
+        if (uqf && uqf != lqf) {
+            used[nused++] = uqf;
+        }
+        if (haslow || hasup) {
+            bool desc = (dirs[neq] < 0);
+            // Lower bound of the descending field condition limits keys from above
+            TCXSTR *lb = desc ? cs->ukey : cs->lkey;
+            TCXSTR *ub = desc ? cs->lkey : cs->ukey;
+            _cidxkeycat(lb, JBCIDXTNUM, lr.lkey, haslow ? JBNUMKEYSZ : 0, desc);
+            _cidxkeycat(ub, JBCIDXTNUM, ur.ukey, hasup ? JBNUMKEYSZ : 0, desc);
+            if (haslow) {
+                *(desc ? &cs->uincl : &cs->lincl) = lr.lincl;
             }
+            if (hasup) {
+                *(desc ? &cs->lincl : &cs->uincl) = ur.uincl;
+            }
+            cs->ncond++;
         }
     }
-    count = (skip < count) ? count - skip : 0;
-    if (count > max) {
-        count = max;
-    }
-    *outcount = count;
-    if (log) {
-        tcxstrprintf(log, "RS COUNT: %u\n", count);
-        tcxstrprintf(log, "RS SIZE: %d\n", (res ? TCLISTNUM(res) : 0));
-        tcxstrprintf(log, "FINAL SORTING: %s\n", 
-                           ((q->flags & EJQONLYCOUNT) || aofsz <= 0) ? "NO" : "YES");
-    }
-
-    // Apply deffered index changes
-    if (ctx.didxctx) {
-        for (int i = TCLISTNUM(ctx.didxctx) - 1; i >= 0; --i) {
-            _DEFFEREDIDXCTX *di = TCLISTVALPTR(ctx.didxctx, i);
-            assert(di);
-            if (di->rmap) {
-                tctdbidxout2(coll->tdb, &(di->oid), sizeof (di->oid), di->rmap);
-                tcmapdel(di->rmap);
-            }
-            if (di->imap) {
-                tctdbidxput2(coll->tdb, &(di->oid), sizeof (di->oid), di->imap);
-                tcmapdel(di->imap);
+    // `$orderby` fields should follow the equality prefix
+    // in the index fields order with the same or all opposite directions
+    bool ordered = (ofsz > 0);
+    int odir = 0;
+    for (int i = 0, f = neq; ordered && i < ofsz; ++i) {
+        int j = 0;
+        for (; j < fnum; ++j) {
+            if (fpathszs[j] == ofs[i]->fpathsz && !memcmp(fpaths[j], ofs[i]->fpath, fpathszs[j])) {
+                break;
             }
         }
+        if (j < neq) { // Field value is fixed by equality condition
+            continue;
+        }
+        if (j != f++ || (odir && odir != ofs[i]->order * dirs[j])) {
+            ordered = false;
+        }
+        odir = ofs[i]->order * dirs[j];
     }
-    // Cleanup
-    if (qfs) {
-        TCFREE(qfs);
-    }
-    if (ofs) {
-        TCFREE(ofs);
+    if (ordered && !_cidxhasmulti(idx)) {
+        cs->ordered = true;
+        cs->desc = (odir < 0);
     }
-    ctx.res = NULL; // Save res from deleting in `_qryctxclear()`
-    _qryctxclear(&ctx);
-#undef JBQREGREC
-    return res;
+    EJQ *q = ctx->q;
+    cs->exact = (!(q->flags & EJQUPDATING) && !ctx->dfields && !q->ifields &&
+                 (!q->orqlist || TCLISTNUM(q->orqlist) == 0) && 
+                 (!q->andqlist || TCLISTNUM(q->andqlist) == 0));
+    for (int i = 0; cs->exact && i < TCLISTNUM(qflist); ++i) {
+        EJQF *qf = TCLISTVALPTR(qflist, i);
+        if (qf->fpathsz > 0 && !(qf->flags & EJFEXCLUDED)) { // Active condition
+            int j = 0;
+            while (j < nused && used[j] != qf) ++j;
+            cs->exact = (j < nused);
+        }
+    }
+    return cs;
 }
 
-static void _qryctxclear(_QRYCTX *ctx) {
-    if (ctx->dfields) {
-        tcmapdel(ctx->dfields);
-    }
-    if (ctx->ifields) {
-        tcmapdel(ctx->ifields);
-    }
-    if (ctx->q) {
-        ejdbquerydel(ctx->q);
-    }
-    if (ctx->res) {
-        tclistdel(ctx->res);
+/**
+ * Returns true if `$fields` of the query are restored from compound index keys,
+ * so result records are built without reading the collection records.
+ */
+static bool _qrycidxcovered(const _QRYCTX *ctx) {
+    const TDBIDX *idx = ctx->cidx->idx;
+    if (!ctx->ifields || !ctx->imode) {
+        return false;
     }
-    if (ctx->didxctx) {
-        tclistdel(ctx->didxctx);
+    const char *fpaths[JBCIDXMAXFIELDS];
+    int fpathszs[JBCIDXMAXFIELDS], dirs[JBCIDXMAXFIELDS];
+    int fnum = _cidxspecparse(idx->name + 1, strlen(idx->name + 1), fpaths, fpathszs, dirs);
+    const char *key;
+    int keysz;
+    TCMAP *ifields = ctx->ifields;
+    tcmapiterinit(ifields);
+    while ((key = tcmapiternext(ifields, &keysz)) != NULL) {
+        if (memchr(key, '.', keysz)) { // Nested fields are not restored
+            return false;
+        }
+        if (keysz == JDBIDKEYNAMEL && !memcmp(key, JDBIDKEYNAME, keysz)) {
+            continue;
+        }
+        int i = 0;
+        while (i < fnum && (fpathszs[i] != keysz || memcmp(fpaths[i], key, keysz))) ++i;
+        if (i == fnum) {
+            return false;
+        }
     }
-    memset(ctx, 0, sizeof(*ctx));
+    return true;
 }
 
-static TDBIDX* _qryfindidx(EJCOLL *coll, EJQF *qf, bson *idxmeta) {
-    TCTDB *tdb = coll->tdb;
-    char p = '\0';
-    switch (qf->tcop) {
-        case TDBQCSTREQ:
-        case TDBQCSTRBW:
-        case TDBQCSTROREQ:
-        case TDBQCSTRORBW:
-            p = (qf->flags & EJCONDICASE) ? 'i' : 's'; // lexical string index
-            break;
-        case TDBQCNUMEQ:
-        case TDBQCNUMGT:
-        case TDBQCNUMGE:
-        case TDBQCNUMLT:
-        case TDBQCNUMLE:
-        case TDBQCNUMBT:
-        case TDBQCNUMOREQ:
-            p = 'n'; // number index
-            break;
-        case TDBQCSTRAND:
-        case TDBQCSTROR:
-            p = 'a'; // token index
-            break;
-        case TDBQTRUE:
-            p = 'o'; // take first appropriate index
-            break;
+/**
+ * Choose compound index which keys range matches the equality conditions prefix
+ * of its fields optionally followed by the number range condition on the next field.
+ * Compound index is used if it matches several conditions or serves `$orderby`.
+ */
+static void _qrycidxplan(_QRYCTX *ctx, uint32_t skipflags) {
+    EJQ *q = ctx->q;
+    EJQF *mqf = ctx->mqf;
+    TCTDB *tdb = ctx->coll->tdb;
+    TCLIST *qflist = q->qflist;
+    if (mqf && (mqf->flags & EJFPKMATCHING)) {
+        return;
     }
-    if (p == '\0' || !qf->fpath || !qf->fpathsz) {
-        return NULL;
+    int ofsz = 0;
+    EJQF **ofs;
+    TCMALLOC(ofs, sizeof (*ofs) * (TCLISTNUM(qflist) + 1));
+    for (int seq = 1; seq <= TCLISTNUM(qflist); ++seq) { // Order fields sorted by `orderseq`
+        int i = 0;
+        for (; i < TCLISTNUM(qflist); ++i) {
+            EJQF *qf = TCLISTVALPTR(qflist, i);
+            if (qf->orderseq == seq) {
+                ofs[ofsz++] = qf;
+                break;
+            }
+        }
+        if (i == TCLISTNUM(qflist)) {
+            break;
+        }
     }
+    _CIDXSCAN *best = NULL;
     for (int i = 0; i < tdb->inum; ++i) {
         TDBIDX *idx = tdb->idxs + i;
-        assert(idx);
-        if (p == 'o') {
-            if (*idx->name == 'a' || *idx->name == 'i') { 
-                // token index or icase index not the best solution here
-                continue;
-            }
-        } else if (*idx->name != p) {
+        if (*idx->name != 'c' || idx->type != TDBITBINNUM) {
             continue;
         }
-        if (!strcmp(qf->fpath, idx->name + 1)) {
-            return idx;
+        _CIDXSCAN *cs = _qrycidxscan(ctx, idx, skipflags, ofs, ofsz);
+        if (!cs) {
+            continue;
         }
-    }
-    // No direct operation index. Any alternatives?
-    if (idxmeta &&
-            !(qf->flags & EJCONDICASE) && // Not a case insensitive query
-            (
-                qf->tcop == TDBQCSTREQ ||
-                qf->tcop == TDBQCSTROREQ ||
-                qf->tcop == TDBQCNUMOREQ ||
-                qf->tcop == TDBQCNUMEQ)
-       ) {
-        bson_iterator it;
-        bson_type bt = bson_find(&it, idxmeta, "iflags");
-        if (bt != BSON_INT) {
-            return NULL;
+        bool use = (cs->ncond > 1 || 
+                    (cs->ncond == 1 && cs->ordered && !(mqf && mqf->orderseq == 1)));
+        if (use && (!best || cs->ncond > best->ncond || 
+                    (cs->ncond == best->ncond && cs->ordered && !best->ordered))) {
+            _CIDXSCAN *tmp = best;
+            best = cs;
+            cs = tmp;
         }
-        int iflags = bson_iterator_int(&it);
-        if (iflags & JBIDXARR) { // Array token index exists so convert qf into TDBQCSTROR
-            for (int i = 0; i < tdb->inum; ++i) {
-                TDBIDX *idx = tdb->idxs + i;
-                if (!strcmp(qf->fpath, idx->name + 1)) {
-                    if (qf->tcop == TDBQCSTREQ) {
-                        qf->tcop = TDBQCSTROR;
-                        qf->exprlist = tclistnew2(1);
-                        TCLISTPUSH(qf->exprlist, qf->expr, qf->exprsz);
-                        if (qf->expr) TCFREE(qf->expr);
-                        qf->expr = tclistdump(qf->exprlist, &qf->exprsz);
-                        qf->ftype = BSON_ARRAY;
-                        return idx;
-                    } else if (qf->tcop == TDBQCNUMEQ) {
-                        qf->tcop = TDBQCSTRNUMOR;
-                        qf->exprlist = tclistnew2(1);
-                        TCLISTPUSH(qf->exprlist, qf->expr, qf->exprsz);
-                        if (qf->expr) TCFREE(qf->expr);
-                        qf->expr = tclistdump(qf->exprlist, &qf->exprsz);
-                        qf->ftype = BSON_ARRAY;
-                        return idx;
-                    } else if (qf->tcop == TDBQCSTROREQ) {
-                        assert(qf->ftype == BSON_ARRAY);
-                        qf->tcop = TDBQCSTROR;
-                        return idx;
-                    } else if (qf->tcop == TDBQCNUMOREQ) {
-                        assert(qf->ftype == BSON_ARRAY);
-                        qf->tcop = TDBQCSTRNUMOR;
-                        return idx;
-                    }
-                }
+        if (cs) {
+            tcxstrdel(cs->lkey);
+            tcxstrdel(cs->ukey);
+            TCFREE(cs);
+        }
+    }
+    if (best) {
+        if (best->ordered) {
+            for (int i = 0; i < ofsz; ++i) {
+                ofs[i]->flags |= EJFORDERUSED;
             }
         }
+        ctx->cidx = best;
+        ctx->mqf = NULL;
     }
-    return NULL;
+    TCFREE(ofs);
 }
 
 static void _registerallqfields(TCLIST *reg, EJQ *q) {
@@ -4338,12 +9495,21 @@ static bool _qrypreprocess(_QRYCTX *ctx) {
     bson_iterator it;
     bson_type bt;
 
+    ctx->sortmem = JBSORTMEMDEF;
     if (q->hints) {
         bson_type bt;
         bson_iterator it, sit;
+        // Process $group, matched records are grouped unordered without $skip, $max and $fields
+        bt = bson_find(&it, q->hints, "$group");
+        if (bt == BSON_OBJECT && !(ctx->qflags & JBQRYCOUNT)) {
+            ctx->agg = _aggnew(ctx, &it);
+            if (!ctx->agg) {
+                return false;
+            }
+        }
         // Process $orderby
         bt = bson_find(&it, q->hints, "$orderby");
-        if (bt == BSON_OBJECT) {
+        if (bt == BSON_OBJECT && !ctx->agg) {
             int orderseq = 1;
             BSON_ITERATOR_SUBITERATOR(&it, &sit);
             while ((bt = bson_iterator_next(&sit)) != BSON_EOO) {
@@ -4384,19 +9550,38 @@ static bool _qrypreprocess(_QRYCTX *ctx) {
                 }
             }
         }
-        bt = bson_find(&it, q->hints, "$skip");
+        bt = bson_find(&it, q->hints, "$sortmem");
+        if (BSON_IS_NUM_TYPE(bt)) {
+            int64_t v = bson_iterator_long(&it);
+            ctx->sortmem = (uint64_t) ((v < 0) ? 0 : v);
+        }
+        bt = bson_find(&it, q->hints, "$threads");
+        if (BSON_IS_NUM_TYPE(bt)) {
+            int64_t v = bson_iterator_long(&it);
+            ctx->scanthreads = (int) ((v < 1) ? 1 : MIN(v, JBPSCANMAXTHREADS));
+        }
+        bt = bson_find(&it, q->hints, "$timeout");
+        if (BSON_IS_NUM_TYPE(bt) && bson_iterator_double(&it) > 0) {
+            ctx->deadline = tctime() + bson_iterator_double(&it) / 1000;
+        }
+        bt = bson_find(&it, q->hints, "$maxscan");
         if (BSON_IS_NUM_TYPE(bt)) {
+            int64_t v = bson_iterator_long(&it);
+            ctx->maxscan = (uint64_t) ((v < 0) ? 0 : v);
+        }
+        bt = bson_find(&it, q->hints, "$skip");
+        if (BSON_IS_NUM_TYPE(bt) && !ctx->agg) {
             int64_t v = bson_iterator_long(&it);
             q->skip = (uint32_t) ((v < 0) ? 0 : v);
         }
         bt = bson_find(&it, q->hints, "$max");
         if (ctx->qflags & JBQRYFINDONE) {
             q->max = (uint32_t) 1;
-        } else if (BSON_IS_NUM_TYPE(bt)) {
+        } else if (BSON_IS_NUM_TYPE(bt) && !ctx->agg) {
             int64_t v = bson_iterator_long(&it);
             q->max = (uint32_t) ((v < 0) ? 0 : v);
         }
-        if (!(ctx->qflags & JBQRYCOUNT)) {
+        if (!(ctx->qflags & JBQRYCOUNT) && !ctx->agg) {
             bt = bson_find(&it, q->hints, "$fields"); // Collect required fields
             if (bt == BSON_OBJECT) {
                 TCMAP *fmap = tcmapnew2(TCMAPTINYBNUM);
@@ -4495,7 +9680,7 @@ static bool _qrypreprocess(_QRYCTX *ctx) {
         }
 
         bool firstorderqf = false;
-        qf->idxmeta = _imetaidx(ctx->coll, qf->fpath);
+        qf->idxmeta = _qryimetaidx(ctx, qf->fpath);
         qf->idx = _qryfindidx(ctx->coll, qf, qf->idxmeta);
         if (qf->order && qf->orderseq == 1) { // Index for first 'orderby' exists
             oqf = qf;
@@ -4514,11 +9699,23 @@ static bool _qrypreprocess(_QRYCTX *ctx) {
         }
         int avgreclen = -1;
         int selectivity = -1;
-        bt = bson_find(&it, qf->idxmeta, "selectivity");
+        // Stats of the chosen index type (see `ejdbanalyze()`) take precedence over field stats
+        char spath[32];
+        snprintf(spath, sizeof (spath), "istats.%c.selectivity", *qf->idx->name);
+        BSON_ITERATOR_INIT(&it, qf->idxmeta);
+        bt = bson_find_fieldpath_value(spath, &it);
+        if (bt != BSON_DOUBLE) {
+            bt = bson_find(&it, qf->idxmeta, "selectivity");
+        }
         if (bt == BSON_DOUBLE) {
             selectivity = (int) ((double) bson_iterator_double(&it) * 100); // Selectivity percent
         }
-        bt = bson_find(&it, qf->idxmeta, "avgreclen");
+        snprintf(spath, sizeof (spath), "istats.%c.avgreclen", *qf->idx->name);
+        BSON_ITERATOR_INIT(&it, qf->idxmeta);
+        bt = bson_find_fieldpath_value(spath, &it);
+        if (bt != BSON_DOUBLE) {
+            bt = bson_find(&it, qf->idxmeta, "avgreclen");
+        }
         if (bt == BSON_DOUBLE) {
             avgreclen = (int) bson_iterator_double(&it);
         }
@@ -4547,6 +9744,11 @@ static bool _qrypreprocess(_QRYCTX *ctx) {
                     iscore += scoreexact;
                 }
                 break;
+            case TDBQCSTRRX:
+                if (avgreclen > 0 && qf->rxprefixsz > avgreclen) {
+                    iscore += scoreexact;
+                }
+                break;
             case TDBQCNUMGT:
             case TDBQCNUMGE:
             case TDBQCNUMLT:
@@ -4558,6 +9760,13 @@ static bool _qrypreprocess(_QRYCTX *ctx) {
                 }
                 break;
         }
+        if (ctx->explain) {
+            if (!ctx->cands) {
+                ctx->cands = tclistnew2(TCLISTINYNUM);
+            }
+            _QRYCAND cand = {.fpath = qf->fpath, .iname = qf->idx->name, .score = iscore};
+            TCLISTPUSH(ctx->cands, &cand, sizeof (cand));
+        }
         if (iscore >= maxiscore) {
             ctx->mqf = qf;
             maxiscore = iscore;
@@ -4566,6 +9775,11 @@ static bool _qrypreprocess(_QRYCTX *ctx) {
     if (ctx->mqf == NULL && (oqf && oqf->idx && !oqf->negate)) {
         ctx->mqf = oqf;
     }
+    _qrycidxplan(ctx, skipflags);
+    if (!ctx->cidx) {
+        _qryisectplan(ctx, skipflags);
+        _qryorplan(ctx, skipflags);
+    }
 
     if (q->flags & EJQHASUQUERY) { 
         // Check update $(query) projection then sync inter-qf refs #91
@@ -4604,9 +9818,20 @@ static bool _qrypreprocess(_QRYCTX *ctx) {
 
     // Init query processing buffers
     assert(!q->colbuf && !q->bsbuf);
-    q->colbuf = tcxstrnew3(1024);
-    q->bsbuf = tcxstrnew3(1024);
-    q->tmpbuf = tcxstrnew();
+    EJQPLAN *plan = ctx->plan;
+    if (plan && plan->colbuf) { // Take buffers of the prepared query
+        q->colbuf = plan->colbuf;
+        q->bsbuf = plan->bsbuf;
+        q->tmpbuf = plan->tmpbuf;
+        plan->colbuf = plan->bsbuf = plan->tmpbuf = NULL;
+        tcxstrclear(q->colbuf);
+        tcxstrclear(q->bsbuf);
+        tcxstrclear(q->tmpbuf);
+    } else {
+        q->colbuf = tcxstrnew3(1024);
+        q->bsbuf = tcxstrnew3(1024);
+        q->tmpbuf = tcxstrnew();
+    }
     ctx->didxctx = (q->flags & EJQUPDATING) ? tclistnew() : NULL;
     ctx->res = (q->flags & EJQONLYCOUNT) ? NULL : tclistnew2(4096);
     return true;
@@ -4717,6 +9942,7 @@ finish:
 static bool _metasetbson2(EJCOLL *coll, const char *mkey, 
                           bson *val, bool merge, bool mergeoverwrt) {
     assert(coll);
+    ++coll->igen; // Drop index meta cached by prepared queries
     return _metasetbson(coll->jb, coll->cname, coll->cnamesz, mkey, val, merge, mergeoverwrt);
 }
 
@@ -4786,6 +10012,62 @@ finish:
     return rv;
 }
 
+/**
+ * Attach the plan cache of the prepared query `q` to the query context.
+ * Index meta cached for other collection or for the outdated indexes is dropped.
+ */
+static bool _qryplanattach(_QRYCTX *ctx, const EJQ *q) {
+    EJQPLAN *plan = q->plan;
+    if (!plan) {
+        return true;
+    }
+    for (int i = 0; i < TCLISTNUM(plan->params); ++i) {
+        if (!(*((EJQF**) TCLISTVALPTR(plan->params, i)))->expr) {
+            _ejdbsetecode(ctx->coll->jb, JBEQPARAM, __FILE__, __LINE__, __func__);
+            return false;
+        }
+    }
+    if (plan->coll != ctx->coll || plan->igen != ctx->coll->igen) {
+        tcmapclear(plan->imeta);
+        plan->coll = ctx->coll;
+        plan->igen = ctx->coll->igen;
+    }
+    ctx->plan = plan;
+    return true;
+}
+
+/** Index meta of the field served by the prepared query plan cache if it is attached */
+static bson* _qryimetaidx(_QRYCTX *ctx, const char *fpath) {
+    EJQPLAN *plan = ctx->plan;
+    if (!plan) {
+        return _imetaidx(ctx->coll, fpath);
+    }
+    int fpathsz = strlen(fpath);
+    int bsz;
+    const void *bsdata = tcmapget(plan->imeta, fpath, fpathsz, &bsz);
+    if (bsdata) {
+        return (bsz > 0) ? bson_create_from_buffer(bsdata, bsz) : NULL;
+    }
+    bson *rv = _imetaidx(ctx->coll, fpath);
+    if (rv) {
+        tcmapput(plan->imeta, fpath, fpathsz, bson_data(rv), bson_size(rv));
+    } else if (ejdbecode(ctx->coll->jb) == TCESUCCESS) {
+        tcmapput(plan->imeta, fpath, fpathsz, "", 0);
+    }
+    return rv;
+}
+
+static void _qryplandel(EJQPLAN *plan) {
+    tclistdel(plan->params);
+    tcmapdel(plan->imeta);
+    if (plan->colbuf) {
+        tcxstrdel(plan->colbuf);
+        tcxstrdel(plan->bsbuf);
+        tcxstrdel(plan->tmpbuf);
+    }
+    TCFREE(plan);
+}
+
 /** Free EJQF field **/
 static void _delqfdata(const EJQ *q, const EJQF *qf) {
     assert(q && qf);
@@ -4807,11 +10089,14 @@ static void _delqfdata(const EJQ *q, const EJQF *qf) {
     if (qf->uslots) {
         tclistdel(qf->uslots);
     }
-    if (qf->regex && !(EJQINTERNAL & q->flags)) {
+    if (qf->regex && !(EJQINTERNAL & q->flags) && !(qf->flags & EJFRXSHARED)) {
         // We do not clear regex_t data because it not deep copy in internal queries
         regfree((regex_t *) qf->regex);
         TCFREE(qf->regex);
     }
+    if (qf->rxprefix) {
+        TCFREE(qf->rxprefix);
+    }
     if (qf->exprlist) {
         tclistdel(qf->exprlist);
     }
@@ -4946,7 +10231,148 @@ static char* _fetch_bson_str_array2(EJDB *jb, bson_iterator *it,
     return tokens;
 }
 
-static int _parse_qobj_impl(EJDB *jb, EJQ *q, bson_iterator *it, TCLIST *qlist, 
+/**
+ * Literal prefix shared by all strings matched by the anchored
+ * POSIX extended regular expression `^abc...`. Case insensitive prefix
+ * is folded the same way as keys of `JBIDXISTR` index.
+ * Returns NULL if expression has no usable prefix.
+ * Result must be freed by TCFREE.
+ */
+static char* _rxprefix(const char *rx, bool icase, int *sp) {
+    *sp = 0;
+    if (*rx != '^') {
+        return NULL;
+    }
+    // Top level alternation `^abc|def` does not anchor all branches
+    int depth = 0;
+    for (const char *p = rx; *p; ++p) {
+        if (*p == '\\') {
+            if (!*++p) return NULL;
+        } else if (*p == '[') { // Bracket expression, `]` first in the list is literal
+            ++p;
+            if (*p == '^') ++p;
+            if (*p == ']') ++p;
+            while (*p && *p != ']') {
+                if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) { // [:class:], [.coll.], [=equiv=]
+                    char c = p[1];
+                    for (p += 2; *p && !(*p == c && p[1] == ']'); ++p);
+                    if (!*p) return NULL;
+                    p += 2;
+                } else {
+                    ++p;
+                }
+            }
+            if (!*p) return NULL;
+        } else if (*p == '(') {
+            ++depth;
+        } else if (*p == ')') {
+            --depth;
+        } else if (*p == '|' && depth <= 0) {
+            return NULL;
+        }
+    }
+    int len = 0;
+    char *buf;
+    TCMALLOC(buf, strlen(rx) + 1);
+    const char *p = rx + 1;
+    while (*p) {
+        int clen;
+        const char *c = p;
+        if (*p == '\\') {
+            if (!strchr(".[]\\()*+?{}|^$", p[1])) { // GNU escapes like `\w` or `\<` are not literals
+                break;
+            }
+            c = p + 1;
+            clen = 1;
+            p += 2;
+        } else if (strchr(".[]()*+?{}|^$", *p)) {
+            break;
+        } else {
+            for (clen = 1; (p[clen] & 0xc0) == 0x80; ++clen); // Whole UTF-8 character
+            p += clen;
+        }
+        if (icase && (clen > 1 || *c < 0x20 || *c > 0x7e)) { // Only ASCII is folded predictably
+            break;
+        }
+        if (*p == '*' || *p == '?' || *p == '{') { // Last character is optional
+            break;
+        }
+        memcpy(buf + len, c, clen);
+        len += clen;
+        if (*p == '+') {
+            break;
+        }
+    }
+    buf[len] = '\0';
+    if (len > 0 && icase) {
+        char sbuf[JBSTRINOPBUFFERSZ];
+        char *cbuf = NULL;
+        int cbufsz = tcicaseformat(buf, len, sbuf, JBSTRINOPBUFFERSZ, &cbuf);
+        if (cbufsz > 0) {
+            TCFREE(buf);
+            TCMEMDUP(buf, cbuf, cbufsz);
+            len = cbufsz;
+        } else {
+            len = 0;
+        }
+        if (cbuf && cbuf != sbuf) {
+            TCFREE(cbuf);
+        }
+    }
+    if (len < 1) {
+        TCFREE(buf);
+        return NULL;
+    }
+    *sp = len;
+    return buf;
+}
+
+/**
+ * Compile regular expression `rx` with `rxopt` regcomp flags.
+ * Compiled expressions are kept by database up to `JBRXCACHEMAX` entries
+ * and reused by subsequent queries, `shared` is set to true for them.
+ * Returns NULL if expression is invalid.
+ */
+static regex_t* _qryrxcompile(EJDB *jb, const char *rx, int rxopt, bool *shared) {
+    *shared = false;
+    int rxsz = strlen(rx);
+    int ksz = sizeof (rxopt) + rxsz;
+    char *kbuf;
+    TCMALLOC(kbuf, ksz);
+    memcpy(kbuf, &rxopt, sizeof (rxopt));
+    memcpy(kbuf + sizeof (rxopt), rx, rxsz);
+    int vsz;
+    regex_t *rv = NULL;
+    regex_t **vbuf = tcmdbget(jb->rxcache, kbuf, ksz, &vsz);
+    if (vbuf) {
+        rv = *vbuf;
+        TCFREE(vbuf);
+        TCFREE(kbuf);
+        *shared = true;
+        return rv;
+    }
+    TCMALLOC(rv, sizeof (*rv));
+    if (regcomp(rv, rx, rxopt)) {
+        TCFREE(rv);
+        TCFREE(kbuf);
+        return NULL;
+    }
+    if (tcmdbrnum(jb->rxcache) < JBRXCACHEMAX) {
+        if (tcmdbputkeep(jb->rxcache, kbuf, ksz, &rv, sizeof (rv))) {
+            *shared = true;
+        } else if ((vbuf = tcmdbget(jb->rxcache, kbuf, ksz, &vsz)) != NULL) { // Compiled by another thread
+            regfree(rv);
+            TCFREE(rv);
+            rv = *vbuf;
+            TCFREE(vbuf);
+            *shared = true;
+        }
+    }
+    TCFREE(kbuf);
+    return rv;
+}
+
+static int _parse_qobj_impl(EJDB *jb, EJQ *q, bson_iterator *it, TCLIST *qlist,
                             TCLIST *pathStack, EJQF *pqf, int elmatchgrp) {
                                 
     assert(it && qlist && pathStack);
@@ -5343,15 +10769,18 @@ static int _parse_qobj_impl(EJDB *jb, EJQ *q, bson_iterator *it, TCLIST *qlist,
                 qf.fpathsz = strlen(qf.fpath);
                 qf.expr = re;
                 qf.exprsz = strlen(qf.expr);
-                const char *rxstr = qf.expr;
-                regex_t rxbuf;
                 int rxopt = REG_EXTENDED | REG_NOSUB;
                 if (strchr(opts, 'i')) {
                     rxopt |= REG_ICASE;
+                    qf.flags |= EJFRXICASE;
                 }
-                if (regcomp(&rxbuf, rxstr, rxopt) == 0) {
-                    TCMALLOC(qf.regex, sizeof (rxbuf));
-                    memcpy(qf.regex, &rxbuf, sizeof (rxbuf));
+                bool rxshared;
+                qf.regex = _qryrxcompile(jb, qf.expr, rxopt, &rxshared);
+                if (qf.regex) {
+                    if (rxshared) {
+                        qf.flags |= EJFRXSHARED;
+                    }
+                    qf.rxprefix = _rxprefix(qf.expr, (rxopt & REG_ICASE), &qf.rxprefixsz);
                 } else {
                     ret = JBEQINVALIDQRX;
                     _ejdbsetecode(jb, ret, __FILE__, __LINE__, __func__);
@@ -5594,9 +11023,20 @@ static char* _bsonipathrowldr(
             return res;
         }
     }
-    if (!ipath || ipathsz < 2 || *(ipath + 1) == '\0' || strchr("snai", *ipath) == NULL) {
+    if (!ipath || ipathsz < 2 || *(ipath + 1) == '\0' || strchr("snaic", *ipath) == NULL) {
         return NULL;
     }
+    if (*ipath == 'c') { // Compound index key
+        int bsize;
+        char *bsdata = tcmaploadone(rowdata, rowdatasz, JDBCOLBSON, JDBCOLBSONL, &bsize);
+        if (!bsdata) {
+            *vsz = 0;
+            return NULL;
+        }
+        res = _cidxkey(bsdata, ipath + 1, ipathsz - 1, vsz);
+        TCFREE(bsdata);
+        return res;
+    }
     // Skip index type prefix char with (fpath + 1)
     res = _bsonfpathrowldr(tokens, rowdata, rowdatasz, ipath + 1, ipathsz - 1, op, vsz);
     if (*vsz == 0) { // Do not allow empty strings for index opration
@@ -5620,6 +11060,17 @@ static char* _bsonfpathrowldr(TCLIST *tokens, const char *rowdata, int rowdatasz
     }
     BSON_ITERATOR_FROM_BUFFER(&it, bsdata);
     bson_find_fieldpath_value2(fpath, fpathsz, &it);
+    if (odata->numkey) {
+        char kbuf[JBNUMKEYSZ];
+        if (_bsonitnumkey(&it, kbuf)) {
+            ret = tcmemdup(kbuf, JBNUMKEYSZ);
+            *vsz = JBNUMKEYSZ;
+        } else {
+            *vsz = 0;
+        }
+        TCFREE(bsdata);
+        return ret;
+    }
     ret = _bsonitstrval(odata->coll->jb, &it, vsz, tokens, (odata->icase ? JBICASE : 0));
     TCFREE(bsdata);
     return ret;
@@ -5646,6 +11097,25 @@ static bool _updatebsonidx(EJCOLL *coll, const bson_oid_t *oid, const bson *bs,
 
     tcmapiterinit(cmeta);
     while ((mkey = tcmapiternext(cmeta, &mkeysz)) != NULL && mkeysz > 0) {
+        if (*mkey == 'c' && mkeysz <= BSON_MAX_FPATH_LEN + 1) { // Compound index
+            int ckeysz = 0, ockeysz = 0;
+            char *ckey = bs ? _cidxkey(bson_data(bs), mkey + 1, mkeysz - 1, &ckeysz) : NULL;
+            char *ockey = (obsdata && obsdatasz > 0) ? 
+                          _cidxkey(obsdata, mkey + 1, mkeysz - 1, &ockeysz) : NULL;
+            if (ckey || ockey) {
+                if (imap == NULL) {
+                    imap = tcmapnew2(TCMAPTINYBNUM);
+                    rimap = tcmapnew2(TCMAPTINYBNUM);
+                }
+                if (!ckey || !ockey || ckeysz != ockeysz || memcmp(ckey, ockey, ckeysz)) {
+                    if (ockey) tcmapput(rimap, mkey, mkeysz, ockey, ockeysz);
+                    if (ckey) tcmapput(imap, mkey, mkeysz, ckey, ckeysz);
+                }
+            }
+            if (ckey) TCFREE(ckey);
+            if (ockey) TCFREE(ockey);
+            continue;
+        }
         if (*mkey != 'i' || mkeysz > BSON_MAX_FPATH_LEN + 1) {
             continue;
         }
@@ -5704,6 +11174,19 @@ static bool _updatebsonidx(EJCOLL *coll, const bson_oid_t *oid, const bson *bs,
             int itype = (1 << i);
             if (itype == JBIDXNUM && (JBIDXNUM & iflags)) {
                 ikey[0] = 'n';
+                if (_isbinnumidx(coll, ikey)) {
+                    char nkey[JBNUMKEYSZ], onkey[JBNUMKEYSZ];
+                    bool hasnkey = (bs && _bsonitnumkey(&fit, nkey));
+                    bool hasonkey = (obsdata && obsdatasz > 0 && _bsonitnumkey(&oit, onkey));
+                    if (hasonkey && (!hasnkey || memcmp(nkey, onkey, JBNUMKEYSZ))) {
+                        tcmapput(rimap, ikey, mkeysz, onkey, JBNUMKEYSZ);
+                        rm = true;
+                    }
+                    if (hasnkey && (!hasonkey || rm)) {
+                        tcmapput(imap, ikey, mkeysz, nkey, JBNUMKEYSZ);
+                    }
+                    continue;
+                }
             } else if (itype == JBIDXSTR && (JBIDXSTR & iflags)) {
                 ikey[0] = 's';
             } else if (itype == JBIDXISTR && (JBIDXISTR & iflags)) {
@@ -5773,6 +11256,24 @@ static bool _updatebsonidx(EJCOLL *coll, const bson_oid_t *oid, const bson *bs,
     return rv;
 }
 
+/**
+ * Remove run files of spilled sorts left next to the collection files, e.g. by a crashed process.
+ * Only a locking writer removes them since it excludes other processes using the collection.
+ */
+static void _delsortruns(EJCOLL *coll) {
+    uint32_t mode = coll->tdb->hdb->omode;
+    if (!(mode & JBOWRITER) || (mode & JBONOLCK)) {
+        return;
+    }
+    char *pattern = tcsprintf("%s.sort-*", tctdbpath(coll->tdb));
+    TCLIST *paths = tcglobpat(pattern);
+    for (int i = 0; i < TCLISTNUM(paths); ++i) {
+        unlink(TCLISTVALPTR(paths, i));
+    }
+    tclistdel(paths);
+    TCFREE(pattern);
+}
+
 static void _delcoldb(EJCOLL *coll) {
     assert(coll);
     tctdbdel(coll->tdb);
@@ -5780,6 +11281,8 @@ static void _delcoldb(EJCOLL *coll) {
     coll->jb = NULL;
     coll->cnamesz = 0;
     TCFREE(coll->cname);
+    TCFREE(coll->hists);
+    coll->hists = NULL;
     if (coll->mmtx) {
         pthread_rwlock_destroy(coll->mmtx);
         TCFREE(coll->mmtx);
@@ -5807,6 +11310,7 @@ static bool _addcoldb0(const char *cname, EJDB *jb, EJCOLLOPTS *opts, EJCOLL **r
     coll->tdb = cdb;
     coll->jb = jb;
     coll->mmtx = NULL;
+    TCCALLOC(coll->hists, JBHNUM, sizeof (*coll->hists));
     if (!_ejdbcolsetmutex(coll)) {
         return false;
     }
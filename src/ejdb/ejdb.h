@@ -46,8 +46,13 @@ typedef struct {        /**< EJDB collection tuning options. */
 
 typedef TCLIST* EJQRESULT; /**< EJDB query result */
 
+struct EJQCUR; /**< EJDB query cursor. */
+typedef struct EJQCUR EJQCUR;
+
 #define JBMAXCOLNAMELEN 128
 
+#define JBSLOWLOGSIZE 128 /**< Default number of slow queries log entries. See `ejdbsetslowlog()` */
+
 enum { /** Error codes */
     JBEINVALIDCOLNAME = 9000,   /**< Invalid collection name. */
     JBEINVALIDBSON = 9001,      /**< Invalid bson object. */
@@ -67,7 +72,11 @@ enum { /** Error codes */
     JBEEI = 9015,               /**< EJDB export/import error */
     JBEEJSONPARSE = 9016,       /**< JSON parsing failed */
     JBETOOBIGBSON = 9017,       /**< BSON size is too big */
-    JBEINVALIDCMD = 9018        /**< Invalid ejdb command specified */
+    JBEINVALIDCMD = 9018,       /**< Invalid ejdb command specified */
+    JBEQPARAM = 9019,           /**< Invalid or unbound query parameter */
+    JBEQGROUP = 9020,           /**< Invalid $group hint */
+    JBEQLIMIT = 9021,           /**< Query time or records scan limit exceeded */
+    JBEQCANCELLED = 9022        /**< Query cancelled */
 };
 
 enum { /** Database open modes */
@@ -346,6 +355,59 @@ EJDB_EXPORT EJQ* ejdbqueryaddor(EJDB *jb, EJQ *q, const void *orbsdata);
  */
 EJDB_EXPORT EJQ* ejdbqueryhints(EJDB *jb, EJQ *q, const void *hintsbsdata);
 
+/**
+ * Prepare the query for repeated execution.
+ *
+ *  - Every string operand `"?"` of equality, `$begin`, `$gt`, `$gte`, `$lt`, `$lte` conditions
+ *    of the query and of its `$and`, `$or` subqueries becomes a placeholder.
+ *    Placeholders are numbered from zero in the order of conditions and must be bound
+ *    by `ejdbquerybindstr()`, `ejdbquerybindlong()` or `ejdbquerybinddouble()` before execution.
+ *  - Index meta and query processing buffers are cached between executions of the prepared query.
+ *    The cache is dropped when the query is executed on another collection or when
+ *    indexes of the collection are changed.
+ *
+ * Prepared query must be completely built before this call
+ * and must not be executed by several threads at the same time.
+ *
+ * @param jb EJDB database handle.
+ * @param q Query handle.
+ * @return NULL on error.
+ */
+EJDB_EXPORT EJQ* ejdbqueryprepare(EJDB *jb, EJQ *q);
+
+/**
+ * Number of placeholders of the prepared query.
+ */
+EJDB_EXPORT int ejdbqueryparams(const EJQ *q);
+
+/**
+ * Bind the string value to the placeholder `pos` of the prepared query.
+ * @return false if `pos` is not a valid placeholder number.
+ */
+EJDB_EXPORT bool ejdbquerybindstr(EJDB *jb, EJQ *q, int pos, const char *val);
+
+/**
+ * Bind the integer value to the placeholder `pos` of the prepared query.
+ * @return false if `pos` is not a valid placeholder number.
+ */
+EJDB_EXPORT bool ejdbquerybindlong(EJDB *jb, EJQ *q, int pos, int64_t val);
+
+/**
+ * Bind the floating point value to the placeholder `pos` of the prepared query.
+ * @return false if `pos` is not a valid placeholder number.
+ */
+EJDB_EXPORT bool ejdbquerybinddouble(EJDB *jb, EJQ *q, int pos, double val);
+
+/**
+ * Request or withdraw the cancellation of the query.
+ * Can be called from any thread while the query is executed, executions of the cancelled
+ * query stop at the next scanned record and fail with `JBEQCANCELLED` error code.
+ * The query stays cancelled until `ejdbqrycancel(q, false)` is called.
+ * @param q Query handle.
+ * @param cancel Cancel the query if true, withdraw cancellation otherwise.
+ */
+EJDB_EXPORT void ejdbqrycancel(EJQ *q, bool cancel);
+
 /**
  * Destroy query object created with ejdbcreatequery().
  * @param q
@@ -368,6 +430,8 @@ EJDB_EXPORT void ejdbquerydel(EJQ *q);
  *              - Eg: flag = JBIDXDROP | JBIDXNUM (Drop number index)
  *      - `JBIDXDROPALL` Drop index for all types.
  *      - `JBIDXREBLD` Rebuild index of specified type.
+ *              Number indexes created by older versions (decimal string keys)
+ *              are converted into binary number keys on rebuild.
  *      - `JBIDXOP` Optimize index of specified type. (Optimize the B+ tree index file)
  *
  *  Examples:
@@ -387,11 +451,87 @@ EJDB_EXPORT void ejdbquerydel(EJQ *q);
  */
 EJDB_EXPORT bool ejdbsetindex(EJCOLL *coll, const char *ipath, int flags);
 
+/**
+ * Set compound index over the ordered list of JSON fields in EJDB collection.
+ *
+ *  - Index keys are built from number and string values of the fields.
+ *    Records having arrays or objects in the indexed fields
+ *    are kept in the index but are not ordered by it.
+ *
+ *  - Index is used by queries having equality conditions on the leading index fields
+ *    optionally followed by the number range condition on the next field.
+ *    `$orderby` on the following index fields is served by index without sorting.
+ *
+ *  - Query is answered from index keys without reading the collection records
+ *    if its conditions are fully matched by the index keys range and
+ *    its `$fields` projection includes only top level index fields and `_id`.
+ *
+ *  - Available index operations:
+ *      - `JBIDXDROP` Drop index.
+ *      - `JBIDXREBLD` Rebuild index.
+ *      - `JBIDXOP` Optimize index. (Optimize the B+ tree index file)
+ *
+ *  Examples:
+ *      - Set index for equality on `tenant` and range/ordering on `created` in descending order:
+ *          `ejdbsetcompoundindex(ccoll, "tenant,-created", 0)`
+ *
+ * @param coll Collection handle.
+ * @param fields Comma separated list of 2 up to 8 BSON field paths,
+ *               field path prefixed by `-` is indexed in descending order.
+ * @param flags Index operation flags.
+ * @return
+ */
+EJDB_EXPORT bool ejdbsetcompoundindex(EJCOLL *coll, const char *fields, int flags);
+
+/**
+ * Collect statistics of all indexes of the collection and store them
+ * into the index meta of every indexed field. Each index is scanned once,
+ * indexes of more than 65536 entries are sampled and their cardinality is estimated.
+ * Indexes are scanned under the collection read lock, concurrent queries are not blocked.
+ *
+ * Stored per field (taken from the index with the most entries):
+ *      - `selectivity` Number of distinct keys divided by number of records.
+ *      - `avgreclen` Average index key length in bytes.
+ *      - `cardinality` Number of distinct keys.
+ *      - `records` Number of collection records.
+ *      - `istats` Object of the same statistics for every index type of the field
+ *                 keyed by index type prefix (`s`, `i`, `n`, `a`) with
+ *                 `entries` count, equi-depth `histogram` bucket upper bounds and
+ *                 number of `sampled` keys (0 if all keys are scanned).
+ *
+ * The query planner uses these statistics to choose the main index.
+ *
+ * @param coll Collection handle.
+ * @param log Optional operation log buffer.
+ * @return true on success.
+ */
+EJDB_EXPORT bool ejdbanalyze(EJCOLL *coll, TCXSTR *log);
+
 /**
  * Execute the query against EJDB collection.
  * It is better to execute update queries with specified `JBQRYCOUNT` control
  * flag avoid unnecessarily rows fetching.
  *
+ * Query hints limiting the execution:
+ *  - `{$timeout : ms}` Maximum execution time in milliseconds.
+ *  - `{$maxscan : n}` Maximum number of index keys or records examined.
+ *
+ * If a limit is exceeded or the query is cancelled by `ejdbqrycancel()` the scan
+ * is stopped, the collection lock is released and `NULL` is returned with
+ * `JBEQLIMIT` or `JBEQCANCELLED` error code. Records updated before the
+ * interruption stay updated.
+ *
+ * The `$group` query hint replaces matched records by their groups computed in the scan loop:
+ *
+ *      {$group : {_id : '$category', total : {$sum : '$price'}, n : {$count : {}}}}
+ *
+ *  - `_id` group key is a `$field` path, an object of keys or a constant.
+ *  - Accumulators: `{$sum : '$field' | number}`, `{$avg : '$field'}`,
+ *    `{$min : '$field'}`, `{$max : '$field'}`, `{$count : {}}`.
+ *  - Groups exceeding the `$sortmem` budget are spilled into temporary files.
+ *  - `$orderby`, `$skip`, `$max` and `$fields` hints are ignored, the order of groups is unspecified.
+ *    In count mode matched records are counted.
+ *
  * @param jcoll EJDB database
  * @param q Query handle created with ejdbcreatequery()
  * @param count Output count pointer. Result set size will be stored into it.
@@ -403,9 +543,82 @@ EJDB_EXPORT bool ejdbsetindex(EJCOLL *coll, const char *ipath, int flags);
  * @return TCLIST with matched bson records data.
  * If (qflags & JBQRYCOUNT) then NULL will be returned
  * and only count reported.
+ * `NULL` is also returned on error, check `ejdbecode()`.
  */
 EJDB_EXPORT EJQRESULT ejdbqryexecute(EJCOLL *jcoll, const EJQ *q, uint32_t *count, int qflags, TCXSTR *log);
 
+/**
+ * Execute the query like `ejdbqryexecute()` and describe its execution plan.
+ *
+ * The `explain` BSON object is filled with the following fields:
+ *  - `collection` Collection name.
+ *  - `access` Records access method: `count`, `fullscan`, `parallel fullscan`, `pk`,
+ *             `index`, `compound`, `intersection` or `union`.
+ *  - `index` Name of the index used or `null`. `indexes` array lists indexes
+ *            of the `intersection` and `union` access methods.
+ *  - `candidates` Array of `{field, index, score}` indexes scored by the query planner.
+ *  - `keys` Number of index keys examined.
+ *  - `records` Number of records read.
+ *  - `bytes` Number of bytes of records read.
+ *  - `matched` Number of records matched before `$skip` and `$max` are applied.
+ *  - `returned` Number of records returned.
+ *  - `sort` Result set sorting: `none`, `index`, `topk`, `memory` or `spill`.
+ *           `sortruns` is the number of sorted runs spilled to disk.
+ *  - `stages` Wall and CPU time in milliseconds spent by `plan`, `scan`, `sort`
+ *             and `finish` query execution stages: `{plan : {wall, cpu}, ...}`.
+ *
+ * Counters are maintained by every query so the explain costs only two clock
+ * reads per execution stage and may be sampled in production.
+ *
+ * @param jcoll EJDB collection.
+ * @param q Query handle created with ejdbcreatequery()
+ * @param count Output count pointer. Result set size will be stored into it.
+ * @param qflags Execution flags. See `ejdbqryexecute()`
+ * @param explain Uninitialized BSON object filled with the execution plan description.
+ *                It is always initialized and finished by this call and must be destroyed
+ *                by `bson_destroy()`.
+ * @return TCLIST with matched bson records data. See `ejdbqryexecute()`
+ */
+EJDB_EXPORT EJQRESULT ejdbqryexplain(EJCOLL *jcoll, const EJQ *q, uint32_t *count, int qflags, bson *explain);
+
+/**
+ * Enable or disable the slow queries log of the database.
+ *
+ * Queries executed by `ejdbqryexecute()`, `ejdbupdate()` and other query methods
+ * longer than `thresholdms` milliseconds are recorded into the ring buffer of the last `size`
+ * entries. Every entry is the BSON object:
+ *
+ *      {
+ *          ts : double,            //Unix time in seconds the query finished at
+ *          collection : string,    //Collection name
+ *          fingerprint : string,   //Hex hash of the query shape
+ *          shape : string,         //Normalized query with operands stripped, eg: '{a:$gt,b:$in} $orderby{c:-1}'
+ *          access : string,        //Records access method. See `ejdbqryexplain()`
+ *          index : string|null,    //Name of the index used
+ *          keys : long,            //Number of index keys examined
+ *          records : long,         //Number of records read
+ *          matched : long,         //Number of matched records
+ *          ms : double,            //Query execution time in milliseconds
+ *          update : bool,          //True for updating queries
+ *          errorCode : int         //Error code of the interrupted query, 0 otherwise
+ *      }
+ *
+ * @param jb EJDB database handle.
+ * @param thresholdms Slow query threshold in milliseconds, the log is disabled if negative.
+ * @param size Maximum number of kept entries, `JBSLOWLOGSIZE` if not positive.
+ * @return false on error.
+ */
+EJDB_EXPORT bool ejdbsetslowlog(EJDB *jb, int64_t thresholdms, int size);
+
+/**
+ * Returns the slow queries log entries as BSON array ordered from the oldest entry.
+ * Also available with the `slowlog` command. See `ejdbcommand()`
+ * @param jb EJDB database handle.
+ * @param reset If true the log is cleared.
+ * @return Allocated BSON array, caller should call `bson_del()` on it.
+ */
+EJDB_EXPORT bson* ejdbslowlog(EJDB *jb, bool reset);
+
 /**
  * Returns the number of elements in the query result set.
  * @param qr Query result set. Can be `NULL` in this case 0 is returned.
@@ -425,6 +638,46 @@ EJDB_EXPORT const void* ejdbqresultbsondata(EJQRESULT qr, int pos, int *size);
  */
 EJDB_EXPORT void ejdbqresultdispose(EJQRESULT qr);
 
+/**
+ * Open the query cursor fetching matched records one by one.
+ *
+ * Records are read lazily from the collection records iterator or from the main index
+ * keys range. Queries in updating or count mode, queries having the `$orderby` not served
+ * by the main index and queries using other index access methods are executed at once
+ * and the cursor iterates over their materialized result set. If the result set of such
+ * query has been spilled into sorted run files, the final merge of runs is streamed by the cursor.
+ *
+ * The collection is not locked between `ejdbqrycurnext()` calls, so records saved or removed
+ * while the cursor is open may be returned or not. The main index cursor is repositioned past
+ * the last examined key on every call, other records of the keys range are returned once.
+ * Indexes of the collection must not be changed and the collection must not be removed
+ * until the cursor is disposed.
+ *
+ * @param jcoll EJDB collection.
+ * @param q Query handle created with ejdbcreatequery()
+ * @param qflags Execution flags. See `ejdbqryexecute()`
+ * @param log Optional extended string to collect debug information, can be NULL.
+ * @return Query cursor or `NULL` on error.
+ * The cursor must be disposed by `ejdbqrycurdel()`.
+ */
+EJDB_EXPORT EJQCUR* ejdbqrycursor(EJCOLL *jcoll, const EJQ *q, int qflags, TCXSTR *log);
+
+/**
+ * Fetch the next record of the query cursor.
+ * Returned BSON data buffer is owned by cursor and valid until the next
+ * `ejdbqrycurnext()` or `ejdbqrycurdel()` call.
+ *
+ * @param cur Query cursor.
+ * @param size Output size of the BSON data.
+ * @return BSON data of the record or `NULL` if there are no more records.
+ */
+EJDB_EXPORT const void* ejdbqrycurnext(EJQCUR *cur, int *size);
+
+/**
+ * Dispose the query cursor.
+ */
+EJDB_EXPORT void ejdbqrycurdel(EJQCUR *cur);
+
 /**
  * Convenient method to execute update queries.
  *
@@ -449,6 +702,9 @@ EJDB_EXPORT uint32_t ejdbupdate(EJCOLL *jcoll, bson *qobj, bson *orqobjs, int or
  * @param orqobjsnum Number of OR query objects.
  * 
  * NOTE: Queries with update instruction not supported.
+ *
+ * If `fpath` has a string or number index having a key for every collection record,
+ * distinct values are collected by walking the index keys in index order.
  * 
  * @return Unique values by specified path and query (as BSON array)
  */
@@ -481,7 +737,10 @@ EJDB_EXPORT bool ejdbtranabort(EJCOLL *coll);
 EJDB_EXPORT bool ejdbtranstatus(EJCOLL *jcoll, bool *txactive);
 
 
-/** Gets description of EJDB database and its collections. */
+/**
+ * Gets description of EJDB database and its collections.
+ * Every collection has the `stats` object of engine counters. See `stats` command of `ejdbcommand()`
+ */
 EJDB_EXPORT bson* ejdbmeta(EJDB *jb);
 
 /** Export/Import settings used in `ejdbexport()` and `ejdbimport()` functions. */
@@ -566,6 +825,68 @@ EJDB_EXPORT bool ejdbimport(EJDB *jb, const char *path, TCLIST *cnames, int flag
  *          "errorCode" : int|0,   //ejdb error code
  *       }
  *
+ *  3) Collects index statistics used by the query planner. See ejdbanalyze() method.
+ *
+ *    "analyze" : {
+ *          "cnames" : [string array]|null,  //List of collection names to analyze, all if null
+ *     }
+ *
+ *     Command response:
+ *       {
+ *          "log" : string,        //Per index statistics summary
+ *          "error" : string|null, //ejdb error message
+ *          "errorCode" : int|0,   //ejdb error code
+ *       }
+ *
+ *  4) Reads and configures the slow queries log. See ejdbsetslowlog() and ejdbslowlog() methods.
+ *
+ *    "slowlog" : {
+ *          "threshold" : int|null,  //Enable the log with threshold in milliseconds or disable if negative
+ *          "size" : int|null,       //Maximum number of entries
+ *          "reset" : bool|null      //Clear the log after reading
+ *     }
+ *
+ *     Command response:
+ *       {
+ *          "entries" : [object array], //Slow queries log entries
+ *          "error" : string|null,      //ejdb error message
+ *          "errorCode" : int|0,        //ejdb error code
+ *       }
+ *
+ *  5) Reads engine counters of collections maintained since collections were opened.
+ *
+ *    "stats" : {
+ *          "cnames" : [string array]|null,  //List of collection names, all if null
+ *     }
+ *
+ *     Command response:
+ *       {
+ *          "stats" : {
+ *              <collection name> : {
+ *                  "queries" : long,      //Number of executed queries
+ *                  "idxscans" : long,     //Number of queries served by indexes
+ *                  "fullscans" : long,    //Number of queries executed by full scan
+ *                  "rechit" : long,       //Records found in the record cache
+ *                  "recmiss" : long,      //Records not found in the record cache
+ *                  "recread" : long,      //Records read from the collection file
+ *                  "recwrite" : long,     //Records written into the collection file
+ *                  "leafhit" : long,      //Index leaves found in the leaf caches
+ *                  "leafmiss" : long,     //Index leaves loaded from index files
+ *                  "leafsave" : long,     //Index leaves saved into index files
+ *                  "fsyncs" : long,       //Synchronizations of collection and index files
+ *                  "walbytes" : long,     //Bytes written into write ahead logs
+ *                  "latency" : {          //Latency distributions in microseconds including lock waits
+ *                      <operation> : {    //save, load, query, rm, trancommit, sync
+ *                          "count" : long, "mean" : long, "p50" : long,
+ *                          "p99" : long, "p999" : long, "max" : long
+ *                      }, ...
+ *                  }
+ *              }, ...
+ *          },
+ *          "error" : string|null,      //ejdb error message
+ *          "errorCode" : int|0,        //ejdb error code
+ *       }
+ *
  * @param jb    EJDB database handle.
  * @param cmd   BSON command spec.
  * @return Allocated command response BSON object. Caller should call `bson_del()` on it.
@@ -36,12 +36,37 @@ EJDB_EXTERN_C_START
 #define EJDB_VERSION_SZ 4;  //number of bytes to encode version in TCTDB opaque data 
 
 
+/**> Number of latency histogram buckets: values below 4us have own buckets,
+ *   larger values up to 2^32us are split into 4 buckets per power of two. See `_histbucket()` */
+#define JBHISTBUCKETS 128
+
+enum { /**> Collection operations with latency histograms */
+    JBHSAVE, /**> ejdbsavebson() */
+    JBHLOAD, /**> ejdbloadbson() */
+    JBHQUERY, /**> ejdbqryexecute() */
+    JBHRM, /**> ejdbrmbson() */
+    JBHTRANCOMMIT, /**> ejdbtrancommit() */
+    JBHSYNC, /**> ejdbsyncoll(), ejdbsyncdb() */
+    JBHNUM /**> Number of operations */
+};
+
+typedef struct { /**> Log-bucketed latency histogram of microseconds */
+    uint64_t counts[JBHISTBUCKETS]; /**> Number of operations per bucket */
+    uint64_t total; /**> Sum of latencies */
+    uint64_t max; /**> Maximum latency */
+} EJHIST;
+
 struct EJCOLL { /**> EJDB Collection. */
     char *cname; /**> Collection name. */
     int cnamesz; /**> Collection name length. */
     TCTDB *tdb; /**> Collection TCTDB. */
     EJDB *jb; /**> Database handle. */
     void *mmtx; /*> Mutex for method */
+    uint32_t igen; /*> Generation of the index meta, changed on every index meta update */
+    uint64_t st_queries; /*> Statistics counter of executed queries. See `_collstats()` */
+    uint64_t st_idxscans; /*> Statistics counter of queries served by indexes */
+    uint64_t st_fullscans; /*> Statistics counter of queries executed by full scan */
+    EJHIST *hists; /*> Latency histograms of collection operations, `JBHNUM` items. See `_histadd()` */
 };
 
 struct EJDB {
@@ -50,6 +75,11 @@ struct EJDB {
     uint32_t fversion; /*> Database format version */
     TCTDB *metadb; /*> Metadata DB. */
     void *mmtx; /*> Mutex for method */
+    TCMDB *rxcache; /*> Compiled regular expressions shared by queries. See `_qryrxcompile()` */
+    void *slmtx; /*> Mutex of the slow queries log */
+    int64_t slthreshold; /*> Slow queries threshold in microseconds, negative if the log is disabled */
+    int slsize; /*> Maximum number of slow queries log entries */
+    TCLIST *slowlog; /*> Ring buffer of slow queries log entries BSON data. See `ejdbsetslowlog()` */
 };
 
 enum { /**> Query field flags */
@@ -76,7 +106,10 @@ enum { /**> Query field flags */
     EJCONDOIT = 1u << 16, /**> $do query field operation */
     EJCONDUNSET = 1u << 17, /**> $unset Field value */
     EJCONDRENAME = 1u << 18, /**> $rename Field value */
-    EJCONDPUSH  = 1u << 19 /**> $push, $pushAll. Adds a value to the array */
+    EJCONDPUSH  = 1u << 19, /**> $push, $pushAll. Adds a value to the array */
+    EJFPARAM = 1u << 20, /**> Query operand is a placeholder bound by `ejdbquerybind*()` */
+    EJFRXSHARED = 1u << 21, /**> Regular expression object is owned by the database regex cache */
+    EJFRXICASE = 1u << 22 /**> Case insensitive regular expression */
 };
 
 enum { /**> Query flags */
@@ -113,6 +146,8 @@ struct EJQF { /**> Matching field and status */
     TCLIST *exprlist; /**> List representation of expression */
     TCMAP *exprmap; /**> Hash map for expression tokens used in $in matching operation. */
     void *regex; /**> Regular expression object */
+    char *rxprefix; /**> Literal prefix of anchored regular expression */
+    int rxprefixsz; /**> Size of regular expression literal prefix */
     EJDB *jb; /**> Reference to the EJDB during query processing */
     EJQ *q; /**> Query object in which this field embedded */
     double exprdblval; /**> Double value representation */
@@ -122,6 +157,9 @@ struct EJQF { /**> Matching field and status */
 };
 typedef struct EJQF EJQF;
 
+typedef struct EJQPLAN EJQPLAN; /**> Prepared query plan cache. See `ejdbqueryprepare()` */
+typedef struct EJQMATCH EJQMATCH; /**> Query conditions compiled for the single pass matching */
+
 struct EJQ { /**> Query object. */
     TCLIST *qflist; /**> List of query field objects *EJQF */
     TCLIST *orqlist; /**> List of $or joined query objects *EJQ */
@@ -137,6 +175,14 @@ struct EJQ { /**> Query object. */
     uint32_t flags; /**> Control flags */
     EJQ *lastmatchedorq; /**> Reference to the last matched $or query */
     EJQF **allqfields; /**> NULL terminated list of all *EJQF fields including all $and $or QF*/
+    EJQPLAN *plan; /**> Plan cache of the prepared query, not copied into internal query objects */
+    EJQMATCH *match; /**> Conditions field path trie matched by a single pass over record */
+    int cancel; /**> Cancellation request set by `ejdbqrycancel()` from any thread */
+
+    //Execution counters of the internal query object. See `ejdbqryexplain()`
+    uint64_t nkeys; /**> Number of index keys examined */
+    uint64_t nrecs; /**> Number of records read */
+    uint64_t nbytes; /**> Number of bytes of records read */
 
     //Temporal buffers used during query processing
     TCXSTR *colbuf; /**> TCTDB current column buffer */
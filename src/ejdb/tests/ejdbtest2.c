@@ -6290,6 +6290,2810 @@ void subTestTicket163(const char* op) {
     tclistdel(q1res);
 }
 
+void testBinaryNumberIndex(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "binnumidx", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+
+    bson b;
+    bson_oid_t oid;
+    for (int i = 0; i < 7; ++i) {
+        bson_init(&b);
+        switch (i) {
+            case 0: bson_append_int(&b, "n", -5); break;
+            case 1: bson_append_double(&b, "n", 2.5); break;
+            case 2: bson_append_int(&b, "n", 3); break;
+            case 3: bson_append_long(&b, "n", 9007199254740993LL); break;
+            case 4: bson_append_double(&b, "n", 9007199254740992.0); break;
+            case 5: bson_append_long(&b, "n", 1000); break;
+            case 6: bson_append_string(&b, "n", "str"); break;
+        }
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "n", JBIDXNUM));
+    TDBIDX *idx = NULL;
+    for (int i = 0; i < coll->tdb->inum; ++i) {
+        if (!strcmp(coll->tdb->idxs[i].name, "nn")) idx = coll->tdb->idxs + i;
+    }
+    CU_ASSERT_PTR_NOT_NULL_FATAL(idx);
+    CU_ASSERT_EQUAL(idx->type, TDBITBINNUM);
+
+    // Table queries cannot evaluate conditions by binary keys but use them for number ordering
+    TDBQRY *tq = tctdbqrynew(coll->tdb);
+    tctdbqryaddcond(tq, "nn", TDBQCNUMGT, "2");
+    TCLIST *tres = tctdbqrysearch(tq);
+    CU_ASSERT_EQUAL(TCLISTNUM(tres), 0);
+    CU_ASSERT_EQUAL(tctdbecode(coll->tdb), TCEINVALID);
+    CU_ASSERT_PTR_NOT_NULL(strstr(tctdbqryhint(tq), "binary index \"nn\" cannot evaluate"));
+    CU_ASSERT_FALSE(tctdbqrysearchout(tq));
+    tclistdel(tres);
+    tctdbqrydel(tq);
+    tq = tctdbqrynew(coll->tdb);
+    tctdbqrysetorder(tq, "nn", TDBQONUMASC);
+    tctdbqrysetlimit(tq, 1, 0);
+    tres = tctdbqrysearch(tq);
+    CU_ASSERT_PTR_NOT_NULL(strstr(tctdbqryhint(tq), "using an index: \"nn\" asc (order)"));
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(tres), 1);
+    CU_ASSERT_EQUAL_FATAL(TCLISTVALSIZ(tres, 0), sizeof(bson_oid_t));
+    bson *bsmin = ejdbloadbson(coll, (bson_oid_t*) TCLISTVALPTR(tres, 0));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(bsmin);
+    CU_ASSERT_FALSE(bson_compare_long(-5, bson_data(bsmin), "n"));
+    bson_del(bsmin);
+    tclistdel(tres);
+    tctdbqrydel(tq);
+
+    // {n : {$gt : 2}} $orderby {n : -1}
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "n");
+    bson_append_int(&bsq1, "$gt", 2);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    bson bshints;
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "n", -1);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    uint32_t count = 0;
+    TCXSTR *log = tcxstrnew();
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "MAIN IDX: 'nn'"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "FINAL SORTING: NO"));
+    CU_ASSERT_EQUAL(count, 5);
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(q1res), 5);
+    CU_ASSERT_FALSE(bson_compare_long(9007199254740993LL, TCLISTVALPTR(q1res, 0), "n"));
+    CU_ASSERT_FALSE(bson_compare_double(9007199254740992.0, TCLISTVALPTR(q1res, 1), "n"));
+    CU_ASSERT_FALSE(bson_compare_long(1000, TCLISTVALPTR(q1res, 2), "n"));
+    CU_ASSERT_FALSE(bson_compare_long(3, TCLISTVALPTR(q1res, 3), "n"));
+    CU_ASSERT_FALSE(bson_compare_double(2.5, TCLISTVALPTR(q1res, 4), "n"));
+    bson_destroy(&bsq1);
+    bson_destroy(&bshints);
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+
+    // {n : {$bt : [-5, 3]}}
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "n");
+    bson_append_start_array(&bsq1, "$bt");
+    bson_append_int(&bsq1, "0", -5);
+    bson_append_int(&bsq1, "1", 3);
+    bson_append_finish_array(&bsq1);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    log = tcxstrnew();
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "MAIN IDX: 'nn'"));
+    CU_ASSERT_EQUAL(count, 3);
+    bson_destroy(&bsq1);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+
+    // {n : {$in : [3, 1000, 7]}}
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "n");
+    bson_append_start_array(&bsq1, "$in");
+    bson_append_int(&bsq1, "0", 3);
+    bson_append_int(&bsq1, "1", 1000);
+    bson_append_int(&bsq1, "2", 7);
+    bson_append_finish_array(&bsq1);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, NULL);
+    CU_ASSERT_EQUAL(count, 2);
+    bson_destroy(&bsq1);
+    ejdbquerydel(q1);
+
+    // Legacy decimal index is migrated by JBIDXREBLD
+    CU_ASSERT_TRUE(tctdbsetindex(coll->tdb, "nn", TDBITDECIMAL));
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "n", JBIDXNUM | JBIDXREBLD));
+    idx = NULL;
+    for (int i = 0; i < coll->tdb->inum; ++i) {
+        if (!strcmp(coll->tdb->idxs[i].name, "nn")) idx = coll->tdb->idxs + i;
+    }
+    CU_ASSERT_PTR_NOT_NULL_FATAL(idx);
+    CU_ASSERT_EQUAL(idx->type, TDBITBINNUM);
+
+    // {n : {$lte : 9007199254740992}}
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "n");
+    bson_append_long(&bsq1, "$lte", 9007199254740992LL);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, NULL);
+    CU_ASSERT_EQUAL(count, 5);
+    bson_destroy(&bsq1);
+    ejdbquerydel(q1);
+}
+
+void testAnalyze(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "analyze", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "u", JBIDXSTR));
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "b", JBIDXNUM));
+
+    bson b;
+    bson_oid_t oid;
+    char nbuf[TCNUMBUFSIZ];
+    for (int i = 0; i < 100; ++i) {
+        snprintf(nbuf, TCNUMBUFSIZ, "x%d", i);
+        bson_init(&b);
+        bson_append_string(&b, "u", nbuf);
+        bson_append_int(&b, "b", i % 2);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_string(&bsq1, "u", "x5");
+    bson_append_int(&bsq1, "b", 1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+
+    // Without stats both indexes score the same
+    uint32_t count = 0;
+    TCXSTR *log = tcxstrnew();
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "MAIN IDX: 'nb'"));
+    CU_ASSERT_EQUAL(count, 1);
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+
+    bson cmd;
+    bson_init(&cmd);
+    bson_append_start_object(&cmd, "analyze");
+    bson_append_start_array(&cmd, "cnames");
+    bson_append_string(&cmd, "0", "analyze");
+    bson_append_finish_array(&cmd);
+    bson_append_finish_object(&cmd);
+    bson_finish(&cmd);
+    bson *cmdret = ejdbcommand(jb, &cmd);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(cmdret);
+    bson_iterator it;
+    CU_ASSERT_EQUAL(bson_find(&it, cmdret, "error"), BSON_EOO);
+    CU_ASSERT_EQUAL_FATAL(bson_find(&it, cmdret, "log"), BSON_STRING);
+    CU_ASSERT_PTR_NOT_NULL(strstr(bson_iterator_string(&it),
+                                  "ANALYZE INDEX 'su': ENTRIES: 100 CARDINALITY: 100 SELECTIVITY: 1.0000"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(bson_iterator_string(&it),
+                                  "ANALYZE INDEX 'nb': ENTRIES: 100 CARDINALITY: 2 SELECTIVITY: 0.0200"));
+    bson_del(cmdret);
+    bson_destroy(&cmd);
+
+    // Low selectivity number index is not used anymore
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "MAIN IDX: 'su'"));
+    CU_ASSERT_EQUAL(count, 1);
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+}
+
+void testTopK(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "topk", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    bson b;
+    bson_oid_t oid;
+    for (int i = 0; i < 1000; ++i) {
+        bson_init(&b);
+        bson_append_int(&b, "v", (i * 7919) % 1000);
+        bson_append_int(&b, "odd", i % 2);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_finish(&bsq1);
+    bson bshints;
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "v", -1);
+    bson_append_finish_object(&bshints);
+    bson_append_int(&bshints, "$skip", 5);
+    bson_append_int(&bshints, "$max", 10);
+    bson_append_start_object(&bshints, "$fields");
+    bson_append_int(&bshints, "odd", 0);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    uint32_t count = 0;
+    TCXSTR *log = tcxstrnew();
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "FETCH ALL: YES"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "TOP-K HEAP: 15"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "RS SIZE: 10"));
+    CU_ASSERT_EQUAL(count, 10);
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(q1res), 10);
+    for (int i = 0; i < TCLISTNUM(q1res); ++i) {
+        CU_ASSERT_FALSE(bson_compare_long(994 - i, TCLISTVALPTR(q1res, i), "v"));
+        bson_iterator it;
+        CU_ASSERT_EQUAL(bson_find_from_buffer(&it, TCLISTVALPTR(q1res, i), "odd"), BSON_EOO);
+    }
+    bson_destroy(&bshints);
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+
+    // Records with duplicate keys at the `$skip + $max` boundary are the same as of the full sort
+    coll = ejdbcreatecoll(jb, "topkties", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    for (int i = 0; i < 100; ++i) {
+        bson_init(&b);
+        bson_append_int(&b, "v", i % 10);
+        bson_append_int(&b, "n", i);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "v", 1);
+    bson_append_finish_object(&bshints);
+    bson_append_int(&bshints, "$skip", 3);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    log = tcxstrnew();
+    TCLIST *fullres = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NULL(strstr(TCXSTRPTR(log), "TOP-K HEAP"));
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(fullres), 97);
+    bson_destroy(&bshints);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "v", 1);
+    bson_append_finish_object(&bshints);
+    bson_append_int(&bshints, "$skip", 3);
+    bson_append_int(&bshints, "$max", 12);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    log = tcxstrnew();
+    q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "TOP-K HEAP: 15"));
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(q1res), 12);
+    for (int i = 0; i < TCLISTNUM(q1res); ++i) {
+        bson_iterator it;
+        CU_ASSERT_EQUAL_FATAL(bson_find_from_buffer(&it, TCLISTVALPTR(fullres, i), "n"), BSON_INT);
+        CU_ASSERT_FALSE(bson_compare_long(bson_iterator_int(&it), TCLISTVALPTR(q1res, i), "n"));
+    }
+    bson_destroy(&bsq1);
+    bson_destroy(&bshints);
+    tclistdel(fullres);
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+}
+
+void testSortKeys(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "sortkeys", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    bson b;
+    bson_oid_t oid;
+    char sbuf[16];
+    for (int i = 0; i < 300; ++i) {
+        bson_init(&b);
+        switch (i % 5) { //Mixed types of `a` field
+            case 0:
+                bson_append_int(&b, "a", i % 7);
+                break;
+            case 1:
+                bson_append_long(&b, "a", i % 11);
+                break;
+            case 2:
+                bson_append_double(&b, "a", (i % 13) / 2.0);
+                break;
+            case 3:
+                sprintf(sbuf, "s%d", i % 3);
+                bson_append_string(&b, "a", sbuf);
+                break;
+            default: //no `a` field
+                break;
+        }
+        sprintf(sbuf, "%03d", (i * 37) % 300);
+        bson_append_start_object(&b, "b");
+        bson_append_string(&b, "c", sbuf);
+        bson_append_finish_object(&b);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_finish(&bsq1);
+    bson bshints;
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "a", 1);
+    bson_append_int(&bshints, "b.c", -1);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    uint32_t count = 0;
+    TCXSTR *log = tcxstrnew();
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "FINAL SORTING: YES"));
+    CU_ASSERT_EQUAL(count, 300);
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(q1res), 300);
+    for (int i = 1; i < TCLISTNUM(q1res); ++i) { //Same ordering as bson_compare()
+        const void *p = TCLISTVALPTR(q1res, i - 1);
+        const void *n = TCLISTVALPTR(q1res, i);
+        int cv = bson_compare(p, n, "a", 1);
+        CU_ASSERT_TRUE(cv < 0 || (cv == 0 && bson_compare(p, n, "b.c", 3) > 0));
+    }
+    bson_destroy(&bsq1);
+    bson_destroy(&bshints);
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+}
+
+void testSortSpill(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "sortspill", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    bson b;
+    bson_oid_t oid;
+    char sbuf[128];
+    memset(sbuf, 'x', sizeof(sbuf) - 1);
+    sbuf[sizeof(sbuf) - 1] = '\0';
+    for (int i = 0; i < 3000; ++i) {
+        bson_init(&b);
+        bson_append_int(&b, "v", (i * 7919) % 3000);
+        bson_append_string(&b, "pad", sbuf);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_finish(&bsq1);
+    bson bshints;
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "v", -1);
+    bson_append_finish_object(&bshints);
+    bson_append_int(&bshints, "$sortmem", 4096); //More than 64 runs to merge
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    uint32_t count = 0;
+    TCXSTR *log = tcxstrnew();
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "SORT SPILLED RUNS:"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "RS SIZE: 3000"));
+    CU_ASSERT_EQUAL(count, 3000);
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(q1res), 3000);
+    for (int i = 0; i < TCLISTNUM(q1res); ++i) {
+        CU_ASSERT_FALSE(bson_compare_long(2999 - i, TCLISTVALPTR(q1res, i), "v"));
+    }
+    TCLIST *runs = tcglobpat("dbt2_sortspill.sort-*"); //Run files are removed
+    CU_ASSERT_EQUAL(TCLISTNUM(runs), 0);
+    tclistdel(runs);
+    bson_destroy(&bshints);
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+
+    // $skip is applied by merging of spilled runs
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "v", 1);
+    bson_append_finish_object(&bshints);
+    bson_append_int(&bshints, "$sortmem", 4096);
+    bson_append_int(&bshints, "$skip", 1000);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    log = tcxstrnew();
+    q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "SORT SPILLED RUNS:"));
+    CU_ASSERT_EQUAL(count, 2000);
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(q1res), 2000);
+    for (int i = 0; i < TCLISTNUM(q1res); ++i) {
+        CU_ASSERT_FALSE(bson_compare_long(1000 + i, TCLISTVALPTR(q1res, i), "v"));
+    }
+    tclistdel(q1res);
+    tcxstrdel(log);
+
+    // Final merge of spilled runs is streamed by the query cursor
+    log = tcxstrnew();
+    EJQCUR *cur = ejdbqrycursor(coll, q1, 0, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(cur);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "STREAMING CURSOR: MERGE"));
+    int size, i = 0;
+    const void *bsdata;
+    while ((bsdata = ejdbqrycurnext(cur, &size)) != NULL) {
+        CU_ASSERT_EQUAL(size, bson_size2(bsdata));
+        CU_ASSERT_FALSE(bson_compare_long(1000 + i, bsdata, "v"));
+        ++i;
+    }
+    CU_ASSERT_EQUAL(i, 2000);
+    ejdbqrycurdel(cur);
+    runs = tcglobpat("dbt2_sortspill.sort-*");
+    CU_ASSERT_EQUAL(TCLISTNUM(runs), 0);
+    tclistdel(runs);
+    bson_destroy(&bsq1);
+    bson_destroy(&bshints);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+
+    // Run files left by a crashed process are removed when the database is closed or opened
+    EJDB *jb2 = ejdbnew();
+    CU_ASSERT_TRUE_FATAL(ejdbopen(jb2, "dbt2runs", JBOWRITER | JBOCREAT | JBOTRUNC));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(ejdbcreatecoll(jb2, "sortspill", NULL));
+    CU_ASSERT_TRUE(tcwritefile("dbt2runs_sortspill.sort-0-0", "", 0));
+    CU_ASSERT_TRUE_FATAL(ejdbclose(jb2));
+    runs = tcglobpat("dbt2runs_sortspill.sort-*");
+    CU_ASSERT_EQUAL(TCLISTNUM(runs), 0);
+    tclistdel(runs);
+    CU_ASSERT_TRUE(tcwritefile("dbt2runs_sortspill.sort-0-1", "", 0));
+    CU_ASSERT_TRUE_FATAL(ejdbopen(jb2, "dbt2runs", JBOWRITER | JBOCREAT));
+    runs = tcglobpat("dbt2runs_sortspill.sort-*");
+    CU_ASSERT_EQUAL(TCLISTNUM(runs), 0);
+    tclistdel(runs);
+    CU_ASSERT_TRUE(ejdbclose(jb2));
+    ejdbdel(jb2);
+}
+
+void testIndexIntersection(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "isect", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "a", JBIDXSTR));
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "b", JBIDXNUM));
+
+    bson b;
+    bson_oid_t oid;
+    char nbuf[TCNUMBUFSIZ];
+    for (int i = 0; i < 2000; ++i) {
+        snprintf(nbuf, TCNUMBUFSIZ, "a%d", i % 40);
+        bson_init(&b);
+        bson_append_string(&b, "a", nbuf);
+        bson_append_int(&b, "b", i % 50);
+        bson_append_int(&b, "i", i);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_string(&bsq1, "a", "a3");
+    bson_append_int(&bsq1, "b", 3);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+    bson bshints;
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "i", -1);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+
+    // No intersection without index stats
+    uint32_t count = 0;
+    TCXSTR *log = tcxstrnew();
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NULL(strstr(TCXSTRPTR(log), "INDEX INTERSECTION"));
+    CU_ASSERT_EQUAL(count, 10);
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+
+    CU_ASSERT_TRUE(ejdbanalyze(coll, NULL));
+
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "MAIN IDX: 'nb'"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "INDEX INTERSECTION: 'nb' 'sa'"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "INTERSECTED PKS: 10"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "FINAL SORTING: YES"));
+    CU_ASSERT_EQUAL(count, 10);
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(q1res), 10);
+    for (int i = 0; i < TCLISTNUM(q1res); ++i) {
+        CU_ASSERT_FALSE(bson_compare_long(1803 - i * 200, TCLISTVALPTR(q1res, i), "i"));
+    }
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+    bson_destroy(&bshints);
+}
+
+void testOrIndexUnion(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "orunion", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "status", JBIDXSTR));
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "owner", JBIDXNUM));
+
+    bson b;
+    bson_oid_t oid;
+    char nbuf[TCNUMBUFSIZ];
+    for (int i = 0; i < 1000; ++i) {
+        snprintf(nbuf, TCNUMBUFSIZ, "s%d", i % 10);
+        bson_init(&b);
+        bson_append_string(&b, "status", nbuf);
+        bson_append_int(&b, "owner", i % 100);
+        bson_append_int(&b, "i", i);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    // {$or : [{status : 's1'}, {owner : {$in : [2, 11]}}]}
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_start_array(&bsq1, "$or");
+    bson_append_start_object(&bsq1, "0");
+    bson_append_string(&bsq1, "status", "s1");
+    bson_append_finish_object(&bsq1);
+    bson_append_start_object(&bsq1, "1");
+    bson_append_start_object(&bsq1, "owner");
+    bson_append_start_array(&bsq1, "$in");
+    bson_append_int(&bsq1, "0", 2);
+    bson_append_int(&bsq1, "1", 11); //Matched by `status` too
+    bson_append_finish_array(&bsq1);
+    bson_append_finish_object(&bsq1);
+    bson_append_finish_object(&bsq1);
+    bson_append_finish_array(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+
+    uint32_t count = 0;
+    TCXSTR *log = tcxstrnew();
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "MAIN IDX: 'NONE'"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "$OR INDEX UNION: 'sstatus' 'nowner'"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "UNITED PKS: 110"));
+    CU_ASSERT_PTR_NULL(strstr(TCXSTRPTR(log), "RUN FULLSCAN"));
+    CU_ASSERT_EQUAL(count, 110);
+    CU_ASSERT_EQUAL(TCLISTNUM(q1res), 110);
+    for (int i = 0; i < TCLISTNUM(q1res); ++i) {
+        CU_ASSERT_TRUE(!bson_compare_string("s1", TCLISTVALPTR(q1res, i), "status") ||
+                       !bson_compare_long(2, TCLISTVALPTR(q1res, i), "owner"));
+    }
+    tclistdel(q1res);
+    tcxstrdel(log);
+
+    log = tcxstrnew(); // Count only
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "UNITED PKS: 110"));
+    CU_ASSERT_EQUAL(count, 110);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+
+    // $or query without index falls back to fullscan
+    bson_init_as_query(&bsq1);
+    bson_append_start_array(&bsq1, "$or");
+    bson_append_start_object(&bsq1, "0");
+    bson_append_string(&bsq1, "status", "s1");
+    bson_append_finish_object(&bsq1);
+    bson_append_start_object(&bsq1, "1");
+    bson_append_int(&bsq1, "i", 2);
+    bson_append_finish_object(&bsq1);
+    bson_append_finish_array(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NULL(strstr(TCXSTRPTR(log), "$OR INDEX UNION"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "RUN FULLSCAN"));
+    CU_ASSERT_EQUAL(count, 101);
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+}
+
+void testCompoundIndex(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "cidx", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+
+    bson b;
+    bson_oid_t oid;
+    char nbuf[TCNUMBUFSIZ];
+    for (int i = 0; i < 1000; ++i) {
+        snprintf(nbuf, TCNUMBUFSIZ, "t%d", i % 5);
+        bson_init(&b);
+        bson_append_string(&b, "tenant", nbuf);
+        bson_append_int(&b, "created", i);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+    CU_ASSERT_FALSE(ejdbsetcompoundindex(coll, "tenant", 0));
+    CU_ASSERT_FALSE(ejdbsetcompoundindex(coll, "tenant,,created", 0));
+    CU_ASSERT_TRUE(ejdbsetcompoundindex(coll, "tenant,-created", 0));
+
+    // {tenant : 't1', created : {$gte : 100, $lt : 300}}
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_string(&bsq1, "tenant", "t1");
+    bson_append_start_object(&bsq1, "created");
+    bson_append_int(&bsq1, "$gte", 100);
+    bson_append_int(&bsq1, "$lt", 300);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+
+    bson bshints;
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "created", -1);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+
+    uint32_t count = 0;
+    TCXSTR *log = tcxstrnew();
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "COMPOUND IDX: 'ctenant,-created'"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "COMPOUND IDX CONDITIONS: 2"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "COMPOUND IDX ORDER: ASC"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "FETCH ALL: NO"));
+    CU_ASSERT_PTR_NULL(strstr(TCXSTRPTR(log), "RUN FULLSCAN"));
+    CU_ASSERT_EQUAL(count, 40);
+    CU_ASSERT_EQUAL(TCLISTNUM(q1res), 40);
+    for (int i = 0; i < TCLISTNUM(q1res); ++i) {
+        CU_ASSERT_FALSE(bson_compare_long(296 - i * 5, TCLISTVALPTR(q1res, i), "created"));
+        CU_ASSERT_FALSE(bson_compare_string("t1", TCLISTVALPTR(q1res, i), "tenant"));
+    }
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bshints);
+
+    // Reversed order scan stops after $max records
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "created", 1);
+    bson_append_finish_object(&bshints);
+    bson_append_int(&bshints, "$max", 5);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "COMPOUND IDX ORDER: DESC"));
+    CU_ASSERT_EQUAL(count, 5);
+    CU_ASSERT_EQUAL(TCLISTNUM(q1res), 5);
+    for (int i = 0; i < TCLISTNUM(q1res); ++i) {
+        CU_ASSERT_FALSE(bson_compare_long(101 + i * 5, TCLISTVALPTR(q1res, i), "created"));
+    }
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+
+    // Record with array value is kept aside of ordered keys
+    bson_init(&b);
+    bson_append_start_array(&b, "tenant");
+    bson_append_string(&b, "0", "t1");
+    bson_append_string(&b, "1", "t2");
+    bson_append_finish_array(&b);
+    bson_append_int(&b, "created", 102);
+    bson_finish(&b);
+    CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+    bson_destroy(&b);
+
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "COMPOUND IDX ORDER: NONE"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "TOP-K HEAP: 5"));
+    CU_ASSERT_EQUAL(count, 5);
+    CU_ASSERT_EQUAL(TCLISTNUM(q1res), 5);
+    CU_ASSERT_FALSE(bson_compare_long(101, TCLISTVALPTR(q1res, 0), "created"));
+    CU_ASSERT_FALSE(bson_compare_long(102, TCLISTVALPTR(q1res, 1), "created"));
+    CU_ASSERT_FALSE(bson_compare_long(106, TCLISTVALPTR(q1res, 2), "created"));
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bshints);
+
+    // Index keys are updated
+    bson bsupd;
+    bson_init_as_query(&bsupd);
+    bson_append_string(&bsupd, "tenant", "t1");
+    bson_append_int(&bsupd, "created", 111);
+    bson_append_start_object(&bsupd, "$set");
+    bson_append_int(&bsupd, "created", 5000);
+    bson_append_finish_object(&bsupd);
+    bson_finish(&bsupd);
+    CU_ASSERT_EQUAL(ejdbupdate(coll, &bsupd, NULL, 0, NULL, NULL), 1);
+    bson_destroy(&bsupd);
+
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "COMPOUND IDX CONDITIONS: 2"));
+    CU_ASSERT_EQUAL(count, 40);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+
+    bson_init_as_query(&bsq1);
+    bson_append_string(&bsq1, "tenant", "t1");
+    bson_append_int(&bsq1, "created", 5000);
+    bson_finish(&bsq1);
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "COMPOUND IDX CONDITIONS: 2"));
+    CU_ASSERT_EQUAL(count, 1);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+
+    CU_ASSERT_TRUE(ejdbsetcompoundindex(coll, "tenant,-created", JBIDXDROP));
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, log);
+    CU_ASSERT_PTR_NULL(strstr(TCXSTRPTR(log), "COMPOUND IDX"));
+    CU_ASSERT_EQUAL(count, 1);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+}
+
+void testCoveredQuery(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "covered", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetcompoundindex(coll, "tenant,-created", 0));
+
+    bson b;
+    bson_oid_t oid;
+    char payload[4096];
+    memset(payload, 'x', sizeof (payload) - 1);
+    payload[sizeof (payload) - 1] = '\0';
+    for (int i = 0; i < 100; ++i) {
+        bson_init(&b);
+        bson_append_string_n(&b, "tenant", (i % 2) ? "t\0b" : "ta", (i % 2) ? 3 : 2); // Embedded zero
+        if (i % 3 == 0) {
+            bson_append_double(&b, "created", i + 0.5);
+        } else if (i % 3 == 1) {
+            bson_append_long(&b, "created", 10000000000000000LL + i);
+        } else {
+            bson_append_int(&b, "created", i);
+        }
+        bson_append_string(&b, "payload", payload);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    // {tenant : 'ta', created : {$gt : 10}}
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_string(&bsq1, "tenant", "ta");
+    bson_append_start_object(&bsq1, "created");
+    bson_append_int(&bsq1, "$gt", 10);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+
+    bson bshints;
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$fields");
+    bson_append_int(&bshints, "_id", 1);
+    bson_append_int(&bshints, "tenant", 1);
+    bson_append_int(&bshints, "created", 1);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+
+    uint32_t count = 0;
+    TCXSTR *log = tcxstrnew();
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "COMPOUND IDX CONDITIONS: 2"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "COMPOUND IDX COVERED: YES"));
+    CU_ASSERT_EQUAL(count, 46);
+    CU_ASSERT_EQUAL(TCLISTNUM(q1res), 46);
+    for (int i = 0; i < TCLISTNUM(q1res); ++i) {
+        bson_iterator it;
+        void *bsdata = TCLISTVALPTR(q1res, i);
+        CU_ASSERT_EQUAL(bson_find_from_buffer(&it, bsdata, "payload"), BSON_EOO);
+        CU_ASSERT_EQUAL_FATAL(bson_find_from_buffer(&it, bsdata, "_id"), BSON_OID);
+        bson *rec = ejdbloadbson(coll, bson_iterator_oid(&it));
+        CU_ASSERT_PTR_NOT_NULL_FATAL(rec);
+        bson_type bt = bson_find_from_buffer(&it, bsdata, "created");
+        bson_iterator rit;
+        CU_ASSERT_EQUAL(bt, bson_find(&rit, rec, "created"));
+        CU_ASSERT_FALSE(bson_compare_it_current(&it, &rit));
+        CU_ASSERT_EQUAL(bson_find_from_buffer(&it, bsdata, "tenant"), BSON_STRING);
+        CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "ta");
+        bson_del(rec);
+    }
+    tclistdel(q1res);
+    tcxstrdel(log);
+
+    log = tcxstrnew(); // Count only
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "COMPOUND IDX COVERED: YES"));
+    CU_ASSERT_EQUAL(count, 46);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bshints);
+
+    // Not indexed field requested
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$fields");
+    bson_append_int(&bshints, "created", 1);
+    bson_append_int(&bshints, "payload", 1);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "COMPOUND IDX COVERED: NO"));
+    CU_ASSERT_EQUAL(count, 46);
+    for (int i = 0; i < TCLISTNUM(q1res); ++i) {
+        CU_ASSERT_FALSE(bson_compare_string(payload, TCLISTVALPTR(q1res, i), "payload"));
+    }
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bshints);
+    bson_destroy(&bsq1);
+
+    // Condition on not indexed field
+    bson_init_as_query(&bsq1);
+    bson_append_string(&bsq1, "tenant", "ta");
+    bson_append_int(&bsq1, "created", 2);
+    bson_append_string(&bsq1, "payload", "x");
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "COMPOUND IDX COVERED: NO"));
+    CU_ASSERT_EQUAL(count, 0);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+}
+
+void testQueryCursor(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "qcursor", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "n", JBIDXNUM));
+
+    bson b;
+    bson_oid_t oid;
+    for (int i = 0; i < 500; ++i) {
+        bson_init(&b);
+        bson_append_int(&b, "n", i);
+        bson_append_int(&b, "m", i % 7);
+        bson_append_string(&b, "s", (i % 2) ? "odd" : "even");
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    // {s : 'odd'} full scan
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_string(&bsq1, "s", "odd");
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+
+    uint32_t count = 0;
+    int size;
+    const void *bsdata;
+    TCXSTR *log = tcxstrnew();
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    EJQCUR *cur = ejdbqrycursor(coll, q1, 0, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(cur);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "RUN FULLSCAN"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "STREAMING CURSOR: YES"));
+    count = 0;
+    while ((bsdata = ejdbqrycurnext(cur, &size)) != NULL) {
+        CU_ASSERT_EQUAL(size, bson_size2(bsdata));
+        CU_ASSERT_FALSE(bson_compare_string("odd", bsdata, "s"));
+        ++count;
+    }
+    CU_ASSERT_EQUAL(count, 250);
+    CU_ASSERT_PTR_NULL(ejdbqrycurnext(cur, &size));
+    ejdbqrycurdel(cur);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+
+    // {n : {$gte : 100, $lt : 400}, m : 3} ordered by index, $skip, $max and $fields
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "n");
+    bson_append_int(&bsq1, "$gte", 100);
+    bson_append_int(&bsq1, "$lt", 400);
+    bson_append_finish_object(&bsq1);
+    bson_append_int(&bsq1, "m", 3);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+
+    bson bshints;
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "n", -1);
+    bson_append_finish_object(&bshints);
+    bson_append_int(&bshints, "$skip", 3);
+    bson_append_int(&bshints, "$max", 20);
+    bson_append_start_object(&bshints, "$fields");
+    bson_append_int(&bshints, "n", 1);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, NULL);
+    CU_ASSERT_EQUAL(count, 20);
+    cur = ejdbqrycursor(coll, q1, 0, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(cur);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "MAIN IDX: 'nn'"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "STREAMING CURSOR: YES"));
+    int i = 0;
+    while ((bsdata = ejdbqrycurnext(cur, &size)) != NULL) {
+        CU_ASSERT_TRUE_FATAL(i < TCLISTNUM(q1res));
+        CU_ASSERT_EQUAL(size, TCLISTVALSIZ(q1res, i));
+        CU_ASSERT_FALSE(memcmp(bsdata, TCLISTVALPTR(q1res, i), size));
+        bson_iterator it;
+        CU_ASSERT_EQUAL(bson_find_from_buffer(&it, bsdata, "m"), BSON_EOO);
+        ++i;
+    }
+    CU_ASSERT_EQUAL(i, 20);
+    CU_ASSERT_FALSE(bson_compare_long(374, TCLISTVALPTR(q1res, 0), "n"));
+    ejdbqrycurdel(cur);
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bshints);
+
+    // Ordering by not indexed field is served by the materialized result set
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "s", 1);
+    bson_append_int(&bshints, "n", 1);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    q1res = ejdbqryexecute(coll, q1, &count, 0, NULL);
+    CU_ASSERT_EQUAL(count, 43);
+    cur = ejdbqrycursor(coll, q1, 0, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(cur);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "STREAMING CURSOR: NO"));
+    for (i = 0; (bsdata = ejdbqrycurnext(cur, &size)) != NULL; ++i) {
+        CU_ASSERT_TRUE_FATAL(i < TCLISTNUM(q1res));
+        CU_ASSERT_FALSE(memcmp(bsdata, TCLISTVALPTR(q1res, i), size));
+    }
+    CU_ASSERT_EQUAL(i, 43);
+    ejdbqrycurdel(cur);
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bshints);
+    bson_destroy(&bsq1);
+}
+
+void testParallelFullscan(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "pscan", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+
+    bson b;
+    bson_oid_t oid;
+    char nbuf[TCNUMBUFSIZ];
+    for (int i = 0; i < 10000; ++i) {
+        snprintf(nbuf, TCNUMBUFSIZ, "name%d", i);
+        bson_init(&b);
+        bson_append_string(&b, "name", nbuf);
+        bson_append_int(&b, "n", i);
+        bson_append_int(&b, "g", i % 10);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    // {name : {$regex : '7$'}, $or : [{g : 7}, {n : {$lt : 100}}]}
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_regex(&bsq1, "name", "7$", "");
+    bson_append_start_array(&bsq1, "$or");
+    bson_append_start_object(&bsq1, "0");
+    bson_append_int(&bsq1, "g", 7);
+    bson_append_finish_object(&bsq1);
+    bson_append_start_object(&bsq1, "1");
+    bson_append_start_object(&bsq1, "n");
+    bson_append_int(&bsq1, "$lt", 100);
+    bson_append_finish_object(&bsq1);
+    bson_append_finish_object(&bsq1);
+    bson_append_finish_array(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+
+    bson bshints;
+    bson_init_as_query(&bshints);
+    bson_append_int(&bshints, "$threads", 1);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+
+    uint32_t count = 0, pcount = 0;
+    TCXSTR *log = tcxstrnew();
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NULL(strstr(TCXSTRPTR(log), "PARALLEL FULLSCAN"));
+    CU_ASSERT_EQUAL(count, 1000);
+    ejdbquerydel(q1);
+    bson_destroy(&bshints);
+    tcxstrdel(log);
+
+    bson_init_as_query(&bshints);
+    bson_append_int(&bshints, "$threads", 4);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    TCLIST *q2res = ejdbqryexecute(coll, q1, &pcount, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "PARALLEL FULLSCAN THREADS: 4"));
+    CU_ASSERT_EQUAL(pcount, count);
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(q2res), TCLISTNUM(q1res));
+    for (int i = 0; i < TCLISTNUM(q1res); ++i) { // Same records in the same order
+        CU_ASSERT_EQUAL(TCLISTVALSIZ(q1res, i), TCLISTVALSIZ(q2res, i));
+        CU_ASSERT_FALSE(memcmp(TCLISTVALPTR(q1res, i), TCLISTVALPTR(q2res, i), TCLISTVALSIZ(q1res, i)));
+    }
+    tclistdel(q1res);
+    tclistdel(q2res);
+    tcxstrdel(log);
+
+    log = tcxstrnew(); // Count only
+    ejdbqryexecute(coll, q1, &pcount, JBQRYCOUNT, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "PARALLEL FULLSCAN THREADS: 4"));
+    CU_ASSERT_EQUAL(pcount, 1000);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bshints);
+
+    // $orderby, $skip and $max over parallel full scan
+    bson_init_as_query(&bshints);
+    bson_append_int(&bshints, "$threads", 3);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "n", -1);
+    bson_append_finish_object(&bshints);
+    bson_append_int(&bshints, "$skip", 10);
+    bson_append_int(&bshints, "$max", 5);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "PARALLEL FULLSCAN THREADS: 3"));
+    CU_ASSERT_EQUAL(count, 5);
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(q1res), 5);
+    for (int i = 0; i < TCLISTNUM(q1res); ++i) {
+        CU_ASSERT_FALSE(bson_compare_long(9997 - 10 * (10 + i), TCLISTVALPTR(q1res, i), "n"));
+    }
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bshints);
+    bson_destroy(&bsq1);
+}
+
+void testPreparedQuery(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "prepq", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+
+    bson b;
+    bson_oid_t oid, oid42;
+    char nbuf[TCNUMBUFSIZ];
+    for (int i = 0; i < 100; ++i) {
+        snprintf(nbuf, TCNUMBUFSIZ, "name%d", i);
+        bson_init(&b);
+        bson_append_string(&b, "name", nbuf);
+        bson_append_int(&b, "n", i);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+        if (i == 42) {
+            oid42 = oid;
+        }
+    }
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "n", JBIDXNUM));
+
+    // {n : ?}
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_string(&bsq1, "n", "?");
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+
+    uint32_t count = 0;
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    CU_ASSERT_EQUAL(ejdbqueryparams(q1), 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(ejdbqueryprepare(jb, q1));
+    CU_ASSERT_EQUAL(ejdbqueryparams(q1), 1);
+
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, NULL); // Unbound placeholder
+    CU_ASSERT_PTR_NULL(q1res);
+    CU_ASSERT_EQUAL(ejdbecode(jb), JBEQPARAM);
+    CU_ASSERT_FALSE(ejdbquerybindlong(jb, q1, 1, 42));
+    CU_ASSERT_EQUAL(ejdbecode(jb), JBEQPARAM);
+
+    for (int i = 40; i < 45; ++i) {
+        TCXSTR *log = tcxstrnew();
+        CU_ASSERT_TRUE(ejdbquerybindlong(jb, q1, 0, i));
+        q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+        CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "PREPARED QUERY PARAMS: 1"));
+        CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "MAIN IDX: 'nn'"));
+        CU_ASSERT_EQUAL(count, 1);
+        CU_ASSERT_EQUAL_FATAL(TCLISTNUM(q1res), 1);
+        bson_iterator it;
+        CU_ASSERT_EQUAL(bson_find_from_buffer(&it, TCLISTVALPTR(q1res, 0), "n"), BSON_INT);
+        CU_ASSERT_EQUAL(bson_iterator_int(&it), i);
+        tclistdel(q1res);
+        tcxstrdel(log);
+    }
+
+    // Cached index meta is dropped on index changes
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "n", JBIDXDROPALL));
+    TCXSTR *log = tcxstrnew();
+    CU_ASSERT_TRUE(ejdbquerybinddouble(jb, q1, 0, 77));
+    q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "MAIN IDX: 'NONE'"));
+    CU_ASSERT_EQUAL(count, 1);
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+
+    // {name : {$begin : ?}, n : {$lt : ?}}
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "name");
+    bson_append_string(&bsq1, "$begin", "?");
+    bson_append_finish_object(&bsq1);
+    bson_append_start_object(&bsq1, "n");
+    bson_append_string(&bsq1, "$lt", "?");
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+
+    q1 = ejdbqueryprepare(jb, ejdbcreatequery(jb, &bsq1, NULL, 0, NULL));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    CU_ASSERT_EQUAL(ejdbqueryparams(q1), 2);
+    CU_ASSERT_TRUE(ejdbquerybindstr(jb, q1, 0, "name1"));
+    CU_ASSERT_TRUE(ejdbquerybindlong(jb, q1, 1, 50));
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, NULL);
+    CU_ASSERT_EQUAL(count, 11); // name1, name10 ... name19
+    CU_ASSERT_TRUE(ejdbquerybindstr(jb, q1, 0, "name4"));
+    CU_ASSERT_TRUE(ejdbquerybindlong(jb, q1, 1, 45));
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, NULL);
+    CU_ASSERT_EQUAL(count, 6); // name4, name40 ... name44
+    CU_ASSERT_TRUE(ejdbquerybindlong(jb, q1, 1, 100));
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, NULL);
+    CU_ASSERT_EQUAL(count, 11); // name4, name40 ... name49
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+
+    // {_id : ?}
+    char oidstr[25];
+    bson_oid_to_string(&oid42, oidstr);
+    bson_init_as_query(&bsq1);
+    bson_append_string(&bsq1, "_id", "?");
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+    q1 = ejdbqueryprepare(jb, ejdbcreatequery(jb, &bsq1, NULL, 0, NULL));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    CU_ASSERT_TRUE(ejdbquerybindstr(jb, q1, 0, oidstr));
+    log = tcxstrnew();
+    q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "PRIMARY KEY MATCHING: TRUE"));
+    CU_ASSERT_EQUAL(count, 1);
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+}
+
+void testSinglePassMatch(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "spmatch", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+
+    bson b;
+    bson_oid_t oid;
+    for (int i = 0; i < 100; ++i) {
+        bson_init(&b);
+        bson_append_int(&b, "g", i % 10);
+        bson_append_start_object(&b, "o");
+        bson_append_int(&b, "x", i % 3);
+        bson_append_start_object(&b, "y");
+        bson_append_int(&b, "z", i % 5);
+        bson_append_finish_object(&b);
+        bson_append_finish_object(&b);
+        if (i % 2 == 0) {
+            bson_append_start_array(&b, "arr");
+            bson_append_start_object(&b, "0");
+            bson_append_int(&b, "v", i % 4);
+            bson_append_finish_object(&b);
+            bson_append_start_object(&b, "1");
+            bson_append_int(&b, "v", 7);
+            bson_append_finish_object(&b);
+            bson_append_finish_array(&b);
+        }
+        if (i % 7 == 0) {
+            bson_append_int(&b, "opt", i);
+        }
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    // {g : 3, 'o.x' : 1, 'o.y.z' : {$gt : 1}}
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_int(&bsq1, "g", 3);
+    bson_append_int(&bsq1, "o.x", 1);
+    bson_append_start_object(&bsq1, "o.y.z");
+    bson_append_int(&bsq1, "$gt", 1);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+
+    uint32_t count = 0, ecount = 0;
+    TCXSTR *log = tcxstrnew();
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "SINGLE PASS CONDITIONS: 3"));
+    for (int i = 0; i < 100; ++i) {
+        if (i % 10 == 3 && i % 3 == 1 && i % 5 > 1) ecount++;
+    }
+    CU_ASSERT_EQUAL(count, ecount);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+
+    // Array in the middle of field path: {g : 4, 'arr.v' : 7, 'o.x' : {$not : 0}}
+    bson_init_as_query(&bsq1);
+    bson_append_int(&bsq1, "g", 4);
+    bson_append_int(&bsq1, "arr.v", 7);
+    bson_append_start_object(&bsq1, "o.x");
+    bson_append_int(&bsq1, "$not", 0);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, NULL);
+    ecount = 0;
+    for (int i = 0; i < 100; ++i) {
+        if (i % 10 == 4 && i % 3 != 0) ecount++;
+    }
+    CU_ASSERT_EQUAL(count, ecount);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+
+    // Missing fields: {g : {$lt : 2}, opt : {$exists : true}, 'o.w' : {$not : 1}, 'g.a' : {$exists : false}}
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "g");
+    bson_append_int(&bsq1, "$lt", 2);
+    bson_append_finish_object(&bsq1);
+    bson_append_start_object(&bsq1, "opt");
+    bson_append_bool(&bsq1, "$exists", true);
+    bson_append_finish_object(&bsq1);
+    bson_append_start_object(&bsq1, "o.w");
+    bson_append_int(&bsq1, "$not", 1);
+    bson_append_finish_object(&bsq1);
+    bson_append_start_object(&bsq1, "g.a");
+    bson_append_bool(&bsq1, "$exists", false);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, NULL);
+    ecount = 0;
+    for (int i = 0; i < 100; ++i) {
+        if (i % 10 < 2 && i % 7 == 0) ecount++;
+    }
+    CU_ASSERT_EQUAL(count, ecount);
+    CU_ASSERT_EQUAL(TCLISTNUM(q1res), ecount);
+    tclistdel(q1res);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+
+    // Not matched on missing field: {g : 5, 'o.y.w' : 1}
+    bson_init_as_query(&bsq1);
+    bson_append_int(&bsq1, "g", 5);
+    bson_append_int(&bsq1, "o.y.w", 1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, NULL);
+    CU_ASSERT_EQUAL(count, 0);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+}
+
+static uint32_t _rxprefixcount(EJCOLL *coll, const char *rx, const char *opts, const char *midx) {
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_regex(&bsq1, "name", rx, opts);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+    uint32_t count = 0;
+    TCXSTR *log = tcxstrnew();
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_EQUAL(count, TCLISTNUM(q1res));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), midx));
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+    return count;
+}
+
+void testRegexPrefixIndex(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "rxprefix", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "name", JBIDXSTR | JBIDXISTR));
+
+    const char *names[] = {"apple", "apricot", "banana", "Apple"};
+    char nbuf[32];
+    bson b;
+    bson_oid_t oid;
+    for (int i = 0; i < 100; ++i) {
+        snprintf(nbuf, sizeof (nbuf), "%s%02d", names[i % 4], i);
+        bson_init(&b);
+        bson_append_string(&b, "name", nbuf);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    // Prefix range scan, regular expression is still checked for each record
+    CU_ASSERT_EQUAL(_rxprefixcount(coll, "^ap(p|r)", "", "MAIN IDX: 'sname'"), 50);
+    CU_ASSERT_EQUAL(_rxprefixcount(coll, "^apple[0-4]", "", "MAIN IDX: 'sname'"), 13);
+    // Optional last character is not a part of prefix
+    CU_ASSERT_EQUAL(_rxprefixcount(coll, "^apples?", "", "MAIN IDX: 'sname'"), 25);
+    CU_ASSERT_EQUAL(_rxprefixcount(coll, "^b\\.?anana", "", "MAIN IDX: 'sname'"), 25);
+    // Case insensitive expression uses case insensitive index
+    CU_ASSERT_EQUAL(_rxprefixcount(coll, "^APP", "i", "MAIN IDX: 'iname'"), 50);
+    // Not anchored expressions
+    CU_ASSERT_EQUAL(_rxprefixcount(coll, "^apr|ban", "", "MAIN IDX: 'NONE'"), 50);
+    CU_ASSERT_EQUAL(_rxprefixcount(coll, "pple", "", "MAIN IDX: 'NONE'"), 50);
+    CU_ASSERT_EQUAL(_rxprefixcount(coll, "^.pple", "", "MAIN IDX: 'NONE'"), 50);
+    // Cached expression is shared by queries
+    CU_ASSERT_EQUAL(_rxprefixcount(coll, "^ap(p|r)", "", "MAIN IDX: 'sname'"), 50);
+    CU_ASSERT_EQUAL(_rxprefixcount(coll, "^ap(p|r)", "i", "MAIN IDX: 'iname'"), 75);
+}
+
+void testInMergeJoin(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "inmerge", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "sid", JBIDXSTR));
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "num", JBIDXNUM));
+
+    char nbuf[32];
+    bson b;
+    bson_oid_t oid;
+    for (int i = 0; i < 1000; ++i) {
+        snprintf(nbuf, sizeof (nbuf), "id%04d", i);
+        bson_init(&b);
+        bson_append_string(&b, "sid", nbuf);
+        bson_append_int(&b, "num", i);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    // Dense `$in` keys are merged with index keys by single cursor pass
+    // {sid : {$in : ['id0999', 'id0996', ..., 'id0000', 'zz']}}
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "sid");
+    bson_append_start_array(&bsq1, "$in");
+    int n = 0;
+    for (int i = 999; i >= 0; i -= 3) {
+        snprintf(nbuf, sizeof (nbuf), "id%04d", i);
+        bson_append_string(&bsq1, nbuf + 2, nbuf);
+        n++;
+    }
+    bson_append_string(&bsq1, "zz", "zz");
+    bson_append_finish_array(&bsq1);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+
+    uint32_t count = 0;
+    TCXSTR *log = tcxstrnew();
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "MAIN IDX: 'ssid'"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "INDEX JUMPS: 1\n"));
+    CU_ASSERT_EQUAL(count, n);
+    CU_ASSERT_EQUAL(TCLISTNUM(q1res), n);
+    for (int i = 0; i < TCLISTNUM(q1res); ++i) {
+        bson_iterator it;
+        CU_ASSERT_EQUAL(bson_find_from_buffer(&it, TCLISTVALPTR(q1res, i), "num"), BSON_INT);
+        CU_ASSERT_EQUAL(bson_iterator_int(&it) % 3, 0);
+    }
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+
+    // Sparse keys: {num : {$in : [999, 5, 500, 5000]}}
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "num");
+    bson_append_start_array(&bsq1, "$in");
+    bson_append_int(&bsq1, "0", 999);
+    bson_append_int(&bsq1, "1", 5);
+    bson_append_int(&bsq1, "2", 500);
+    bson_append_int(&bsq1, "3", 5000);
+    bson_append_finish_array(&bsq1);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+    log = tcxstrnew();
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "MAIN IDX: 'nnum'"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "$IN KEYS: 4 INDEX JUMPS: 3\n"));
+    CU_ASSERT_EQUAL(count, 3);
+    tclistdel(q1res);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+
+    // Dense number keys: {num : {$in : [10, 11, ..., 109]}} $orderby {num : -1}
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "num");
+    bson_append_start_array(&bsq1, "$in");
+    for (int i = 10; i < 110; ++i) {
+        snprintf(nbuf, sizeof (nbuf), "%d", i);
+        bson_append_int(&bsq1, nbuf, i);
+    }
+    bson_append_finish_array(&bsq1);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+    bson bshints;
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "num", -1);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+    CU_ASSERT_FALSE_FATAL(bshints.err);
+    for (int j = 0; j < 2; ++j) {
+        log = tcxstrnew();
+        q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, j ? &bshints : NULL);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+        q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+        CU_ASSERT_EQUAL(count, 100);
+        CU_ASSERT_EQUAL(TCLISTNUM(q1res), 100);
+        if (j == 0) {
+            CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "$IN KEYS: 100 INDEX JUMPS: 1\n"));
+        }
+        for (int i = 0; i < TCLISTNUM(q1res); ++i) {
+            bson_iterator it;
+            CU_ASSERT_EQUAL(bson_find_from_buffer(&it, TCLISTVALPTR(q1res, i), "num"), BSON_INT);
+            CU_ASSERT_EQUAL(bson_iterator_int(&it), j ? 109 - i : 10 + i);
+        }
+        tclistdel(q1res);
+        tcxstrdel(log);
+        ejdbquerydel(q1);
+    }
+    bson_destroy(&bshints);
+    bson_destroy(&bsq1);
+}
+
+static uint32_t _skipkeysquery(EJCOLL *coll, bson *bsq, bson *bshints, int qflags, const char *logmsg, int *first) {
+    uint32_t count = 0;
+    TCXSTR *log = tcxstrnew();
+    EJQ *q1 = ejdbcreatequery(jb, bsq, NULL, 0, bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, qflags, log);
+    if (logmsg) {
+        CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), logmsg));
+    } else {
+        CU_ASSERT_PTR_NULL(strstr(TCXSTRPTR(log), "INDEX KEYS SKIPPED"));
+    }
+    if (first && q1res && TCLISTNUM(q1res) > 0) {
+        bson_iterator it;
+        CU_ASSERT_EQUAL(bson_find_from_buffer(&it, TCLISTVALPTR(q1res, 0), "n"), BSON_INT);
+        *first = bson_iterator_int(&it);
+    }
+    if (q1res) {
+        tclistdel(q1res);
+    }
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    return count;
+}
+
+void testIndexKeysSkip(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "keysskip", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "n", JBIDXNUM));
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "s", JBIDXSTR));
+
+    char nbuf[32];
+    bson b;
+    bson_oid_t oid;
+    for (int i = 0; i < 3000; ++i) {
+        snprintf(nbuf, sizeof (nbuf), "k%05d", (i < 2990) ? i : 0);
+        bson_init(&b);
+        bson_append_int(&b, "n", i);
+        bson_append_string(&b, "s", nbuf);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    // {n : {$bt : [100, 2099]}}
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "n");
+    bson_append_start_array(&bsq1, "$bt");
+    bson_append_int(&bsq1, "0", 100);
+    bson_append_int(&bsq1, "1", 2099);
+    bson_append_finish_array(&bsq1);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_EQUAL(_skipkeysquery(coll, &bsq1, NULL, JBQRYCOUNT, "INDEX KEYS SKIPPED: 2000\n", NULL), 2000);
+    bson_destroy(&bsq1);
+
+    // {n : {$gt : 100}}
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "n");
+    bson_append_int(&bsq1, "$gt", 100);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_EQUAL(_skipkeysquery(coll, &bsq1, NULL, JBQRYCOUNT, "INDEX KEYS SKIPPED: 2899\n", NULL), 2899);
+    bson_destroy(&bsq1);
+
+    // {s : {$begin : 'k01'}}
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "s");
+    bson_append_string(&bsq1, "$begin", "k01");
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_EQUAL(_skipkeysquery(coll, &bsq1, NULL, JBQRYCOUNT, "INDEX KEYS SKIPPED: 1000\n", NULL), 1000);
+    bson_destroy(&bsq1);
+
+    // Duplicated keys {s : 'k00000'}
+    bson_init_as_query(&bsq1);
+    bson_append_string(&bsq1, "s", "k00000");
+    bson_finish(&bsq1);
+    CU_ASSERT_EQUAL(_skipkeysquery(coll, &bsq1, NULL, JBQRYCOUNT, "INDEX KEYS SKIPPED: 11\n", NULL), 11);
+    bson_destroy(&bsq1);
+
+    // Not all conditions are served by index {n : {$gt : 100}, s : {$begin : 'k00'}}
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "n");
+    bson_append_int(&bsq1, "$gt", 100);
+    bson_append_finish_object(&bsq1);
+    bson_append_start_object(&bsq1, "s");
+    bson_append_string(&bsq1, "$begin", "k00");
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_EQUAL(_skipkeysquery(coll, &bsq1, NULL, JBQRYCOUNT, NULL, NULL), 909);
+    bson_destroy(&bsq1);
+
+    // {n : {$gte : 0}} $orderby {n : 1} $skip 2500 $max 10
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "n");
+    bson_append_int(&bsq1, "$gte", 0);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    bson bshints;
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "n", 1);
+    bson_append_finish_object(&bshints);
+    bson_append_int(&bshints, "$skip", 2500);
+    bson_append_int(&bshints, "$max", 10);
+    bson_finish(&bshints);
+    int first = -1;
+    CU_ASSERT_EQUAL(_skipkeysquery(coll, &bsq1, &bshints, 0, "INDEX KEYS SKIPPED: 2500\n", &first), 10);
+    CU_ASSERT_EQUAL(first, 2500);
+    bson_destroy(&bshints);
+
+    // Skip beyond the range end $skip 5000
+    bson_init_as_query(&bshints);
+    bson_append_int(&bshints, "$skip", 5000);
+    bson_finish(&bshints);
+    CU_ASSERT_EQUAL(_skipkeysquery(coll, &bsq1, &bshints, 0, "INDEX KEYS SKIPPED: 3000\n", NULL), 0);
+    bson_destroy(&bshints);
+    bson_destroy(&bsq1);
+}
+
+void testIndexDistinct(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "idxdistinct", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "n", JBIDXNUM));
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "s", JBIDXSTR));
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "m", JBIDXSTR));
+
+    char nbuf[32];
+    bson b;
+    bson_oid_t oid;
+    for (int i = 0; i < 1000; ++i) {
+        snprintf(nbuf, sizeof (nbuf), "v%02d", i % 25);
+        bson_init(&b);
+        bson_append_int(&b, "n", i % 10);
+        bson_append_string(&b, "s", nbuf);
+        if (i % 2) { // Number and string values share the same key of string index
+            bson_append_int(&b, "m", 7);
+        } else {
+            bson_append_string(&b, "m", "7");
+        }
+        bson_append_int(&b, "g", i % 3);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    uint32_t count = 0;
+    bson_iterator it;
+    TCXSTR *log = tcxstrnew();
+    bson *res = ejdbqrydistinct(coll, "s", NULL, NULL, 0, &count, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(res);
+    CU_ASSERT_EQUAL(count, 25);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "DISTINCT INDEX: 'ss' KEY RUNS: 25 RECORDS READ: 25"));
+    CU_ASSERT_EQUAL(bson_find(&it, res, "0"), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "v00");
+    CU_ASSERT_EQUAL(bson_find(&it, res, "24"), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "v24");
+    bson_del(res);
+
+    tcxstrclear(log);
+    res = ejdbqrydistinct(coll, "n", NULL, NULL, 0, &count, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(res);
+    CU_ASSERT_EQUAL(count, 10);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "DISTINCT INDEX: 'nn' KEY RUNS: 10"));
+    CU_ASSERT_EQUAL(bson_find(&it, res, "9"), BSON_INT);
+    CU_ASSERT_EQUAL(bson_iterator_int(&it), 9);
+    bson_del(res);
+
+    // Distinct 's' values of records {n : 3}
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_int(&bsq1, "n", 3);
+    bson_finish(&bsq1);
+    tcxstrclear(log);
+    res = ejdbqrydistinct(coll, "s", &bsq1, NULL, 0, &count, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(res);
+    CU_ASSERT_EQUAL(count, 5);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "DISTINCT INDEX: 'ss' KEY RUNS: 25"));
+    CU_ASSERT_EQUAL(bson_find(&it, res, "1"), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "v08");
+    bson_del(res);
+    bson_destroy(&bsq1);
+
+    tcxstrclear(log);
+    res = ejdbqrydistinct(coll, "m", NULL, NULL, 0, &count, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(res);
+    CU_ASSERT_EQUAL(count, 2);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "DISTINCT INDEX: 'sm' KEY RUNS: 1 RECORDS READ: 1000"));
+    bson_del(res);
+
+    // Not indexed field
+    tcxstrclear(log);
+    res = ejdbqrydistinct(coll, "g", NULL, NULL, 0, &count, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(res);
+    CU_ASSERT_EQUAL(count, 3);
+    CU_ASSERT_PTR_NULL(strstr(TCXSTRPTR(log), "DISTINCT INDEX"));
+    bson_del(res);
+    tcxstrdel(log);
+}
+
+static TCLIST* _groupquery(EJCOLL *coll, const char *gkey, int sortmem, uint32_t *count, TCXSTR *log) {
+    bson bsq, bshints;
+    bson_init_as_query(&bsq);
+    bson_append_int(&bsq, "flag", 1);
+    bson_finish(&bsq);
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$group");
+    bson_append_string(&bshints, "_id", gkey);
+    bson_append_start_object(&bshints, "total");
+    bson_append_string(&bshints, "$sum", "$v");
+    bson_append_finish_object(&bshints);
+    bson_append_start_object(&bshints, "n");
+    bson_append_start_object(&bshints, "$count");
+    bson_append_finish_object(&bshints);
+    bson_append_finish_object(&bshints);
+    bson_append_start_object(&bshints, "avg");
+    bson_append_string(&bshints, "$avg", "$d");
+    bson_append_finish_object(&bshints);
+    bson_append_start_object(&bshints, "mn");
+    bson_append_string(&bshints, "$min", "$v");
+    bson_append_finish_object(&bshints);
+    bson_append_start_object(&bshints, "mx");
+    bson_append_string(&bshints, "$max", "$v");
+    bson_append_finish_object(&bshints);
+    bson_append_start_object(&bshints, "ones");
+    bson_append_int(&bshints, "$sum", 1);
+    bson_append_finish_object(&bshints);
+    bson_append_finish_object(&bshints);
+    if (sortmem > 0) {
+        bson_append_int(&bshints, "$sortmem", sortmem);
+    }
+    bson_finish(&bshints);
+    EJQ *q = ejdbcreatequery(jb, &bsq, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q);
+    TCLIST *res = ejdbqryexecute(coll, q, count, 0, log);
+    bson_destroy(&bsq);
+    bson_destroy(&bshints);
+    ejdbquerydel(q);
+    return res;
+}
+
+void testGroupAggregate(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "groupagg", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    char nbuf[32];
+    bson b;
+    bson_oid_t oid;
+    for (int i = 0; i < 1000; ++i) {
+        snprintf(nbuf, sizeof (nbuf), "c%d", i % 4);
+        bson_init(&b);
+        bson_append_string(&b, "cat", nbuf);
+        bson_append_int(&b, "v", i);
+        bson_append_double(&b, "d", i * 0.5);
+        bson_append_int(&b, "flag", i % 2);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    uint32_t count = 0;
+    bson_iterator it;
+    TCXSTR *log = tcxstrnew();
+    TCLIST *res = _groupquery(coll, "$cat", 0, &count, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(res);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "GROUPED RECORDS: 500 SPILLED RUNS: 0"));
+    CU_ASSERT_EQUAL(count, 2);
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(res), 2);
+    const void *gbuf = TCLISTVALPTR(res, 0);
+    CU_ASSERT_FALSE(bson_compare_string("c1", gbuf, "_id"));
+    CU_ASSERT_FALSE(bson_compare_long(124750, gbuf, "total"));
+    CU_ASSERT_FALSE(bson_compare_long(250, gbuf, "n"));
+    CU_ASSERT_FALSE(bson_compare_double(249.5, gbuf, "avg"));
+    CU_ASSERT_FALSE(bson_compare_long(1, gbuf, "mn"));
+    CU_ASSERT_FALSE(bson_compare_long(997, gbuf, "mx"));
+    CU_ASSERT_EQUAL(bson_find_from_buffer(&it, gbuf, "ones"), BSON_INT);
+    CU_ASSERT_EQUAL(bson_iterator_int(&it), 250);
+    CU_ASSERT_FALSE(bson_compare_string("c3", TCLISTVALPTR(res, 1), "_id"));
+
+    // Every group is spilled, spilled runs are merged into the same groups
+    tcxstrclear(log);
+    TCLIST *sres = _groupquery(coll, "$cat", 1, &count, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(sres);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "SPILLED RUNS: 500"));
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(sres), 2);
+    for (int i = 0; i < TCLISTNUM(res); ++i) {
+        CU_ASSERT_EQUAL(TCLISTVALSIZ(res, i), TCLISTVALSIZ(sres, i));
+        CU_ASSERT_FALSE(memcmp(TCLISTVALPTR(res, i), TCLISTVALPTR(sres, i), TCLISTVALSIZ(res, i)));
+    }
+    tclistdel(sres);
+    tclistdel(res);
+
+    tcxstrclear(log);
+    res = _groupquery(coll, "$v", 1, &count, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(res);
+    CU_ASSERT_EQUAL(count, 500);
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(res), 500);
+    for (int i = 0; i < TCLISTNUM(res); ++i) {
+        CU_ASSERT_EQUAL(bson_find_from_buffer(&it, TCLISTVALPTR(res, i), "_id"), BSON_INT);
+        CU_ASSERT_FALSE(bson_compare_long(bson_iterator_int(&it), TCLISTVALPTR(res, i), "mx"));
+        CU_ASSERT_FALSE(bson_compare_long(1, TCLISTVALPTR(res, i), "n"));
+    }
+    TCLIST *runs = tcglobpat("dbt2_groupagg.sort-*"); //Run files are removed
+    CU_ASSERT_EQUAL(TCLISTNUM(runs), 0);
+    tclistdel(runs);
+    tclistdel(res);
+
+    // Constant group key and compound group key
+    bson bsq, bshints;
+    bson_init_as_query(&bsq);
+    bson_finish(&bsq);
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$group");
+    bson_append_null(&bshints, "_id");
+    bson_append_start_object(&bshints, "n");
+    bson_append_start_object(&bshints, "$count");
+    bson_append_finish_object(&bshints);
+    bson_append_finish_object(&bshints);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+    EJQ *q = ejdbcreatequery(jb, &bsq, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q);
+    res = ejdbqryexecute(coll, q, &count, 0, NULL);
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(res), 1);
+    CU_ASSERT_EQUAL(bson_find_from_buffer(&it, TCLISTVALPTR(res, 0), "_id"), BSON_NULL);
+    CU_ASSERT_FALSE(bson_compare_long(1000, TCLISTVALPTR(res, 0), "n"));
+    tclistdel(res);
+    ejdbquerydel(q);
+    bson_destroy(&bshints);
+
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$group");
+    bson_append_start_object(&bshints, "_id");
+    bson_append_string(&bshints, "c", "$cat");
+    bson_append_string(&bshints, "f", "$flag");
+    bson_append_finish_object(&bshints);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+    q = ejdbcreatequery(jb, &bsq, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q);
+    res = ejdbqryexecute(coll, q, &count, 0, NULL);
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(res), 4);
+    CU_ASSERT_FALSE(bson_compare_string("c2", TCLISTVALPTR(res, 2), "_id.c"));
+    CU_ASSERT_FALSE(bson_compare_long(0, TCLISTVALPTR(res, 2), "_id.f"));
+    tclistdel(res);
+    ejdbquerydel(q);
+    bson_destroy(&bshints);
+
+    // Unknown accumulator
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$group");
+    bson_append_string(&bshints, "_id", "$cat");
+    bson_append_start_object(&bshints, "x");
+    bson_append_string(&bshints, "$median", "$v");
+    bson_append_finish_object(&bshints);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+    q = ejdbcreatequery(jb, &bsq, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q);
+    res = ejdbqryexecute(coll, q, &count, 0, NULL);
+    CU_ASSERT_PTR_NULL(res);
+    CU_ASSERT_EQUAL(ejdbecode(jb), JBEQGROUP);
+    ejdbquerydel(q);
+    bson_destroy(&bshints);
+    bson_destroy(&bsq);
+    tcxstrdel(log);
+}
+
+void testJoinBatch(void) {
+    EJCOLL *ucoll = ejdbcreatecoll(jb, "joinusers", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(ucoll);
+    EJCOLL *coll = ejdbcreatecoll(jb, "joinorders", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    char nbuf[32];
+    char xoid[25];
+    bson b;
+    bson_oid_t oid, uoids[50];
+    for (int i = 0; i < 50; ++i) {
+        snprintf(nbuf, sizeof (nbuf), "u%02d", i);
+        bson_init(&b);
+        bson_append_string(&b, "name", nbuf);
+        bson_finish(&b);
+        CU_ASSERT_TRUE_FATAL(ejdbsavebson(ucoll, &b, &uoids[i]));
+        bson_destroy(&b);
+    }
+    for (int i = 0; i < 1000; ++i) {
+        bson_init(&b);
+        bson_append_int(&b, "n", i);
+        bson_append_oid(&b, "user", &uoids[i % 50]);
+        bson_append_start_array(&b, "watchers");
+        bson_oid_to_string(&uoids[(i + 1) % 50], xoid);
+        bson_append_string(&b, "0", xoid);
+        bson_append_oid(&b, "1", &uoids[(i + 2) % 50]);
+        bson_append_finish_array(&b);
+        bson_finish(&b);
+        CU_ASSERT_TRUE_FATAL(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "$do");
+    bson_append_start_object(&bsq1, "user");
+    bson_append_string(&bsq1, "$join", "joinusers");
+    bson_append_finish_object(&bsq1);
+    bson_append_start_object(&bsq1, "watchers");
+    bson_append_string(&bsq1, "$join", "joinusers");
+    bson_append_finish_object(&bsq1);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    bson bshints;
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "n", 1);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+
+    // References of the whole result set are read once
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    uint32_t count = 0;
+    TCXSTR *log = tcxstrnew();
+    TCLIST *q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1res);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "$join PREFETCHED RECORDS: 50"));
+    CU_ASSERT_EQUAL(count, 1000);
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(q1res), 1000);
+    for (int i = 0; i < TCLISTNUM(q1res); ++i) {
+        void *bsdata = TCLISTVALPTR(q1res, i);
+        CU_ASSERT_FALSE(bson_compare_long(i, bsdata, "n"));
+        snprintf(nbuf, sizeof (nbuf), "u%02d", i % 50);
+        CU_ASSERT_FALSE(bson_compare_string(nbuf, bsdata, "user.name"));
+        snprintf(nbuf, sizeof (nbuf), "u%02d", (i + 1) % 50);
+        CU_ASSERT_FALSE(bson_compare_string(nbuf, bsdata, "watchers.0.name"));
+        snprintf(nbuf, sizeof (nbuf), "u%02d", (i + 2) % 50);
+        CU_ASSERT_FALSE(bson_compare_string(nbuf, bsdata, "watchers.1.name"));
+    }
+    tclistdel(q1res);
+    ejdbquerydel(q1);
+    bson_destroy(&bshints);
+
+    // Records ordered by joined field are joined during scan
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "user.name", -1);
+    bson_append_int(&bshints, "n", 1);
+    bson_append_finish_object(&bshints);
+    bson_append_int(&bshints, "$max", 3);
+    bson_finish(&bshints);
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    tcxstrclear(log);
+    q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1res);
+    CU_ASSERT_PTR_NULL(strstr(TCXSTRPTR(log), "$join PREFETCHED"));
+    CU_ASSERT_EQUAL_FATAL(TCLISTNUM(q1res), 3);
+    CU_ASSERT_FALSE(bson_compare_string("u49", TCLISTVALPTR(q1res, 0), "user.name"));
+    CU_ASSERT_FALSE(bson_compare_long(49, TCLISTVALPTR(q1res, 0), "n"));
+    CU_ASSERT_FALSE(bson_compare_long(99, TCLISTVALPTR(q1res, 1), "n"));
+    tclistdel(q1res);
+    ejdbquerydel(q1);
+    bson_destroy(&bshints);
+    bson_destroy(&bsq1);
+    tcxstrdel(log);
+}
+
+void testQueryExplain(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "qryexplain", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "a", JBIDXNUM));
+
+    bson b;
+    bson_oid_t oid;
+    for (int i = 0; i < 1000; ++i) {
+        bson_init(&b);
+        bson_append_int(&b, "a", i);
+        bson_append_int(&b, "b", 1000 - i);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    // {a : {$gt : 900}} ordered by 'b'
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "a");
+    bson_append_int(&bsq1, "$gt", 900);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    bson bshints;
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "b", 1);
+    bson_append_finish_object(&bshints);
+    bson_finish(&bshints);
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+
+    uint32_t count = 0;
+    bson explain;
+    bson_iterator it;
+    EJQRESULT q1res = ejdbqryexplain(coll, q1, &count, 0, &explain);
+    CU_ASSERT_EQUAL(count, 99);
+    CU_ASSERT_EQUAL(ejdbqresultnum(q1res), 99);
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "access"), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "index");
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "index"), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "na");
+    bson_iterator_init(&it, &explain);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("candidates.0.field", &it), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "a");
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "records"), BSON_LONG);
+    CU_ASSERT_EQUAL(bson_iterator_long(&it), 99);
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "bytes"), BSON_LONG);
+    CU_ASSERT_TRUE(bson_iterator_long(&it) > 0);
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "matched"), BSON_LONG);
+    CU_ASSERT_EQUAL(bson_iterator_long(&it), 99);
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "returned"), BSON_LONG);
+    CU_ASSERT_EQUAL(bson_iterator_long(&it), 99);
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "sort"), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "memory");
+    bson_iterator_init(&it, &explain);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("stages.scan.wall", &it), BSON_DOUBLE);
+    bson_iterator_init(&it, &explain);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("stages.sort.cpu", &it), BSON_DOUBLE);
+    ejdbqresultdispose(q1res);
+    bson_destroy(&explain);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+
+    // Full scan of {b : {$gt : 900}} ordered by 'b' with $max
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "b");
+    bson_append_int(&bsq1, "$gt", 900);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    bson_destroy(&bshints);
+    bson_init_as_query(&bshints);
+    bson_append_start_object(&bshints, "$orderby");
+    bson_append_int(&bshints, "b", 1);
+    bson_append_finish_object(&bshints);
+    bson_append_int(&bshints, "$max", 10);
+    bson_finish(&bshints);
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    q1res = ejdbqryexplain(coll, q1, &count, 0, &explain);
+    CU_ASSERT_EQUAL(count, 10);
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "access"), BSON_STRING);
+    CU_ASSERT_PTR_NOT_NULL(strstr(bson_iterator_string(&it), "fullscan"));
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "index"), BSON_NULL);
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "records"), BSON_LONG);
+    CU_ASSERT_EQUAL(bson_iterator_long(&it), 1000);
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "matched"), BSON_LONG);
+    CU_ASSERT_EQUAL(bson_iterator_long(&it), 100);
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "returned"), BSON_LONG);
+    CU_ASSERT_EQUAL(bson_iterator_long(&it), 10);
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "sort"), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "topk");
+    ejdbqresultdispose(q1res);
+    bson_destroy(&explain);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+    bson_destroy(&bshints);
+
+    // Simple count
+    bson_init_as_query(&bsq1);
+    bson_finish(&bsq1);
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    q1res = ejdbqryexplain(coll, q1, &count, JBQRYCOUNT, &explain);
+    CU_ASSERT_EQUAL(count, 1000);
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "access"), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "count");
+    CU_ASSERT_EQUAL(bson_find(&it, &explain, "records"), BSON_LONG);
+    CU_ASSERT_EQUAL(bson_iterator_long(&it), 0);
+    ejdbqresultdispose(q1res);
+    bson_destroy(&explain);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+}
+
+static EJQ* _limitsquery(const char *fpath, const char *hint, double val) {
+    bson bsq, bshints;
+    bson_init_as_query(&bsq);
+    bson_append_start_object(&bsq, fpath);
+    bson_append_int(&bsq, "$gt", -1);
+    bson_append_finish_object(&bsq);
+    bson_finish(&bsq);
+    bson_init_as_query(&bshints);
+    if (hint) {
+        bson_append_double(&bshints, hint, val);
+    }
+    bson_finish(&bshints);
+    EJQ *q = ejdbcreatequery(jb, &bsq, NULL, 0, &bshints);
+    bson_destroy(&bsq);
+    bson_destroy(&bshints);
+    return q;
+}
+
+void testQueryLimits(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "qrylimits", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "a", JBIDXNUM));
+
+    bson b;
+    bson_oid_t oid;
+    for (int i = 0; i < 1000; ++i) {
+        bson_init(&b);
+        bson_append_int(&b, "a", i);
+        bson_append_int(&b, "b", i);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    uint32_t count = 0;
+    TCXSTR *log = tcxstrnew();
+    // Full scan exceeding $maxscan
+    EJQ *q1 = _limitsquery("b", "$maxscan", 100);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    EJQRESULT q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NULL(q1res);
+    CU_ASSERT_EQUAL(count, 0);
+    CU_ASSERT_EQUAL(ejdbecode(jb), JBEQLIMIT);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "QUERY INTERRUPTED"));
+    ejdbquerydel(q1);
+
+    // Index scan exceeding $maxscan in count mode
+    q1 = _limitsquery("a", "$maxscan", 10);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    q1res = ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, NULL);
+    CU_ASSERT_PTR_NULL(q1res);
+    CU_ASSERT_EQUAL(count, 0);
+    CU_ASSERT_EQUAL(ejdbecode(jb), JBEQLIMIT);
+    ejdbquerydel(q1);
+
+    // Query within the limit
+    q1 = _limitsquery("b", "$maxscan", 1000);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    q1res = ejdbqryexecute(coll, q1, &count, 0, NULL);
+    CU_ASSERT_EQUAL(ejdbecode(jb), TCESUCCESS);
+    CU_ASSERT_EQUAL(count, 1000);
+    CU_ASSERT_EQUAL(ejdbqresultnum(q1res), 1000);
+    ejdbqresultdispose(q1res);
+    ejdbquerydel(q1);
+
+    // Elapsed deadline
+    q1 = _limitsquery("b", "$timeout", 1e-6);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    q1res = ejdbqryexecute(coll, q1, &count, 0, NULL);
+    CU_ASSERT_PTR_NULL(q1res);
+    CU_ASSERT_EQUAL(ejdbecode(jb), JBEQLIMIT);
+    ejdbquerydel(q1);
+
+    // Cancelled query
+    q1 = _limitsquery("b", NULL, 0);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    ejdbqrycancel(q1, true);
+    q1res = ejdbqryexecute(coll, q1, &count, 0, NULL);
+    CU_ASSERT_PTR_NULL(q1res);
+    CU_ASSERT_EQUAL(ejdbecode(jb), JBEQCANCELLED);
+    ejdbqrycancel(q1, false);
+    q1res = ejdbqryexecute(coll, q1, &count, JBQRYCOUNT, NULL);
+    CU_ASSERT_EQUAL(ejdbecode(jb), TCESUCCESS);
+    CU_ASSERT_EQUAL(count, 1000);
+    ejdbquerydel(q1);
+
+    // Collection is unlocked after interrupted queries
+    bson_init(&b);
+    bson_append_int(&b, "a", 1000);
+    bson_finish(&b);
+    CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+    bson_destroy(&b);
+
+    // Parallel full scan exceeding $maxscan
+    for (int i = 0; i < 2000; ++i) {
+        bson_init(&b);
+        bson_append_int(&b, "b", i);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+    bson bsq1, bshints;
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "b");
+    bson_append_int(&bsq1, "$gt", -1);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    bson_init_as_query(&bshints);
+    bson_append_int(&bshints, "$maxscan", 100);
+    bson_append_int(&bshints, "$threads", 4);
+    bson_finish(&bshints);
+    q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    tcxstrclear(log);
+    q1res = ejdbqryexecute(coll, q1, &count, 0, log);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "PARALLEL FULLSCAN THREADS: 4"));
+    CU_ASSERT_PTR_NULL(q1res);
+    CU_ASSERT_EQUAL(count, 0);
+    CU_ASSERT_EQUAL(ejdbecode(jb), JBEQLIMIT);
+    bson_destroy(&bsq1);
+    bson_destroy(&bshints);
+    ejdbquerydel(q1);
+
+    tcxstrdel(log);
+}
+
+static void _slowlogquery(EJCOLL *coll, int a, const char *b, bool orderby) {
+    bson bsq, bshints;
+    bson_init_as_query(&bsq);
+    if (b) {
+        bson_append_string(&bsq, "b", b);
+    }
+    bson_append_start_object(&bsq, "a");
+    bson_append_int(&bsq, "$gt", a);
+    bson_append_finish_object(&bsq);
+    bson_finish(&bsq);
+    bson_init_as_query(&bshints);
+    if (orderby) {
+        bson_append_start_object(&bshints, "$orderby");
+        bson_append_int(&bshints, "c", -1);
+        bson_append_finish_object(&bshints);
+    }
+    bson_finish(&bshints);
+    EJQ *q = ejdbcreatequery(jb, &bsq, NULL, 0, &bshints);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q);
+    uint32_t count = 0;
+    EJQRESULT res = ejdbqryexecute(coll, q, &count, 0, NULL);
+    ejdbqresultdispose(res);
+    ejdbquerydel(q);
+    bson_destroy(&bsq);
+    bson_destroy(&bshints);
+}
+
+void testSlowQueryLog(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "slowlog", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "a", JBIDXNUM));
+    bson b;
+    bson_oid_t oid;
+    for (int i = 0; i < 100; ++i) {
+        bson_init(&b);
+        bson_append_int(&b, "a", i);
+        bson_append_string(&b, "b", (i % 2) ? "x" : "y");
+        bson_append_int(&b, "c", i);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+
+    _slowlogquery(coll, 10, "x", false); // Not logged
+    CU_ASSERT_TRUE(ejdbsetslowlog(jb, 0, 3)); // Log every query
+    _slowlogquery(coll, 10, "x", false);
+    _slowlogquery(coll, 10, "x", false);
+    _slowlogquery(coll, 90, "y", false);
+    _slowlogquery(coll, 20, NULL, true);
+
+    bson_iterator it;
+    bson *log = ejdbslowlog(jb, false);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(log);
+    bson_iterator_init(&it, log);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("2", &it), BSON_OBJECT);
+    bson_iterator_init(&it, log);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("3", &it), BSON_EOO);
+    bson_iterator_init(&it, log);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("0.shape", &it), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "{a:$gt,b:$eq}");
+    bson_iterator_init(&it, log);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("0.index", &it), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "na");
+    bson_iterator_init(&it, log);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("0.matched", &it), BSON_LONG);
+    CU_ASSERT_EQUAL(bson_iterator_long(&it), 45);
+    bson_iterator_init(&it, log);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("0.fingerprint", &it), BSON_STRING);
+    char fingerprint[32];
+    snprintf(fingerprint, sizeof (fingerprint), "%s", bson_iterator_string(&it));
+    bson_iterator_init(&it, log);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("1.fingerprint", &it), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), fingerprint);
+    bson_iterator_init(&it, log);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("1.matched", &it), BSON_LONG);
+    CU_ASSERT_EQUAL(bson_iterator_long(&it), 4);
+    bson_iterator_init(&it, log);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("2.shape", &it), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "{a:$gt} $orderby{c:-1}");
+    bson_iterator_init(&it, log);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("2.ms", &it), BSON_DOUBLE);
+    bson_del(log);
+
+    // Read and reset the log by the command
+    bson cmd;
+    bson_init(&cmd);
+    bson_append_start_object(&cmd, "slowlog");
+    bson_append_bool(&cmd, "reset", true);
+    bson_append_finish_object(&cmd);
+    bson_finish(&cmd);
+    bson *ret = ejdbcommand(jb, &cmd);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(ret);
+    bson_iterator_init(&it, ret);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("entries.2.collection", &it), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "slowlog");
+    bson_del(ret);
+    bson_destroy(&cmd);
+    log = ejdbslowlog(jb, false);
+    CU_ASSERT_EQUAL(bson_size(log), 5);
+    bson_del(log);
+
+    // Disable the log by the command
+    bson_init(&cmd);
+    bson_append_start_object(&cmd, "slowlog");
+    bson_append_int(&cmd, "threshold", -1);
+    bson_append_finish_object(&cmd);
+    bson_finish(&cmd);
+    ret = ejdbcommand(jb, &cmd);
+    bson_iterator_init(&it, ret);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("errorCode", &it), BSON_EOO);
+    bson_del(ret);
+    bson_destroy(&cmd);
+    _slowlogquery(coll, 10, "x", false);
+    log = ejdbslowlog(jb, false);
+    CU_ASSERT_EQUAL(bson_size(log), 5);
+    bson_del(log);
+}
+
+void testEngineStats(void) {
+    EJCOLLOPTS opts = {.cachedrecords = 1000};
+    EJCOLL *coll = ejdbcreatecoll(jb, "engstats", &opts);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "a", JBIDXNUM));
+    bson b;
+    bson_oid_t oid;
+    for (int i = 0; i < 100; ++i) {
+        bson_init(&b);
+        bson_append_int(&b, "a", i);
+        bson_append_int(&b, "b", i);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+    for (int i = 0; i < 2; ++i) { // The second load is served by the record cache
+        bson *bs = ejdbloadbson(coll, &oid);
+        CU_ASSERT_PTR_NOT_NULL(bs);
+        bson_del(bs);
+    }
+
+    uint32_t count = 0;
+    const char *fields[] = {"a", "b"};
+    for (int i = 0; i < 2; ++i) {
+        bson bsq;
+        bson_init_as_query(&bsq);
+        bson_append_start_object(&bsq, fields[i]);
+        bson_append_int(&bsq, "$gt", 50);
+        bson_append_finish_object(&bsq);
+        bson_finish(&bsq);
+        EJQ *q = ejdbcreatequery(jb, &bsq, NULL, 0, NULL);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(q);
+        ejdbqryexecute(coll, q, &count, JBQRYCOUNT, NULL);
+        CU_ASSERT_EQUAL(count, 49);
+        ejdbquerydel(q);
+        bson_destroy(&bsq);
+    }
+
+    bson cmd;
+    bson_init(&cmd);
+    bson_append_start_object(&cmd, "stats");
+    bson_append_start_array(&cmd, "cnames");
+    bson_append_string(&cmd, "0", "engstats");
+    bson_append_finish_array(&cmd);
+    bson_append_finish_object(&cmd);
+    bson_finish(&cmd);
+    bson *ret = ejdbcommand(jb, &cmd);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(ret);
+    bson_iterator it;
+    bson_iterator_init(&it, ret);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("stats.engstats.queries", &it), BSON_LONG);
+    CU_ASSERT_EQUAL(bson_iterator_long(&it), 2);
+    bson_iterator_init(&it, ret);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("stats.engstats.idxscans", &it), BSON_LONG);
+    CU_ASSERT_EQUAL(bson_iterator_long(&it), 1);
+    bson_iterator_init(&it, ret);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("stats.engstats.fullscans", &it), BSON_LONG);
+    CU_ASSERT_EQUAL(bson_iterator_long(&it), 1);
+    bson_iterator_init(&it, ret);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("stats.engstats.rechit", &it), BSON_LONG);
+    CU_ASSERT_TRUE(bson_iterator_long(&it) > 0);
+    bson_iterator_init(&it, ret);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("stats.engstats.recwrite", &it), BSON_LONG);
+    CU_ASSERT_TRUE(bson_iterator_long(&it) >= 100);
+    bson_iterator_init(&it, ret);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("stats.engstats.leafhit", &it), BSON_LONG);
+    CU_ASSERT_TRUE(bson_iterator_long(&it) > 0);
+    bson_iterator_init(&it, ret);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("stats.slowlog", &it), BSON_EOO);
+    bson_del(ret);
+    bson_destroy(&cmd);
+
+    CU_ASSERT_TRUE(ejdbsyncoll(coll));
+    bson *meta = ejdbmeta(jb);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(meta);
+    bool found = false;
+    for (int i = 0; !found; ++i) {
+        char path[64];
+        snprintf(path, sizeof (path), "collections.%d.name", i);
+        bson_iterator_init(&it, meta);
+        if (bson_find_fieldpath_value(path, &it) != BSON_STRING) {
+            break;
+        }
+        if (strcmp(bson_iterator_string(&it), "engstats")) {
+            continue;
+        }
+        found = true;
+        snprintf(path, sizeof (path), "collections.%d.stats.fsyncs", i);
+        bson_iterator_init(&it, meta);
+        CU_ASSERT_EQUAL(bson_find_fieldpath_value(path, &it), BSON_LONG);
+        CU_ASSERT_TRUE(bson_iterator_long(&it) > 0);
+    }
+    CU_ASSERT_TRUE(found);
+    bson_del(meta);
+}
+
+void testLatencyHistograms(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "latency", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    bson b;
+    bson_oid_t oid;
+    for (int i = 0; i < 10; ++i) {
+        bson_init(&b);
+        bson_append_int(&b, "a", i);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+    bson *bs = ejdbloadbson(coll, &oid);
+    CU_ASSERT_PTR_NOT_NULL(bs);
+    bson_del(bs);
+    CU_ASSERT_TRUE(ejdbrmbson(coll, &oid));
+    CU_ASSERT_TRUE(ejdbtranbegin(coll));
+    CU_ASSERT_TRUE(ejdbtrancommit(coll));
+    CU_ASSERT_TRUE(ejdbsyncdb(jb));
+
+    bson cmd;
+    bson_init(&cmd);
+    bson_append_start_object(&cmd, "stats");
+    bson_append_start_array(&cmd, "cnames");
+    bson_append_string(&cmd, "0", "latency");
+    bson_append_finish_array(&cmd);
+    bson_append_finish_object(&cmd);
+    bson_finish(&cmd);
+    bson *ret = ejdbcommand(jb, &cmd);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(ret);
+    bson_iterator it;
+    const char *ops[] = {"save", "load", "query", "rm", "trancommit", "sync"};
+    const int64_t counts[] = {10, 1, 0, 1, 1, 1};
+    for (int i = 0; i < 6; ++i) {
+        char path[64];
+        snprintf(path, sizeof (path), "stats.latency.latency.%s.count", ops[i]);
+        bson_iterator_init(&it, ret);
+        CU_ASSERT_EQUAL(bson_find_fieldpath_value(path, &it), BSON_LONG);
+        CU_ASSERT_EQUAL(bson_iterator_long(&it), counts[i]);
+        snprintf(path, sizeof (path), "stats.latency.latency.%s.max", ops[i]);
+        bson_iterator_init(&it, ret);
+        CU_ASSERT_EQUAL(bson_find_fieldpath_value(path, &it), BSON_LONG);
+        int64_t max = bson_iterator_long(&it);
+        snprintf(path, sizeof (path), "stats.latency.latency.%s.p999", ops[i]);
+        bson_iterator_init(&it, ret);
+        CU_ASSERT_EQUAL(bson_find_fieldpath_value(path, &it), BSON_LONG);
+        int64_t p999 = bson_iterator_long(&it);
+        snprintf(path, sizeof (path), "stats.latency.latency.%s.p50", ops[i]);
+        bson_iterator_init(&it, ret);
+        CU_ASSERT_EQUAL(bson_find_fieldpath_value(path, &it), BSON_LONG);
+        int64_t p50 = bson_iterator_long(&it);
+        CU_ASSERT_TRUE(p50 <= p999 && p999 <= max);
+    }
+    bson_del(ret);
+    bson_destroy(&cmd);
+}
+
+void testInplaceUpdate(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "inplace", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "idx", JBIDXNUM));
+    char pad[20000];
+    memset(pad, 'x', sizeof (pad) - 1);
+    pad[sizeof (pad) - 1] = '\0';
+    bson b;
+    bson_oid_t oid;
+    bson_init(&b);
+    bson_append_int(&b, "cnt", 1);
+    bson_append_long(&b, "lng", 1);
+    bson_append_double(&b, "dbl", 1.0);
+    bson_append_bool(&b, "flag", false);
+    bson_append_int(&b, "idx", 1);
+    bson_append_start_object(&b, "nested");
+    bson_append_int(&b, "n", 1);
+    bson_append_finish_object(&b);
+    bson_append_string(&b, "pad", pad);
+    bson_finish(&b);
+    CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+    bson_destroy(&b);
+    bson *bs = ejdbloadbson(coll, &oid);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(bs);
+    int bsz = bson_size(bs);
+    bson_del(bs);
+
+    // Counter-style update of non indexed fields overwrites only the changed bytes
+    TCHDB *hdb = coll->tdb->hdb;
+    uint64_t walbytes = TCSTATGET(hdb->st_walbytes);
+    CU_ASSERT_TRUE(ejdbtranbegin(coll));
+    bson bsq;
+    bson_init_as_query(&bsq);
+    bson_append_start_object(&bsq, "$inc");
+    bson_append_int(&bsq, "cnt", 5);
+    bson_append_double(&bsq, "dbl", 1.5);
+    bson_append_int(&bsq, "nested.n", 2);
+    bson_append_finish_object(&bsq);
+    bson_append_start_object(&bsq, "$set");
+    bson_append_bool(&bsq, "flag", true);
+    bson_append_long(&bsq, "lng", 7);
+    bson_append_finish_object(&bsq);
+    bson_finish(&bsq);
+    CU_ASSERT_EQUAL(ejdbupdate(coll, &bsq, 0, 0, 0, 0), 1);
+    bson_destroy(&bsq);
+    CU_ASSERT_TRUE(ejdbtrancommit(coll));
+    CU_ASSERT_TRUE(TCSTATGET(hdb->st_walbytes) - walbytes < 1024);
+
+    bs = ejdbloadbson(coll, &oid);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(bs);
+    CU_ASSERT_EQUAL(bson_size(bs), bsz);
+    bson_iterator it;
+    bson_iterator_init(&it, bs);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("cnt", &it), BSON_INT);
+    CU_ASSERT_EQUAL(bson_iterator_int(&it), 6);
+    bson_iterator_init(&it, bs);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("lng", &it), BSON_LONG);
+    CU_ASSERT_EQUAL(bson_iterator_long(&it), 7);
+    bson_iterator_init(&it, bs);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("dbl", &it), BSON_DOUBLE);
+    CU_ASSERT_DOUBLE_EQUAL(bson_iterator_double(&it), 2.5, 0.001);
+    bson_iterator_init(&it, bs);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("flag", &it), BSON_BOOL);
+    CU_ASSERT_TRUE(bson_iterator_bool(&it));
+    bson_iterator_init(&it, bs);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("nested.n", &it), BSON_INT);
+    CU_ASSERT_EQUAL(bson_iterator_int(&it), 3);
+    bson_iterator_init(&it, bs);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("pad", &it), BSON_STRING);
+    CU_ASSERT_EQUAL(strlen(bson_iterator_string(&it)), sizeof (pad) - 1);
+    bson_del(bs);
+
+    // Indexed field is patched in place with the index updated
+    bson_init_as_query(&bsq);
+    bson_append_start_object(&bsq, "$inc");
+    bson_append_int(&bsq, "idx", 41);
+    bson_append_finish_object(&bsq);
+    bson_finish(&bsq);
+    CU_ASSERT_EQUAL(ejdbupdate(coll, &bsq, 0, 0, 0, 0), 1);
+    bson_destroy(&bsq);
+    uint32_t count = 0;
+    for (int i = 1; i <= 42; i += 41) {
+        bson_init_as_query(&bsq);
+        bson_append_int(&bsq, "idx", i);
+        bson_finish(&bsq);
+        EJQ *q = ejdbcreatequery(jb, &bsq, NULL, 0, NULL);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(q);
+        TCXSTR *log = tcxstrnew();
+        ejdbqryexecute(coll, q, &count, JBQRYCOUNT, log);
+        CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "MAIN IDX: 'nidx'"));
+        CU_ASSERT_EQUAL(count, (i == 42) ? 1 : 0);
+        tcxstrdel(log);
+        ejdbquerydel(q);
+        bson_destroy(&bsq);
+    }
+
+    // Changing the type or adding fields rewrites the record
+    bson_init_as_query(&bsq);
+    bson_append_start_object(&bsq, "$set");
+    bson_append_string(&bsq, "cnt", "many");
+    bson_append_finish_object(&bsq);
+    bson_append_start_object(&bsq, "$inc");
+    bson_append_int(&bsq, "added", 1);
+    bson_append_finish_object(&bsq);
+    bson_finish(&bsq);
+    CU_ASSERT_EQUAL(ejdbupdate(coll, &bsq, 0, 0, 0, 0), 1);
+    bson_destroy(&bsq);
+    bs = ejdbloadbson(coll, &oid);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(bs);
+    bson_iterator_init(&it, bs);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("cnt", &it), BSON_STRING);
+    CU_ASSERT_STRING_EQUAL(bson_iterator_string(&it), "many");
+    bson_iterator_init(&it, bs);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("added", &it), BSON_LONG);
+    CU_ASSERT_EQUAL(bson_iterator_long(&it), 1);
+    bson_iterator_init(&it, bs);
+    CU_ASSERT_EQUAL(bson_find_fieldpath_value("idx", &it), BSON_INT);
+    CU_ASSERT_EQUAL(bson_iterator_int(&it), 42);
+    bson_del(bs);
+}
+
+void testAnalyzeSampled(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "analyzesmp", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "n", JBIDXNUM));
+    bson b;
+    bson_oid_t oid;
+    CU_ASSERT_TRUE(ejdbtranbegin(coll));
+    for (int i = 0; i < 100000; ++i) {
+        bson_init(&b);
+        bson_append_int(&b, "n", i % 5000);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+    CU_ASSERT_TRUE(ejdbtrancommit(coll));
+
+    // Large index is sampled, cardinality is estimated
+    TCXSTR *log = tcxstrnew();
+    CU_ASSERT_TRUE(ejdbanalyze(coll, log));
+    const char *lp = strstr(TCXSTRPTR(log), "ANALYZE INDEX 'nn'");
+    CU_ASSERT_PTR_NOT_NULL_FATAL(lp);
+    uint64_t entries = 0, cardinality = 0, sampled = 0;
+    CU_ASSERT_EQUAL(sscanf(lp, "ANALYZE INDEX 'nn': ENTRIES: %" SCNu64 " CARDINALITY: %" SCNu64,
+                           &entries, &cardinality), 2);
+    CU_ASSERT_EQUAL(entries, 100000);
+    CU_ASSERT_TRUE(cardinality >= 4000 && cardinality <= 6000);
+    lp = strstr(lp, "SAMPLED: ");
+    CU_ASSERT_PTR_NOT_NULL_FATAL(lp);
+    CU_ASSERT_EQUAL(sscanf(lp, "SAMPLED: %" SCNu64, &sampled), 1);
+    CU_ASSERT_TRUE(sampled > 0 && sampled < 100000);
+
+    // Sampled stats are the same on every run
+    TCXSTR *log2 = tcxstrnew();
+    CU_ASSERT_TRUE(ejdbanalyze(coll, log2));
+    CU_ASSERT_STRING_EQUAL(TCXSTRPTR(log2), TCXSTRPTR(log));
+    tcxstrdel(log2);
+    tcxstrdel(log);
+}
+
+void testQueryCursorWrites(void) {
+    EJCOLL *coll = ejdbcreatecoll(jb, "qcursorwr", NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(coll);
+    CU_ASSERT_TRUE(ejdbsetindex(coll, "n", JBIDXNUM));
+
+    bson b;
+    bson_oid_t *oids = malloc(20000 * sizeof(*oids));
+    CU_ASSERT_PTR_NOT_NULL_FATAL(oids);
+    for (int i = 0; i < 20000; ++i) {
+        bson_init(&b);
+        bson_append_int(&b, "n", i);
+        bson_append_bool(&b, "keep", !(i % 2));
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, oids + i));
+        bson_destroy(&b);
+    }
+
+    // {n : {$gte : 0}} streamed by the number index
+    bson bsq1;
+    bson_init_as_query(&bsq1);
+    bson_append_start_object(&bsq1, "n");
+    bson_append_int(&bsq1, "$gte", 0);
+    bson_append_finish_object(&bsq1);
+    bson_finish(&bsq1);
+    CU_ASSERT_FALSE_FATAL(bsq1.err);
+    TCXSTR *log = tcxstrnew();
+    EJQ *q1 = ejdbcreatequery(jb, &bsq1, NULL, 0, NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(q1);
+    EJQCUR *cur = ejdbqrycursor(coll, q1, 0, log);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(cur);
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "MAIN IDX: 'nn'"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(TCXSTRPTR(log), "STREAMING CURSOR: YES"));
+
+    int size, kept = 0;
+    const void *bsdata;
+    char *seen = calloc(20000, 1);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(seen);
+    for (int i = 0; i < 100; ++i) {
+        bsdata = ejdbqrycurnext(cur, &size);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(bsdata);
+        CU_ASSERT_FALSE(bson_compare_long(i, bsdata, "n"));
+        seen[i]++;
+    }
+    // Index leaves are changed while the cursor is open
+    for (int i = 1; i < 20000; i += 2) {
+        CU_ASSERT_TRUE(ejdbrmbson(coll, oids + i));
+    }
+    for (int i = 0; i < 2000; ++i) {
+        bson_oid_t oid;
+        bson_init(&b);
+        bson_append_int(&b, "n", (i * 7919) % 20000);
+        bson_append_bool(&b, "keep", false);
+        bson_finish(&b);
+        CU_ASSERT_TRUE(ejdbsavebson(coll, &b, &oid));
+        bson_destroy(&b);
+    }
+    while ((bsdata = ejdbqrycurnext(cur, &size)) != NULL) {
+        bson_iterator it;
+        if (bson_find_from_buffer(&it, bsdata, "keep") == BSON_BOOL && bson_iterator_bool(&it)) {
+            CU_ASSERT_EQUAL_FATAL(bson_find_from_buffer(&it, bsdata, "n"), BSON_INT);
+            int n = bson_iterator_int(&it);
+            CU_ASSERT_TRUE_FATAL(n >= 100 && n < 20000);
+            seen[n]++;
+        }
+    }
+    for (int i = 0; i < 20000; i += 2) { // Every record not changed is returned once
+        if (seen[i] == 1) {
+            ++kept;
+        }
+    }
+    CU_ASSERT_EQUAL(kept, 10000);
+    ejdbqrycurdel(cur);
+    free(seen);
+    free(oids);
+    tcxstrdel(log);
+    ejdbquerydel(q1);
+    bson_destroy(&bsq1);
+}
+
 int main() {
     setlocale(LC_ALL, "en_US.UTF-8");
     CU_pSuite pSuite = NULL;
@@ -6387,7 +9191,34 @@ int main() {
             (NULL == CU_add_test(pSuite, "testTicket148", testTicket148)) ||
             (NULL == CU_add_test(pSuite, "testTicket156", testTicket156)) ||
             (NULL == CU_add_test(pSuite, "testTicket161", testTicket161)) ||
-            (NULL == CU_add_test(pSuite, "testTicket163", testTicket163))
+            (NULL == CU_add_test(pSuite, "testTicket163", testTicket163)) ||
+            (NULL == CU_add_test(pSuite, "testBinaryNumberIndex", testBinaryNumberIndex)) ||
+            (NULL == CU_add_test(pSuite, "testAnalyze", testAnalyze)) ||
+            (NULL == CU_add_test(pSuite, "testTopK", testTopK)) ||
+            (NULL == CU_add_test(pSuite, "testSortKeys", testSortKeys)) ||
+            (NULL == CU_add_test(pSuite, "testSortSpill", testSortSpill)) ||
+            (NULL == CU_add_test(pSuite, "testIndexIntersection", testIndexIntersection)) ||
+            (NULL == CU_add_test(pSuite, "testOrIndexUnion", testOrIndexUnion)) ||
+            (NULL == CU_add_test(pSuite, "testCompoundIndex", testCompoundIndex)) ||
+            (NULL == CU_add_test(pSuite, "testCoveredQuery", testCoveredQuery)) ||
+            (NULL == CU_add_test(pSuite, "testQueryCursor", testQueryCursor)) ||
+            (NULL == CU_add_test(pSuite, "testParallelFullscan", testParallelFullscan)) ||
+            (NULL == CU_add_test(pSuite, "testPreparedQuery", testPreparedQuery)) ||
+            (NULL == CU_add_test(pSuite, "testSinglePassMatch", testSinglePassMatch)) ||
+            (NULL == CU_add_test(pSuite, "testRegexPrefixIndex", testRegexPrefixIndex)) ||
+            (NULL == CU_add_test(pSuite, "testInMergeJoin", testInMergeJoin)) ||
+            (NULL == CU_add_test(pSuite, "testIndexKeysSkip", testIndexKeysSkip)) ||
+            (NULL == CU_add_test(pSuite, "testIndexDistinct", testIndexDistinct)) ||
+            (NULL == CU_add_test(pSuite, "testGroupAggregate", testGroupAggregate)) ||
+            (NULL == CU_add_test(pSuite, "testJoinBatch", testJoinBatch)) ||
+            (NULL == CU_add_test(pSuite, "testQueryExplain", testQueryExplain)) ||
+            (NULL == CU_add_test(pSuite, "testQueryLimits", testQueryLimits)) ||
+            (NULL == CU_add_test(pSuite, "testSlowQueryLog", testSlowQueryLog)) ||
+            (NULL == CU_add_test(pSuite, "testEngineStats", testEngineStats)) ||
+            (NULL == CU_add_test(pSuite, "testLatencyHistograms", testLatencyHistograms)) ||
+            (NULL == CU_add_test(pSuite, "testInplaceUpdate", testInplaceUpdate)) ||
+            (NULL == CU_add_test(pSuite, "testAnalyzeSampled", testAnalyzeSampled)) ||
+            (NULL == CU_add_test(pSuite, "testQueryCursorWrites", testQueryCursorWrites))
     ) {
         CU_cleanup_registry();
         return CU_get_error();
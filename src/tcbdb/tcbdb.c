@@ -149,6 +149,7 @@ static bool tcbdbcurjumpimpl(BDBCUR *cur, const char *kbuf, int ksiz, bool forwa
 static bool tcbdbcuradjust(BDBCUR *cur, bool forward);
 static bool tcbdbcurprevimpl(BDBCUR *cur);
 static bool tcbdbcurnextimpl(BDBCUR *cur);
+static bool tcbdbcurskipimpl(BDBCUR *cur, const char *kbuf, int ksiz, uint64_t num, uint64_t *np);
 static bool tcbdbcurputimpl(BDBCUR *cur, const char *vbuf, int vsiz, int mode);
 static bool tcbdbcuroutimpl(BDBCUR *cur);
 static bool tcbdbcurrecimpl(BDBCUR *cur, const char **kbp, int *ksp, const char **vbp, int *vsp);
@@ -1029,6 +1030,35 @@ bool tcbdbcurnext(BDBCUR *cur) {
     return rv;
 }
 
+/* Move a cursor object forward over records whose keys are less than a bound key. */
+uint64_t tcbdbcurskip(BDBCUR *cur, const void *kbuf, int ksiz, uint64_t num) {
+    assert(cur && ksiz >= 0);
+    TCBDB *bdb = cur->bdb;
+    uint64_t rv = 0;
+    bool more = true;
+    while (more) {
+        if (!BDBLOCKMETHOD(bdb, false)) break;
+        if (!bdb->open) {
+            tcbdbsetecode(bdb, TCEINVALID, __FILE__, __LINE__, __func__);
+            BDBUNLOCKMETHOD(bdb);
+            break;
+        }
+        if (cur->id < 1) {
+            tcbdbsetecode(bdb, TCENOREC, __FILE__, __LINE__, __func__);
+            BDBUNLOCKMETHOD(bdb);
+            break;
+        }
+        more = tcbdbcurskipimpl(cur, kbuf, ksiz, num, &rv);
+        bool adj = TCMAPRNUM(bdb->leafc) > bdb->lcnum || TCMAPRNUM(bdb->nodec) > bdb->ncnum;
+        BDBUNLOCKMETHOD(bdb);
+        if (adj && BDBLOCKMETHOD(bdb, true)) {
+            if (!bdb->tran) tcbdbcacheadjust(bdb);
+            BDBUNLOCKMETHOD(bdb);
+        }
+    }
+    return rv;
+}
+
 /* Insert a record around a cursor object. */
 bool tcbdbcurput(BDBCUR *cur, const void *vbuf, int vsiz, int cpmode) {
     assert(cur && vbuf && vsiz >= 0);
@@ -1641,6 +1671,9 @@ static void tcbdbclear(TCBDB *bdb) {
     bdb->tran = false;
     bdb->rbopaque = NULL;
     bdb->clock = 0;
+    bdb->st_leafhit = 0;
+    bdb->st_leafmiss = 0;
+    bdb->st_saveleaf = 0;
     bdb->cnt_saveleaf = -1;
     bdb->cnt_loadleaf = -1;
     bdb->cnt_killleaf = -1;
@@ -1805,6 +1838,7 @@ static bool tcbdbleafcacheout(TCBDB *bdb, BDBLEAF *leaf) {
 static bool tcbdbleafsave(TCBDB *bdb, BDBLEAF *leaf) {
     assert(bdb && leaf);
     TCDODEBUG(bdb->cnt_saveleaf++);
+    TCSTATADD(bdb->st_saveleaf, 1);
     TCXSTR *rbuf = tcxstrnew3(BDBPAGEBUFSIZ);
     char hbuf[(sizeof (uint64_t) + 1)*3];
     char *wp = hbuf;
@@ -1869,10 +1903,12 @@ static BDBLEAF *tcbdbleafload(TCBDB *bdb, uint64_t id) {
     BDBLEAF *leaf = (BDBLEAF *) tcmapget3(bdb->leafc, &id, sizeof (id), &rsiz);
     if (leaf) {
         if (clk) BDBUNLOCKCACHE(bdb);
+        TCSTATADD(bdb->st_leafhit, 1);
         return leaf;
     }
     if (clk) BDBUNLOCKCACHE(bdb);
     TCDODEBUG(bdb->cnt_loadleaf++);
+    TCSTATADD(bdb->st_leafmiss, 1);
     char hbuf[(sizeof (uint64_t) + 1)*3];
     int step;
     step = sprintf(hbuf, "%" PRIx64 "", (uint64_t) id);
@@ -3669,6 +3705,62 @@ static bool tcbdbcurnextimpl(BDBCUR *cur) {
     return tcbdbcuradjust(cur, true);
 }
 
+/* Compare a key with the key of a record.
+   `bdb' specifies the B+ tree database object.
+   `kbuf' specifies the pointer to the region of the key.
+   `ksiz' specifies the size of the region of the key.
+   `rec' specifies the record object.
+   The return value is positive if the key is greater than the key of the record, 0 if both are
+   equivalent, negative if the key is less. */
+static int tcbdbcmprec(TCBDB *bdb, const char *kbuf, int ksiz, BDBREC *rec) {
+    char *dbuf = (char *) rec + sizeof (*rec);
+    int rv;
+    if (bdb->cmp == tccmplexical) {
+        TCCMPLEXICAL(rv, kbuf, ksiz, dbuf, rec->ksiz);
+    } else {
+        rv = bdb->cmp(kbuf, ksiz, dbuf, rec->ksiz, bdb->cmpop);
+    }
+    return rv;
+}
+
+/* Move a cursor object forward over records whose keys are less than a bound key.
+   `cur' specifies the cursor object.
+   `kbuf' specifies the pointer to the region of the bound key.  If it is `NULL', there is no bound.
+   `ksiz' specifies the size of the region of the bound key.
+   `num' specifies the maximum number of records to move over.
+   `np' specifies the pointer to the variable into which the number of records moved over is added.
+   The return value is true if the cache should be adjusted before moving further, else, it is
+   false.
+   Records of a leaf are counted without comparing their keys if the last key of the leaf is less
+   than the bound. */
+static bool tcbdbcurskipimpl(BDBCUR *cur, const char *kbuf, int ksiz, uint64_t num, uint64_t *np) {
+    assert(cur && np);
+    TCBDB *bdb = cur->bdb;
+    while (*np < num && tcbdbcuradjust(cur, true)) {
+        BDBLEAF *leaf = tcbdbleafload(bdb, cur->id);
+        if (!leaf) return false;
+        TCPTRLIST *recs = leaf->recs;
+        int knum = TCPTRLISTNUM(recs);
+        bool whole = !kbuf || tcbdbcmprec(bdb, kbuf, ksiz, TCPTRLISTVAL(recs, knum - 1)) > 0;
+        while (*np < num && cur->kidx < knum) {
+            BDBREC *rec = TCPTRLISTVAL(recs, cur->kidx);
+            if (!whole && tcbdbcmprec(bdb, kbuf, ksiz, rec) <= 0) return false;
+            uint64_t vnum = (rec->rest ? TCLISTNUM(rec->rest) + 1 : 1) - cur->vidx;
+            if (vnum > num - *np) {
+                cur->vidx += num - *np;
+                *np = num;
+            } else {
+                *np += vnum;
+                cur->kidx++;
+                cur->vidx = 0;
+            }
+        }
+        if (TCMAPRNUM(bdb->leafc) > bdb->lcnum) return true;
+    }
+    if (cur->id > 0) tcbdbcuradjust(cur, true);
+    return false;
+}
+
 /* Insert a record around a cursor object.
    `cur' specifies the cursor object.
    `vbuf' specifies the pointer to the region of the value.
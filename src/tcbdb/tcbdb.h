@@ -70,6 +70,9 @@ typedef struct { /* type of structure for a B+ tree database */
     bool tran; /* whether in the transaction */
     char *rbopaque; /* opaque for rollback */
     volatile uint64_t clock; /* logical clock */
+    uint64_t st_leafhit; /* statistics counter of leaves found in the leaf cache */
+    uint64_t st_leafmiss; /* statistics counter of leaves loaded from the database */
+    uint64_t st_saveleaf; /* statistics counter of leaves saved into the database */
     volatile int64_t cnt_saveleaf; /* tesing counter for leaf save times */
     volatile int64_t cnt_loadleaf; /* tesing counter for leaf load times */
     volatile int64_t cnt_killleaf; /* tesing counter for leaf kill times */
@@ -702,6 +705,19 @@ EJDB_EXPORT bool tcbdbcurprev(BDBCUR *cur);
 EJDB_EXPORT bool tcbdbcurnext(BDBCUR *cur);
 
 
+/* Move a cursor object forward over records whose keys are less than a bound key.
+   `cur' specifies the cursor object.
+   `kbuf' specifies the pointer to the region of the bound key.  If it is `NULL', records are
+   moved over up to the end of the database.
+   `ksiz' specifies the size of the region of the bound key.
+   `num' specifies the maximum number of records to move over.
+   The return value is the number of records moved over.  The cursor is placed at the first record
+   not moved over.
+   Keys of leaves entirely preceding the bound are not compared, so counting or skipping records
+   of a key range is much faster than moving the cursor by `tcbdbcurnext'. */
+EJDB_EXPORT uint64_t tcbdbcurskip(BDBCUR *cur, const void *kbuf, int ksiz, uint64_t num);
+
+
 /* Insert a record around a cursor object.
    `cur' specifies the cursor object of writer connection.
    `vbuf' specifies the pointer to the region of the value.
@@ -190,6 +190,8 @@ static bool tchdbopenimpl(TCHDB *hdb, const char *path, int omode);
 static bool tchdbcloseimpl(TCHDB *hdb);
 static bool tchdbputimpl(TCHDB *hdb, const char *kbuf, int ksiz, uint64_t bidx, uint8_t hash,
         const char *vbuf, int vsiz, int dmode);
+static bool tchdbputpartimpl(TCHDB *hdb, const char *kbuf, int ksiz, uint64_t bidx, uint8_t hash,
+        int off, const char *vbuf, int vsiz);
 static void tchdbdrpappend(TCHDB *hdb, const char *kbuf, int ksiz, const char *vbuf, int vsiz,
         uint8_t hash);
 static bool tchdbputasyncimpl(TCHDB *hdb, const char *kbuf, int ksiz, uint64_t bidx,
@@ -676,6 +678,31 @@ bool tchdbputasync2(TCHDB *hdb, const char *kstr, const char *vstr) {
     return tchdbputasync(hdb, kstr, strlen(kstr), vstr, strlen(vstr));
 }
 
+/* Overwrite a region of the value of an existing record of a hash database object in place. */
+bool tchdbputpart(TCHDB *hdb, const void *kbuf, int ksiz, int off, const void *vbuf, int vsiz) {
+    assert(hdb && kbuf && ksiz >= 0 && off >= 0 && vbuf && vsiz >= 0);
+    if (!HDBLOCKMETHOD(hdb, false)) return false;
+    if (INVALIDHANDLE(hdb->fd) || !(hdb->omode & HDBOWRITER) || hdb->zmode) {
+        tchdbsetecode(hdb, TCEINVALID, __FILE__, __LINE__, __func__);
+        HDBUNLOCKMETHOD(hdb);
+        return false;
+    }
+    uint8_t hash;
+    uint64_t bidx = tchdbbidx(hdb, kbuf, ksiz, &hash);
+    if (hdb->async && !tchdbflushdrp(hdb)) {
+        HDBUNLOCKMETHOD(hdb);
+        return false;
+    }
+    if (!HDBLOCKRECORD(hdb, bidx, true)) {
+        HDBUNLOCKMETHOD(hdb);
+        return false;
+    }
+    bool rv = tchdbputpartimpl(hdb, kbuf, ksiz, bidx, hash, off, vbuf, vsiz);
+    HDBUNLOCKRECORD(hdb, bidx);
+    HDBUNLOCKMETHOD(hdb);
+    return rv;
+}
+
 /* Remove a record of a hash database object. */
 bool tchdbout(TCHDB *hdb, const void *kbuf, int ksiz) {
     assert(hdb && kbuf && ksiz >= 0);
@@ -1540,6 +1567,7 @@ bool tchdbmemsync(TCHDB *hdb, bool phys) {
         }
 #endif
         HDBUNLOCKSMEMPTR(hdb);
+        TCSTATADD(hdb->st_fsync, 1);
         if (fsync(hdb->fd)) {
             tchdbsetecode(hdb, TCESYNC, __FILE__, __LINE__, __func__);
             err = true;
@@ -1558,6 +1586,17 @@ uint64_t tchdbbnum(TCHDB *hdb) {
     return hdb->bnum;
 }
 
+/* Get the index of the bucket of a key in the bucket array of a hash database object. */
+uint64_t tchdbkeybidx(TCHDB *hdb, const void *kbuf, int ksiz) {
+    assert(hdb && kbuf && ksiz >= 0);
+    if (INVALIDHANDLE(hdb->fd)) {
+        tchdbsetecode(hdb, TCEINVALID, __FILE__, __LINE__, __func__);
+        return 0;
+    }
+    uint8_t hash;
+    return tchdbbidx(hdb, kbuf, ksiz, &hash);
+}
+
 /* Get the record alignment a hash database object. */
 uint32_t tchdbalign(TCHDB *hdb) {
     assert(hdb);
@@ -2304,6 +2343,12 @@ static bool tchdbloadmeta(TCHDB *hdb, const char *hbuf) {
    `hdb' specifies the hash database object. */
 static void tchdbclear(TCHDB *hdb) {
     assert(hdb);
+    hdb->st_rechit = 0;
+    hdb->st_recmiss = 0;
+    hdb->st_readrec = 0;
+    hdb->st_writerec = 0;
+    hdb->st_fsync = 0;
+    hdb->st_walbytes = 0;
     hdb->mmtx = NULL;
     hdb->smtx = NULL;
     hdb->rmtxs = NULL;
@@ -2962,6 +3007,7 @@ static bool tchdbwriterec(TCHDB *hdb, TCHREC *rec, uint64_t bidx, off_t entoff,
     assert(hdb && rec);
     char stack[HDBIOBUFSIZ];
     TCDODEBUG(hdb->cnt_writerec++);
+    TCSTATADD(hdb->st_writerec, 1);
     int bsiz = 0;
     char *rbuf = NULL;
     bool dblocked = false;
@@ -3125,6 +3171,7 @@ begining:
 static bool tchdbreadrec(TCHDB *hdb, TCHREC *rec, char *rbuf) {
     assert(hdb && rec && rbuf);
     TCDODEBUG(hdb->cnt_readrec++);
+    TCSTATADD(hdb->st_readrec, 1);
     int rsiz = hdb->runit;
     if (!HDBLOCKSMEMPTR(hdb, false)) return false;
     if (!tchdbseekread2(hdb, rec->off, rbuf, rsiz, HDBOPTNOSMLOCK | HDBSEEKTRY)) {
@@ -3513,6 +3560,7 @@ static bool tchdbwalinit(TCHDB *hdb) {
         tchdbsetecode(hdb, TCEWRITE, __FILE__, __LINE__, __func__);
         err = true;
     }
+    TCSTATADD(hdb->st_walbytes, sizeof (llnum));
     if (!err) hdb->walend = llnum;
     HDBUNLOCKWAL(hdb);
     if (!tchdbwalwrite(hdb, 0, HDBHEADSIZ)) return false;
@@ -3557,11 +3605,15 @@ static bool tchdbwalwrite(TCHDB *hdb, uint64_t off, int64_t size) {
         HDBUNLOCKWAL(hdb);
         return false;
     }
+    TCSTATADD(hdb->st_walbytes, wp - buf);
     if (buf != stack) TCFREE(buf);
-    if ((hdb->omode & HDBOTSYNC) && fsync(hdb->walfd)) {
-        tchdbsetecode(hdb, TCESYNC, __FILE__, __LINE__, __func__);
-        HDBUNLOCKWAL(hdb);
-        return false;
+    if (hdb->omode & HDBOTSYNC) {
+        TCSTATADD(hdb->st_fsync, 1);
+        if (fsync(hdb->walfd)) {
+            tchdbsetecode(hdb, TCESYNC, __FILE__, __LINE__, __func__);
+            HDBUNLOCKWAL(hdb);
+            return false;
+        }
     }
     HDBUNLOCKWAL(hdb);
     return true;
@@ -4207,6 +4259,58 @@ static bool tchdbputimpl(TCHDB *hdb, const char *kbuf, int ksiz, uint64_t bidx,
     return tchdbwriterec(hdb, &rec, bidx, entoff, true);
 }
 
+/* Overwrite a region of the value of an existing record in place.
+   `hdb' specifies the hash database object.
+   `kbuf' specifies the pointer to the region of the key.
+   `ksiz' specifies the size of the region of the key.
+   `bidx' specifies the index of the bucket array.
+   `hash' specifies the hash value for the collision tree.
+   `off' specifies the offset of the overwritten region in the value.
+   `vbuf' specifies the pointer to the region of the new data.
+   `vsiz' specifies the size of the region of the new data.
+   If successful, the return value is true, else, it is false.
+   #METHOD RLOCK + BNUM WLOCK */
+static bool tchdbputpartimpl(TCHDB *hdb, const char *kbuf, int ksiz, uint64_t bidx, uint8_t hash,
+        int off, const char *vbuf, int vsiz) {
+    assert(hdb && kbuf && ksiz >= 0 && off >= 0 && vbuf && vsiz >= 0);
+    if (hdb->recc) tcmdbout(hdb->recc, kbuf, ksiz);
+    off_t roff = tchdbgetbucket(hdb, bidx);
+    if (roff == -1) return false;
+    TCHREC rec;
+    char rbuf[HDBIOBUFSIZ];
+    while (roff > 0) {
+        rec.off = roff;
+        if (!tchdbreadrec(hdb, &rec, rbuf)) return false;
+        if (hash > rec.hash) {
+            roff = rec.left;
+        } else if (hash < rec.hash) {
+            roff = rec.right;
+        } else {
+            if (!rec.kbuf && !tchdbreadrecbody(hdb, &rec)) return false;
+            int kcmp = tcreckeycmp(kbuf, ksiz, rec.kbuf, rec.ksiz);
+            if (kcmp > 0) {
+                roff = rec.left;
+            } else if (kcmp < 0) {
+                roff = rec.right;
+            } else {
+                TCFREE(rec.bbuf);
+                if ((uint64_t) off + vsiz > rec.vsiz) {
+                    tchdbsetecode(hdb, TCEINVALID, __FILE__, __LINE__, __func__);
+                    return false;
+                }
+                TCDODEBUG(hdb->cnt_writerec++);
+                TCSTATADD(hdb->st_writerec, 1);
+                return tchdbseekwrite(hdb, rec.boff + rec.ksiz + off, vbuf, vsiz);
+            }
+            TCFREE(rec.bbuf);
+            rec.kbuf = NULL;
+            rec.bbuf = NULL;
+        }
+    }
+    tchdbsetecode(hdb, TCENOREC, __FILE__, __LINE__, __func__);
+    return false;
+}
+
 /* Append a record to the delayed record pool.
    `hdb' specifies the hash database object.
    `kbuf' specifies the pointer to the region of the key.
@@ -4401,6 +4505,7 @@ static char *tchdbgetimpl(TCHDB *hdb, const char *kbuf, int ksiz, uint64_t bidx,
         int tvsiz;
         char *tvbuf = tcmdbget(hdb->recc, kbuf, ksiz, &tvsiz);
         if (tvbuf) {
+            TCSTATADD(hdb->st_rechit, 1);
             if (*tvbuf == '*') {
                 tchdbsetecode(hdb, TCENOREC, __FILE__, __LINE__, __func__);
                 TCFREE(tvbuf);
@@ -4410,6 +4515,7 @@ static char *tchdbgetimpl(TCHDB *hdb, const char *kbuf, int ksiz, uint64_t bidx,
             memmove(tvbuf, tvbuf + 1, tvsiz);
             return tvbuf;
         }
+        TCSTATADD(hdb->st_recmiss, 1);
     }
     off_t off = tchdbgetbucket(hdb, bidx);
     if (off == -1) return NULL;
@@ -4493,6 +4599,7 @@ static int tchdbgetintoxstrimpl(TCHDB *hdb, const char *kbuf, int ksiz, uint64_t
         int tvsiz;
         char *tvbuf = tcmdbget(hdb->recc, kbuf, ksiz, &tvsiz);
         if (tvbuf) {
+            TCSTATADD(hdb->st_rechit, 1);
             if (*tvbuf == '*') {
                 tchdbsetecode(hdb, TCENOREC, __FILE__, __LINE__, __func__);
                 TCFREE(tvbuf);
@@ -4503,6 +4610,7 @@ static int tchdbgetintoxstrimpl(TCHDB *hdb, const char *kbuf, int ksiz, uint64_t
             TCFREE(tvbuf); //todo
             return tvsiz;
         }
+        TCSTATADD(hdb->st_recmiss, 1);
     }
     off_t off = tchdbgetbucket(hdb, bidx);
     if (off == -1) return -1;
@@ -4591,6 +4699,7 @@ static int tchdbgetintobuf(TCHDB *hdb, const char *kbuf, int ksiz, uint64_t bidx
         int tvsiz;
         char *tvbuf = tcmdbget(hdb->recc, kbuf, ksiz, &tvsiz);
         if (tvbuf) {
+            TCSTATADD(hdb->st_rechit, 1);
             if (*tvbuf == '*') {
                 tchdbsetecode(hdb, TCENOREC, __FILE__, __LINE__, __func__);
                 TCFREE(tvbuf);
@@ -4601,6 +4710,7 @@ static int tchdbgetintobuf(TCHDB *hdb, const char *kbuf, int ksiz, uint64_t bidx
             TCFREE(tvbuf);
             return tvsiz;
         }
+        TCSTATADD(hdb->st_recmiss, 1);
     }
     off_t off = tchdbgetbucket(hdb, bidx);
     if (off == -1) return -1;
@@ -4875,6 +4985,7 @@ static int tchdbvsizimpl(TCHDB *hdb, const char *kbuf, int ksiz, uint64_t bidx,
         int tvsiz;
         char *tvbuf = tcmdbget(hdb->recc, kbuf, ksiz, &tvsiz);
         if (tvbuf) {
+            TCSTATADD(hdb->st_rechit, 1);
             if (*tvbuf == '*') {
                 tchdbsetecode(hdb, TCENOREC, __FILE__, __LINE__, __func__);
                 TCFREE(tvbuf);
@@ -4883,6 +4994,7 @@ static int tchdbvsizimpl(TCHDB *hdb, const char *kbuf, int ksiz, uint64_t bidx,
             TCFREE(tvbuf);
             return tvsiz - 1;
         }
+        TCSTATADD(hdb->st_recmiss, 1);
     }
     off_t off = tchdbgetbucket(hdb, bidx);
     if (off == -1) return -1;
@@ -100,6 +100,12 @@ typedef struct { /* type of structure for a hash database */
     uint64_t drpoff; /* offset of the delayed record pool */
     uint64_t inode; /* inode number */
     uint64_t walend; /* end offset of write ahead logging */
+    uint64_t st_rechit; /* statistics counter of records found in the record cache */
+    uint64_t st_recmiss; /* statistics counter of records not found in the record cache */
+    uint64_t st_readrec; /* statistics counter of records read from the file */
+    uint64_t st_writerec; /* statistics counter of records written into the file */
+    uint64_t st_fsync; /* statistics counter of file synchronizations */
+    uint64_t st_walbytes; /* statistics counter of bytes written into the write ahead log */
 
 #ifndef NDEBUG
     volatile int64_t cnt_writerec; /* tesing counter for record write times */
@@ -337,6 +343,19 @@ EJDB_EXPORT bool tchdbputasync(TCHDB *hdb, const void *kbuf, int ksiz, const voi
 EJDB_EXPORT bool tchdbputasync2(TCHDB *hdb, const char *kstr, const char *vstr);
 
 
+/* Overwrite a region of the value of an existing record of a hash database object in place.
+   `hdb' specifies the hash database object connected as a writer.
+   `kbuf' specifies the pointer to the region of the key.
+   `ksiz' specifies the size of the region of the key.
+   `off' specifies the offset of the overwritten region in the value.
+   `vbuf' specifies the pointer to the region of the new data.
+   `vsiz' specifies the size of the region of the new data.
+   If successful, the return value is true, else, it is false.  False is returned if no record
+   corresponds, if the region exceeds the value or if values of the database are compressed.
+   Only the region is written into the file, the size of the value is never changed. */
+EJDB_EXPORT bool tchdbputpart(TCHDB *hdb, const void *kbuf, int ksiz, int off, const void *vbuf, int vsiz);
+
+
 /* Remove a record of a hash database object.
    `hdb' specifies the hash database object connected as a writer.
    `kbuf' specifies the pointer to the region of the key.
@@ -690,6 +709,16 @@ bool tchdbmemsync(TCHDB *hdb, bool phys);
 EJDB_EXPORT uint64_t tchdbbnum(TCHDB *hdb);
 
 
+/* Get the index of the bucket of a key in the bucket array of a hash database object.
+   `hdb' specifies the hash database object.
+   `kbuf' specifies the pointer to the region of the key.
+   `ksiz' specifies the size of the region of the key.
+   The return value is the bucket index of the key or 0 if the object does not connect to any
+   database file.  Records of many keys are read with better locality of the bucket array if
+   their keys are ordered by the bucket index. */
+EJDB_EXPORT uint64_t tchdbkeybidx(TCHDB *hdb, const void *kbuf, int ksiz);
+
+
 /* Get the record alignment of a hash database object.
    `hdb' specifies the hash database object.
    The return value is the record alignment or 0 if the object does not connect to any database
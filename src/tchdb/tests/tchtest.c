@@ -1277,6 +1277,46 @@ static int procmisc(const char *path, int rnum, bool mt, int opts, int omode) {
             if (i == rnum || i % (rnum / 10) == 0) iprintf(" (%08d)\n", i);
         }
     }
+    iprintf("partial writing:\n");
+    bool zmode = opts & (HDBTDEFLATE | HDBTBZIP | HDBTTCBS);
+    for (int i = 1; i <= rnum; i++) {
+        char kbuf[RECBUFSIZ];
+        int ksiz = sprintf(kbuf, "%08d", i);
+        if (!tchdbputpart(hdb, kbuf, ksiz, 0, "xx", 2)) {
+            if (!zmode || tchdbecode(hdb) != TCEINVALID) {
+                eprint(hdb, __LINE__, "tchdbputpart");
+                err = true;
+            }
+            break;
+        }
+        int vsiz;
+        char *vbuf = tchdbget(hdb, kbuf, ksiz, &vsiz);
+        if (!vbuf) {
+            eprint(hdb, __LINE__, "tchdbget");
+            err = true;
+            break;
+        } else if (vsiz != ksiz || memcmp(vbuf, "xx", 2) || memcmp(vbuf + 2, kbuf + 2, vsiz - 2)) {
+            eprint(hdb, __LINE__, "(validation)");
+            err = true;
+            tcfree(vbuf);
+            break;
+        }
+        tcfree(vbuf);
+        if (tchdbputpart(hdb, kbuf, ksiz, ksiz - 1, "xx", 2) || tchdbecode(hdb) != TCEINVALID) {
+            eprint(hdb, __LINE__, "tchdbputpart");
+            err = true;
+            break;
+        }
+        if (!tchdbputpart(hdb, kbuf, ksiz, 0, kbuf, 2)) {
+            eprint(hdb, __LINE__, "tchdbputpart");
+            err = true;
+            break;
+        }
+        if (rnum > 250 && i % (rnum / 250) == 0) {
+            iputchar('.');
+            if (i == rnum || i % (rnum / 10) == 0) iprintf(" (%08d)\n", i);
+        }
+    }
     iprintf("checking words:\n");
     for (int i = 0; words[i] != NULL; i += 2) {
         const char *kbuf = words[i];
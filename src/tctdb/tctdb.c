@@ -742,6 +742,7 @@ uint64_t tctdbfsiz(TCTDB *tdb) {
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
             case TDBITTOKEN:
             case TDBITQGRAM:
                 rv += tcbdbfsiz(idx->db);
@@ -910,7 +911,7 @@ TCLIST *tctdbqrysearch(TDBQRY *qry) {
     }
     TCLIST *rv = tctdbqrysearchimpl(qry);
     TDBUNLOCKMETHOD(tdb);
-    return rv;
+    return rv ? rv : tclistnew();
 }
 
 /* Remove each record corresponding to a query object. */
@@ -934,6 +935,10 @@ bool tctdbqryproc(TDBQRY *qry, TDBQRYPROC proc, void *op) {
     int64_t putnum = 0;
     int64_t outnum = 0;
     TCLIST *res = tctdbqrysearchimpl(qry);
+    if (!res) {
+        TDBUNLOCKMETHOD(tdb);
+        return false;
+    }
     int rnum = TCLISTNUM(res);
     for (int i = 0; i < rnum; i++) {
         const char *pkbuf;
@@ -1240,6 +1245,7 @@ bool tctdbmemsync(TCTDB *tdb, bool phys) {
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
             case TDBITTOKEN:
             case TDBITQGRAM:
                 if (!tcbdbmemsync(idx->db, phys)) {
@@ -1622,6 +1628,8 @@ int tctdbstrtoindextype(const char *str) {
         type = TDBITLEXICAL;
     } else if (!tcstricmp(str, "DEC") || !tcstricmp(str, "DECIMAL") || !tcstricmp(str, "NUM")) {
         type = TDBITDECIMAL;
+    } else if (!tcstricmp(str, "BIN") || !tcstricmp(str, "BINNUM")) {
+        type = TDBITBINNUM;
     } else if (!tcstricmp(str, "TOK") || !tcstricmp(str, "TOKEN")) {
         type = TDBITTOKEN;
     } else if (!tcstricmp(str, "QGR") || !tcstricmp(str, "QGRAM") || !tcstricmp(str, "FTS")) {
@@ -1937,7 +1945,8 @@ static bool tctdbopenimpl(TCTDB *tdb, const char *path, int omode) {
         *(ep++) = '\0';
         int nsiz;
         char *name = tcurldecode(stem, &nsiz);
-        if (!strcmp(ep, "lex") || !strcmp(ep, "dec") || !strcmp(ep, "tok") || !strcmp(ep, "qgr")) {
+        if (!strcmp(ep, "lex") || !strcmp(ep, "dec") || !strcmp(ep, "num") ||
+                !strcmp(ep, "tok") || !strcmp(ep, "qgr")) {
             TCBDB *bdb = tcbdbnew();
             if (!INVALIDHANDLE(dbgfd)) tcbdbsetdbgfd(bdb, dbgfd);
             if (tdb->mmtx) tcbdbsetmutex(bdb);
@@ -1951,6 +1960,8 @@ static bool tctdbopenimpl(TCTDB *tdb, const char *path, int omode) {
                 idxs[inum].type = TDBITLEXICAL;
                 if (!strcmp(ep, "dec")) {
                     idxs[inum].type = TDBITDECIMAL;
+                } else if (!strcmp(ep, "num")) {
+                    idxs[inum].type = TDBITBINNUM;
                 } else if (!strcmp(ep, "tok")) {
                     idxs[inum].type = TDBITTOKEN;
                 } else if (!strcmp(ep, "qgr")) {
@@ -2011,6 +2022,7 @@ static bool tctdbcloseimpl(TCTDB *tdb) {
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
             case TDBITTOKEN:
             case TDBITQGRAM:
                 if (!tcbdbclose(idx->db)) {
@@ -2218,6 +2230,7 @@ static bool tctdboptimizeimpl(TCTDB *tdb, int64_t bnum, int8_t apow, int8_t fpow
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
             case TDBITTOKEN:
             case TDBITQGRAM:
                 if (!tcbdbvanish(idx->db)) {
@@ -2306,6 +2319,7 @@ static bool tctdboptimizeimpl(TCTDB *tdb, int64_t bnum, int8_t apow, int8_t fpow
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
             case TDBITTOKEN:
             case TDBITQGRAM:
                 if (!tcbdboptimize(idx->db, -1, -1, -1, -1, -1, UINT8_MAX)) {
@@ -2341,6 +2355,7 @@ static bool tctdbvanishimpl(TCTDB *tdb) {
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
             case TDBITTOKEN:
             case TDBITQGRAM:
                 if (!tcbdbvanish(idx->db)) {
@@ -2379,6 +2394,7 @@ static bool tctdbcopyimpl(TCTDB *tdb, const char *path) {
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
             case TDBITTOKEN:
             case TDBITQGRAM:
                 if (*path == '@') {
@@ -2430,6 +2446,7 @@ bool tctdbtranbeginimpl(TCTDB *tdb) {
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
             case TDBITTOKEN:
             case TDBITQGRAM:
                 if (!tcbdbtranbegin(idx->db)) {
@@ -2466,6 +2483,7 @@ bool tctdbtrancommitimpl(TCTDB *tdb) {
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
             case TDBITTOKEN:
             case TDBITQGRAM:
                 if (!tcbdbtrancommit(idx->db)) {
@@ -2501,6 +2519,7 @@ bool tctdbtranabortimpl(TCTDB *tdb) {
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
             case TDBITTOKEN:
             case TDBITQGRAM:
                 if (!tcbdbtranabort(idx->db)) {
@@ -2580,6 +2599,7 @@ static bool tctdbsetindeximpl(TCTDB *tdb, const char *name, int type, TDBRVALOAD
                 switch (idx->type) {
                     case TDBITLEXICAL:
                     case TDBITDECIMAL:
+                    case TDBITBINNUM:
                     case TDBITTOKEN:
                     case TDBITQGRAM:
                         if (!tcbdboptimize(idx->db, -1, -1, -1, -1, -1, UINT8_MAX)) {
@@ -2600,6 +2620,7 @@ static bool tctdbsetindeximpl(TCTDB *tdb, const char *name, int type, TDBRVALOAD
             switch (idx->type) {
                 case TDBITLEXICAL:
                 case TDBITDECIMAL:
+                case TDBITBINNUM:
                 case TDBITTOKEN:
                 case TDBITQGRAM:
                     path = tcstrdup(tcbdbpath(idx->db));
@@ -2686,6 +2707,24 @@ static bool tctdbsetindeximpl(TCTDB *tdb, const char *name, int type, TDBRVALOAD
             }
             tdb->inum++;
             break;
+        case TDBITBINNUM:
+            idx->db = tcbdbnew();
+            idx->name = tcstrdup(name);
+            tcxstrprintf(pbuf, "%cnum", MYEXTCHR);
+            if (!INVALIDHANDLE(dbgfd)) tcbdbsetdbgfd(idx->db, dbgfd);
+            if (tdb->mmtx) tcbdbsetmutex(idx->db);
+            if (enc && dec) tcbdbsetcodecfunc(idx->db, enc, encop, dec, decop);
+            tcbdbtune(idx->db, TDBIDXLMEMB, TDBIDXNMEMB, bbnum, -1, -1, bopts);
+            tcbdbsetcache(idx->db, tdb->lcnum, tdb->ncnum);
+            tcbdbsetxmsiz(idx->db, bxmsiz);
+            tcbdbsetdfunit(idx->db, tchdbdfunit(tdb->hdb));
+            tcbdbsetlsmax(idx->db, TDBIDXLSMAX);
+            if (!tcbdbopen(idx->db, TCXSTRPTR(pbuf), bomode)) {
+                tctdbsetecode(tdb, tcbdbecode(idx->db), __FILE__, __LINE__, __func__);
+                err = true;
+            }
+            tdb->inum++;
+            break;
         case TDBITTOKEN:
             idx->db = tcbdbnew();
             idx->cc = tcmapnew2(TDBIDXICCBNUM);
@@ -2747,6 +2786,7 @@ static bool tctdbsetindeximpl(TCTDB *tdb, const char *name, int type, TDBRVALOAD
                 switch (type) {
                     case TDBITLEXICAL:
                     case TDBITDECIMAL:
+                    case TDBITBINNUM:
                         assert(vbuf);
                         if (!tcbdbput(db, pkbuf, pksiz, vbuf, vsiz)) {
                             tctdbsetecode(tdb, tcbdbecode(db), __FILE__, __LINE__, __func__);
@@ -2765,6 +2805,7 @@ static bool tctdbsetindeximpl(TCTDB *tdb, const char *name, int type, TDBRVALOAD
                 switch (type) {
                     case TDBITLEXICAL:
                     case TDBITDECIMAL:
+                    case TDBITBINNUM:
                         if (vbuf && !tctdbidxputone(tdb, idx, pkbuf, pksiz, tctdbidxhash(pkbuf, pksiz), vbuf, vsiz)) err = true;
                         break;
                     case TDBITTOKEN:
@@ -2806,7 +2847,8 @@ static int64_t tctdbgenuidimpl(TCTDB *tdb, int64_t inc) {
 
 /* Execute the search of a query object.
    `qry' specifies the query object.
-   The return value is a list object of the primary keys of the corresponding records. */
+   The return value is a list object of the primary keys of the corresponding records or `NULL' if
+   a condition cannot be evaluated by the index of its column. */
 static TCLIST *tctdbqrysearchimpl(TDBQRY *qry) {
     assert(qry);
     TCTDB *tdb = qry->tdb;
@@ -2834,6 +2876,7 @@ static TCLIST *tctdbqrysearchimpl(TDBQRY *qry) {
     TDBIDX *nidx = NULL;
     TDBCOND *scond = NULL;
     TDBIDX *sidx = NULL;
+    TDBCOND *bcond = NULL;
     for (int i = 0; i < cnum; i++) {
         TDBCOND *cond = conds + i;
         if (!cond->sign || cond->noidx) continue;
@@ -2914,10 +2957,19 @@ static TCLIST *tctdbqrysearchimpl(TDBQRY *qry) {
                                 break;
                         }
                         break;
+                    case TDBITBINNUM:
+                        /* keys are encoded by the caller, expressions cannot be compared with them */
+                        if (!bcond) bcond = cond;
+                        break;
                 }
             }
         }
     }
+    if (bcond) {
+        tcxstrprintf(hint, "binary index \"%s\" cannot evaluate the condition\n", bcond->name);
+        tctdbsetecode(tdb, TCEINVALID, __FILE__, __LINE__, __func__);
+        return NULL;
+    }
     if (mcond) {
         res = tclistnew();
         mcond->alive = false;
@@ -3494,6 +3546,7 @@ static TCLIST *tctdbqrysearchimpl(TDBQRY *qry) {
                     }
                     break;
                 case TDBITDECIMAL:
+                case TDBITBINNUM:
                     switch (otype) {
                         case TDBQONUMASC:
                             oidx = idx;
@@ -4533,6 +4586,7 @@ bool tctdbidxput(TCTDB *tdb, const void *pkbuf, int pksiz, TCMAP *cols) {
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
                 if (!tcbdbput(idx->db, pkbuf, pksiz, rbuf, pksiz)) {
                     tctdbsetecode(tdb, tcbdbecode(idx->db), __FILE__, __LINE__, __func__);
                     err = true;
@@ -4559,6 +4613,7 @@ bool tctdbidxput(TCTDB *tdb, const void *pkbuf, int pksiz, TCMAP *cols) {
             switch (idx->type) {
                 case TDBITLEXICAL:
                 case TDBITDECIMAL:
+                case TDBITBINNUM:
                     if (!tctdbidxputone(tdb, idx, pkbuf, pksiz, hash, vbuf, vsiz)) err = true;
                     break;
                 case TDBITTOKEN:
@@ -4593,6 +4648,7 @@ bool tctdbidxput2(TCTDB *tdb, const void *pkbuf, int pksiz, TCMAP *cols) {
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
                 if (!tcbdbput(idx->db, pkbuf, pksiz, rbuf, pksiz)) {
                     tctdbsetecode(tdb, tcbdbecode(idx->db), __FILE__, __LINE__, __func__);
                     err = true;
@@ -4619,6 +4675,7 @@ bool tctdbidxput2(TCTDB *tdb, const void *pkbuf, int pksiz, TCMAP *cols) {
             switch (idx->type) {
                 case TDBITLEXICAL:
                 case TDBITDECIMAL:
+                case TDBITBINNUM:
                     if (!tctdbidxputone(tdb, idx, pkbuf, pksiz, hash, vbuf, vsiz)) err = true;
                     break;
                 case TDBITTOKEN:
@@ -4874,6 +4931,7 @@ bool tctdbidxout(TCTDB *tdb, const void *pkbuf, int pksiz, TCMAP *cols) {
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
                 if (!tcbdbout(idx->db, pkbuf, pksiz)) {
                     tctdbsetecode(tdb, tcbdbecode(idx->db), __FILE__, __LINE__, __func__);
                     err = true;
@@ -4900,6 +4958,7 @@ bool tctdbidxout(TCTDB *tdb, const void *pkbuf, int pksiz, TCMAP *cols) {
             switch (idx->type) {
                 case TDBITLEXICAL:
                 case TDBITDECIMAL:
+                case TDBITBINNUM:
                     if (!tctdbidxoutone(tdb, idx, pkbuf, pksiz, hash, vbuf, vsiz)) err = true;
                     break;
                 case TDBITTOKEN:
@@ -4934,6 +4993,7 @@ bool tctdbidxout2(TCTDB *tdb, const void *pkbuf, int pksiz, TCMAP *cols) {
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
                 if (!tcbdbout(idx->db, pkbuf, pksiz)) {
                     tctdbsetecode(tdb, tcbdbecode(idx->db), __FILE__, __LINE__, __func__);
                     err = true;
@@ -4960,6 +5020,7 @@ bool tctdbidxout2(TCTDB *tdb, const void *pkbuf, int pksiz, TCMAP *cols) {
             switch (idx->type) {
                 case TDBITLEXICAL:
                 case TDBITDECIMAL:
+                case TDBITBINNUM:
                     if (!tctdbidxoutone(tdb, idx, pkbuf, pksiz, hash, vbuf, vsiz)) err = true;
                     break;
                 case TDBITTOKEN:
@@ -6239,6 +6300,7 @@ static bool tctdbdefragimpl(TCTDB *tdb, int64_t step) {
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
             case TDBITTOKEN:
             case TDBITQGRAM:
                 if (!tcbdbdefrag(idx->db, step)) {
@@ -6266,6 +6328,7 @@ static bool tctdbcacheclearimpl(TCTDB *tdb) {
         switch (idx->type) {
             case TDBITLEXICAL:
             case TDBITDECIMAL:
+            case TDBITBINNUM:
             case TDBITTOKEN:
             case TDBITQGRAM:
                 if (!tcbdbcacheclear(idx->db)) {
@@ -90,6 +90,7 @@ enum { /* enumeration for index types */
     TDBITDECIMAL, /* decimal string */
     TDBITTOKEN, /* token inverted index */
     TDBITQGRAM, /* q-gram inverted index */
+    TDBITBINNUM, /* binary sortable number */
     TDBITOPT = 9998, /* optimize */
     TDBITVOID = 9999, /* void */
     TDBITKEEP = 1 << 24 /* keep existing index */
@@ -666,7 +667,10 @@ EJDB_EXPORT uint64_t tctdbfsiz(TCTDB *tdb);
    `name' specifies the name of a column.  If the name of an existing index is specified, the
    index is rebuilt.  An empty string means the primary key.
    `type' specifies the index type: `TDBITLEXICAL' for lexical string, `TDBITDECIMAL' for decimal
-   string, `TDBITTOKEN' for token inverted index, `TDBITQGRAM' for q-gram inverted index.  If it
+   string, `TDBITTOKEN' for token inverted index, `TDBITQGRAM' for q-gram inverted index,
+   `TDBITBINNUM' for fixed-width binary keys compared with `memcmp' (the caller is responsible
+   for the key encoding, see `tctdbsetindexrldr', the keys must sort as numbers; queries use the
+   index only for number ordering).  If it
    is `TDBITOPT', the index is optimized.  If it is `TDBITVOID', the index is removed.  If
    `TDBITKEEP' is added by bitwise-or and the index exists, this function merely returns failure.
    If successful, the return value is true, else, it is false.
@@ -711,7 +715,8 @@ EJDB_EXPORT void tctdbqrydel(TDBQRY *qry);
    phrase of the expression, `TDBQCFTSAND' for full-text search with all tokens in the expression,
    `TDBQCFTSOR' for full-text search with at least one token in the expression, `TDBQCFTSEX' for
    full-text search with the compound expression.  All operations can be flagged by bitwise-or:
-   `TDBQCNEGATE' for negation, `TDBQCNOIDX' for using no index.
+   `TDBQCNEGATE' for negation, `TDBQCNOIDX' for using no index.  A condition on a column with
+   a `TDBITBINNUM' index must be flagged by `TDBQCNOIDX', otherwise the search fails.
    `expr' specifies an operand exression. */
 EJDB_EXPORT void tctdbqryaddcond(TDBQRY *qry, const char *name, int op, const char *expr);
 
@@ -735,8 +740,9 @@ EJDB_EXPORT void tctdbqrysetlimit(TDBQRY *qry, int max, int skip);
 
 /* Execute the search of a query object.
    `qry' specifies the query object.
-   The return value is a list object of the primary keys of the corresponding records.  This
-   function does never fail.  It returns an empty list even if no record corresponds.
+   The return value is a list object of the primary keys of the corresponding records.  It
+   returns an empty list even if no record corresponds.  If a condition cannot be evaluated by
+   a `TDBITBINNUM' index, an empty list is returned and the error code is `TCEINVALID'.
    Because the object of the return value is created with the function `tclistnew', it should
    be deleted with the function `tclistdel' when it is no longer in use. */
 EJDB_EXPORT TCLIST *tctdbqrysearch(TDBQRY *qry);